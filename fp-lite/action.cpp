@@ -3,9 +3,176 @@
 
 #include "action.hpp"
 #include "context.hpp"
+#include "endian.hpp"
+
+#include <cstring>
 
 
 namespace fp
 {
 
+// -------------------------------------------------------------------------- //
+// Action program compilation
+
+namespace
+{
+
+// Accumulates the bytes written by consecutive set-field
+// actions into masked 8-byte windows. A new window is started
+// whenever a byte falls outside of the current one.
+struct Window_builder
+{
+  Window_builder(Action_program& p)
+    : prog(p), open(false), address(0), base(0)
+  { }
+
+  bool put(std::uint8_t, std::uint16_t, Byte);
+  bool flush();
+
+  Action_program& prog;
+  bool            open;
+  std::uint8_t    address;
+  std::uint16_t   base;
+  Byte            mask[8];
+  Byte            value[8];
+};
+
+
+// Add the byte b at position pos in the given address space
+// to the current window, or flush the window and start a new
+// one. Metadata windows always start at offset 0 since that
+// address space is exactly 8 bytes. Returns false if the
+// program is full.
+bool
+Window_builder::put(std::uint8_t addr, std::uint16_t pos, Byte b)
+{
+  if (!open || addr != address || pos < base || pos >= base + 8) {
+    if (!flush())
+      return false;
+    open = true;
+    address = addr;
+    base = addr == Metadata_memory ? 0 : pos;
+    std::fill(mask, mask + 8, 0);
+    std::fill(value, value + 8, 0);
+  }
+  assert(pos - base < 8);
+  mask[pos - base] = 0xff;
+  value[pos - base] = b;
+  return true;
+}
+
+
+// Emit the current window as a masked write, if any.
+// Returns false if the program is full.
+bool
+Window_builder::flush()
+{
+  if (!open)
+    return true;
+  if (prog.length == Action_program::max_length)
+    return false;
+
+  Write_instruction w;
+  w.address = address;
+  w.offset = base;
+  std::memcpy(&w.mask, mask, 8);
+  std::memcpy(&w.value, value, 8);
+  prog.instrs[prog.length++] = w;
+  open = false;
+  return true;
+}
+
+
+// Returns true if the field lies within its address space. The
+// extent of packet memory depends on the packet, so packet fields
+// are bounded when they are written (see Context::apply_program).
+inline bool
+is_valid(Field const& f)
+{
+  switch (f.address) {
+    case Packet_memory: return true;
+    case Metadata_memory: return f.offset + f.length <= int(sizeof(Metadata));
+    default: return false;
+  }
+}
+
+
+// Returns true if the action can be compiled. Actions are given
+// by applications, so they are checked in all builds.
+inline bool
+is_valid(Action const& a)
+{
+  switch (a.type) {
+    case Action::SET:
+      return a.value.set.field.length <= max_set_length && is_valid(a.value.set.field);
+    case Action::COPY: {
+      Field const& f = a.value.copy.field;
+      std::uint8_t dst = f.address == Packet_memory ? Metadata_memory : Packet_memory;
+      return is_valid(f) && is_valid(Field{dst, a.value.copy.offset, f.length});
+    }
+    case Action::OUTPUT:
+    case Action::QUEUE:
+    case Action::GROUP:
+      return true;
+    default:
+      return false;
+  }
+}
+
+
+} // namespace
+
+
+// Compile the sequence of n actions into this program,
+// replacing its previous contents. Returns false, leaving
+// the program empty, if the compiled actions do not fit, or
+// if any action is invalid (e.g., a field outside of its
+// address space).
+bool
+Action_program::compile(Action const* actions, int n)
+{
+  clear();
+  Window_builder win(*this);
+  for (int i = 0; i < n; ++i) {
+    Action const& a = actions[i];
+    if (!is_valid(a)) {
+      clear();
+      return false;
+    }
+    if (a.type == Action::SET) {
+      Field const& f = a.value.set.field;
+
+      // Pre-swap the value into network order.
+      Byte buf[max_set_length];
+      std::copy(a.value.set.value, a.value.set.value + f.length, buf);
+      native_to_network_order(buf, f.length);
+      for (int j = 0; j < f.length; ++j) {
+        if (!win.put(f.address, f.offset + j, buf[j])) {
+          clear();
+          return false;
+        }
+      }
+      continue;
+    }
+
+    // Any other action ends the current window.
+    if (!win.flush() || length == max_length) {
+      clear();
+      return false;
+    }
+    switch (a.type) {
+      case Action::COPY: instrs[length++] = a.value.copy; break;
+      case Action::OUTPUT: instrs[length++] = a.value.output; break;
+      case Action::QUEUE: instrs[length++] = a.value.queue; break;
+      case Action::GROUP: instrs[length++] = a.value.group; break;
+    }
+  }
+  if (!win.flush()) {
+    clear();
+    return false;
+  }
+  return true;
+}
+
+
 } // namespace fp
@@ -6,6 +6,8 @@
 
 #include "types.hpp"
 
+#include <cassert>
+#include <algorithm>
 #include <vector>
 
 
@@ -43,34 +45,34 @@ struct Field
 // popping headers.
 
 
+// The maximum number of bytes that a set-field action can
+// write. Values are stored inline so that constructing,
+// copying, and applying actions never allocates.
+constexpr int max_set_length = 16;
+
+
 // Copies a value into the given field. Note that
 // value + field.length must be within the range
 // of memory designated by field.address.
+//
+// The value is stored in native byte order and is
+// converted to network order when applied. A value
+// longer than max_set_length is truncated, and the
+// action is rejected when it is applied or compiled.
 struct Set_action
 {
   Set_action()
-    : field {0, 0, 0}, value(nullptr)
+    : field {0, 0, 0}, value()
   { }
 
-  Set_action(std::uint8_t addr, std::uint16_t off, std::uint16_t len, Byte* v)
-    : field{addr, off, len}, value(new Byte[len])
+  Set_action(std::uint8_t addr, std::uint16_t off, std::uint16_t len, Byte const* v)
+    : field{addr, off, len}, value()
   {
-    std::copy(v, v + len, value);
+    std::copy(v, v + std::min<int>(len, max_set_length), value);
   }
 
-  Set_action(Set_action const& s)
-    : field(s.field), value(new Byte[s.field.length])
-  {
-    std::copy(s.value, s.value + s.field.length, value);
-  }
-
-  ~Set_action() {
-    if (value)
-      delete [] value;
-  }
-
-  Field       field;
-  Byte*       value;
+  Field field;
+  Byte  value[max_set_length];
 };
 
 
@@ -127,15 +129,9 @@ struct Action
   Action(Output_action const& o) : value(o), type(OUTPUT) { }
   Action(Queue_action const& q) : value(q), type(QUEUE) { }
   Action(Group_action const& g) : value(g), type(GROUP) { }
-  Action(Action const&);
-
-  ~Action()
-  {
-    clear();
-  }
-
-  void clear();
 
+  // All alternatives are trivially copyable, so actions
+  // can be copied by value without inspecting the type.
   union Action_data
   {
     Action_data() { }
@@ -145,8 +141,6 @@ struct Action
     Action_data(Queue_action const& q) : queue(q) { }
     Action_data(Group_action const& g) : group(g) { }
 
-    ~Action_data() { }
-
     Set_action    set;
     Copy_action   copy;
     Output_action output;
@@ -159,50 +153,133 @@ struct Action
 };
 
 
+// A list of actions.
+using Action_list = std::vector<Action>;
+
+
+// The action set maintains a sequence of instructions
+// to be executed on a packet (context) prior to egress.
+// Actions are stored inline, so writing to the set never
+// allocates. Currently, we limit the set to 16 actions.
+//
+// FIXME: This is a highly structured list of actions,
+// and the order in which those actions are applied matters.
+struct Action_set
+{
+  constexpr static int max_length = 16;
+
+  Action_set()
+    : length(0)
+  { }
+
+  bool is_empty() const { return length == 0; }
+  bool is_full() const  { return length == max_length; }
+  int  size() const     { return length; }
+
+  Action const* begin() const { return actions; }
+  Action const* end() const   { return actions + length; }
+
+  bool push_back(Action const&);
+  void clear();
+
+  Action actions[max_length];
+  int    length;
+};
+
+
+// Append an action to the set. Returns false, leaving the
+// set unchanged, if the set is full.
+inline bool
+Action_set::push_back(Action const& a)
+{
+  if (is_full())
+    return false;
+  actions[length++] = a;
+  return true;
+}
+
+
+// Remove all actions from the set.
 inline void
-Action::clear()
+Action_set::clear()
 {
-  if (type == SET)
-    value.set.~Set_action();
+  length = 0;
 }
 
-inline
-Action::Action(Action const& a)
+
+// -------------------------------------------------------------------------- //
+// Action programs
+//
+// An action program is a flattened, precompiled form of a
+// sequence of actions. Programs are compiled once, when they
+// are attached to a flow, so that evaluation does no per-packet
+// interpretation of field lengths or byte order. In particular,
+// consecutive set-field actions whose bytes fall within the same
+// 8-byte window are fused into a single masked 64-bit write, and
+// written values are stored in network byte order.
+
+
+// Writes the bytes selected by mask into an 8-byte window
+// starting at offset in the given address space. Both the
+// mask and value have the same byte layout as memory.
+struct Write_instruction
+{
+  std::uint8_t  address;
+  std::uint16_t offset;
+  std::uint64_t mask;
+  std::uint64_t value;
+};
+
+
+// A single step in an action program.
+struct Instruction
 {
-  type = a.type;
-  switch (a.type)
+  enum Code : std::uint8_t
   {
-    case SET:
-      value = Action_data(a.value.set);
-      break;
-    case COPY:
-      value = Action_data(a.value.copy);
-      break;
-    case OUTPUT:
-      value = Action_data(a.value.output);
-      break;
-    case QUEUE:
-      value = Action_data(a.value.queue);
-      break;
-    case GROUP:
-      value = Action_data(a.value.group);
-      break;
-  }
-}
+    WRITE, COPY, OUTPUT, QUEUE, GROUP
+  };
 
+  Instruction() { }
+  Instruction(Write_instruction const& w) : code(WRITE), write(w) { }
+  Instruction(Copy_action const& c) : code(COPY), copy(c) { }
+  Instruction(Output_action const& o) : code(OUTPUT), output(o) { }
+  Instruction(Queue_action const& q) : code(QUEUE), queue(q) { }
+  Instruction(Group_action const& g) : code(GROUP), group(g) { }
 
-// A list of actions.
-using Action_list = std::vector<Action>;
+  std::uint8_t code;
+  union
+  {
+    Write_instruction write;
+    Copy_action       copy;
+    Output_action     output;
+    Queue_action      queue;
+    Group_action      group;
+  };
+};
 
 
-// The action set maintains a sequence of instructions
-// to be executed on a packet (context) prior to egress.
-//
-// FIXME: This is a highly structured list of actions,
-// and the order in which those actions are applied matters.
-struct Action_set : Action_list
+// A compiled sequence of instructions. Like the action set,
+// instructions are stored inline and the length of a program
+// is limited to 16 instructions.
+struct Action_program
 {
+  constexpr static int max_length = 16;
+
+  Action_program()
+    : length(0)
+  { }
+
+  bool is_empty() const { return length == 0; }
+  int  size() const     { return length; }
+
+  Instruction const* begin() const { return instrs; }
+  Instruction const* end() const   { return instrs + length; }
+
+  bool compile(Action const*, int);
+  void clear() { length = 0; }
 
+  Instruction instrs[max_length];
+  int         length;
 };
 
 
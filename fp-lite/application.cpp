@@ -85,6 +85,26 @@ Library::~Library()
   lib_close(handle);
 }
 
+
+// Returns the address of the symbol in this library that has the
+// same name as the symbol at the given address in the library
+// from. Addresses outside of that library are returned unchanged.
+// If the address does not name an exported symbol, or there is no
+// such symbol in this library, the result is nullptr.
+void*
+Library::relink(void* addr, Library const& from) const
+{
+  Dl_info base;
+  Dl_info info;
+  if (!::dladdr((void*)from.proc, &base) || !::dladdr(addr, &info))
+    return addr;
+  if (info.dli_fbase != base.dli_fbase)
+    return addr;
+  if (!info.dli_sname || info.dli_saddr != addr)
+    return nullptr;
+  return lib_resolve(handle, info.dli_sname);
+}
+
 // -------------------------------------------------------------------------- //
 // Application objects objects
 
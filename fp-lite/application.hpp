@@ -20,6 +20,8 @@ struct Library
   Library(char const*);
   ~Library();
 
+  void* relink(void*, Library const&) const;
+
   char const* path;
   void*       handle;
 
@@ -44,6 +46,12 @@ public:
   // State of the application
   enum State { INIT, READY, RUNNING, STOPPED };
 
+  // The result of processing a packet, which determines what
+  // happens to it in a chain of applications. A packet continues
+  // to the next stage, stops (i.e., skips the remaining stages),
+  // or is dropped.
+  enum Verdict { CONTINUE = 0, STOP = 1, DROP = 2 };
+
   Application(char const* name)
     : lib_(name), state_(INIT)
   { }
@@ -0,0 +1,167 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#include "bench.hpp"
+#include "time.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <thread>
+
+
+namespace fp
+{
+
+namespace bench
+{
+
+namespace
+{
+
+// The minimum duration of a measured run, in nanoseconds, and the
+// maximum number of iterations.
+constexpr std::uint64_t min_time = 250000000;
+constexpr std::uint64_t max_iterations = 1000000000;
+
+
+// Returns the registered benchmarks.
+std::vector<std::unique_ptr<Benchmark>>&
+registry()
+{
+  static std::vector<std::unique_ptr<Benchmark>> r;
+  return r;
+}
+
+
+// Run the benchmark for n iterations on each of nt threads, and
+// return the mean number of ticks taken by a thread. Threads start
+// together, so that they contend for the duration of the run.
+std::uint64_t
+run(Benchmark const& b, std::int64_t arg, int nt, std::uint64_t n)
+{
+  std::vector<State> states;
+  for (int i = 0; i < nt; ++i)
+    states.emplace_back(n, arg, i, nt);
+
+  if (nt == 1) {
+    b.fn(states[0]);
+  }
+  else {
+    std::atomic<int> ready(0);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < nt; ++i) {
+      threads.emplace_back([&, i]() {
+        ready.fetch_add(1);
+        while (ready.load() < nt)
+          ;
+        b.fn(states[i]);
+      });
+    }
+    for (std::thread& t : threads)
+      t.join();
+  }
+
+  std::uint64_t sum = 0;
+  for (State const& s : states)
+    sum += s.ticks();
+  return sum / nt;
+}
+
+
+// Run the benchmark with enough iterations to be measured, and
+// report the time per iteration.
+void
+measure(Benchmark const& b, std::int64_t arg, bool has_arg, int nt)
+{
+  std::uint64_t n = 1;
+  std::uint64_t ticks;
+  while (true) {
+    ticks = run(b, arg, nt, n);
+    std::uint64_t ns = Time::to_nanoseconds(ticks);
+    if (ns >= min_time || n >= max_iterations)
+      break;
+
+    // Aim past the minimum time, but grow by at most 100 times.
+    std::uint64_t next = ns ? n * (min_time * 14 / 10) / ns : n * 100;
+    n = std::min(std::max(next, n + 1), std::min(n * 100, max_iterations));
+  }
+
+  std::string label = b.name;
+  if (has_arg)
+    label += '/' + std::to_string(arg);
+  if (nt > 1)
+    label += "/threads:" + std::to_string(nt);
+
+  double ns = double(Time::to_nanoseconds(ticks)) / n;
+  if (Time::calibration.tsc)
+    std::printf("%-44s %12llu %12.1f %12.1f\n", label.c_str(),
+                (unsigned long long)n, ns, double(ticks) / n);
+  else
+    std::printf("%-44s %12llu %12.1f %12s\n", label.c_str(),
+                (unsigned long long)n, ns, "-");
+  std::fflush(stdout);
+}
+
+
+} // namespace
+
+
+void
+State::pause()
+{
+  ticks_ += Time::current() - start_;
+}
+
+
+void
+State::resume()
+{
+  start_ = Time::current();
+}
+
+
+// Register a benchmark. The returned object may be used to add
+// arguments and thread counts.
+Benchmark*
+add(char const* name, Function fn)
+{
+  registry().emplace_back(new Benchmark(name, fn));
+  return registry().back().get();
+}
+
+
+} // namespace bench
+
+} // namespace fp
+
+
+using namespace fp;
+
+
+// Run the benchmarks whose names contain the given filter, or all
+// of them if none is given.
+int
+main(int argc, char* argv[])
+{
+  char const* filter = argc > 1 ? argv[1] : "";
+
+  std::printf("%-44s %12s %12s %12s\n", "Benchmark", "Iterations", "ns/op", "cycles/op");
+  for (auto const& b : bench::registry()) {
+    if (!std::strstr(b->name.c_str(), filter))
+      continue;
+    std::vector<int> counts = b->thread_counts;
+    if (counts.empty())
+      counts.push_back(1);
+    bool has_arg = !b->args.empty();
+    std::vector<std::int64_t> args = b->args;
+    if (!has_arg)
+      args.push_back(0);
+    for (std::int64_t a : args)
+      for (int nt : counts)
+        bench::measure(*b, a, has_arg, nt);
+  }
+  return 0;
+}
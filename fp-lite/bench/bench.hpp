@@ -0,0 +1,134 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#ifndef FP_BENCH_HPP
+#define FP_BENCH_HPP
+
+// The benchmark module is a small harness for microbenchmarks, in
+// the style of Google Benchmark. A benchmark is a function that
+// runs its operation once per iteration of the state's loop:
+//
+//    void
+//    search(bench::State& s)
+//    {
+//      ... // Setup is not timed.
+//      while (s.keep_running())
+//        bench::keep(tbl.search(k));
+//    }
+//    FP_BENCHMARK(search)->arg(16)->arg(1024);
+//
+// The harness chooses the number of iterations, so that each run
+// takes long enough to be measured. A benchmark may be run with
+// each of several arguments, and by several threads at once.
+//
+// Results are reported in nanoseconds and cycles per operation.
+// Cycles are those of the time stamp counter (see time.hpp), which
+// ticks at a constant rate and may differ from the core's clock.
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+
+namespace fp
+{
+
+namespace bench
+{
+
+// The state of a benchmark run, given to the benchmark function.
+// Each thread of a run has its own state.
+class State
+{
+public:
+  State(std::uint64_t n, std::int64_t a, int t, int nt)
+    : arg_(a), thread_(t), threads_(nt), total_(n), left_(n),
+      start_(0), ticks_(0)
+  { }
+
+  bool keep_running();
+
+  // Stop and restart the timer, e.g., for setup in the loop.
+  void pause();
+  void resume();
+
+  std::int64_t  arg() const        { return arg_; }
+  int           thread() const     { return thread_; }
+  int           threads() const    { return threads_; }
+  std::uint64_t iterations() const { return total_; }
+  std::uint64_t ticks() const      { return ticks_; }
+
+private:
+  std::int64_t  arg_;
+  int           thread_;
+  int           threads_;
+  std::uint64_t total_;
+  std::uint64_t left_;
+  std::uint64_t start_;
+  std::uint64_t ticks_;
+};
+
+
+// Returns true if another iteration should run. The timer starts
+// with the first iteration and stops after the last.
+inline bool
+State::keep_running()
+{
+  if (left_ == total_)
+    resume();
+  if (left_ == 0) {
+    pause();
+    return false;
+  }
+  --left_;
+  return true;
+}
+
+
+using Function = void (*)(State&);
+
+
+// A registered benchmark, and the arguments and thread counts with
+// which it is run. If none are given, it is run once, by one thread,
+// with argument 0.
+struct Benchmark
+{
+  Benchmark(char const* n, Function f)
+    : name(n), fn(f)
+  { }
+
+  Benchmark* arg(std::int64_t a) { args.push_back(a); return this; }
+  Benchmark* threads(int n)      { thread_counts.push_back(n); return this; }
+
+  std::string               name;
+  Function                  fn;
+  std::vector<std::int64_t> args;
+  std::vector<int>          thread_counts;
+};
+
+
+Benchmark* add(char const*, Function);
+
+
+// Prevent the compiler from optimizing away the computation of a
+// value, or the stores to the object.
+template<typename T>
+inline void
+keep(T const& v)
+{
+  asm volatile("" : : "g"(&v) : "memory");
+}
+
+
+} // namespace bench
+
+} // namespace fp
+
+
+// Register a benchmark function with the harness.
+#define FP_BENCHMARK(fn) \
+  static ::fp::bench::Benchmark* fp_bench_ ## fn __attribute__((unused)) = \
+    ::fp::bench::add(#fn, fn)
+
+
+#endif
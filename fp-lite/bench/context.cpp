@@ -0,0 +1,118 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#include "bench.hpp"
+#include "context.hpp"
+#include "dataplane.hpp"
+#include "system.hpp"
+
+#include <cstdarg>
+
+
+using namespace fp;
+
+
+namespace
+{
+
+// A 64 byte Ethernet/IPv4/UDP frame.
+Byte frame[64] = {
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01,
+  0x08, 0x00,
+  0x45, 0x00, 0x00, 0x32, 0x00, 0x00, 0x00, 0x00, 0x40, 0x11, 0x00, 0x00,
+  0x0a, 0x00, 0x00, 0x01, 0x0a, 0x00, 0x00, 0x02,
+  0x04, 0xd2, 0x00, 0x35, 0x00, 0x1e, 0x00, 0x00,
+};
+
+
+Dataplane dp("bench");
+
+
+// Bind the fields gathered by the benchmarks: the Ethernet type,
+// the IPv4 addresses, and the UDP ports.
+void
+bind(Context& cxt)
+{
+  cxt.bind_field(0, 12, 2);
+  cxt.bind_field(1, 26, 4);
+  cxt.bind_field(2, 30, 4);
+  cxt.bind_field(3, 34, 2);
+  cxt.bind_field(4, 36, 2);
+}
+
+
+// Gather a key of n fields, as fp_goto_table does.
+Key
+gather(Context* cxt, int n, ...)
+{
+  va_list args;
+  va_start(args, n);
+  Key k = fp_gather(cxt, 16, n, args);
+  va_end(args);
+  return k;
+}
+
+
+// Construct a context for a received packet.
+void
+context_construct(bench::State& s)
+{
+  while (s.keep_running()) {
+    Context cxt(&dp, Packet(frame, sizeof(frame)));
+    bench::keep(cxt);
+  }
+}
+FP_BENCHMARK(context_construct);
+
+
+// Reset a context for reuse, as when a buffer is reallocated.
+void
+context_reset(bench::State& s)
+{
+  Context cxt(&dp, Packet(frame, sizeof(frame)));
+  while (s.keep_running()) {
+    cxt.reset();
+    bench::keep(cxt);
+  }
+}
+FP_BENCHMARK(context_reset);
+
+
+// Gather a key of the given number of fields.
+void
+gather_fields(bench::State& s)
+{
+  Context cxt(&dp, Packet(frame, sizeof(frame)));
+  bind(cxt);
+  int n = s.arg();
+  while (s.keep_running())
+    bench::keep(gather(&cxt, n, 0, 1, 2, 3, 4));
+}
+FP_BENCHMARK(gather_fields)->arg(1)->arg(3)->arg(5);
+
+
+// Apply an action set of the given number of set-field actions
+// on the IPv4 header, each updating its checksum, and an output
+// action.
+void
+apply_actions(bench::State& s)
+{
+  Context cxt(&dp, Packet(frame, sizeof(frame)));
+  Byte ttl = 63;
+  Byte dst[4] = {10, 0, 0, 3};
+  for (int i = 0; i < s.arg(); ++i) {
+    if (i % 2)
+      cxt.write_action(Set_action(Packet_memory, 22, 1, &ttl));
+    else
+      cxt.write_action(Set_action(Packet_memory, 30, 4, dst));
+  }
+  cxt.write_action(Output_action{2});
+  while (s.keep_running()) {
+    cxt.apply_actions();
+    bench::keep(cxt);
+  }
+}
+FP_BENCHMARK(apply_actions)->arg(1)->arg(4)->arg(8);
+
+
+} // namespace
@@ -0,0 +1,472 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+// The loopback benchmark measures a driver end to end. It connects
+// two endpoints to a wire driver (e.g., fp-wire-epoll-tpp), sends
+// UDP frames through one and receives them from the other, and
+// determines the highest rate at which no frame is lost, by binary
+// search over the offered rate as in RFC 2544. The latency of each
+// frame, from send to receipt, is measured at that rate.
+//
+// The driver may be started by the benchmark, so that variants are
+// easily compared:
+//
+//    fp-loopback --size=64 --flows=16 -- ./drivers/wire/fp-wire-epoll-tpp
+//
+// The application and port types under test cannot be chosen by
+// the benchmark; they are fixed by the driver. The wire drivers load
+// apps/wire.app relative to their working directory, so the benchmark
+// is run from the build's fp-lite directory, and they accept their
+// ports as TCP connections on port 5000, the first connection being
+// the ingress port. Another application or port type is measured by
+// naming another driver.
+//
+// The driver's output is redirected to the standard error. Results
+// are written to the standard output as JSON.
+
+#include "latency.hpp"
+#include "time.hpp"
+
+#include <freeflow/ip.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+
+using namespace fp;
+
+
+namespace
+{
+
+struct Options
+{
+  std::string host       = "127.0.0.1";
+  int         port       = 5000;
+  int         size       = 64;   // Frame size, in bytes.
+  int         flows      = 1;    // Number of distinct UDP flows.
+  double      rate       = 1e6;  // Maximum offered rate, in frames per second.
+  double      duration   = 1.0;  // Length of a trial, in seconds.
+  double      resolution = 0.01; // Search resolution, as a fraction of the rate.
+  int         trials     = 16;   // Maximum number of trials.
+  char**      command    = nullptr;
+};
+
+
+// The test payload follows the Ethernet, IPv4, and UDP headers.
+constexpr int payload_offset = 42;
+constexpr int payload_size = 20;
+constexpr int min_size = payload_offset + payload_size;
+constexpr int max_size = 9000;
+
+
+// The payload of a test frame.
+struct Payload
+{
+  std::uint32_t trial;
+  std::uint64_t seq;
+  Timestamp     sent;
+};
+
+
+// The outcome of a trial.
+struct Trial
+{
+  double                             rate;
+  std::uint64_t                      sent;
+  std::uint64_t                      received;
+  std::shared_ptr<Latency_histogram> latency;
+
+  bool passed(Options const& opt) const
+  {
+    // The rate must have been offered, and nothing lost.
+    return received == sent && sent >= 0.99 * rate * opt.duration;
+  }
+};
+
+
+int
+usage()
+{
+  std::fprintf(stderr,
+    "usage: fp-loopback [options] [-- driver [args...]]\n"
+    "    --host=<addr>         The driver's address (127.0.0.1)\n"
+    "    --port=<port>         The driver's port (5000)\n"
+    "    --size=<bytes>        The frame size (64)\n"
+    "    --flows=<n>           The number of flows (1)\n"
+    "    --rate=<fps>          The maximum rate, in frames per second (1000000)\n"
+    "    --duration=<seconds>  The length of each trial (1)\n"
+    "    --resolution=<frac>   The search resolution (0.01)\n"
+    "    --trials=<n>          The maximum number of trials (16)\n");
+  return 1;
+}
+
+
+// Parse the command line. Returns false if it is invalid.
+bool
+parse(int argc, char* argv[], Options& opt)
+{
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--") {
+      if (i + 1 < argc)
+        opt.command = argv + i + 1;
+      break;
+    }
+    std::size_t eq = arg.find('=');
+    if (arg.compare(0, 2, "--") || eq == std::string::npos)
+      return false;
+    std::string name = arg.substr(2, eq - 2);
+    std::string value = arg.substr(eq + 1);
+    if (name == "host")
+      opt.host = value;
+    else if (name == "port")
+      opt.port = std::stoi(value);
+    else if (name == "size")
+      opt.size = std::stoi(value);
+    else if (name == "flows")
+      opt.flows = std::stoi(value);
+    else if (name == "rate")
+      opt.rate = std::stod(value);
+    else if (name == "duration")
+      opt.duration = std::stod(value);
+    else if (name == "resolution")
+      opt.resolution = std::stod(value);
+    else if (name == "trials")
+      opt.trials = std::stoi(value);
+    else
+      return false;
+  }
+  return opt.size >= min_size && opt.size <= max_size && opt.flows > 0 &&
+         opt.rate > 0 && opt.duration > 0 && opt.trials > 0;
+}
+
+
+// Build a frame, with its length header, for each flow. Flows
+// differ in their UDP source port.
+std::vector<std::vector<Byte>>
+make_frames(Options const& opt)
+{
+  std::vector<std::vector<Byte>> frames(opt.flows);
+  for (int f = 0; f < opt.flows; ++f) {
+    std::vector<Byte>& v = frames[f];
+    v.assign(4 + opt.size, 0);
+    std::uint32_t len = htonl(opt.size);
+    std::memcpy(&v[0], &len, 4);
+    Byte* p = &v[4];
+    Byte eth[14] = {0, 0, 0, 0, 0, 2, 0, 0, 0, 0, 0, 1, 0x08, 0x00};
+    std::memcpy(p, eth, sizeof(eth));
+    Byte* ip = p + 14;
+    std::uint16_t iplen = htons(opt.size - 14);
+    std::uint16_t udplen = htons(opt.size - 34);
+    ip[0] = 0x45;
+    std::memcpy(ip + 2, &iplen, 2);
+    ip[8] = 64;
+    ip[9] = 17;
+    Byte addrs[8] = {10, 0, 0, 1, 10, 0, 0, 2};
+    std::memcpy(ip + 12, addrs, 8);
+    Byte* udp = ip + 20;
+    std::uint16_t sport = htons(1024 + f);
+    std::uint16_t dport = htons(9);
+    std::memcpy(udp, &sport, 2);
+    std::memcpy(udp + 2, &dport, 2);
+    std::memcpy(udp + 4, &udplen, 2);
+  }
+  return frames;
+}
+
+
+// Write all of the buffer. Returns false on error.
+bool
+write_all(int fd, Byte const* p, int n)
+{
+  while (n) {
+    int k = ::write(fd, p, n);
+    if (k < 0 && errno == EINTR)
+      continue;
+    if (k <= 0)
+      return false;
+    p += k;
+    n -= k;
+  }
+  return true;
+}
+
+
+// Send frames at the given rate for the duration of a trial,
+// cycling through the flows. Frames are sent as soon as they are
+// due, so a sender that falls behind sends back to back. Returns
+// the number of frames sent.
+//
+// The sender sleeps until shortly before each frame is due, and
+// spins only for the rest, so that it does not take processor time
+// from the driver when they share processors.
+std::uint64_t
+send_frames(int fd, std::vector<std::vector<Byte>>& frames, std::uint32_t trial,
+            double rate, double duration)
+{
+  constexpr std::uint64_t spin_ns = 100000;
+
+  Timestamp interval = Time::frequency() / rate;
+  Timestamp start = Time::current();
+  Timestamp end = start + Timestamp(duration * Time::frequency());
+  Timestamp spin = Time::from_nanoseconds(spin_ns);
+  std::uint64_t n = 0;
+  for (Timestamp due = start; due < end; due += interval) {
+    Timestamp now = Time::current();
+    if (now + spin < due)
+      ::usleep(Time::to_nanoseconds(due - now - spin) / 1000);
+    while ((now = Time::current()) < due)
+      ;
+    if (now >= end)
+      break;
+    std::vector<Byte>& f = frames[n % frames.size()];
+    Payload pl = {trial, n, now};
+    Byte* p = &f[4 + payload_offset];
+    std::memcpy(p, &pl.trial, 4);
+    std::memcpy(p + 4, &pl.seq, 8);
+    std::memcpy(p + 12, &pl.sent, 8);
+    if (!write_all(fd, f.data(), f.size()))
+      break;
+    ++n;
+  }
+  return n;
+}
+
+
+// Reads frames from the stream, and counts those of the current
+// trial.
+class Receiver
+{
+public:
+  explicit Receiver(int fd)
+    : fd_(fd), buf_(1 << 20), len_(0)
+  { }
+
+  int  fd() const { return fd_; }
+  bool receive(std::uint32_t, std::uint64_t&, Latency_histogram&);
+
+private:
+  int               fd_;
+  std::vector<Byte> buf_;
+  int               len_;
+};
+
+
+// Read and parse what is available. Returns false if the stream
+// is closed.
+bool
+Receiver::receive(std::uint32_t trial, std::uint64_t& n, Latency_histogram& h)
+{
+  int k = ::read(fd_, &buf_[len_], buf_.size() - len_);
+  if (k < 0)
+    return errno == EINTR;
+  if (k == 0)
+    return false;
+  len_ += k;
+
+  Timestamp now = Time::current();
+  int off = 0;
+  while (len_ - off >= 4) {
+    std::uint32_t len;
+    std::memcpy(&len, &buf_[off], 4);
+    len = ntohl(len);
+    if (len > (std::uint32_t)max_size)
+      return false;
+    if (len_ - off < int(4 + len))
+      break;
+    if (len >= (std::uint32_t)min_size) {
+      Payload pl;
+      Byte const* p = &buf_[off + 4 + payload_offset];
+      std::memcpy(&pl.trial, p, 4);
+      std::memcpy(&pl.seq, p + 4, 8);
+      std::memcpy(&pl.sent, p + 12, 8);
+      if (pl.trial == trial) {
+        ++n;
+        if (now > pl.sent)
+          h.record(Time::to_nanoseconds(now - pl.sent));
+      }
+    }
+    off += 4 + len;
+  }
+  std::memmove(&buf_[0], &buf_[off], len_ - off);
+  len_ -= off;
+  return true;
+}
+
+
+// Run a trial at the given rate. After sending, frames are awaited
+// until all have arrived, or none has arrived for a while.
+Trial
+run_trial(Options const& opt, int tx, Receiver& rx,
+          std::vector<std::vector<Byte>>& frames, std::uint32_t id, double rate)
+{
+  constexpr int idle_ms = 250;
+
+  Trial t = {rate, 0, 0, std::make_shared<Latency_histogram>()};
+  std::atomic<bool> done(false);
+  std::thread sender([&]() {
+    t.sent = send_frames(tx, frames, id, rate, opt.duration);
+    done.store(true);
+  });
+
+  pollfd pfd = {rx.fd(), POLLIN, 0};
+  int idle = 0;
+  bool open = true;
+  while (open) {
+    bool finished = done.load();
+    if (finished && (t.received >= t.sent || idle >= idle_ms))
+      break;
+    if (::poll(&pfd, 1, 1) > 0) {
+      open = rx.receive(id, t.received, *t.latency);
+      idle = 0;
+    }
+    else if (finished) {
+      ++idle;
+    }
+  }
+  sender.join();
+  return t;
+}
+
+
+// Connect to the driver, retrying for up to 30 seconds while it
+// starts. Returns -1 on failure.
+int
+connect_driver(Options const& opt)
+{
+  ff::Ipv4_socket_address addr(ff::Ipv4_address(opt.host), opt.port);
+  for (int i = 0; i < 300; ++i) {
+    int fd = ff::stream_socket(AF_INET);
+    if (fd < 0)
+      return -1;
+    if (ff::connect(fd, addr) == 0)
+      return fd;
+    ::close(fd);
+    ::usleep(100000);
+  }
+  return -1;
+}
+
+
+// Start the driver, with its output redirected to the standard
+// error. Returns its process id, or -1 on failure.
+pid_t
+spawn(char** command)
+{
+  pid_t pid = ::fork();
+  if (pid == 0) {
+    ::dup2(2, 1);
+    ::execvp(command[0], command);
+    std::perror(command[0]);
+    ::_exit(127);
+  }
+  return pid;
+}
+
+
+void
+write_results(Options const& opt, std::vector<Trial> const& trials, Trial const* best)
+{
+  double fps = best ? best->rate : 0;
+  std::printf("{\"size\":%d,\"flows\":%d,\"duration\":%g,", opt.size, opt.flows,
+              opt.duration);
+  std::printf("\"throughput\":{\"fps\":%.0f,\"mbps\":%.3f},", fps,
+              fps * opt.size * 8 / 1e6);
+  if (best) {
+    Latency_histogram const& h = *best->latency;
+    std::printf("\"latency_ns\":{\"mean\":%.0f,\"p50\":%llu,\"p99\":%llu,"
+                "\"p999\":%llu,\"max\":%llu},", h.mean(),
+                (unsigned long long)h.percentile(0.5), (unsigned long long)h.percentile(0.99),
+                (unsigned long long)h.percentile(0.999), (unsigned long long)h.max());
+  }
+  std::printf("\"trials\":[");
+  for (std::size_t i = 0; i < trials.size(); ++i) {
+    Trial const& t = trials[i];
+    std::printf("%s{\"rate\":%.0f,\"sent\":%llu,\"received\":%llu,\"passed\":%s}",
+                i ? "," : "", t.rate, (unsigned long long)t.sent,
+                (unsigned long long)t.received, t.passed(opt) ? "true" : "false");
+  }
+  std::printf("]}\n");
+}
+
+
+} // namespace
+
+
+int
+main(int argc, char* argv[])
+{
+  Options opt;
+  if (!parse(argc, argv, opt))
+    return usage();
+
+  pid_t pid = -1;
+  if (opt.command && (pid = spawn(opt.command)) < 0) {
+    std::perror("fork");
+    return 1;
+  }
+
+  // The first connection is the driver's first port.
+  int tx = connect_driver(opt);
+  int rx = tx < 0 ? -1 : connect_driver(opt);
+  if (tx < 0 || rx < 0) {
+    std::fprintf(stderr, "error: could not connect to %s:%d\n", opt.host.c_str(), opt.port);
+    if (pid > 0)
+      ::kill(pid, SIGINT);
+    return 1;
+  }
+
+  // Allow the driver to accept both connections.
+  ::usleep(500000);
+
+  // Search for the highest rate without loss.
+  std::vector<std::vector<Byte>> frames = make_frames(opt);
+  Receiver recv(rx);
+  std::vector<Trial> trials;
+  int best = -1;
+  double lo = 0;
+  double hi = opt.rate;
+  double rate = hi;
+  for (int i = 0; i < opt.trials; ++i) {
+    trials.push_back(run_trial(opt, tx, recv, frames, i + 1, rate));
+    Trial const& t = trials.back();
+    bool ok = t.passed(opt);
+    std::fprintf(stderr, "[loopback] trial %d: %.0f fps, sent %llu, received %llu: %s\n",
+                 i + 1, rate, (unsigned long long)t.sent, (unsigned long long)t.received,
+                 ok ? "pass" : "fail");
+    if (ok) {
+      lo = rate;
+      best = i;
+    }
+    else {
+      hi = rate;
+    }
+    if (hi - lo <= opt.resolution * opt.rate)
+      break;
+    rate = (lo + hi) / 2;
+  }
+
+  write_results(opt, trials, best < 0 ? nullptr : &trials[best]);
+
+  ::close(tx);
+  ::close(rx);
+  if (pid > 0) {
+    ::kill(pid, SIGINT);
+    ::waitpid(pid, nullptr, 0);
+  }
+  return 0;
+}
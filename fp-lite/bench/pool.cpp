@@ -0,0 +1,45 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#include "bench.hpp"
+#include "buffer.hpp"
+#include "dataplane.hpp"
+
+
+using namespace fp;
+
+
+namespace
+{
+
+// The pool shared by all threads of a run.
+Pool&
+pool()
+{
+  static Dataplane dp("bench");
+  static Pool p(&dp);
+  return p;
+}
+
+
+// Allocate and free a burst of buffers, as a port does for each
+// batch of packets. The argument is the size of the burst.
+void
+pool_alloc_dealloc(bench::State& s)
+{
+  Pool& p = pool();
+  int n = s.arg();
+  int ids[64];
+  while (s.keep_running()) {
+    for (int i = 0; i < n; ++i)
+      ids[i] = p.alloc().id();
+    for (int i = 0; i < n; ++i)
+      p.dealloc(ids[i]);
+  }
+}
+FP_BENCHMARK(pool_alloc_dealloc)
+  ->arg(1)->arg(32)
+  ->threads(1)->threads(2)->threads(4);
+
+
+} // namespace
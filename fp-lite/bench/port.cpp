@@ -0,0 +1,51 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#include "bench.hpp"
+#include "buffer.hpp"
+#include "dataplane.hpp"
+#include "port_tcp.hpp"
+
+#include <sys/socket.h>
+
+
+using namespace fp;
+
+
+namespace
+{
+
+// Send a frame of the given size through a TCP port and receive
+// it on another, over a UNIX socket pair. This measures the cost
+// of framing and of the system calls for each packet.
+void
+port_tcp_framing(bench::State& s)
+{
+  static Dataplane dp("bench");
+  static Pool pool(16, &dp);
+
+  int sv[2];
+  if (::socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+    throw std::string("socketpair failed");
+  Port_eth_tcp tx(1);
+  Port_eth_tcp rx(2);
+  tx.attach(Port_tcp::Socket(ff::give(sv[0])));
+  rx.attach(Port_tcp::Socket(ff::give(sv[1])));
+  rx.set_pool(&pool);
+
+  Buffer& out = pool.alloc();
+  out.context().reset();
+  out.context().packet().limit(s.arg());
+  Buffer& in = pool.alloc();
+  while (s.keep_running()) {
+    in.context().reset();
+    tx.send(out.context());
+    rx.recv(in.context());
+  }
+  pool.dealloc(in.id());
+  pool.dealloc(out.id());
+}
+FP_BENCHMARK(port_tcp_framing)->arg(64)->arg(512)->arg(1500);
+
+
+} // namespace
@@ -0,0 +1,93 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#include "bench.hpp"
+#include "table.hpp"
+
+#include <map>
+#include <memory>
+#include <random>
+#include <vector>
+
+
+using namespace fp;
+
+
+namespace
+{
+
+// The number of keys searched, in a random order.
+constexpr int num_probes = 4096;
+
+
+// A table with random keys, and keys to search for: those of its
+// flows, and others.
+struct Fixture
+{
+  explicit Fixture(int);
+
+  Hash_table       tbl;
+  std::vector<Key> hits;
+  std::vector<Key> misses;
+};
+
+
+Fixture::Fixture(int n)
+  : tbl(0, n, 16), hits(num_probes), misses(num_probes)
+{
+  std::mt19937_64 gen(n);
+  auto random_key = [&gen]() { return (Key(gen()) << 64) | gen(); };
+  std::vector<Key> keys(n);
+  for (Key& k : keys) {
+    k = random_key();
+    tbl.insert(k, Flow());
+  }
+  for (Key& k : hits)
+    k = keys[gen() % n];
+  for (Key& k : misses)
+    k = random_key();
+}
+
+
+// Returns the fixture with n flows. Fixtures are created once,
+// since filling large tables takes much longer than a run.
+Fixture&
+fixture(int n)
+{
+  static std::map<int, std::unique_ptr<Fixture>> fixtures;
+  std::unique_ptr<Fixture>& f = fixtures[n];
+  if (!f)
+    f.reset(new Fixture(n));
+  return *f;
+}
+
+
+// Search a table with the given number of flows for keys in the
+// table.
+void
+table_search_hit(bench::State& s)
+{
+  Fixture& f = fixture(s.arg());
+  int i = 0;
+  while (s.keep_running())
+    bench::keep(f.tbl.search(f.hits[i++ & (num_probes - 1)]));
+}
+FP_BENCHMARK(table_search_hit)
+  ->arg(16)->arg(1024)->arg(65536)->arg(1 << 20);
+
+
+// Search a table with the given number of flows for keys not in
+// the table.
+void
+table_search_miss(bench::State& s)
+{
+  Fixture& f = fixture(s.arg());
+  int i = 0;
+  while (s.keep_running())
+    bench::keep(f.tbl.search(f.misses[i++ & (num_probes - 1)]));
+}
+FP_BENCHMARK(table_search_miss)
+  ->arg(16)->arg(1024)->arg(65536)->arg(1 << 20);
+
+
+} // namespace
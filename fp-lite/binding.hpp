@@ -160,6 +160,7 @@ struct Environment
 
   void push(int n, Binding b);
   void pop(int n);
+  void clear();
 
   Binding_list fields[max_fields];
 };
@@ -181,6 +182,15 @@ Environment::pop(int n)
 }
 
 
+// Remove all bindings from the environment.
+inline void
+Environment::clear()
+{
+  for (Binding_list& l : fields)
+    l.current = -1;
+}
+
+
 
 } // namespace fp
 
@@ -4,9 +4,11 @@
 #include "types.hpp"
 #include "context.hpp"
 
+#include <atomic>
 #include <queue>
 #include <functional>
 #include <mutex>
+#include <string>
 #include <vector>
 
 namespace fp
@@ -20,12 +22,25 @@ class Dataplane;
 // expected to initialize the context when it is allocated.
 // After a buffer has been freed, accessing the contents of
 // any field in this structure results in undefined behavior.
+//
+// The id of the buffer's packet is the buffer id, so that a
+// packet can be returned to the pool given only its context.
+//
+// Each buffer reserves headroom before the packet, so that
+// headers can be pushed (e.g., by tunnel encapsulation) without
+// moving the packet.
 struct Buffer
 {
+  static constexpr int data_size = 2048;
+  static constexpr int default_headroom = 128;
+
   // Buffer ctor.
-  Buffer(int id, Dataplane* dp)
-    : id_(id), data_(new Byte[2048]), cxt_(dp, {data_, 2048})
-  { }
+  Buffer(int id, Dataplane* dp, int headroom = default_headroom)
+    : id_(id), data_(new Byte[headroom + data_size]),
+      cxt_(dp, {data_, headroom + data_size, headroom})
+  {
+    cxt_.packet().id_ = id;
+  }
 
   // Accessors.
   //
@@ -52,7 +67,7 @@ public:
 
   Pool(Dataplane*);
 
-  Pool(int, Dataplane*);
+  Pool(int, Dataplane*, int = Buffer::default_headroom);
 
   ~Pool();
 
@@ -61,40 +76,60 @@ public:
 
   // Returns the next free index from the min-heap.
   inline Buffer& alloc();
+  inline Buffer* try_alloc();
 
   // Places the given index back into the min-heap.
   inline void dealloc(int);
 
+  // Chains segments onto a packet, or releases them.
+  inline bool extend(Packet&, int);
+  inline void trim(Packet&);
+
+  // Shares the segments of a packet with another packet.
+  inline void share(Packet const&);
+
+  // Returns the number of buffers, and the number that are free.
+  // The free count is read without locking the pool.
+  int size() const      { return data_.size(); }
+  int available() const { return free_.load(std::memory_order_relaxed); }
+
 private:
   // The buffer data store.
   Store_type data_;
   // The free-list, a min-heap.
   Heap_type  heap_;
+  // The number of packets sharing each buffer, beyond the first.
+  std::vector<int> refs_;
   // Mutex for concurrency operations.
   Mutex_type mutex_;
+  // The size of the free-list, updated under the mutex.
+  std::atomic<int> free_;
 };
 
 
 
 // Buffer pool default ctor.
+inline
 Pool::Pool(Dataplane* dp)
   : Pool(4096, dp)
 { }
 
 
 // Buffer pool sized ctor. Intializes the free-list (min-heap)
-// and the pool of buffers.
-Pool::Pool(int size, Dataplane* dp)
-  : data_(), heap_(), mutex_()
+// and the pool of buffers, each with the given headroom.
+inline
+Pool::Pool(int size, Dataplane* dp, int headroom)
+  : data_(), heap_(), refs_(size, 0), mutex_(), free_(size)
 { 
   for (int i = 0; i < size; i++) {
     heap_.push(i);
-    data_.push_back(Buffer(i, dp));
+    data_.push_back(Buffer(i, dp, headroom));
   }
 }
 
 
 // Buffer pool dtor.
+inline
 Pool::~Pool()
 { }
 
@@ -108,42 +143,138 @@ Pool::operator[](int idx)
 
 
 // Returns a reference to the next free buffer using the min-heap.
+// Throws if the pool is exhausted.
 inline Buffer&
 Pool::alloc()         
 { 
-  //while (heap_.empty()) { }
+  if (Buffer* buf = try_alloc())
+    return *buf;
+  throw std::string("Buffer pool exhausted");
+}
+
+
+// Returns the next free buffer, or nullptr if the pool is
+// exhausted.
+inline Buffer*
+Pool::try_alloc()
+{
   // Lock the heap.
   mutex_.lock();
+  if (heap_.empty()) {
+    mutex_.unlock();
+    return nullptr;
+  }
 
   // Get the next available index.
   int id(heap_.top());
 
   // Remove index from the heap.
   heap_.pop();
+  free_.store(heap_.size(), std::memory_order_relaxed);
   
   // Unlock the heap.
   mutex_.unlock();
 
-  // Return a reference to the buffer at the index.
-  return data_[id];
+  // Return the buffer at the index.
+  return &data_[id];
 }
 
 
-// Places the given index back into the min-heap.
+// Places the given index back into the min-heap, along with
+// the buffers of any segments chained to its packet. Segments
+// that are shared with other packets are kept until the last of
+// those is deallocated.
 inline void 
 Pool::dealloc(int id)   
 { 
   // Lock the heap.
   mutex_.lock();
 
-  // Return the index to the heap.
-  heap_.push(id);
+  // Return the index, and those of its segments, to the heap.
+  Packet* p = &data_[id].context().packet();
+  while (p) {
+    Packet* next = p->next_;
+    if (refs_[p->id()] != 0) {
+      --refs_[p->id()];
+    }
+    else {
+      p->next_ = nullptr;
+      heap_.push(p->id());
+    }
+    p = next;
+  }
+  free_.store(heap_.size(), std::memory_order_relaxed);
   
   // Unlock the heap.
   mutex_.unlock();
 }
 
 
+// Allocates empty segments, with room for at least n more bytes,
+// and chains them to the end of the packet. Segments use their
+// entire buffer, since nothing is pushed in front of them, so no
+// more are allocated than the bytes need. Returns false, leaving
+// the packet unchanged, if the pool does not have enough free
+// buffers.
+inline bool
+Pool::extend(Packet& pkt, int n)
+{
+  Packet* last = &pkt;
+  while (last->next_)
+    last = last->next_;
+
+  // Lock the heap.
+  mutex_.lock();
+
+  int k = (n + Buffer::data_size - 1) / Buffer::data_size;
+  if ((int)heap_.size() < k) {
+    mutex_.unlock();
+    return false;
+  }
+  while (n > 0) {
+    Buffer& buf = data_[heap_.top()];
+    heap_.pop();
+    Packet& seg = buf.context().packet();
+    seg.cap_ += seg.buf_ - seg.base_;
+    seg.buf_ = seg.base_;
+    seg.len_ = 0;
+    last->next_ = &seg;
+    last = &seg;
+    n -= seg.cap_;
+  }
+  free_.store(heap_.size(), std::memory_order_relaxed);
+
+  // Unlock the heap.
+  mutex_.unlock();
+  return true;
+}
+
+
+// Returns the segments chained to the packet to the pool, leaving
+// only the packet itself.
+inline void
+Pool::trim(Packet& pkt)
+{
+  if (Packet* seg = pkt.next_) {
+    pkt.next_ = nullptr;
+    dealloc(seg->id());
+  }
+}
+
+
+// Adds a reference to each segment chained to the packet, which
+// another packet (e.g., a replica) also chains. Only later
+// segments may be shared, since a packet's first segment is its
+// own buffer.
+inline void
+Pool::share(Packet const& pkt)
+{
+  mutex_.lock();
+  for (Packet const* seg = pkt.next_; seg; seg = seg->next_)
+    ++refs_[seg->id()];
+  mutex_.unlock();
+}
+
 
 // The flowpath buffer pool singleton namespace. Used to
 // statically initialize a new instance of a buffer pool.
@@ -0,0 +1,371 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#include "cache.hpp"
+#include "context.hpp"
+#include "flow.hpp"
+#include "port.hpp"
+#include "application.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+
+namespace fp
+{
+
+std::atomic<std::uint32_t> flow_generation(0);
+
+
+namespace
+{
+
+// Returns the hash of a cache key. The result is never 0.
+inline std::uint32_t
+key_hash(std::uint32_t h, std::uint32_t in_port)
+{
+  std::uint32_t k = mix(std::uint64_t(h) << 32 | in_port);
+  return k ? k : 1;
+}
+
+
+// The two slots that an entry with the given hash may occupy.
+inline int
+first_slot(std::uint32_t h)
+{
+  return h & (Microflow_cache::size - 1);
+}
+
+
+inline int
+second_slot(std::uint32_t h)
+{
+  return (h >> 16) & (Microflow_cache::size - 1);
+}
+
+
+inline bool
+matches(Microflow_cache::Entry const& e, Decision_record const& r, std::uint32_t in_port)
+{
+  return e.hash == r.hash
+      && e.in_port == in_port
+      && !std::memcmp(&e.tuple, &r.key, sizeof(Five_tuple));
+}
+
+
+// Returns true if the decision recorded for the context can be
+// cached.
+inline bool
+is_cacheable(Context const& cxt)
+{
+  Decision_record const& r = cxt.record_;
+  return r.active && r.cacheable && cxt.actions_.is_empty();
+}
+
+
+// Save the decision made for the context.
+void
+capture(Context const& cxt, int v, Flow_decision& d)
+{
+  Decision_record const& r = cxt.record_;
+  d.out_port = cxt.ctrl_.out_port;
+  d.queue = cxt.ctrl_.queue;
+  d.group = cxt.ctrl_.group;
+  d.verdict = v;
+  d.drop = cxt.ctrl_.drop;
+  d.nmatches = r.nmatches;
+  std::copy(r.matches, r.matches + r.nmatches, d.matches);
+}
+
+
+// Returns true if the meter drops the context's packet, in which
+// case the packet is directed to the drop port.
+inline bool
+drops(Context& cxt, std::uint32_t id)
+{
+  Meter* m = cxt.dataplane()->meters().find(id);
+  if (!m || m->apply(cxt) != Meter::DROP)
+    return false;
+  cxt.set_drop_reason(DROP_METER);
+  cxt.set_output_port(cxt.dataplane()->get_drop_port()->id());
+  return true;
+}
+
+
+// Apply a cached decision to the context and return its verdict.
+// The matched flows are counted, and their meters and programs
+// applied, as in fp_goto_table. If a meter drops the packet, the
+// remainder of the decision is not applied.
+//
+// The matches are also recorded, so that the decision can be
+// cached again by another cache.
+int
+replay(Context& cxt, Flow_decision const& d)
+{
+  for (int i = 0; i < d.nmatches; ++i) {
+    Flow_match const& m = d.matches[i];
+    cxt.ctrl_.table = m.table;
+    cxt.ctrl_.flow = m.flow;
+    m.flow->count_->count(cxt.packet().total_length());
+    if (m.flow->meter_ && drops(cxt, m.flow->meter_)) {
+      cxt.no_cache();
+      return Application::STOP;
+    }
+    if (!m.flow->prog_.is_empty())
+      cxt.apply_program(m.flow->prog_);
+    cxt.record_.match(m.table, m.flow);
+  }
+  cxt.ctrl_.out_port = d.out_port;
+  cxt.ctrl_.queue = d.queue;
+  cxt.ctrl_.group = d.group;
+  cxt.ctrl_.drop = d.drop;
+  return d.verdict;
+}
+
+
+} // namespace
+
+
+// -------------------------------------------------------------------------- //
+// Microflow cache
+
+Microflow_cache::Microflow_cache()
+  : hits_(0), misses_(0)
+{
+  for (Entry& e : entries_)
+    e.hash = 0;
+}
+
+
+// Look up the context's packet. On a hit, the cached decision is
+// applied to the context, the verdict of the application chain is
+// stored in v, and the result is true.
+//
+// The context's decision must be being recorded. On a miss, the
+// key is saved in the record so that the decision can be cached
+// by insert() after processing.
+bool
+Microflow_cache::lookup(Context& cxt, int& v)
+{
+  Decision_record& r = cxt.record_;
+  if (!extract_tuple(cxt.packet(), r.key)) {
+    ++misses_;
+    return false;
+  }
+  cxt.ctrl_.hash = hash(r.key);
+  r.hash = key_hash(cxt.ctrl_.hash, cxt.input_port_id());
+
+  std::uint32_t gen = flow_generation.load(std::memory_order_acquire);
+  Entry* e = &entries_[first_slot(r.hash)];
+  if (!matches(*e, r, cxt.input_port_id())) {
+    e = &entries_[second_slot(r.hash)];
+    if (!matches(*e, r, cxt.input_port_id()))
+      e = nullptr;
+  }
+  if (!e || e->generation != gen) {
+    ++misses_;
+    return false;
+  }
+
+  ++hits_;
+  v = replay(cxt, e->decision);
+  return true;
+}
+
+
+// Cache the decision recorded for the context, which was made
+// with the given verdict in generation gen. Decisions that cannot
+// be replayed are not cached.
+//
+// The entry replaces an unused or stale entry in one of its slots,
+// or else the entry in its first slot.
+void
+Microflow_cache::insert(Context const& cxt, int v, std::uint32_t gen)
+{
+  Decision_record const& r = cxt.record_;
+  if (!r.hash || !is_cacheable(cxt))
+    return;
+
+  std::uint32_t cur = flow_generation.load(std::memory_order_relaxed);
+  Entry* e = &entries_[first_slot(r.hash)];
+  if (e->hash && e->generation == cur) {
+    Entry* f = &entries_[second_slot(r.hash)];
+    if (!f->hash || f->generation != cur)
+      e = f;
+  }
+
+  e->hash = r.hash;
+  e->generation = gen;
+  e->in_port = cxt.input_port_id();
+  e->tuple = r.key;
+  capture(cxt, v, e->decision);
+}
+
+
+// -------------------------------------------------------------------------- //
+// Megaflow cache
+
+namespace
+{
+
+using Megaflow_key = Megaflow_cache::Key;
+constexpr int megaflow_words = Megaflow_cache::words;
+
+// The number of lookups between re-rankings of subtables.
+constexpr std::uint64_t rank_interval = 1024;
+
+
+// Load the leading bytes of the packet. Bytes beyond the end of
+// the packet are 0.
+inline void
+load_key(Packet const& pkt, Megaflow_key k)
+{
+  int n = std::min(pkt.length(), megaflow_key_size);
+  std::memset(k, 0, sizeof(Megaflow_key));
+  std::memcpy(k, pkt.data(), n);
+}
+
+
+// Returns the hash of the packet's key under the subtable's mask.
+inline std::uint64_t
+masked_hash(Megaflow_cache::Subtable const& t, Megaflow_key const k, std::uint32_t in_port)
+{
+  std::uint64_t h = mix(in_port);
+  for (int i = 0; i < t.nwords; ++i) {
+    int w = t.index[i];
+    h = mix(h ^ (k[w] & t.mask[w]));
+  }
+  return h;
+}
+
+
+inline bool
+masked_equal(Megaflow_cache::Subtable const& t, Megaflow_cache::Entry const& e,
+             Megaflow_key const k, std::uint32_t in_port)
+{
+  if (e.in_port != in_port)
+    return false;
+  for (int i = 0; i < t.nwords; ++i) {
+    int w = t.index[i];
+    if (e.key[w] != (k[w] & t.mask[w]))
+      return false;
+  }
+  return true;
+}
+
+} // namespace
+
+
+Megaflow_cache::Megaflow_cache()
+  : generation_(0), size_(0), lookups_(0), hits_(0), misses_(0)
+{ }
+
+
+// Discard all megaflows.
+void
+Megaflow_cache::clear()
+{
+  subtables_.clear();
+  size_ = 0;
+}
+
+
+// Order subtables by the number of recent hits, so that lookups
+// of the most common traffic probe the fewest subtables.
+void
+Megaflow_cache::rank()
+{
+  std::stable_sort(subtables_.begin(), subtables_.end(), [](Subtable const& a, Subtable const& b) {
+    return a.hits > b.hits;
+  });
+  for (Subtable& t : subtables_)
+    t.hits /= 2;
+}
+
+
+// Look up the context's packet. On a hit, the cached decision is
+// applied to the context, the verdict of the application chain is
+// stored in v, and the result is true.
+bool
+Megaflow_cache::lookup(Context& cxt, int& v)
+{
+  std::uint32_t gen = flow_generation.load(std::memory_order_acquire);
+  if (gen != generation_) {
+    clear();
+    generation_ = gen;
+  }
+  if (++lookups_ % rank_interval == 0)
+    rank();
+
+  Megaflow_key& k = cxt.record_.snapshot;
+  load_key(cxt.packet(), k);
+  std::uint32_t in_port = cxt.input_port_id();
+  for (Subtable& t : subtables_) {
+    auto iter = t.entries.find(masked_hash(t, k, in_port));
+    if (iter != t.entries.end() && masked_equal(t, iter->second, k, in_port)) {
+      ++t.hits;
+      ++hits_;
+      v = replay(cxt, iter->second.decision);
+      return true;
+    }
+  }
+  ++misses_;
+  return false;
+}
+
+
+// Cache the decision recorded for the context as a megaflow that
+// matches the bytes read while making it. The decision was made in
+// generation gen; if the generation has changed, it is discarded.
+void
+Megaflow_cache::insert(Context const& cxt, int v, std::uint32_t gen)
+{
+  Decision_record const& r = cxt.record_;
+  if (!r.masked || !is_cacheable(cxt))
+    return;
+  if (gen != generation_ || gen != flow_generation.load(std::memory_order_relaxed))
+    return;
+  if (size_ >= max_entries)
+    clear();
+
+  // Build the mask from the bytes that were read.
+  Byte bytes[megaflow_key_size];
+  for (int i = 0; i < megaflow_key_size; ++i)
+    bytes[i] = (r.accessed[i / 64] >> (i % 64)) & 1 ? 0xff : 0;
+  Megaflow_key mask;
+  std::memcpy(mask, bytes, sizeof(mask));
+
+  // Find or create the subtable for the mask.
+  Subtable* t = nullptr;
+  for (Subtable& s : subtables_) {
+    if (!std::memcmp(s.mask, mask, sizeof(mask))) {
+      t = &s;
+      break;
+    }
+  }
+  if (!t) {
+    subtables_.emplace_back();
+    t = &subtables_.back();
+    std::memcpy(t->mask, mask, sizeof(mask));
+    t->nwords = 0;
+    t->hits = 0;
+    for (int i = 0; i < megaflow_words; ++i) {
+      if (mask[i])
+        t->index[t->nwords++] = i;
+    }
+  }
+
+  // The key is the packet as it was before processing.
+  Megaflow_key const& k = r.snapshot;
+  std::uint32_t in_port = cxt.input_port_id();
+  std::size_t n = t->entries.size();
+  Entry& e = t->entries[masked_hash(*t, k, in_port)];
+  e.in_port = in_port;
+  for (int i = 0; i < megaflow_words; ++i)
+    e.key[i] = k[i] & mask[i];
+  capture(cxt, v, e.decision);
+  size_ += t->entries.size() - n;
+}
+
+
+} // namespace fp
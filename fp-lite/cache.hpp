@@ -0,0 +1,266 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#ifndef FP_CACHE_HPP
+#define FP_CACHE_HPP
+
+#include "tuple.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+
+namespace fp
+{
+
+class Context;
+struct Table;
+struct Flow;
+
+
+// The flow cache generation. Any change that could alter the
+// forwarding decision for a packet (a table modification, a port
+// change, or a change of application) advances the generation,
+// which invalidates every cached decision.
+extern std::atomic<std::uint32_t> flow_generation;
+
+
+// Invalidate all cached decisions. This must be called after a
+// change is made visible to workers, and before any object that
+// the change unlinks is retired.
+inline void
+invalidate_flow_caches()
+{
+  flow_generation.fetch_add(1);
+}
+
+
+// The flow caches that can be enabled for a dataplane.
+enum Flow_cache_mode
+{
+  MICROFLOW_CACHE = 0x01,
+  MEGAFLOW_CACHE  = 0x02,
+};
+
+
+// The number of leading packet bytes that can be matched by
+// a megaflow.
+constexpr int megaflow_key_size = 128;
+
+
+// A table match made while processing a packet.
+struct Flow_match
+{
+  Table* table;
+  Flow*  flow;
+};
+
+
+// The record of how a packet's forwarding decision was made. The
+// runtime records each table match while a packet is processed.
+// Runtime calls whose effects cannot be replayed from the matched
+// flows (e.g., writing a field directly) mark the decision as not
+// cacheable.
+//
+// The runtime also records which of the leading bytes of the
+// packet were read through field bindings. A decision that read
+// bytes beyond the megaflow key is not masked, and cannot be
+// cached as a megaflow.
+//
+// The keys are taken before processing, since processing may
+// modify the packet.
+struct Decision_record
+{
+  static constexpr int max_matches = 4;
+
+  void clear();
+  void match(Table*, Flow*);
+  void access(int, int);
+
+  bool          active;
+  bool          cacheable;
+  bool          masked;
+  int           nmatches;
+  Flow_match    matches[max_matches];
+  std::uint64_t accessed[megaflow_key_size / 64]; // One bit per byte.
+  std::uint32_t hash;  // The hash of the key, or 0 if there is no key.
+  Five_tuple    key;
+  std::uint64_t snapshot[megaflow_key_size / 8]; // The megaflow key.
+};
+
+
+inline void
+Decision_record::clear()
+{
+  active = false;
+  cacheable = true;
+  masked = true;
+  nmatches = 0;
+  accessed[0] = accessed[1] = 0;
+  hash = 0;
+}
+
+
+inline void
+Decision_record::match(Table* t, Flow* f)
+{
+  if (nmatches == max_matches)
+    cacheable = false;
+  else
+    matches[nmatches++] = {t, f};
+}
+
+
+// Record that n bytes at the given offset were read.
+inline void
+Decision_record::access(int off, int n)
+{
+  if (off + n > megaflow_key_size) {
+    masked = false;
+    return;
+  }
+  for (int i = off; i < off + n; ++i)
+    accessed[i / 64] |= std::uint64_t(1) << (i % 64);
+}
+
+
+// A cached forwarding decision: the flows matched by the packet,
+// whose meters and action programs are applied to each packet,
+// and the resulting output port, queue, group, and verdict.
+struct Flow_decision
+{
+  std::uint32_t out_port;
+  std::uint32_t queue;
+  std::uint32_t group;
+  std::uint8_t  verdict;
+  std::uint8_t  drop;
+  std::uint8_t  nmatches;
+  Flow_match    matches[Decision_record::max_matches];
+};
+
+
+// The microflow cache is an exact-match cache of forwarding
+// decisions, keyed on a packet's five tuple and input port. A hit
+// bypasses the application: the matched flows' meters and action
+// programs are applied, and the recorded output port, queue, and
+// group are restored.
+//
+// The cache is only correct for applications whose decisions are
+// determined by the key, so it must be enabled by the application
+// (see fp_enable_flow_cache).
+//
+// Each worker owns a cache, so lookups and insertions take no
+// locks. Cached flows are protected by RCU: a cached entry is
+// only used if the generation has not changed since it was made,
+// and tables advance the generation before retiring flows.
+//
+// Entries are placed in one of two slots chosen by independent
+// bits of the hash, as in the OVS exact match cache.
+class Microflow_cache
+{
+public:
+  static constexpr int size = 8192;
+
+  struct Entry
+  {
+    std::uint32_t hash;       // 0 if the entry is unused.
+    std::uint32_t generation;
+    std::uint32_t in_port;
+    Five_tuple    tuple;
+    Flow_decision decision;
+  };
+
+  Microflow_cache();
+
+  bool lookup(Context&, int&);
+  void insert(Context const&, int, std::uint32_t);
+
+  std::uint64_t hits() const   { return hits_; }
+  std::uint64_t misses() const { return misses_; }
+
+private:
+  Entry entries_[size];
+
+  std::uint64_t hits_;
+  std::uint64_t misses_;
+};
+
+
+// The megaflow cache holds wildcarded forwarding decisions. Each
+// megaflow matches the input port and those leading bytes of the
+// packet that the application read while making the decision, so
+// a single entry covers, e.g., all source ports of a destination
+// when the application only examined destination fields.
+//
+// The cache is a tuple space classifier: megaflows with the same
+// mask are kept in a subtable, which is a hash table of masked
+// keys. A lookup probes each subtable in turn, most frequently
+// hit first.
+//
+// Only reads made through the runtime (field bindings and key
+// gathering) are tracked. An application that reads the packet
+// directly must not enable this cache.
+//
+// As with the microflow cache, each worker owns a cache. When the
+// generation changes, the entire cache is discarded.
+class Megaflow_cache
+{
+public:
+  static constexpr int words = megaflow_key_size / 8;
+  static constexpr std::size_t max_entries = 16384;
+
+  using Key = std::uint64_t[words];
+
+  struct Entry
+  {
+    std::uint32_t in_port;
+    Key           key;     // The masked key.
+    Flow_decision decision;
+  };
+
+  struct Subtable
+  {
+    Key           mask;
+    std::uint8_t  index[words]; // The indexes of non-zero mask words.
+    int           nwords;
+    std::uint64_t hits;
+    std::unordered_map<std::uint64_t, Entry> entries;
+  };
+
+  Megaflow_cache();
+
+  bool lookup(Context&, int&);
+  void insert(Context const&, int, std::uint32_t);
+
+  std::size_t   size() const   { return size_; }
+  std::size_t   subtables() const { return subtables_.size(); }
+  std::uint64_t hits() const   { return hits_; }
+  std::uint64_t misses() const { return misses_; }
+
+private:
+  void clear();
+  void rank();
+
+  std::uint32_t         generation_;
+  std::vector<Subtable> subtables_;
+  std::size_t           size_;
+  std::uint64_t         lookups_;
+  std::uint64_t         hits_;
+  std::uint64_t         misses_;
+};
+
+
+// The flow caches owned by a worker.
+struct Flow_caches
+{
+  Microflow_cache microflows;
+  Megaflow_cache  megaflows;
+};
+
+
+} // namespace fp
+
+
+#endif
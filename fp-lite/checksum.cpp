@@ -0,0 +1,343 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#include "checksum.hpp"
+#include "packet.hpp"
+#include "tuple.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+#if defined(__x86_64__)
+#  include <immintrin.h>
+#endif
+
+
+namespace fp
+{
+
+namespace
+{
+
+constexpr std::uint8_t ip_tcp = 6;
+constexpr std::uint8_t ip_udp = 17;
+
+
+// Fold a ones' complement sum to 16 bits.
+inline std::uint16_t
+fold(std::uint64_t s)
+{
+  while (s >> 16)
+    s = (s & 0xffff) + (s >> 16);
+  return s;
+}
+
+
+// Returns the big-endian value of a folded sum of native-order
+// words. The ones' complement sum is independent of byte order
+// (RFC 1071, sec. 2), up to a swap of its bytes.
+inline std::uint16_t
+to_network(std::uint16_t s)
+{
+  Byte b[2];
+  std::memcpy(b, &s, 2);
+  return b[0] << 8 | b[1];
+}
+
+
+inline std::uint16_t
+load16(Byte const* p)
+{
+  return p[0] << 8 | p[1];
+}
+
+
+// Add the native-order 16-bit words of n bytes to the sum s. An
+// odd trailing byte is padded with zero.
+std::uint64_t
+sum_scalar(Byte const* p, int n, std::uint64_t s = 0)
+{
+  for (; n >= 8; p += 8, n -= 8) {
+    std::uint64_t w;
+    std::memcpy(&w, p, 8);
+    s += w & 0xffffffff;
+    s += w >> 32;
+  }
+  for (; n >= 2; p += 2, n -= 2) {
+    std::uint16_t w;
+    std::memcpy(&w, p, 2);
+    s += w;
+  }
+  if (n) {
+    Byte b[2] = {p[0], 0};
+    std::uint16_t w;
+    std::memcpy(&w, b, 2);
+    s += w;
+  }
+  return s;
+}
+
+
+#if defined(__x86_64__)
+
+// The number of vectors added into 32-bit lanes before they are
+// widened, so that no lane can overflow.
+constexpr int max_block = 16384;
+
+
+// Sum 16 bytes at a time. SSE2 is always available on x86-64.
+std::uint64_t
+sum_sse2(Byte const* p, int n)
+{
+  __m128i const zero = _mm_setzero_si128();
+  std::uint64_t s = 0;
+  while (n >= 16) {
+    int k = std::min(n / 16, max_block);
+    __m128i acc = zero;
+    for (int i = 0; i < k; ++i, p += 16) {
+      __m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const*>(p));
+      acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(v, zero));
+      acc = _mm_add_epi32(acc, _mm_unpackhi_epi16(v, zero));
+    }
+    n -= k * 16;
+    std::uint32_t lanes[4];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), acc);
+    for (std::uint32_t l : lanes)
+      s += l;
+  }
+  return sum_scalar(p, n, s);
+}
+
+
+// Sum 32 bytes at a time.
+__attribute__((target("avx2"))) std::uint64_t
+sum_avx2(Byte const* p, int n)
+{
+  __m256i const zero = _mm256_setzero_si256();
+  std::uint64_t s = 0;
+  while (n >= 32) {
+    int k = std::min(n / 32, max_block);
+    __m256i acc = zero;
+    for (int i = 0; i < k; ++i, p += 32) {
+      __m256i v = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(p));
+      acc = _mm256_add_epi32(acc, _mm256_unpacklo_epi16(v, zero));
+      acc = _mm256_add_epi32(acc, _mm256_unpackhi_epi16(v, zero));
+    }
+    n -= k * 32;
+    std::uint32_t lanes[8];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc);
+    for (std::uint32_t l : lanes)
+      s += l;
+  }
+  return sum_scalar(p, n, s);
+}
+
+#else
+
+std::uint64_t
+sum_generic(Byte const* p, int n)
+{
+  return sum_scalar(p, n);
+}
+
+#endif
+
+
+using Sum_fn = std::uint64_t (*)(Byte const*, int);
+
+
+// Select the sum for the processor.
+Sum_fn
+select_sum()
+{
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return sum_avx2;
+  return sum_sse2;
+#else
+  return sum_generic;
+#endif
+}
+
+
+Sum_fn const sum = select_sum();
+
+
+} // namespace
+
+
+std::uint16_t
+checksum(Byte const* p, int n)
+{
+  return ~to_network(fold(sum(p, n)));
+}
+
+
+std::uint16_t
+checksum(Byte const* p, int n, Checksum_isa isa)
+{
+  Sum_fn f = [](Byte const* p, int n) { return sum_scalar(p, n); };
+#if defined(__x86_64__)
+  if (isa == CHECKSUM_SSE2)
+    f = sum_sse2;
+  else if (isa == CHECKSUM_AVX2 && __builtin_cpu_supports("avx2"))
+    f = sum_avx2;
+#endif
+  return ~to_network(fold(f(p, n)));
+}
+
+
+// Update the ones' complement checksum at p after n bytes that it
+// covers change from old to cur (RFC 1624, eqn. 3). The bytes must
+// start on a word boundary of the checksummed data.
+void
+update_checksum(Byte* p, Byte const* old, Byte const* cur, int n)
+{
+  std::uint32_t s = std::uint16_t(~load16(p));
+  s += std::uint16_t(~to_network(fold(sum_scalar(old, n))));
+  s += to_network(fold(sum_scalar(cur, n)));
+  std::uint16_t c = ~fold(s);
+  p[0] = c >> 8;
+  p[1] = c & 0xff;
+}
+
+
+// -------------------------------------------------------------------------- //
+// Checksum layout
+
+// Find the network and transport headers of the packet. Packets
+// that are not IP, or are truncated, have no checksums to maintain.
+void
+Checksum_layout::load(Packet const& pkt)
+{
+  Five_tuple t;
+  if (!extract_tuple(pkt, t) || !t.version) {
+    version = proto = 0;
+    l3 = l4 = 0;
+    return;
+  }
+  version = t.version;
+  proto = t.proto;
+  l3 = t.l3;
+  l4 = t.l4;
+}
+
+
+// Returns true if rewriting n bytes at the given offset may change
+// the layout: the ethertype, VLAN tags and MPLS labels, or the IP
+// fields that locate the transport header. A rewrite of any byte
+// past the Ethernet addresses of a non-IP frame may make it IP.
+bool
+Checksum_layout::is_structural(int off, int n) const
+{
+  auto overlaps = [&](int a, int b) { return off < b && a < off + n; };
+  if (!version)
+    return overlaps(12, 0xffff);
+  if (overlaps(12, l3 + 1))
+    return true;
+  if (version == 4)
+    return overlaps(l3 + 6, l3 + 8) || overlaps(l3 + 9, l3 + 10);
+  return overlaps(l3 + 6, l3 + 7) || overlaps(l3 + 40, l4 ? l4 : 0xffff);
+}
+
+
+// -------------------------------------------------------------------------- //
+// Checksum update
+
+namespace
+{
+
+// Returns the layout of the packet, or an empty layout if no
+// checksum can cover the n bytes at the given offset.
+inline Checksum_layout
+layout_of(Packet const& pkt, int off, int n)
+{
+  Checksum_layout l = {};
+  if (off + n > 14 && off < pkt.length())
+    l.load(pkt);
+  return l;
+}
+
+} // namespace
+
+
+// Save the n bytes at the given offset of the packet, which are
+// about to be rewritten.
+Checksum_update::Checksum_update(Packet& pkt, int off, int n)
+  : Checksum_update(pkt, layout_of(pkt, off, n), off, n)
+{ }
+
+
+// Save the n bytes at the given offset of the packet, whose headers
+// have the given layout. The saved bytes are extended to whole words
+// of the network header.
+//
+// Rewrites of the Ethernet header, which no checksum covers, are
+// not examined further.
+Checksum_update::Checksum_update(Packet& pkt, Checksum_layout const& l, int off, int n)
+  : pkt_(pkt), first_(-1), last_(0), layout_(l)
+{
+  assert(n <= max_length);
+  int len = pkt.length();
+  if (off + n <= 14 || off >= len || !l.version)
+    return;
+
+  first_ = off - ((off - l.l3) & 1);
+  last_ = off + n + ((off + n - l.l3) & 1);
+  int end = std::min(last_, len);
+  std::memset(old_, 0, sizeof(old_));
+  std::memcpy(old_, pkt.data() + first_, end - first_);
+}
+
+
+// Update the checksums that cover the rewritten bytes.
+void
+Checksum_update::commit()
+{
+  if (first_ < 0)
+    return;
+  Byte* p = pkt_.data();
+  int len = pkt_.length();
+  Byte cur[max_length + 2] = {};
+  std::memcpy(cur, p + first_, std::min(last_, len) - first_);
+
+  // Update the checksum at off for the rewritten bytes within
+  // [a, b), unless the checksum was rewritten.
+  auto adjust = [&](int off, int a, int b) {
+    if (first_ < off + 2 && off < last_)
+      return false;
+    int s = std::max(a, first_);
+    int e = std::min(b, last_);
+    if (s < e)
+      update_checksum(p + off, old_ + (s - first_), cur + (s - first_), e - s);
+    return true;
+  };
+
+  // The IPv4 header checksum covers the header.
+  if (layout_.version == 4)
+    adjust(layout_.l3 + 10, layout_.l3, layout_.l3 + (p[layout_.l3] & 0x0f) * 4);
+
+  // The transport checksum covers the addresses of the IP header
+  // (in the pseudo-header) and the entire segment.
+  if (!layout_.l4 || (layout_.proto != ip_tcp && layout_.proto != ip_udp))
+    return;
+  int off = layout_.l4 + (layout_.proto == ip_tcp ? 16 : 6);
+  if (off + 2 > len)
+    return;
+  bool udp = layout_.proto == ip_udp;
+  if (udp && layout_.version == 4 && load16(p + off) == 0)
+    return;
+  bool v4 = layout_.version == 4;
+  if (!adjust(off, layout_.l3 + (v4 ? 12 : 8), layout_.l3 + (v4 ? 20 : 40)))
+    return;
+  adjust(off, layout_.l4, last_);
+
+  // A computed UDP checksum of zero is transmitted as all ones.
+  if (udp && load16(p + off) == 0)
+    p[off] = p[off + 1] = 0xff;
+}
+
+
+} // namespace fp
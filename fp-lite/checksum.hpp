@@ -0,0 +1,105 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#ifndef FP_CHECKSUM_HPP
+#define FP_CHECKSUM_HPP
+
+#include "types.hpp"
+
+#include <cstdint>
+
+
+namespace fp
+{
+
+struct Packet;
+
+
+// Returns the Internet checksum (RFC 1071) of n bytes: the ones'
+// complement of the ones' complement sum of the bytes, taken as
+// big-endian 16-bit words. The result is in native byte order.
+//
+// The sum is computed with the widest vector instructions that
+// the processor supports.
+std::uint16_t checksum(Byte const*, int);
+
+
+// The implementations of the sum, from which checksum() selects.
+enum Checksum_isa { CHECKSUM_SCALAR, CHECKSUM_SSE2, CHECKSUM_AVX2 };
+
+// Returns the checksum of n bytes, computed with the given
+// implementation, or the scalar one if the processor does not
+// support it. This allows each implementation to be tested.
+std::uint16_t checksum(Byte const*, int, Checksum_isa);
+
+
+// Update the ones' complement checksum at p after a 16-bit
+// word that it covers changes from m to n (RFC 1624, eqn. 3).
+inline void
+update_checksum(Byte* p, std::uint16_t m, std::uint16_t n)
+{
+  std::uint32_t sum = std::uint16_t(~(p[0] << 8 | p[1]));
+  sum += std::uint16_t(~m);
+  sum += n;
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  std::uint16_t c = ~sum;
+  p[0] = c >> 8;
+  p[1] = c & 0xff;
+}
+
+
+void update_checksum(Byte*, Byte const*, Byte const*, int);
+
+
+// The offsets of a packet's network and transport headers, which
+// locate the checksums that cover its bytes. The layout is found
+// by decoding the packet, so it is computed once and shared by the
+// updates for each rewrite of the packet.
+struct Checksum_layout
+{
+  void load(Packet const&);
+  bool is_structural(int, int) const;
+
+  std::uint8_t  version; // IP version (4 or 6), or 0 if not IP.
+  std::uint8_t  proto;
+  std::uint16_t l3;
+  std::uint16_t l4;      // Offset of the transport header or 0.
+};
+
+
+// Maintains the IPv4, TCP, and UDP checksums of a packet across a
+// rewrite of some of its bytes. The bytes are saved when the update
+// is constructed, and the checksums covering them are updated
+// incrementally (RFC 1624) by commit(), after the rewrite.
+//
+// A checksum is not updated if the rewrite overlaps it, since the
+// writer is then assumed to have set it. A zero UDP checksum over
+// IPv4 means that there is none, and it remains zero.
+//
+// Rewrites must not change the length or structure of the headers
+// (e.g., the IPv4 header length). If the layout is not given, it
+// is computed from the packet.
+class Checksum_update
+{
+public:
+  static constexpr int max_length = 16;
+
+  Checksum_update(Packet&, int, int);
+  Checksum_update(Packet&, Checksum_layout const&, int, int);
+
+  void commit();
+
+private:
+  Packet&         pkt_;
+  int             first_; // The first saved byte, or -1 if none.
+  int             last_;  // Past the last saved byte.
+  Checksum_layout layout_;
+  Byte            old_[max_length + 2];
+};
+
+
+} // namespace fp
+
+
+#endif
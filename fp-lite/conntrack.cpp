@@ -0,0 +1,448 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#include "conntrack.hpp"
+#include "context.hpp"
+#include "time.hpp"
+#include "tuple.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+
+namespace fp
+{
+
+namespace
+{
+
+constexpr std::uint8_t ip_tcp = 6;
+
+// TCP flags.
+constexpr Byte tcp_fin = 0x01;
+constexpr Byte tcp_syn = 0x02;
+constexpr Byte tcp_rst = 0x04;
+constexpr Byte tcp_ack = 0x10;
+
+
+// Default timeouts, in seconds, as in Linux.
+constexpr std::uint32_t default_timeouts[Conntrack::num_states] = {
+  120,    // TCP_SYN_SENT
+  60,     // TCP_SYN_RECV
+  432000, // TCP_ESTABLISHED
+  120,    // TCP_FIN_WAIT
+  30,     // TCP_LAST_ACK
+  120,    // TCP_TIME_WAIT
+  10,     // TCP_CLOSE
+  30,     // UNREPLIED
+  180,    // REPLIED
+};
+
+
+// Returns true if the TCP flags are valid in any state: at least
+// one of SYN, RST, and ACK is set, and SYN is not combined with
+// FIN or RST.
+inline bool
+valid_tcp(Byte f)
+{
+  if (!(f & (tcp_syn | tcp_rst | tcp_ack)))
+    return false;
+  if ((f & tcp_syn) && (f & (tcp_fin | tcp_rst)))
+    return false;
+  return true;
+}
+
+
+// Build the connection key of the packet. Sets rev if the source
+// of the packet is endpoint b, and flags to its TCP flags. Returns
+// false if the packet is not IP.
+bool
+make_key(Packet const& pkt, Ct_key& k, bool& rev, Byte& flags)
+{
+  Five_tuple t;
+  if (!extract_tuple(pkt, t) || !t.version)
+    return false;
+
+  int c = std::memcmp(t.src, t.dst, 16);
+  rev = c > 0 || (c == 0 && t.src_port > t.dst_port);
+  std::memset(&k, 0, sizeof(k));
+  std::memcpy(k.a, rev ? t.dst : t.src, 16);
+  std::memcpy(k.b, rev ? t.src : t.dst, 16);
+  k.a_port = rev ? t.dst_port : t.src_port;
+  k.b_port = rev ? t.src_port : t.dst_port;
+  k.proto = t.proto;
+  k.version = t.version;
+
+  flags = 0;
+  if (t.proto == ip_tcp && t.l4 && t.l4 + 14 <= pkt.length())
+    flags = pkt.data()[t.l4 + 13];
+  return true;
+}
+
+
+inline std::uint32_t
+hash_key(Ct_key const& k)
+{
+  std::uint64_t h = hash_bytes(reinterpret_cast<Byte const*>(&k), sizeof(k));
+  return h ^ (h >> 32);
+}
+
+
+} // namespace
+
+
+constexpr std::uint32_t Conntrack::nil;
+
+
+// Create a table of n connections.
+Conntrack::Conntrack(int n)
+  : entries_(n), mask_(num_locks - 1), locks_(new std::mutex[num_locks]),
+    free_(nil), size_(0), wheel_(wheel_size, nil), tick_(0),
+    epoch_(Time::current())
+{
+  assert(n > 0);
+  while (mask_ + 1 < std::uint32_t(n))
+    mask_ = mask_ << 1 | 1;
+  buckets_.assign(mask_ + 1, nil);
+  for (int i = n - 1; i >= 0; --i) {
+    entries_[i].next = free_;
+    entries_[i].flags = 0;
+    entries_[i].scheduled = false;
+    free_ = i;
+  }
+  expired_.reserve(n);
+  std::copy(default_timeouts, default_timeouts + num_states, timeouts_);
+}
+
+
+// Set the timeout of connections in the given state. This must
+// not be called while workers are running.
+void
+Conntrack::set_timeout(State s, std::uint32_t secs)
+{
+  assert(s < num_states && secs > 0);
+  timeouts_[s] = secs;
+}
+
+
+// Returns the current tick.
+inline std::uint32_t
+Conntrack::now() const
+{
+  return Time::to_nanoseconds(Time::current() - epoch_) / 1000000000;
+}
+
+
+// Returns the index of the entry with the given key, or nil. The
+// bucket's lock must be held.
+std::uint32_t
+Conntrack::find(Ct_key const& k, std::uint32_t h) const
+{
+  std::uint32_t i = buckets_[h & mask_];
+  while (i != nil) {
+    Entry const& e = entries_[i];
+    if (e.hash == h && !std::memcmp(&e.key, &k, sizeof(k)))
+      return i;
+    i = e.next;
+  }
+  return nil;
+}
+
+
+// Take an entry from the free list, or return nil if the table is
+// full.
+std::uint32_t
+Conntrack::allocate()
+{
+  std::lock_guard<std::mutex> g(free_lock_);
+  std::uint32_t i = free_;
+  if (i != nil) {
+    free_ = entries_[i].next;
+    size_.fetch_add(1, std::memory_order_relaxed);
+  }
+  return i;
+}
+
+
+// Advance the state of the connection for a packet with the given
+// TCP flags, in the given direction. Returns false if the packet
+// is invalid, in which case the connection is unchanged. The
+// bucket's lock must be held.
+bool
+Conntrack::update(Entry& e, bool reply, Byte f, std::uint32_t t)
+{
+  if (e.key.proto != ip_tcp) {
+    if (reply)
+      e.state = REPLIED;
+    refresh(e, t);
+    return true;
+  }
+
+  if (!valid_tcp(f))
+    return false;
+  State s = e.state;
+  if (f & tcp_rst) {
+    s = TCP_CLOSE;
+  }
+  else if (f & tcp_syn) {
+    // A new SYN from the originator reopens a closed connection.
+    // A SYN-ACK from the responder answers the first SYN.
+    if (!(f & tcp_ack)) {
+      if (!reply && s >= TCP_TIME_WAIT) {
+        s = TCP_SYN_SENT;
+        e.flags &= ~(FIN_ORIG | FIN_REPLY);
+      }
+    }
+    else if (reply && s == TCP_SYN_SENT) {
+      s = TCP_SYN_RECV;
+    }
+  }
+  else if (f & tcp_fin) {
+    e.flags |= reply ? FIN_REPLY : FIN_ORIG;
+    if ((e.flags & FIN_ORIG) && (e.flags & FIN_REPLY))
+      s = std::max(s, TCP_LAST_ACK);
+    else
+      s = std::max(s, TCP_FIN_WAIT);
+  }
+  else {
+    // The originator's ACK completes the handshake, and an ACK
+    // after both FINs completes the close.
+    if (s == TCP_SYN_RECV && !reply)
+      s = TCP_ESTABLISHED;
+    else if (s == TCP_LAST_ACK)
+      s = TCP_TIME_WAIT;
+  }
+  e.state = s;
+  refresh(e, t);
+  return true;
+}
+
+
+// Restart the timeout of the connection. A connection is never
+// due after it expires, so it is only rescheduled if its expiry
+// time moves back (i.e., its state changed to one with a shorter
+// timeout). The bucket's lock must be held.
+void
+Conntrack::refresh(Entry& e, std::uint32_t t)
+{
+  std::uint32_t old = e.expires;
+  e.expires = t + timeouts_[e.state];
+  if (e.expires >= old)
+    return;
+  std::uint32_t i = &e - entries_.data();
+  std::lock_guard<std::mutex> g(wheel_lock_);
+  if (e.scheduled && e.due > e.expires) {
+    unschedule(i);
+    schedule(i);
+  }
+}
+
+
+// Place the entry on the wheel at its expiry time, or at the last
+// slot before the wheel wraps. The wheel's lock must be held.
+void
+Conntrack::schedule(std::uint32_t i)
+{
+  Entry& e = entries_[i];
+  std::uint32_t tick = tick_.load(std::memory_order_relaxed);
+  e.due = std::max(tick + 1, std::min(e.expires, tick + wheel_size - 1));
+  std::uint32_t& head = wheel_[e.due % wheel_size];
+  e.prev_timer = nil;
+  e.next_timer = head;
+  if (head != nil)
+    entries_[head].prev_timer = i;
+  head = i;
+  e.scheduled = true;
+}
+
+
+// Remove the entry from the wheel. The wheel's lock must be held.
+void
+Conntrack::unschedule(std::uint32_t i)
+{
+  Entry& e = entries_[i];
+  if (e.prev_timer != nil)
+    entries_[e.prev_timer].next_timer = e.next_timer;
+  else
+    wheel_[e.due % wheel_size] = e.next_timer;
+  if (e.next_timer != nil)
+    entries_[e.next_timer].prev_timer = e.prev_timer;
+  e.scheduled = false;
+}
+
+
+// Expire the slots of each tick up to t. Only one worker advances
+// the wheel at a time; others continue without waiting. The entries
+// of each slot are removed from the wheel before they are examined,
+// so that bucket locks are never acquired while holding the wheel's
+// lock.
+void
+Conntrack::advance(std::uint32_t t)
+{
+  std::unique_lock<std::mutex> g(advance_lock_, std::try_to_lock);
+  if (!g.owns_lock())
+    return;
+  std::uint32_t tick = tick_.load(std::memory_order_relaxed);
+  if (std::int32_t(t - tick) <= 0)
+    return;
+  if (t - tick > std::uint32_t(wheel_size))
+    tick = t - wheel_size;
+  while (tick != t) {
+    ++tick;
+    expired_.clear();
+    {
+      std::lock_guard<std::mutex> w(wheel_lock_);
+      std::uint32_t& head = wheel_[tick % wheel_size];
+      for (std::uint32_t i = head; i != nil; i = entries_[i].next_timer) {
+        entries_[i].scheduled = false;
+        expired_.push_back(i);
+      }
+      head = nil;
+      tick_.store(tick, std::memory_order_relaxed);
+    }
+    for (std::uint32_t i : expired_)
+      reap(i, tick);
+  }
+}
+
+
+// Remove the entry if it expired by t, or reschedule it if it has
+// been refreshed.
+void
+Conntrack::reap(std::uint32_t i, std::uint32_t t)
+{
+  Entry& e = entries_[i];
+  std::lock_guard<std::mutex> g(lock(e.hash));
+  if (e.expires > t) {
+    std::lock_guard<std::mutex> w(wheel_lock_);
+    schedule(i);
+    return;
+  }
+
+  std::uint32_t* p = &buckets_[e.hash & mask_];
+  while (*p != i)
+    p = &entries_[*p].next;
+  *p = e.next;
+  e.flags = 0;
+
+  std::lock_guard<std::mutex> f(free_lock_);
+  e.next = free_;
+  free_ = i;
+  size_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+
+// Expire idle connections.
+void
+Conntrack::expire()
+{
+  advance(now());
+}
+
+
+void
+Conntrack::expire(std::uint32_t t)
+{
+  advance(t);
+}
+
+
+// Returns the status of the packet's connection (see Status), or
+// 0 if the packet cannot be tracked. If the connection is committed,
+// its state is updated.
+int
+Conntrack::lookup(Context& cxt)
+{
+  return lookup(cxt, now());
+}
+
+
+int
+Conntrack::lookup(Context& cxt, std::uint32_t t)
+{
+  Ct_key k;
+  bool rev;
+  Byte f;
+  if (!make_key(cxt.packet(), k, rev, f))
+    return 0;
+  std::uint32_t h = hash_key(k);
+  if (t != tick_.load(std::memory_order_relaxed))
+    advance(t);
+
+  std::lock_guard<std::mutex> g(lock(h));
+  std::uint32_t i = find(k, h);
+  if (i == nil || entries_[i].expires <= t) {
+    bool ok = k.proto != ip_tcp || valid_tcp(f);
+    return TRACKED | NEW | (ok ? 0 : INVALID);
+  }
+  Entry& e = entries_[i];
+  bool reply = rev != bool(e.flags & REVERSED);
+  int s = TRACKED | ESTABLISHED | (reply ? REPLY : 0);
+  if (!update(e, reply, f, t))
+    s |= INVALID;
+  return s;
+}
+
+
+// Commit the packet's connection, with the packet's source as its
+// originator. Returns false if the packet cannot be tracked, if it
+// is not valid, or if the table is full. Committing a connection
+// that is already committed has no effect.
+bool
+Conntrack::commit(Context& cxt)
+{
+  return commit(cxt, now());
+}
+
+
+bool
+Conntrack::commit(Context& cxt, std::uint32_t t)
+{
+  Ct_key k;
+  bool rev;
+  Byte f;
+  if (!make_key(cxt.packet(), k, rev, f))
+    return false;
+  if (k.proto == ip_tcp && !valid_tcp(f))
+    return false;
+  std::uint32_t h = hash_key(k);
+  if (t != tick_.load(std::memory_order_relaxed))
+    advance(t);
+
+  std::lock_guard<std::mutex> g(lock(h));
+  std::uint32_t i = find(k, h);
+  if (i != nil && entries_[i].expires > t)
+    return true;
+
+  // Reuse an expired entry that has not yet been reaped. Its
+  // timer is rescheduled by refresh, or by the wheel.
+  bool fresh = i == nil;
+  if (fresh) {
+    i = allocate();
+    if (i == nil)
+      return false;
+  }
+  Entry& e = entries_[i];
+  if (fresh) {
+    e.key = k;
+    e.hash = h;
+    e.expires = t;
+    e.next = buckets_[h & mask_];
+    buckets_[h & mask_] = i;
+  }
+  e.flags = rev ? REVERSED : 0;
+  if (k.proto == ip_tcp)
+    e.state = (f & tcp_syn) ? TCP_SYN_SENT : TCP_ESTABLISHED;
+  else
+    e.state = UNREPLIED;
+  update(e, false, f, t);
+  if (fresh) {
+    std::lock_guard<std::mutex> w(wheel_lock_);
+    schedule(i);
+  }
+  return true;
+}
+
+
+} // namespace fp
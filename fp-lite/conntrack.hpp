@@ -0,0 +1,169 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#ifndef FP_CONNTRACK_HPP
+#define FP_CONNTRACK_HPP
+
+#include "types.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+
+namespace fp
+{
+
+class Context;
+
+
+// The key of a tracked connection. The endpoints are ordered so
+// that both directions of a connection have the same key: a is
+// the lesser endpoint, comparing addresses and then ports.
+struct Ct_key
+{
+  Byte          a[16];
+  Byte          b[16];
+  std::uint16_t a_port;
+  std::uint16_t b_port;
+  std::uint8_t  proto;
+  std::uint8_t  version;
+  std::uint8_t  pad[2];
+};
+
+
+// The connection tracker follows the connections of IP packets
+// so that applications can make stateful decisions, e.g., a
+// firewall that admits replies only to connections that it has
+// allowed. An application looks up each packet's connection, and
+// commits the connections that it accepts.
+//
+// TCP connections follow a simplified version of the TCP state
+// machine, driven by the flags of the packets in each direction.
+// Other protocols are either unreplied or replied. Each state has
+// a timeout, after which an idle connection expires. Connections
+// picked up in the middle of a TCP stream are established.
+//
+// The table holds a fixed number of connections, allocated when
+// it is created; commits fail when it is full. Buckets are guarded
+// by striped locks, so that workers rarely contend. Connections
+// expire on a timer wheel with a one second tick, advanced by the
+// first worker to see a new tick. Refreshing a connection only
+// moves its expiry time forward: the wheel examines the slot in
+// which the connection was scheduled, and reschedules it if it
+// has been refreshed since.
+class Conntrack
+{
+public:
+  // The status of a packet's connection, as returned by lookup.
+  enum Status
+  {
+    TRACKED     = 0x01, // The packet was tracked.
+    NEW         = 0x02, // The connection is not committed.
+    ESTABLISHED = 0x04, // The connection is committed.
+    REPLY       = 0x08, // The packet is in the reply direction.
+    INVALID     = 0x10, // The packet is not valid for the connection.
+  };
+
+  // Connection states.
+  enum State : std::uint8_t
+  {
+    TCP_SYN_SENT,
+    TCP_SYN_RECV,
+    TCP_ESTABLISHED,
+    TCP_FIN_WAIT,
+    TCP_LAST_ACK,
+    TCP_TIME_WAIT,
+    TCP_CLOSE,
+    UNREPLIED,
+    REPLIED,
+    num_states
+  };
+
+  static constexpr int wheel_size = 4096; // Slots of one second.
+  static constexpr int num_locks = 256;
+
+  explicit Conntrack(int);
+
+  int  lookup(Context&);
+  bool commit(Context&);
+  void expire();
+
+  // As above, at the given time, in seconds since the table was
+  // created. Time must not move backward.
+  int  lookup(Context&, std::uint32_t);
+  bool commit(Context&, std::uint32_t);
+  void expire(std::uint32_t);
+
+  void set_timeout(State, std::uint32_t);
+
+  int capacity() const { return entries_.size(); }
+  int size() const     { return size_.load(std::memory_order_relaxed); }
+
+private:
+  static constexpr std::uint32_t nil = -1;
+
+  // Entry flags.
+  enum Flag : std::uint8_t
+  {
+    REVERSED  = 0x01, // The originator is endpoint b.
+    FIN_ORIG  = 0x02, // The originator has sent a FIN.
+    FIN_REPLY = 0x04, // The responder has sent a FIN.
+  };
+
+  struct Entry
+  {
+    Ct_key        key;
+    std::uint32_t hash;
+    std::uint32_t next;    // The next entry in the bucket, or free list.
+    std::uint32_t expires; // The expiry time, in ticks.
+    std::uint32_t due;     // The tick of its wheel slot, if scheduled.
+    std::uint32_t prev_timer;
+    std::uint32_t next_timer;
+    State         state;
+    std::uint8_t  flags;
+    bool          scheduled; // On the wheel. Guarded by the wheel lock.
+  };
+
+  std::uint32_t now() const;
+
+  std::uint32_t find(Ct_key const&, std::uint32_t) const;
+  std::uint32_t allocate();
+  bool          update(Entry&, bool, Byte, std::uint32_t);
+  void          refresh(Entry&, std::uint32_t);
+  void          schedule(std::uint32_t);
+  void          unschedule(std::uint32_t);
+  void          advance(std::uint32_t);
+  void          reap(std::uint32_t, std::uint32_t);
+
+  std::mutex& lock(std::uint32_t h) { return locks_[h % num_locks]; }
+
+  std::vector<Entry>         entries_;
+  std::vector<std::uint32_t> buckets_;
+  std::uint32_t              mask_;
+  std::unique_ptr<std::mutex[]> locks_;
+
+  // The free list.
+  std::uint32_t    free_;
+  std::mutex       free_lock_;
+  std::atomic<int> size_;
+
+  // The timer wheel. Slots are lists of entries, guarded by the
+  // wheel lock. The tick is the last second that was expired.
+  std::vector<std::uint32_t> wheel_;
+  std::mutex                 wheel_lock_;
+  std::mutex                 advance_lock_;
+  std::atomic<std::uint32_t> tick_;
+  std::vector<std::uint32_t> expired_;
+  std::uint64_t              epoch_;
+
+  std::uint32_t timeouts_[num_states];
+};
+
+
+} // namespace fp
+
+
+#endif
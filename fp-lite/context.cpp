@@ -1,18 +1,24 @@
 #include "context.hpp"
+#include "checksum.hpp"
 #include "endian.hpp"
 #include "system.hpp"
+#include "tuple.hpp"
+#include "trace.hpp"
+
+#include <cassert>
+#include <cstring>
 
 namespace fp
 {
 
 Context::Context(Packet const& p, Dataplane* dp, unsigned int in, unsigned int in_phy, int tunnelid)
-  : input_{in, in_phy, tunnelid}, ctrl_(), decode_(), packet_(p),
-    dp_(dp)
+  : input_{in, in_phy, tunnelid}, ctrl_(), decode_(), record_(),
+    packet_(p), dp_(dp)
 { }
 
 Context::Context(Packet const& p, Dataplane* dp, Port* in, Port* in_phy, int tunnelid)
   : input_{in->id(), in_phy->id(), tunnelid}, ctrl_(), decode_(),
-    packet_(p), dp_(dp)
+    record_(), packet_(p), dp_(dp)
 { }
 
 
@@ -42,70 +48,285 @@ Context::read_metadata()
 }
 
 
+// Computes the hash of the packet's five tuple.
+std::uint32_t
+Context::compute_flow_hash() const
+{
+  Five_tuple t;
+  extract_tuple(packet_, t);
+  return hash(t);
+}
+
+
 // -------------------------------------------------------------------------- //
 // Evaluation of actions
 
 namespace
 {
 
+// Returns true if the field lies within the context's memory:
+// the packet's data, not its tailroom, or the metadata. Fields
+// are given by applications, so they are checked in all builds.
+inline bool
+in_bounds(Context const& cxt, std::uint8_t addr, int off, int len)
+{
+  if (addr != Packet_memory && addr != Metadata_memory)
+    return false;
+  return off + len <= cxt.address_size(addr);
+}
+
+
+// Rewrite n bytes of the packet at the given offset with f,
+// maintaining its checksums. The layout of the packet is kept
+// for later rewrites, unless this one may have changed it.
+template<typename F>
 inline void
-apply(Context& cxt, Set_action a)
+rewrite(Context& cxt, int off, int n, F f)
+{
+  Checksum_layout const& l = cxt.checksum_layout();
+  Checksum_update u(cxt.packet(), l, off, n);
+  f();
+  u.commit();
+  if (l.is_structural(off, n))
+    cxt.decode_.has_layout = false;
+}
+
+
+// Rewrites of the packet maintain its checksums. Returns false
+// if the field is out of bounds, or its value is too long.
+inline bool
+apply(Context& cxt, Set_action const& a)
 {
-  // Copy the new data into the packet at the appropriate location.
-  Byte* p = cxt.get_field(a.field.offset);
-  Byte* val = a.value;
   int len = a.field.length;
+  if (len > max_set_length || !in_bounds(cxt, a.field.address, a.field.offset, len))
+    return false;
+
+  // Copy the new data into the appropriate location.
+  Byte* p = cxt.address(a.field.address, a.field.offset);
+  Byte const* val = a.value;
 
   // Convert native to network order after copying.
-  std::copy(val, val + len, p);
-  native_to_network_order(p, len);
+  if (a.field.address == Packet_memory) {
+    rewrite(cxt, a.field.offset, len, [&] {
+      std::copy(val, val + len, p);
+      native_to_network_order(p, len);
+    });
+  } else {
+    std::copy(val, val + len, p);
+    native_to_network_order(p, len);
+  }
+  return true;
 }
 
 
-inline void
-apply(Context& cxt, Copy_action a)
+// Copy the field into the other address space. Returns false
+// if either field is out of bounds. One of them is in metadata,
+// so copies are never longer than a checksum update allows.
+inline bool
+apply(Context& cxt, Copy_action const& a)
 {
-  // TODO: Implement me.
+  std::uint8_t src = a.field.address;
+  std::uint8_t dst = src == Packet_memory ? Metadata_memory : Packet_memory;
+  if (!in_bounds(cxt, src, a.field.offset, a.field.length) ||
+      !in_bounds(cxt, dst, a.offset, a.field.length))
+    return false;
+  Byte* from = cxt.address(src, a.field.offset);
+  Byte* to = cxt.address(dst, a.offset);
+  if (dst == Packet_memory) {
+    rewrite(cxt, a.offset, a.field.length, [&] {
+      std::memmove(to, from, a.field.length);
+    });
+  } else {
+    std::memmove(to, from, a.field.length);
+  }
+  return true;
 }
 
 
-inline void
-apply(Context& cxt, Output_action a)
+inline bool
+apply(Context& cxt, Output_action const& a)
 {
   cxt.set_output_port(a.port);
+  return true;
 }
 
 
-inline void
-apply(Context& cxt, Queue_action a)
+inline bool
+apply(Context& cxt, Queue_action const& a)
 {
-  // TODO: Implement queues.
+  cxt.set_queue(a.queue);
+  return true;
 }
 
 
+inline bool
+apply(Context& cxt, Group_action const& a)
+{
+  cxt.set_group(a.group);
+  return true;
+}
+
+
+// Apply a masked write to an 8-byte window. When the window
+// extends past the end of the address space, fall back to
+// writing only the selected bytes, which the caller has found
+// to be within it.
 inline void
-apply(Context& cxt, Group_action a)
+write(Context& cxt, Write_instruction const& w)
+{
+  int size = cxt.address_size(w.address);
+  Byte* p = cxt.address(w.address, w.offset);
+  if (w.offset + 8 <= size) {
+    std::uint64_t x;
+    std::memcpy(&x, p, 8);
+    x = (x & ~w.mask) | w.value;
+    std::memcpy(p, &x, 8);
+  } else {
+    Byte mask[8];
+    Byte value[8];
+    std::memcpy(mask, &w.mask, 8);
+    std::memcpy(value, &w.value, 8);
+    for (int i = 0; i < 8 && w.offset + i < size; ++i) {
+      if (mask[i])
+        p[i] = value[i];
+    }
+  }
+}
+
+
+// Rewrites of the packet maintain its checksums. Only the bytes
+// selected by the mask are rewritten, so that a write next to a
+// checksum does not appear to overwrite it. Returns false if any
+// selected byte is out of bounds.
+inline bool
+apply(Context& cxt, Write_instruction const& w)
+{
+  if (!w.mask)
+    return true;
+  Byte mask[8];
+  std::memcpy(mask, &w.mask, 8);
+  int first = 0;
+  int last = 8;
+  while (!mask[first])
+    ++first;
+  while (!mask[last - 1])
+    --last;
+  if (!in_bounds(cxt, w.address, w.offset + first, last - first))
+    return false;
+  if (w.address == Packet_memory)
+    rewrite(cxt, w.offset + first, last - first, [&] { write(cxt, w); });
+  else
+    write(cxt, w);
+  return true;
+}
+
+
+#ifdef FP_TRACE
+// Returns the port, queue, or group selected by an action or
+// instruction, or 0 for other actions.
+inline std::uint64_t
+target(Action const& a)
+{
+  switch (a.type) {
+    case Action::OUTPUT: return a.value.output.port;
+    case Action::QUEUE: return a.value.queue.queue;
+    case Action::GROUP: return a.value.group.group;
+    default: return 0;
+  }
+}
+
+
+inline std::uint64_t
+target(Instruction const& i)
 {
-  // TODO: Implement group actions.
+  switch (i.code) {
+    case Instruction::OUTPUT: return i.output.port;
+    case Instruction::QUEUE: return i.queue.queue;
+    case Instruction::GROUP: return i.group.group;
+    default: return 0;
+  }
 }
+#endif
 
 
 } // namespace
 
 
+// Send the packet to the drop port. The reason is counted when
+// the packet is sent there (see drop.hpp).
 void
-Context::apply_action(Action a)
+Context::drop(Drop_reason r)
+{
+  set_drop_reason(r);
+  if (Port* p = dp_->get_drop_port())
+    set_output_port(p->id());
+}
+
+
+// Apply an action. Traced actions are recorded with their type.
+// If the action cannot be applied to the packet (e.g., it writes
+// past the end of the packet), the packet is dropped as malformed,
+// and the result is false.
+bool
+Context::apply_action(Action const& a)
 {
+#ifdef FP_TRACE
+  trace(*this, TRACE_ACTION, a.type, target(a));
+#endif
+  bool ok = false;
   switch (a.type) {
-    case Action::SET: return apply(*this, a.value.set);
-    case Action::COPY: return apply(*this, a.value.copy);
-    case Action::OUTPUT: return apply(*this, a.value.output);
-    case Action::QUEUE: return apply(*this, a.value.queue);
-    case Action::GROUP: return apply(*this, a.value.group);
+    case Action::SET: ok = apply(*this, a.value.set); break;
+    case Action::COPY: ok = apply(*this, a.value.copy); break;
+    case Action::OUTPUT: ok = apply(*this, a.value.output); break;
+    case Action::QUEUE: ok = apply(*this, a.value.queue); break;
+    case Action::GROUP: ok = apply(*this, a.value.group); break;
+  }
+  if (!ok)
+    drop(DROP_MALFORMED);
+  return ok;
+}
+
+
+// Execute a compiled action program. Instructions are traced
+// as the actions they implement; their codes are the same. As
+// for actions, a write or copy that cannot be applied drops the
+// packet.
+void
+Context::apply_program(Action_program const& prog)
+{
+  for (Instruction const& i : prog) {
+#ifdef FP_TRACE
+    trace(*this, TRACE_ACTION, i.code, target(i));
+#endif
+    switch (i.code) {
+      case Instruction::WRITE:
+        if (!apply(*this, i.write)) {
+          drop(DROP_MALFORMED);
+          return;
+        }
+        break;
+      case Instruction::COPY:
+        if (!apply(*this, i.copy)) {
+          drop(DROP_MALFORMED);
+          return;
+        }
+        break;
+      case Instruction::OUTPUT: apply(*this, i.output); break;
+      case Instruction::QUEUE: apply(*this, i.queue); break;
+      case Instruction::GROUP: apply(*this, i.group); break;
+    }
   }
 }
 
 
+// Apply the selected group.
+void
+Context::apply_group()
+{
+  dp_->groups().apply(*this);
+}
+
+
 } // namespace fp
 
 
@@ -4,9 +4,12 @@
 #include "packet.hpp"
 #include "action.hpp"
 #include "binding.hpp"
+#include "checksum.hpp"
 #include "types.hpp"
 #include "dataplane.hpp"
+#include "cache.hpp"
 
+#include <cassert>
 #include <cstdint>
 #include <utility>
 
@@ -26,53 +29,34 @@ struct Ingress_info
   unsigned int in_port;
   unsigned int in_phy_port;
   int   tunnel_id;
+  bool  sampled;     // Selected for sampling (see sample.hpp).
 };
 
 
 // Maintains information about the control flow of a
-// context through a pipeline.
+// context through a pipeline. The table and flow refer to
+// the most recent match.
 //
-// FIXME: Am I actually using the table and flow?
+// Group 0 is reserved to mean that no group was selected.
 struct Control_info
 {
   unsigned int out_port; // The selected output port.
+  unsigned int queue;    // The selected egress queue.
+  unsigned int group;    // The selected group.
+  std::uint32_t hash;    // The flow hash, or 0 if not computed.
   Table* table;
   Flow*  flow;
-};
-
-
-// Maintains information about the current decoding
-// of the packet.
-//
-// FIXME: These data structures should be required by
-// the application, since a) not every data application
-// needs full support for rebinding and b) making that
-// assumption will be an unfortunate pessimization.
-struct Decoding_info
-{
-  uint16_t pos;
-  Environment hdrs;
-  Environment flds;
-};
-
-
-// Packet metadata. This is an unstructured blob
-// to be used as scratch data by the application.
-//
-// FIXME: This should be dynamically allocated on
-// application load and indexed by fields.
-struct Metadata
-{
-  uint64_t data;
+  std::uint8_t drop;     // The reason for dropping the packet, if dropped.
 };
 
 
 // Represents a header in the header stack. This
-// is represented by its offset and a "link" to
-// the next header in the stack. The last header
-// has next == -1.
+// is represented by its protocol, its offset, and a
+// "link" to the next header in the stack. The last
+// header has next == -1.
 struct Header
 {
+  int protocol;
   int offset;
   int next;
 };
@@ -92,10 +76,61 @@ struct Header
 // Header structure.
 struct Header_stack
 {
-  void push(int offset);
+  static constexpr int max_headers = 16;
 
-  Header hdrs[16];
-  int    top;
+  bool is_empty() const { return size == 0; }
+  bool is_full() const  { return size == max_headers; }
+
+  void push(int protocol, int offset);
+  void clear() { size = 0; }
+
+  Header hdrs[max_headers];
+  int    size;
+};
+
+
+// Push a header onto the stack, linking it to the previous
+// header. Behavior is undefined if the stack is full.
+inline void
+Header_stack::push(int protocol, int offset)
+{
+  assert(!is_full());
+  hdrs[size] = {protocol, offset, -1};
+  if (size)
+    hdrs[size - 1].next = size;
+  ++size;
+}
+
+
+// Maintains information about the current decoding
+// of the packet.
+//
+// FIXME: These data structures should be required by
+// the application, since a) not every data application
+// needs full support for rebinding and b) making that
+// assumption will be an unfortunate pessimization.
+//
+// The checksum layout is found when the packet is first rewritten,
+// and is discarded with the bindings.
+struct Decoding_info
+{
+  uint16_t pos;
+  Environment hdrs;
+  Environment flds;
+  Header_stack stack;
+  Checksum_layout layout;
+  bool has_layout;
+};
+
+
+// Packet metadata. This is an unstructured blob
+// to be used as scratch data by the application.
+//
+// FIXME: This should be dynamically allocated on
+// application load and indexed by fields.
+struct Metadata
+{
+  uint64_t data;
 };
 
 
@@ -107,18 +142,22 @@ class Context
 {
 public:
   Context(Dataplane* dp, Packet const& p)
-    : input_(), ctrl_(), decode_(), packet_(p), dp_(dp)
+    : input_(), ctrl_(), decode_(), record_(), packet_(p), dp_(dp)
   { }
 
   Context(Packet const&, Dataplane*, unsigned int, unsigned int, int);
   Context(Packet const&, Dataplane*, Port*, Port*, int);
 
+  // Prepares a reused context for a new packet.
+  void reset();
+
   // Returns the packet owned by the context.
   Packet const& packet() const { return packet_; }
   Packet&       packet()       { return packet_; }
 
   // Returns a pointer to the dataplane which created the context.
   Dataplane const* dataplane() const { return dp_; }
+  Dataplane*       dataplane()       { return dp_; }
 
   // Returns the metadata owned by the context.
   Metadata const& metadata() const { return metadata_; }
@@ -143,32 +182,78 @@ public:
   // Sets the output port.
   void set_output_port(unsigned int p) { ctrl_.out_port = p; }
 
+  // Returns true if the packet was selected for sampling (see
+  // sample.hpp).
+  bool sampled() const { return input_.sampled; }
+  void set_sampled()   { input_.sampled = true; }
+
   // Sets the input port, physical input port, and tunnel id.
   void set_input(Port*, Port*, int);
 
+  // Returns the selected egress queue and group.
+  unsigned int queue_id() const { return ctrl_.queue; }
+  unsigned int group_id() const { return ctrl_.group; }
+
+  void set_queue(unsigned int q) { ctrl_.queue = q; }
+  void set_group(unsigned int g) { ctrl_.group = g; }
+
+  // Returns the reason for which the packet is dropped, if it is
+  // sent to the drop port (see drop.hpp).
+  Drop_reason drop_reason() const          { return Drop_reason(ctrl_.drop); }
+  void        set_drop_reason(Drop_reason r) { ctrl_.drop = r; }
+
+  // Sends the packet to the drop port, for the given reason.
+  void drop(Drop_reason);
+
+  // Returns the hash of the packet's five tuple. This is
+  // computed at most once per packet.
+  std::uint32_t flow_hash();
+
+  // Returns the layout of the packet's checksums. This is
+  // computed once per packet, unless its headers change.
+  Checksum_layout const& checksum_layout();
+
   // Returns the current
   Table*   current_table() const { return ctrl_.table; }
   Flow*    current_flow() const  { return ctrl_.flow; }
 
+  // Records the most recent table match.
+  void set_match(Table*, Flow*);
+
+  // Indicates that the packet's forwarding decision cannot be
+  // replayed from a flow cache.
+  void no_cache() { record_.cacheable = false; }
+
   void            write_metadata(uint64_t);
   Metadata const& read_metadata();
 
   // Aciton interface
-  void apply_action(Action a);
-  void write_action(Action a);
+  bool apply_action(Action const&);
+  bool write_action(Action const&);
   void apply_actions();
   void clear_actions();
+  void apply_program(Action_program const&);
+  void apply_group();
+
+  // Returns a pointer to the given offset in an address space,
+  // and the number of bytes in that address space.
+  Byte* address(std::uint8_t, std::uint16_t);
+  int   address_size(std::uint8_t) const;
 
   // FIXME: Implement me.
   void bind_header(int);
   void bind_field(int, std::uint16_t, std::uint16_t);
+  void clear_bindings();
   Byte const* get_field(std::uint16_t) const;
   Byte*       get_field(std::uint16_t);
   Binding     get_field_binding(int) const;
 
-  Ingress_info  input_;
-  Control_info  ctrl_;
-  Decoding_info decode_;
+  Ingress_info    input_;
+  Control_info    ctrl_;
+  Decoding_info   decode_;
+  Decision_record record_;
+
+  std::uint32_t compute_flow_hash() const;
 
   // Packet data and context local data.
   //
@@ -181,6 +266,19 @@ public:
 
   // A pointer to the dataplane which constructed the context.
   Dataplane* dp_;
+
+#ifdef FP_LATENCY
+  // The times at which processing started, and at which the packet
+  // was queued for egress (see latency.hpp).
+  std::uint64_t processed_ = 0;
+  std::uint64_t enqueued_ = 0;
+#endif
+
+#ifdef FP_TRACE
+  // The packet's trace tag, or 0 if it is not traced (see
+  // trace.hpp).
+  std::uint64_t trace_ = 0;
+#endif
 };
 
 
@@ -205,6 +303,40 @@ Context::output_port() const
 }
 
 
+// Clear all per-packet state, and empty the packet, restoring
+// its headroom. This must be called before a context that was
+// previously used is used for a new packet.
+inline void
+Context::reset()
+{
+  input_ = Ingress_info();
+  ctrl_ = Control_info();
+  packet_.reset();
+  clear_bindings();
+  metadata_ = Metadata();
+  actions_.clear();
+  record_.clear();
+#ifdef FP_LATENCY
+  processed_ = enqueued_ = 0;
+#endif
+#ifdef FP_TRACE
+  trace_ = 0;
+#endif
+}
+
+
+// Records the most recent table match. If the forwarding decision
+// is being recorded, the match is added to the record.
+inline void
+Context::set_match(Table* t, Flow* f)
+{
+  ctrl_.table = t;
+  ctrl_.flow = f;
+  if (record_.active)
+    record_.match(t, f);
+}
+
+
 // Advance the current header offset by n bytes.
 inline void
 Context::advance(std::uint16_t n)
@@ -228,6 +360,9 @@ Context::bind_header(int id)
 }
 
 
+// Bind a field to the given absolute offset and length. Binding
+// a field does not read it, so the field is not added to the
+// forwarding decision's key until it is read (e.g., by fp_gather).
 inline void
 Context::bind_field(int id, std::uint16_t off, std::uint16_t len)
 {
@@ -235,6 +370,20 @@ Context::bind_field(int id, std::uint16_t off, std::uint16_t len)
 }
 
 
+// Remove all header and field bindings, and restore the header
+// offset to the start of the packet. This is required when the
+// packet's headers are moved (e.g., by encapsulation).
+inline void
+Context::clear_bindings()
+{
+  decode_.pos = 0;
+  decode_.hdrs.clear();
+  decode_.flds.clear();
+  decode_.stack.clear();
+  decode_.has_layout = false;
+}
+
+
 // Returns a pointer to a given field at the absolute offset.
 inline Byte const*
 Context::get_field(std::uint16_t off) const
@@ -259,6 +408,29 @@ Context::get_field_binding(int f) const
 }
 
 
+// Returns a pointer to the given offset within the packet
+// or metadata address space.
+inline Byte*
+Context::address(std::uint8_t addr, std::uint16_t off)
+{
+  if (addr == Metadata_memory)
+    return reinterpret_cast<Byte*>(&metadata_) + off;
+  return packet_.data() + off;
+}
+
+
+// Returns the number of addressable bytes within the
+// packet or metadata address space. The packet's tailroom is
+// not addressable, since writes to it would not be sent.
+inline int
+Context::address_size(std::uint8_t addr) const
+{
+  if (addr == Metadata_memory)
+    return sizeof(Metadata);
+  return packet_.length();
+}
+
+
 // Returns a pointer to the current header.
 inline Byte const*
 Context::position() const
@@ -276,20 +448,48 @@ Context::position()
 
 
 // Add the given action to the context's action set.
-// These actions are applied prior to egress.
-inline void
-Context::write_action(Action a)
+// These actions are applied prior to egress. Returns
+// false if the action set is full.
+inline bool
+Context::write_action(Action const& a)
 {
-  actions_.push_back(a);
+  return actions_.push_back(a);
 }
 
 
-// Apply all of the saved actions.
+// Apply all of the saved actions, followed by the selected
+// group, if any. If an action cannot be applied, the packet
+// is dropped and no further actions are applied.
 inline void
 Context::apply_actions()
 {
   for (Action const& a : actions_)
-    apply_action(a);
+    if (!apply_action(a))
+      return;
+  if (ctrl_.group)
+    apply_group();
+}
+
+
+// Returns the flow hash, computing it if needed.
+inline std::uint32_t
+Context::flow_hash()
+{
+  if (!ctrl_.hash)
+    ctrl_.hash = compute_flow_hash();
+  return ctrl_.hash;
+}
+
+
+// Returns the checksum layout, computing it if needed.
+inline Checksum_layout const&
+Context::checksum_layout()
+{
+  if (!decode_.has_layout) {
+    decode_.layout.load(packet_);
+    decode_.has_layout = true;
+  }
+  return decode_.layout;
 }
 
 
@@ -2,7 +2,14 @@
 #include "port.hpp"
 #include "port_drop.hpp"
 #include "port_flood.hpp"
+#include "port_group.hpp"
 #include "application.hpp"
+#include "table.hpp"
+#include "rcu.hpp"
+#include "context.hpp"
+#include "latency.hpp"
+#include "perf.hpp"
+#include "time.hpp"
 
 #include <cassert>
 #include <algorithm>
@@ -14,8 +21,16 @@ namespace fp
 
 Dataplane::~Dataplane()
 {
+  for (int i = 0; i < max_workers; ++i) {
+    delete (*caches_)[i];
+    delete (*latency_)[i];
+    delete (*perf_)[i];
+  }
+  delete chain_.load();
+  delete parser_.load();
   delete drop_;
   delete flood_;
+  delete group_;
 }
 
 
@@ -29,14 +44,17 @@ Dataplane::add_port(Port* p)
 }
 
 
-// Add an explicit drop port to the dataplane.
+// Add the reserved drop, flood, and group ports to the
+// dataplane.
 void
 Dataplane::add_virtual_ports()
 {
   drop_ = new Port_drop;
   flood_ = new Port_flood;
+  group_ = new Port_group;
   portmap_.emplace(drop_->id(), drop_);
   portmap_.emplace(flood_->id(), flood_);
+  portmap_.emplace(group_->id(), group_);
 }
 
 
@@ -53,55 +71,175 @@ Dataplane::remove_port(Port* p)
 }
 
 
-// Load an application from the given path.
+// Publish a new application chain. The previous chain is
+// retired; the applications themselves are not.
+void
+Dataplane::publish(Application_chain* c)
+{
+  Application_chain const* old = chain_.exchange(c);
+  invalidate_flow_caches();
+  rcu_retire(const_cast<Application_chain*>(old));
+}
+
+
+// Load an application from the given path and append it to the
+// chain. If the dataplane is running, the application is started
+// before it receives packets.
 void
 Dataplane::load_application(char const* path)
 {
-  assert(!app_);
-  app_ = new Application(path);
+  Application_chain const* cur = get_chain();
+  Application* app = new Application(path);
   // FIXME: Bandaid for compiled steve app -> fp usage.
-  app_->load(*this);
+  app->load(*this);
   /*
-  if (app_->load(*this)) {
-    delete app_;
+  if (app->load(*this)) {
+    delete app;
     throw std::runtime_error("loading application");
   }
   */
   // Notify the application of all system ports.
   for (Port* p : ports_)
-    app_->port_added(*p);
+    app->port_added(*p);
+  if (!cur->stages.empty() && cur->stages.front()->state() == Application::RUNNING)
+    app->start(*this);
+
+  Application_chain* c = new Application_chain(*cur);
+  c->stages.push_back(app);
+  publish(c);
 }
 
 
-// Unload the application.
+// Unload all applications, last stage first.
 //
 // FIXME: It should probably be the case that the data plane
 // is down when the application is removed.
 void
 Dataplane::unload_application()
 {
-  assert(app_);
-  // FIXME: Bandaid for compiled steve app -> fp usage.
-  app_->unload(*this);
-  /*
-  if (app_->unload(*this))
-    throw std::runtime_error("unloading application");
-  */
-  delete app_;
-  app_ = nullptr;
+  Application_chain const* cur = get_chain();
+  assert(!cur->stages.empty());
+  std::vector<Application*> apps = cur->stages;
+  publish(new Application_chain());
+  // Wait for workers to finish with the applications.
+  rcu_synchronize();
+  for (auto iter = apps.rbegin(); iter != apps.rend(); ++iter) {
+    // FIXME: Bandaid for compiled steve app -> fp usage.
+    (*iter)->unload(*this);
+    /*
+    if ((*iter)->unload(*this))
+      throw std::runtime_error("unloading application");
+    */
+    delete *iter;
+  }
+}
+
+
+namespace
+{
+
+// Maps the instructions of flows installed by a replaced
+// application to the same-named functions of its replacement.
+struct Relink
+{
+  Library const& from;
+  Library const& to;
+};
+
+
+Flow_instructions
+relink_flow(Flow_instructions instr, void* arg)
+{
+  Relink* r = static_cast<Relink*>(arg);
+  return (Flow_instructions)r->to.relink((void*)instr, r->from);
+}
+
+
+// Relink the flows of every table.
+void
+relink_tables(Dataplane::Table_map& tables, Relink& r)
+{
+  for (auto& t : tables)
+    t.second->relink(relink_flow, &r);
+}
+
+} // namespace
+
+
+// Replace the nth application in the chain with the one at the
+// given path, without stopping the dataplane.
+//
+// The new application is loaded, notified of all ports, and
+// started (if the dataplane is up) while the current application
+// continues to process packets. Workers are then switched to the
+// new application. Once every worker has passed a quiescent state,
+// no packets are in the old application, and it is stopped and
+// unloaded.
+//
+// Flows are relinked before the switch, and again after it, since
+// the old application may learn flows until every worker has
+// switched. A further grace period ensures that no worker is still
+// executing a flow of the old application when it is unloaded.
+//
+// Tables belong to the dataplane, so their flows survive the swap.
+// The new application can adopt them by id (see fp_create_table
+// and fp_get_table). Flow instructions that refer to the old
+// application are rebound to the new application's functions of
+// the same name; flows whose instructions cannot be rebound are
+// removed.
+//
+// The path must not name the running application's library, as
+// the system would return the already-loaded library.
+void
+Dataplane::swap_application(std::size_t n, char const* path)
+{
+  Application_chain const* cur = get_chain();
+  if (n >= cur->stages.size())
+    throw std::string("No such application");
+  Application* old = cur->stages[n];
+
+  Application* app = new Application(path);
+  if (app->library().handle == old->library().handle) {
+    delete app;
+    throw std::string("Application is already loaded");
+  }
+  app->load(*this);
+  for (Port* p : ports_) {
+    app->port_added(*p);
+    if (p->is_up())
+      app->port_changed(*p);
+  }
+  if (old->state() == Application::RUNNING)
+    app->start(*this);
+
+  Relink r { old->library(), app->library() };
+  relink_tables(tables_, r);
+
+  Application_chain* c = new Application_chain(*cur);
+  c->stages[n] = app;
+  publish(c);
+  rcu_synchronize();
+
+  relink_tables(tables_, r);
+  rcu_synchronize();
+
+  if (old->state() == Application::RUNNING)
+    old->stop(*this);
+  old->unload(*this);
+  delete old;
 }
 
 
-// Starts executing an application on a dataplane.
+// Starts executing the applications on a dataplane.
 //
 // FIXME: Dataplanes also have state. We don't want to re-up
 // if we've already upped.
 void
 Dataplane::up()
 {
-  // Start the application.
-  if (app_)
-    app_->start(*this);
+  // Start the applications.
+  for (Application* app : get_chain()->stages)
+    app->start(*this);
 }
 
 
@@ -112,9 +250,339 @@ Dataplane::up()
 void
 Dataplane::down()
 {
-  // Then stop the application.
-  if (app_)
-    app_->stop(*this);
+  // Then stop the applications, last stage first.
+  auto const& stages = get_chain()->stages;
+  for (auto iter = stages.rbegin(); iter != stages.rend(); ++iter)
+    (*iter)->stop(*this);
+}
+
+
+namespace
+{
+
+// Look up the context's packet in the enabled caches. On a hit,
+// the cached decision is applied, its verdict is stored in v, and
+// the result is true. A megaflow hit is also added to the
+// microflow cache.
+//
+// The context's decision is recorded from here on, so that it can
+// be cached after processing.
+inline bool
+lookup(Flow_caches* fc, int modes, Context& cxt, int& v, std::uint32_t gen)
+{
+  cxt.record_.clear();
+  cxt.record_.active = true;
+  if ((modes & MICROFLOW_CACHE) && fc->microflows.lookup(cxt, v))
+    return true;
+  if ((modes & MEGAFLOW_CACHE) && fc->megaflows.lookup(cxt, v)) {
+    if (modes & MICROFLOW_CACHE)
+      fc->microflows.insert(cxt, v, gen);
+    return true;
+  }
+  return false;
+}
+
+
+// Cache the decision made for the context in generation gen.
+inline void
+insert(Flow_caches* fc, int modes, Context const& cxt, int v, std::uint32_t gen)
+{
+  if (modes & MICROFLOW_CACHE)
+    fc->microflows.insert(cxt, v, gen);
+  if (modes & MEGAFLOW_CACHE)
+    fc->megaflows.insert(cxt, v, gen);
+}
+
+} // namespace
+
+
+// Process a packet through the application chain. Processing
+// ends after the last stage, or when a stage stops or drops the
+// packet. Dropped packets are directed to the drop port, which
+// counts them (see drop.hpp). Returns
+// the verdict of the last stage executed.
+//
+// If flow caches are enabled, a cached decision for the packet is
+// applied instead, and new decisions are cached.
+int
+Dataplane::process(Context& cxt)
+{
+#ifdef FP_LATENCY
+  cxt.processed_ = Time::current();
+  record_latency(cxt, INGRESS_TO_PROCESS, cxt.packet().timestamp(), cxt.processed_);
+#endif
+#ifdef FP_PERF
+  Perf_counters* pc = perf_counters();
+  Perf_sample ps = pc->read();
+#endif
+
+  Worker_statistics& ws = worker_stats();
+  bump(ws.packets);
+
+  int v = Application::CONTINUE;
+  int modes = flow_cache_modes();
+  Flow_caches* fc = modes ? flow_caches() : nullptr;
+  std::uint32_t gen = flow_generation.load(std::memory_order_acquire);
+  bool hit = fc && lookup(fc, modes, cxt, v, gen);
+#ifdef FP_PERF
+  ps = pc->record(pc->stages[PERF_CLASSIFY], ps, 1);
+  Perf_sample start = ps;
+#endif
+  if (hit) {
+    bump(ws.cache_hits);
+    return v;
+  }
+
+  Application_chain const* chain = get_chain();
+  for (std::size_t i = 0; i < chain->stages.size(); ++i) {
+    v = chain->stages[i]->process(cxt);
+#ifdef FP_PERF
+    if (i < max_perf_applications)
+      ps = pc->record(pc->applications[i], ps, 1);
+#endif
+    if (v != Application::CONTINUE)
+      break;
+  }
+  if (v == Application::DROP)
+    cxt.set_output_port(Port_drop::id);
+  if (fc)
+    insert(fc, modes, cxt, v, gen);
+#ifdef FP_PERF
+  pc->record(pc->stages[PERF_PROCESS], start, 1);
+#endif
+  return v;
+}
+
+
+// Process a batch of packets through the application chain. Each
+// stage processes every packet that is still active before the
+// next stage runs, so that the cost of composing applications is
+// one call per packet per stage, and each stage's code stays warm
+// for the entire batch.
+//
+// Contexts are not reordered. Dropped packets are directed to the
+// drop port, which counts them. Packets that hit in a flow cache do not enter the
+// chain.
+void
+Dataplane::process(Context** cxts, int n)
+{
+  assert(n <= max_batch);
+
+  // The indexes of packets that continue to the next stage, and
+  // the verdict for each packet.
+  std::uint16_t active[max_batch];
+  std::uint8_t  verdict[max_batch];
+
+#ifdef FP_PERF
+  Perf_counters* pc = perf_counters();
+  Perf_sample ps = pc->read();
+#endif
+
+  // Packets that were not stamped by their port arrived with the
+  // batch, so the clock is read once for all of them.
+  Timestamp now = Time::current();
+  for (int i = 0; i < n; ++i) {
+    Packet& pkt = cxts[i]->packet();
+    if (!pkt.timestamp())
+      pkt.stamp(now);
+#ifdef FP_LATENCY
+    cxts[i]->processed_ = now;
+    record_latency(*cxts[i], INGRESS_TO_PROCESS, pkt.timestamp(), now);
+#endif
+  }
+
+  int modes = flow_cache_modes();
+  Flow_caches* fc = modes ? flow_caches() : nullptr;
+  std::uint32_t gen = flow_generation.load(std::memory_order_acquire);
+  int m = 0;
+  for (int i = 0; i < n; ++i) {
+    int v;
+    if (fc && lookup(fc, modes, *cxts[i], v, gen))
+      continue;
+    verdict[i] = Application::CONTINUE;
+    active[m++] = i;
+  }
+#ifdef FP_PERF
+  ps = pc->record(pc->stages[PERF_CLASSIFY], ps, n);
+  Perf_sample start = ps;
+#endif
+
+  Worker_statistics& ws = worker_stats();
+  bump(ws.packets, n);
+  bump(ws.batches);
+  bump(ws.cache_hits, n - m);
+  if (m == 0)
+    return;
+
+  // Remember which packets were processed, so that their decisions
+  // can be cached.
+  std::uint16_t missed[max_batch];
+  std::copy(active, active + m, missed);
+  int nmissed = m;
+
+  Application_chain const* chain = get_chain();
+  for (std::size_t j = 0; j < chain->stages.size(); ++j) {
+    Application* app = chain->stages[j];
+    int k = 0;
+    for (int i = 0; i < m; ++i) {
+      Context& cxt = *cxts[active[i]];
+      int v = app->process(cxt);
+      verdict[active[i]] = v;
+      if (v == Application::CONTINUE)
+        active[k++] = active[i];
+      else if (v == Application::DROP)
+        cxt.set_output_port(Port_drop::id);
+    }
+#ifdef FP_PERF
+    if (j < max_perf_applications)
+      ps = pc->record(pc->applications[j], ps, m);
+#endif
+    if (k == 0)
+      break;
+    m = k;
+  }
+
+  if (fc) {
+    for (int i = 0; i < nmissed; ++i)
+      insert(fc, modes, *cxts[missed[i]], verdict[missed[i]], gen);
+  }
+#ifdef FP_PERF
+  pc->record(pc->stages[PERF_PROCESS], start, nmissed);
+#endif
+}
+
+
+// Notify each application of a change in port state. Cached
+// decisions are invalidated, since they may depend on the state
+// of the port.
+void
+Dataplane::port_changed(Port& p)
+{
+  for (Application* app : get_chain()->stages)
+    app->port_changed(p);
+  invalidate_flow_caches();
+}
+
+
+// Publish a new parse graph. The previous graph is retired.
+void
+Dataplane::publish(Parse_graph* g)
+{
+  Parse_graph const* old = parser_.exchange(g);
+  invalidate_flow_caches();
+  rcu_retire(const_cast<Parse_graph*>(old));
+}
+
+
+// Bind headers of the given protocol to the identifier.
+void
+Dataplane::declare_header(int id, int proto)
+{
+  std::unique_ptr<Parse_graph> g(new Parse_graph(*get_parser()));
+  g->declare_header(id, proto);
+  publish(g.release());
+}
+
+
+// Bind the given protocol field to the identifier.
+void
+Dataplane::declare_field(int id, int field)
+{
+  std::unique_ptr<Parse_graph> g(new Parse_graph(*get_parser()));
+  g->declare_field(id, field);
+  publish(g.release());
+}
+
+
+// Enable the given flow caches (see Flow_cache_mode) and disable
+// the others. Enabling the megaflow cache enables the tracking of
+// field accesses.
+void
+Dataplane::enable_flow_cache(int modes)
+{
+  invalidate_flow_caches();
+  flow_cache_.store(modes, std::memory_order_release);
+}
+
+
+// Enable connection tracking, with a table of n connections.
+void
+Dataplane::enable_conntrack(int n)
+{
+  conntrack_.reset(new Conntrack(n));
+}
+
+
+// Keep one in every n of the packets dropped by each worker (see
+// Drop_capture). The capture must be enabled before the dataplane
+// is up.
+void
+Dataplane::enable_drop_capture(int n)
+{
+  drop_capture_.reset(new Drop_capture(n));
+}
+
+
+// Sample one in every n of the packets received by each worker
+// (see Sampler). Sampling must be enabled before the dataplane is
+// up.
+void
+Dataplane::enable_sampling(int n)
+{
+  sampler_.reset(new Sampler(n));
+}
+
+
+// Returns the enabled flow caches.
+int
+Dataplane::flow_cache_modes() const
+{
+  return flow_cache_.load(std::memory_order_relaxed);
+}
+
+
+// Returns the calling worker's flow caches.
+Flow_caches*
+Dataplane::flow_caches()
+{
+  Flow_caches*& c = caches_->local();
+  if (!c)
+    c = new Flow_caches();
+  return c;
+}
+
+
+// Returns the calling worker's latency histograms.
+Latency_histograms*
+Dataplane::latency_histograms()
+{
+  Latency_histograms*& h = latency_->local();
+  if (!h)
+    h = new Latency_histograms();
+  return h;
+}
+
+
+// Merge the latencies of the given stage, recorded by all workers,
+// into the histogram.
+void
+Dataplane::latency(int s, Latency_histogram& out) const
+{
+  assert(0 <= s && s < num_latency_stages);
+  for (int i = 0; i < max_workers; ++i)
+    if (Latency_histograms const* h = (*latency_)[i])
+      out.merge(h->stages[s]);
+}
+
+
+// Returns the calling worker's hardware event counters.
+Perf_counters*
+Dataplane::perf_counters()
+{
+  Perf_counters*& c = perf_->local();
+  if (!c)
+    c = new Perf_counters();
+  return c;
 }
 
 
@@ -1,24 +1,60 @@
 #ifndef FP_DATAPLANE_HPP
 #define FP_DATAPLANE_HPP
 
+#include "group.hpp"
+#include "meter.hpp"
+#include "cache.hpp"
+#include "conntrack.hpp"
+#include "parser.hpp"
+#include "drop.hpp"
+#include "sample.hpp"
+
+#include <atomic>
 #include <string>
 #include <list>
+#include <memory>
 #include <unordered_map>
+#include <vector>
 
 namespace fp
 {
 
 struct Table;
 class Application;
+class Context;
 class Port;
+class Latency_histogram;
+struct Latency_histograms;
+class Perf_counters;
+class Pool;
+
 
+// An application chain is the ordered sequence of applications
+// that process each packet, as stages of a pipeline. A chain is
+// never modified once published to workers; changing the stages
+// of a dataplane publishes a new chain.
+struct Application_chain
+{
+  std::vector<Application*> stages;
+};
 
-// The flowpath data plane module. Contains an application, a name,
-// and the tables the application will use during decode/lookup.
+
+// The statistics of one worker. Each worker updates only its own
+// statistics (see bump()), and readers sum over all workers.
+struct Worker_statistics
+{
+  std::atomic<std::uint64_t> packets;    // Packets processed.
+  std::atomic<std::uint64_t> batches;    // Batches processed.
+  std::atomic<std::uint64_t> cache_hits; // Packets decided by a flow cache.
+  std::atomic<std::uint64_t> drops[num_drop_reasons]; // Packets dropped, by reason.
+};
+
+
+// The flowpath data plane module. Contains a chain of applications,
+// a name, and the tables the applications will use during
+// decode/lookup.
 //
 // TODO: Rethink how the port table works. Who assigns ids?
-//
-// TODO: Support multuiple applications.
 class Dataplane
 {
 public:
@@ -27,7 +63,13 @@ public:
   using Table_map = std::unordered_map<uint32_t, Table*>;
 
   Dataplane(char const* n)
-    : name_(n), drop_(nullptr), app_(nullptr)
+    : name_(n), drop_(nullptr), flood_(nullptr), group_(nullptr), pool_(nullptr),
+      chain_(new Application_chain()), parser_(new Parse_graph()),
+      flow_cache_(0),
+      caches_(new Per_worker<Flow_caches*>()),
+      latency_(new Per_worker<Latency_histograms*>()),
+      perf_(new Per_worker<Perf_counters*>()),
+      stats_(new Per_worker<Worker_statistics>())
   { }
 
   ~Dataplane();
@@ -48,14 +90,84 @@ public:
   Port* get_port(uint32_t) const;
   Port* get_drop_port() const { return drop_; }
   Port* get_flood_port() const { return flood_; }
+  Port* get_group_port() const { return group_; }
 
-  // Application management.
+  // Application management. Each loaded application is appended
+  // to the chain.
   void load_application(char const*);
   void unload_application();
+  void swap_application(std::size_t, char const*);
+  void publish(Application_chain*);
+
+  Application*             get_application() const;
+  Application_chain const* get_chain() const;
+
+  // Packet processing. Batches hold at most max_batch packets.
+  static constexpr int max_batch = 256;
+
+  int  process(Context&);
+  void process(Context**, int);
 
-  Application* get_application() const { return app_; }
+  // Notifies all applications of a port change.
+  void port_changed(Port&);
+
+  // Parser management. Applications declare the headers and
+  // fields that they use when loaded.
+  void               declare_header(int, int);
+  void               declare_field(int, int);
+  void               publish(Parse_graph*);
+  Parse_graph const* get_parser() const;
+
+  // Flow cache management.
+  void         enable_flow_cache(int);
+  int          flow_cache_modes() const;
+  Flow_caches* flow_caches();
+
+  // Latency measurement (see latency.hpp). Each worker records
+  // into its own histograms, which are merged when read.
+  Latency_histograms* latency_histograms();
+  void                latency(int, Latency_histogram&) const;
+
+  // Hardware event counters (see perf.hpp). Each worker opens its
+  // own counters on first use; readers sum over workers.
+  Perf_counters*       perf_counters();
+  Perf_counters const* perf_counters(int n) const { return (*perf_)[n]; }
+
+  // Worker statistics.
+  Worker_statistics&       worker_stats()            { return stats_->local(); }
+  Worker_statistics const& worker_stats(int n) const { return (*stats_)[n]; }
+
+  // Connection tracking. The tracker must be enabled before the
+  // dataplane is up.
+  void       enable_conntrack(int);
+  Conntrack* conntrack() const { return conntrack_.get(); }
+
+  // Drop capture. A sample of the packets dropped by workers is
+  // kept, if enabled (see drop.hpp).
+  void          enable_drop_capture(int);
+  Drop_capture* drop_capture() const { return drop_capture_.get(); }
+
+  // Packet sampling. One in every n received packets is sampled,
+  // if enabled (see sample.hpp).
+  void     enable_sampling(int);
+  Sampler* sampler() const { return sampler_.get(); }
 
   // Table management.
+  Table* get_table(uint32_t) const;
+
+  // Group management.
+  Group_table const& groups() const { return groups_; }
+  Group_table&       groups()       { return groups_; }
+
+  // The pool from which packet buffers are allocated, if any.
+  // Replicating a packet to the buckets of a group requires a
+  // buffer for each replica.
+  void  set_pool(Pool* p) { pool_ = p; }
+  Pool* pool() const      { return pool_; }
+
+  // Meter management.
+  Meter_table const& meters() const { return meters_; }
+  Meter_table&       meters()       { return meters_; }
 
   // State management.
   void up();
@@ -72,9 +184,43 @@ public:
   Port_map  portmap_;
   Port*     drop_;
   Port*     flood_;
+  Port*     group_;
+  Pool*     pool_;
+
+  Table_map   tables_;
+  Group_table groups_;
+  Meter_table meters_;
+
+  // The running applications. Workers read this once per packet
+  // (or batch), so that it can be replaced without stopping them.
+  std::atomic<Application_chain const*> chain_;
 
-  Table_map tables_;
-  Application* app_;
+  // The parse graph for the running applications. This is
+  // replaced by each declaration.
+  std::atomic<Parse_graph const*> parser_;
+
+  // The enabled flow caches (see Flow_cache_mode), and each
+  // worker's caches, allocated on first use.
+  std::atomic<int>                          flow_cache_;
+  std::unique_ptr<Per_worker<Flow_caches*>> caches_;
+
+  // Each worker's latency histograms, allocated on first use.
+  std::unique_ptr<Per_worker<Latency_histograms*>> latency_;
+
+  // Each worker's hardware event counters, opened on first use.
+  std::unique_ptr<Per_worker<Perf_counters*>> perf_;
+
+  // Each worker's statistics.
+  std::unique_ptr<Per_worker<Worker_statistics>> stats_;
+
+  // The connection tracker, if enabled.
+  std::unique_ptr<Conntrack> conntrack_;
+
+  // The capture of dropped packets, if enabled.
+  std::unique_ptr<Drop_capture> drop_capture_;
+
+  // The packet sampler, if enabled.
+  std::unique_ptr<Sampler> sampler_;
 };
 
 
@@ -89,6 +235,43 @@ Dataplane::get_port(uint32_t id) const
 }
 
 
+// Returns the current application chain.
+inline Application_chain const*
+Dataplane::get_chain() const
+{
+  return chain_.load(std::memory_order_acquire);
+}
+
+
+// Returns the current parse graph.
+inline Parse_graph const*
+Dataplane::get_parser() const
+{
+  return parser_.load(std::memory_order_acquire);
+}
+
+
+// Returns the first application in the chain, or nullptr if no
+// application is loaded.
+inline Application*
+Dataplane::get_application() const
+{
+  Application_chain const* c = get_chain();
+  return c->stages.empty() ? nullptr : c->stages.front();
+}
+
+
+// Returns the table with the given identifier.
+inline Table*
+Dataplane::get_table(uint32_t id) const
+{
+  auto iter = tables_.find(id);
+  if (iter != tables_.end())
+    return iter->second;
+  return nullptr;
+}
+
+
 // -------------------------------------------------------------------------- //
 // Application interface
 
@@ -67,7 +67,7 @@ main(int argc, char* argv[])
 
   // Configure the dataplane. Ports must be added before
   // applications are loaded.
-  fp::Dataplane dp = "dp1";
+  fp::Dataplane dp("dp1");
   dp.add_port(&port1);
   dp.add_virtual_ports();
   dp.load_application(std::string(app_path + "endpoint.app").c_str());
@@ -28,6 +28,9 @@ static bool running;
 // a source to a destination.
 static bool once = false;
 
+// The number of connections tracked by the firewall.
+constexpr int max_connections = 1 << 20;
+
 
 void
 on_signal(int sig)
@@ -69,11 +72,12 @@ main(int argc, char* argv[])
 
   // Configure the dataplane. Ports must be added before
   // applications are loaded.
-  fp::Dataplane dp = "dp1";
+  fp::Dataplane dp("dp1");
   dp.add_port(&port1);
   dp.add_port(&port2);
   dp.add_port(&port3);
   dp.add_virtual_ports();
+  dp.enable_conntrack(max_connections);
   dp.load_application(std::string(app_path + "firewall.app").c_str());
   dp.up();
 
@@ -136,9 +140,8 @@ main(int argc, char* argv[])
     if (nports == 3)
       start = now();
 
-    // Notify the application of the port change.
-    Application* app = dp.get_application();
-    app->port_changed(*port);
+    // Notify the applications of the port change.
+    dp.port_changed(*port);
   };
 
   // Handle input from the client socket.
@@ -149,7 +152,7 @@ main(int argc, char* argv[])
   {
     // Ingress the packet.
     Byte buf[2048];
-    Context cxt(buf, &dp);
+    Context cxt(&dp, Packet(buf, sizeof(buf)));
     bool ok = port.recv(cxt);
 
     // Handle error or closure.
@@ -157,9 +160,8 @@ main(int argc, char* argv[])
       // Detach the socket.
       Ipv4_stream_socket client = port.detach();
 
-      // Notify the application of the port change.
-      Application* app = dp.get_application();
-      app->port_changed(port);
+      // Notify the applications of the port change.
+      dp.port_changed(port);
 
       // Update the poll set.
       ss.del_read(client.fd());
@@ -178,16 +180,11 @@ main(int argc, char* argv[])
     }
     else {
       ++npackets;
-      nbytes += cxt.packet().size();
+      nbytes += cxt.packet().total_length();
     }
 
-    // Otherwise, process the application.
-    //
-    // TODO: This really just runs one step of the pipeline. This needs
-    // to be a loop that continues processing until there are no further
-    // table redirections.
-    Application* app = dp.get_application();
-    app->process(cxt);
+    // Otherwise, run the packet through the application chain.
+    dp.process(cxt);
 
     // Apply actions after pipeline processing.
     cxt.apply_actions();
@@ -218,6 +215,9 @@ main(int argc, char* argv[])
     // occurs since like you said, it's not really an error. Most
     // impls just stick it in a do-while(errno != EINTR);
     int n = select(ss, 10ms);
+
+    // Expire idle connections, even when no packets arrive.
+    dp.conntrack()->expire();
     if (n <= 0)
       continue;
 
@@ -4,6 +4,7 @@
 #include "dataplane.hpp"
 #include "context.hpp"
 #include "application.hpp"
+#include "rcu.hpp"
 
 #include <freeflow/socket.hpp>
 #include <freeflow/select.hpp>
@@ -73,7 +74,7 @@ main(int argc, char* argv[])
 
   // Configure the dataplane. Ports must be added before
   // applications are loaded.
-  fp::Dataplane dp = "dp1";
+  fp::Dataplane dp("dp1");
   dp.add_port(&port1);
   dp.add_virtual_ports();
   dp.load_application(path.c_str());
@@ -126,9 +127,8 @@ main(int argc, char* argv[])
     if (nports == 1)
       start = now();
 
-    // Notify the application of the port change.
-    Application* app = dp.get_application();
-    app->port_changed(port1);
+    // Notify the applications of the port change.
+    dp.port_changed(port1);
   };
 
   // Handle input from the client socket.
@@ -147,9 +147,8 @@ main(int argc, char* argv[])
       // Detach the socket.
       Ipv4_stream_socket client = port.detach();
 
-      // Notify the application of the port change.
-      Application* app = dp.get_application();
-      app->port_changed(port);
+      // Notify the applications of the port change.
+      dp.port_changed(port);
 
       // Update the poll set.
       ss.del_read(client.fd());
@@ -182,13 +181,8 @@ main(int argc, char* argv[])
       return;
     }
 
-    // Otherwise, process the application.
-    //
-    // TODO: This really just runs one step of the pipeline. This needs
-    // to be a loop that continues processing until there are no further
-    // table redirections.
-    Application* app = dp.get_application();
-    app->process(cxt);
+    // Otherwise, run the packet through the application chain.
+    dp.process(cxt);
 
     // Apply actions after pipeline processing.
     // cxt.apply_actions();
@@ -219,6 +213,9 @@ main(int argc, char* argv[])
     // Process input.
     if (port1.fd() > 0 && ss.can_read(port1.fd()))
       ingress(port1);
+
+    // No flows are referenced between packets.
+    rcu_quiescent();
   }
 
 
@@ -67,7 +67,7 @@ main()
 
   // Configure the dataplane. Ports must be added before
   // applications are loaded.
-  fp::Dataplane dp = "dp1";
+  fp::Dataplane dp("dp1");
   dp.add_port(&port1);
   dp.add_port(&port2);
   dp.add_virtual_ports();
@@ -9,6 +9,11 @@
 #include "thread.hpp"
 #include "queue.hpp"
 #include "buffer.hpp"
+#include "rcu.hpp"
+#include "latency.hpp"
+#include "perf.hpp"
+#include "trace.hpp"
+#include "stats.hpp"
 
 #include <freeflow/socket.hpp>
 #include <freeflow/epoll.hpp>
@@ -19,11 +24,11 @@
 #include <array>
 #include <vector>
 #include <iostream>
+#include <cstdio>
+#include <cstdlib>
 #include <signal.h>
 #include <unistd.h>
 
-#include <boost/lockfree/queue.hpp>
-
 
 using namespace ff;
 using namespace fp;
@@ -58,20 +63,39 @@ Thread port_thread[2];
 int nports = 0;
 
 // The data plane object.
-Dataplane dp = "dp1";
+Dataplane dp("dp1");
 
-// Local send/recv buffer size.
-constexpr int local_buf_size = 2048;
+// The maximum number of packets sent by a port's scheduler
+// each time its socket is writable.
+constexpr int send_batch_size = 64;
 
-// Port send queues.
-boost::lockfree::queue<std::array<int, local_buf_size>, boost::lockfree::capacity<2048>> send_queue[2];
+// The maximum number of packets received by a port each time its
+// socket is readable. These are processed as a batch.
+constexpr int recv_batch_size = 32;
 
 
 // The packet buffer pool.
 static Pool& buffer_pool = Buffer_pool::get_pool(&dp);
 
+// The UNIX socket on which statistics are served.
+constexpr char const* stats_path = "/tmp/flowpath-wire.sock";
+
+// The file to which trace rings are dumped on SIGUSR1.
+constexpr char const* trace_path = "/tmp/flowpath-wire.trace";
+
+// The file to which sampled drops are written on SIGUSR2.
+constexpr char const* drops_path = "/tmp/flowpath-wire-drops.pcapng";
+
+// The file to which sampled packets are exported, as pcapng. Other
+// files (e.g., FLOWPATH_SAMPLE_FILE=/tmp/samples.bin) receive the
+// binary stream.
+constexpr char const* samples_path = "/tmp/flowpath-wire-samples.pcapng";
+
+// Set when sampled drops should be written.
+static bool volatile dump_drops;
+
 // Set up the initial polling state.
-Epoll_set eps(3);
+Epoll_set eps(4);
 
 // Signal handling.
 //
@@ -83,8 +107,98 @@ on_signal(int sig)
 }
 
 
-// Apply ingress and pipeline processing on a new packet (context).
-// After processing, the context will be copied to the egress queue.
+void
+on_dump_drops(int sig)
+{
+  dump_drops = true;
+}
+
+
+// Return the buffer of a transmitted packet to the pool.
+void
+release(Context* cxt, void* pool)
+{
+  static_cast<Pool*>(pool)->dealloc(cxt->packet().id());
+}
+
+
+// Receive a frame into the thread's spare buffer and drop it, when
+// the pool has no buffer for it. Frames must be read to keep the
+// port's stream moving.
+void
+drain(Port& port, Buffer& spare)
+{
+  Context& cxt = spare.context();
+  cxt.reset();
+  if (port.recv(cxt))
+    port.count_drop(cxt, DROP_POOL_EXHAUSTED);
+  buffer_pool.trim(cxt.packet());
+}
+
+
+// Queue the packet on its output port. Ports without egress
+// queues (e.g., virtual ports) send immediately. Packets without
+// an output port are sent to the drop port. If the output port
+// is down or its queue is full, the packet is dropped.
+void
+forward(Context& cxt)
+{
+  Port* out = cxt.output_port();
+  if (!out)
+    out = dp.get_drop_port();
+
+  // Publish the packet's sample, if it was selected.
+  if (cxt.sampled())
+    dp.sampler()->commit(out->id());
+
+  if (out->is_down()) {
+    out->count_drop(cxt, DROP_PORT_DOWN);
+    buffer_pool.dealloc(cxt.packet().id());
+  }
+  else if (out->queues()) {
+    if (!out->queues()->enqueue(&cxt, cxt.queue_id())) {
+      out->count_drop(cxt, DROP_QUEUE_FULL);
+      buffer_pool.dealloc(cxt.packet().id());
+    }
+  }
+  else {
+    out->send(cxt);
+    buffer_pool.dealloc(cxt.packet().id());
+  }
+}
+
+
+// Receive up to recv_batch_size packets from the port into new
+// buffers, and store their contexts in batch. Returns the number
+// received, which is less than the maximum once the socket has no
+// more frames. If the pool has no free buffer, the next frame is
+// dropped, and the batch ends.
+int
+receive(Port& port, Context** batch, Buffer& spare)
+{
+  int n = 0;
+  while (n < recv_batch_size) {
+    Buffer* buf = buffer_pool.try_alloc();
+    if (!buf) {
+      drain(port, spare);
+      break;
+    }
+    Context& cxt = buf->context();
+    cxt.reset();
+    if (!port.recv(cxt)) {
+      buffer_pool.dealloc(buf->id());
+      break;
+    }
+    batch[n++] = &cxt;
+  }
+  return n;
+}
+
+
+// Apply ingress and pipeline processing on new packets (contexts).
+// Packets are received and run through the application chain in
+// batches. After processing, each context is placed in an egress
+// queue of its output port, whose thread transmits it.
 //
 // FIXME: Currently we assume ingress processing happens on port2.
 // Maybe wrap ingress and egress calls into a different function
@@ -96,70 +210,77 @@ port_work(void* arg)
   int id = *((int*)arg);
   // Port FD.
   int fd = ports[id].fd();
-  // Local recv/send buffers.
-  std::array<int, local_buf_size> recv_buf;
-  std::array<int, local_buf_size> send_buf;
-  // Iterator to fill local recv buffer.
-  auto recv_iter = recv_buf.begin();
+  // The port's egress queues.
+  Egress_queue_set& queues = *ports[id].queues();
+  // Receives frames when the pool is exhausted.
+  Buffer& spare = buffer_pool.alloc();
+  // The packets received together.
+  Context* batch[recv_batch_size];
+  // Flow tables may be searched only while online.
+  rcu_online();
+#ifdef FP_PERF
+  // Hardware events are counted for this thread.
+  Perf_counters* pc = dp.perf_counters();
+#endif
   // TODO: Figure out a better conditional.
   while (running) {
+    // No flows are referenced between batches.
+    rcu_quiescent();
+
     // Check if the fd is able to read/recv.
     if (eps.can_read(fd)) {
-      
-      // Get the next free buffer from the pool.
-      Buffer& buf = buffer_pool.alloc();
-
-      // Ingress the packet.
-      if (ports[id].recv(buf.context())) {
-        // TODO: This really just runs one step of the pipeline. This needs
-        // to be a loop that continues processing until there are no further
-        // table redirections.
-        Application* app = dp.get_application();
-
-        // NOTE: Have process return the number of redirections to indicate
-        // if further processing should happen? Something like...
-        //
-        // while (app->process(buf.cxt_)) { }
-        app->process(buf.context());
+      // Ingress the packets.
+#ifdef FP_PERF
+      Perf_sample ps = pc->read();
+#endif
+      int n = receive(ports[id], batch, spare);
+#ifdef FP_PERF
+      pc->record(pc->stages[PERF_INGRESS], ps, n);
+#endif
+      if (n) {
+        // Run the packets through the application chain.
+        dp.process(batch, n);
 
         // Apply actions.
-        buf.context().apply_actions();
-
-        // Assuming there's an output send to it.
-        if (buf.context().output_port()) {
-          // If the buffer is full, push it into the send queue.
-          if (++recv_iter == recv_buf.end()) {
-            send_queue[buf.context().output_port()->id() - 1].push(recv_buf);
-            recv_iter = recv_buf.begin() + 1;
-          }
-          // Add the packet buffer index to the local buffer.
-          *recv_iter = buf.id();
-        }
+#ifdef FP_PERF
+        ps = pc->read();
+#endif
+        for (int i = 0; i < n; ++i)
+          batch[i]->apply_actions();
+#ifdef FP_PERF
+        pc->record(pc->stages[PERF_ACTIONS], ps, n);
+#endif
+
+        for (int i = 0; i < n; ++i)
+          forward(*batch[i]);
       }
-      else
-        buffer_pool.dealloc(buf.id());
     } // end if-can-read
   
     // Check if the fd is able to write/send.
     if (eps.can_write(fd)) {
-      // Drain the send queue.
-      while (send_queue[id].pop(send_buf)) {
-        for (int const& idx : send_buf) {
-          ports[id].send(buffer_pool[idx].context());
-          buffer_pool.dealloc(idx);
-        }
-      }
-    } // end if-can-write
+#ifdef FP_PERF
+      Perf_sample ps = pc->read();
+#endif
+      int n = queues.schedule(ports[id], send_batch_size, release, &buffer_pool);
+#ifdef FP_PERF
+      pc->record(pc->stages[PERF_EGRESS], ps, n);
+#endif
+      (void)n;
+    }
   } // end while-running
+  rcu_offline();
 
   // Cleanup.
   //
+  // Release any packets still waiting for transmission.
+  queues.discard(release, &buffer_pool);
+  buffer_pool.dealloc(spare.id());
+  //
   // Detach the socket.
   Ipv4_stream_socket client = ports[id].detach();
 
-  // Notify the application of the port change.
-  Application* app = dp.get_application();
-  app->port_changed(ports[id]);
+  // Notify the applications of the port change.
+  dp.port_changed(ports[id]);
   --nports;
 
   // Report.
@@ -179,6 +300,15 @@ main()
   signal(SIGINT, on_signal);
   signal(SIGKILL, on_signal);
   signal(SIGHUP, on_signal);
+  signal(SIGUSR2, on_dump_drops);
+
+#ifdef FP_TRACE
+  // Trace one in every FLOWPATH_TRACE packets (by default, every
+  // packet), and dump the trace rings on SIGUSR1.
+  char const* period = std::getenv("FLOWPATH_TRACE");
+  trace_enable(period ? std::atoi(period) : 1);
+  trace_dump_on_signal(SIGUSR1, trace_path);
+#endif
 
 
   set_option(server.fd(), reuse_address(true));
@@ -201,6 +331,9 @@ main()
     }
     std::cout << "[flowpath] accept connection " << addr.port() << '\n';
     //set_option(client.fd(), nodelay(true));
+    // Ports read until the socket has no more frames, so reads
+    // must not block.
+    set_option(client.fd(), nonblocking(true));
     eps.add(client.fd());
     // Bind the socket to a port.
     // TODO: Emit a port status change to the application. Does
@@ -215,9 +348,8 @@ main()
     port_thread[nports].run();
     ++nports;
 
-    // Notify the application of the port change.
-    Application* app = dp.get_application();
-    app->port_changed(*port);
+    // Notify the applications of the port change.
+    dp.port_changed(*port);
   };
 
   // Reporting stastics init.
@@ -225,21 +357,47 @@ main()
   Port::Statistics p2_stats = {0,0,0,0};
 
   // Configure the dataplane. Ports must be added before
-  // applications are loaded.
-
+  // applications are loaded. Group replicas are made in buffers
+  // from the pool.
+  dp.set_pool(&buffer_pool);
   for (int i = 0; i < 2; i++) {
     dp.add_port(&ports[i]);
+    ports[i].enable_queues();
+    ports[i].set_pool(&buffer_pool);
     port_thread[i].assign(i, port_work);
   }
 
   dp.add_virtual_ports();
 
+  // Keep one in every FLOWPATH_DROP_CAPTURE dropped packets, if set.
+  if (char const* n = std::getenv("FLOWPATH_DROP_CAPTURE"))
+    dp.enable_drop_capture(std::atoi(n));
+
+  // Sample one in every FLOWPATH_SAMPLE packets, if set, and
+  // export the samples while running.
+  if (char const* n = std::getenv("FLOWPATH_SAMPLE"))
+    dp.enable_sampling(std::atoi(n));
+
   dp.load_application("apps/wire.app");
   dp.up();
 
+  // Export samples to FLOWPATH_SAMPLE_FILE, or the default file.
+  if (Sampler* s = dp.sampler()) {
+    char const* path = std::getenv("FLOWPATH_SAMPLE_FILE");
+    std::string file = path ? path : samples_path;
+    bool pcapng = file.size() >= 7 && file.compare(file.size() - 7, 7, ".pcapng") == 0;
+    if (!s->start(file, pcapng ? SAMPLE_PCAPNG : SAMPLE_BINARY))
+      std::cerr << "[flowpath] cannot export samples to " << file << '\n';
+  }
+
   // Add the server socket to the select set.
   eps.add(server.fd());
 
+  // Serve statistics to monitoring clients.
+  Stats_server stats_server(dp, stats_path);
+  stats_server.set_pool(&buffer_pool);
+  eps.add(stats_server.fd());
+
   // Report statistics.
   auto report = [&]()
   {
@@ -256,6 +414,21 @@ main()
     std::cout << "Receive Rate   (Gb/s): " << bit_rx << '\n';
     std::cout << "Transmit Rate (Pkt/s): " << pkt_tx << '\n';
     std::cout << "Transmit Rate  (Gb/s): " << bit_tx << "\n\n";
+#ifdef FP_LATENCY
+    // Latencies since the start, in microseconds.
+    char const* stages[] = {
+      "Ingress to process", "Process to enqueue", "Queue residency", "End to end"
+    };
+    std::cout << "Latency (us)          p50       p99     p99.9       max\n";
+    for (int i = 0; i < num_latency_stages; ++i) {
+      Latency_histogram h;
+      dp.latency(i, h);
+      std::printf("%-18s %9.1f %9.1f %9.1f %9.1f\n", stages[i],
+                  h.percentile(0.5) / 1e3, h.percentile(0.99) / 1e3,
+                  h.percentile(0.999) / 1e3, h.max() / 1e3);
+    }
+    std::cout << '\n';
+#endif
     p1_stats = p1_curr;
     p2_stats = p2_curr;
   };
@@ -277,6 +450,15 @@ main()
     if (eps.can_read(server.fd()))
       accept(server);
 
+    if (eps.can_read(stats_server.fd()))
+      stats_server.serve();
+
+    if (dump_drops) {
+      dump_drops = false;
+      if (Drop_capture* c = dp.drop_capture())
+        c->write(drops_path);
+    }
+
     curr = now();
     Fp_seconds dur = curr - last;
     double duration = dur.count();
@@ -289,6 +471,8 @@ main()
   port_thread[0].halt();
   port_thread[1].halt();
   eps.clear();
+  if (Sampler* s = dp.sampler())
+    s->stop();
   // Take the dataplane down.
   dp.down();
   dp.unload_application();
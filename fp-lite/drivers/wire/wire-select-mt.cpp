@@ -58,7 +58,7 @@ Thread port_thread[2];
 int nports = 0;
 
 // The data plane object.
-Dataplane dp = "dp1";
+Dataplane dp("dp1");
 
 // Local send/recv buffer size.
 constexpr int local_buf_size = 2048;
@@ -0,0 +1,181 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#include "drop.hpp"
+#include "context.hpp"
+#include "dataplane.hpp"
+#include "trace.hpp"
+#include "time.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+
+namespace fp
+{
+
+namespace
+{
+
+char const* const reason_names[num_drop_reasons] = {
+  "application",
+  "table_miss",
+  "meter",
+  "no_bucket",
+  "malformed",
+  "oversize",
+  "pool_exhausted",
+  "queue_full",
+  "port_down",
+  "tx_error"
+};
+
+
+// A sample copied out of a ring.
+struct Captured
+{
+  std::uint64_t time;
+  std::uint32_t port;
+  std::uint32_t length;
+  std::uint16_t captured;
+  std::uint8_t  reason;
+  std::uint8_t  data[Drop_capture::snap_length];
+};
+
+
+} // namespace
+
+
+// Returns the name of a drop reason.
+char const*
+drop_reason_name(int r)
+{
+  if (0 <= r && r < num_drop_reasons)
+    return reason_names[r];
+  return "unknown";
+}
+
+
+// Count a packet dropped at the given port (or the drop port) by
+// the calling worker. The drop is traced, and the packet may be
+// sampled by the dataplane's drop capture.
+void
+record_drop(Context& cxt, Drop_reason r, std::uint32_t port)
+{
+  Dataplane* dp = cxt.dataplane();
+  if (!dp)
+    return;
+  bump(dp->worker_stats().drops[r]);
+#ifdef FP_TRACE
+  trace(cxt, TRACE_DROP, port, r);
+#endif
+  if (Drop_capture* c = dp->drop_capture())
+    c->sample(cxt, r, port);
+}
+
+
+// -------------------------------------------------------------------------- //
+// Drop capture
+
+// Create a capture that keeps one in every n dropped packets.
+Drop_capture::Drop_capture(std::uint32_t n)
+  : period_(n ? n : 1), rings_(new Per_worker<Ring>())
+{ }
+
+
+Drop_capture::~Drop_capture()
+{
+  for (int i = 0; i < max_workers; ++i)
+    delete[] (*rings_)[i].samples.load(std::memory_order_relaxed);
+}
+
+
+// Sample a dropped packet, if it is the calling worker's next.
+void
+Drop_capture::sample(Context const& cxt, Drop_reason r, std::uint32_t port)
+{
+  Ring& ring = rings_->local();
+  if (ring.countdown > 1) {
+    --ring.countdown;
+    return;
+  }
+  ring.countdown = period_;
+
+  Sample* samples = ring.samples.load(std::memory_order_relaxed);
+  if (!samples) {
+    samples = new Sample[ring_size]();
+    ring.samples.store(samples, std::memory_order_release);
+  }
+
+  Packet const& p = cxt.packet();
+  Sample& s = samples[ring.head++ % ring_size];
+  std::uint32_t seq = s.seq.load(std::memory_order_relaxed);
+  s.seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  s.time = p.timestamp() ? p.timestamp() : Time::current();
+  s.port = port;
+  s.length = p.total_length();
+  s.captured = std::min(p.length(), int(snap_length));
+  s.reason = r;
+  std::memcpy(s.data, p.data(), s.captured);
+  s.seq.store(seq + 2, std::memory_order_release);
+}
+
+
+// Write the samples to a pcapng file, oldest first. Returns false
+// if the file cannot be written.
+bool
+Drop_capture::write(std::string const& path) const
+{
+  // Copy the samples that are not being written.
+  std::vector<Captured> caps;
+  for (int i = 0; i < max_workers; ++i) {
+    Sample const* samples = (*rings_)[i].samples.load(std::memory_order_acquire);
+    if (!samples)
+      continue;
+    for (int j = 0; j < ring_size; ++j) {
+      Sample const& s = samples[j];
+      std::uint32_t seq = s.seq.load(std::memory_order_acquire);
+      if (seq == 0 || seq % 2)
+        continue;
+      Captured c;
+      c.time = s.time;
+      c.port = s.port;
+      c.length = s.length;
+      c.captured = std::min(int(s.captured), int(snap_length));
+      c.reason = s.reason;
+      std::memcpy(c.data, s.data, c.captured);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (s.seq.load(std::memory_order_relaxed) != seq)
+        continue;
+      caps.push_back(c);
+    }
+  }
+  std::sort(caps.begin(), caps.end(), [](Captured const& a, Captured const& b) {
+    return a.time < b.time;
+  });
+
+  FILE* f = std::fopen(path.c_str(), "wb");
+  if (!f)
+    return false;
+
+  // Each packet is commented with its port and reason.
+  std::string out;
+  pcapng_header(out, snap_length);
+  for (Captured const& c : caps) {
+    char comment[64];
+    std::snprintf(comment, sizeof(comment), "port=%u reason=%s",
+                  c.port, drop_reason_name(c.reason));
+    pcapng_packet(out, clock_.nanoseconds(c.time), c.data, c.captured,
+                  c.length, comment);
+  }
+
+  bool ok = std::fwrite(out.data(), 1, out.size(), f) == out.size();
+  ok = std::fclose(f) == 0 && ok;
+  return ok;
+}
+
+
+} // namespace fp
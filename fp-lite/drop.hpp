@@ -0,0 +1,112 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#ifndef FP_DROP_HPP
+#define FP_DROP_HPP
+
+#include "worker.hpp"
+#include "pcapng.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+
+namespace fp
+{
+
+class Context;
+
+
+// The reasons for which packets are dropped. Every drop is counted
+// once, for one reason, by the thread that drops the packet.
+//
+// Packets dropped by the pipeline are directed to the drop port,
+// and counted when they are sent to it. The most specific reason
+// known at that point is counted: the reason recorded by the
+// runtime function that dropped the packet (e.g., a table miss
+// or a meter), or DROP_APPLICATION if the application dropped the
+// packet itself. Packets dropped by ports are counted by the port.
+enum Drop_reason : std::uint8_t
+{
+  DROP_APPLICATION,    // Dropped by an application.
+  DROP_TABLE_MISS,     // Missed in a table whose miss flow drops.
+  DROP_METER,          // Exceeded the rate of a meter.
+  DROP_NO_BUCKET,      // Selected a group without a live bucket.
+  DROP_MALFORMED,      // Could not be decoded, or its actions applied.
+  DROP_OVERSIZE,       // Too large to be received.
+  DROP_POOL_EXHAUSTED, // No buffers were available for the frame.
+  DROP_QUEUE_FULL,     // The egress queue or socket was full.
+  DROP_PORT_DOWN,      // The output port was down.
+  DROP_TX_ERROR,       // The frame could not be written.
+  num_drop_reasons
+};
+
+
+char const* drop_reason_name(int);
+
+void record_drop(Context&, Drop_reason, std::uint32_t);
+
+
+// A drop capture keeps a sample of dropped packets, so that loss
+// can be diagnosed from the packets themselves. Each worker keeps
+// one in every n of the packets it drops in its own ring, which
+// overwrites the oldest sample when full. Up to snap_length bytes
+// of each packet are kept, with its time, port, and drop reason.
+//
+// Workers never block on the capture. Each sample is written under
+// a sequence number, and a reader skips samples that are written
+// while it copies them.
+//
+// The capture is written as a pcapng file, in which the port and
+// reason of each packet are given by its comment:
+//
+//    tshark -r drops.pcapng -T fields -e frame.comment
+class Drop_capture
+{
+public:
+  static constexpr int snap_length = 128;
+  static constexpr int ring_size = 256;
+
+  explicit Drop_capture(std::uint32_t);
+  ~Drop_capture();
+
+  Drop_capture(Drop_capture const&) = delete;
+  Drop_capture& operator=(Drop_capture const&) = delete;
+
+  std::uint32_t period() const { return period_; }
+
+  void sample(Context const&, Drop_reason, std::uint32_t);
+  bool write(std::string const&) const;
+
+private:
+  struct Sample
+  {
+    std::atomic<std::uint32_t> seq;  // Odd while being written.
+    std::uint64_t              time; // Clock ticks.
+    std::uint32_t              port;
+    std::uint32_t              length;
+    std::uint16_t              captured;
+    std::uint8_t               reason;
+    std::uint8_t               data[snap_length];
+  };
+
+  // A worker's ring, allocated on its first sample.
+  struct Ring
+  {
+    std::atomic<Sample*> samples;
+    std::uint64_t        head;
+    std::uint32_t        countdown;
+  };
+
+  std::uint32_t                     period_;
+  std::unique_ptr<Per_worker<Ring>> rings_;
+  Pcapng_clock                      clock_;
+};
+
+
+} // namespace fp
+
+
+#endif
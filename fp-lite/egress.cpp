@@ -0,0 +1,176 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#include "egress.hpp"
+#include "port.hpp"
+#include "context.hpp"
+#include "latency.hpp"
+#include "time.hpp"
+
+#include <algorithm>
+#include <string>
+
+
+namespace fp
+{
+
+// Construct a queue set with a single best-effort class.
+Egress_queue_set::Egress_queue_set()
+{
+  add_class(0);
+}
+
+
+// Add a new class with the given priority, DRR quantum (in
+// bytes), shaping rate (in bytes per second), burst size (in
+// bytes), and capacity (in packets). A rate of 0 means that
+// the class is not shaped. Returns the queue id of the new
+// class.
+//
+// A frame longer than the burst size (e.g., a jumbo or segmented
+// frame) is sent once the class's bucket is full, and holds the
+// class back until the tokens it overdraws are repaid.
+//
+// Classes must be added before the port's scheduler runs.
+int
+Egress_queue_set::add_class(int prio, std::uint32_t quantum,
+                            std::uint64_t rate, std::uint64_t burst,
+                            int cap)
+{
+  if (quantum == 0)
+    throw std::string("Egress quantum must be positive");
+
+  int id = classes_.size();
+  Token_bucket shaper(rate, std::max<std::uint64_t>(burst, quantum));
+  classes_.emplace_back(new Egress_class(prio, quantum, shaper, cap));
+
+  // Add the class to its priority level, keeping levels
+  // sorted by priority.
+  auto iter = std::find_if(levels_.begin(), levels_.end(), [prio](Level const& l) {
+    return l.priority >= prio;
+  });
+  if (iter == levels_.end() || iter->priority != prio)
+    iter = levels_.insert(iter, Level{prio, {}, 0});
+  iter->members.push_back(id);
+  return id;
+}
+
+
+// Enqueue the packet on the given queue. Unknown queue ids
+// are mapped to the first queue. Returns false if the queue is
+// full, in which case the caller retains ownership of the
+// packet.
+bool
+Egress_queue_set::enqueue(Context* cxt, unsigned int q)
+{
+  Egress_class& c = *classes_[q < classes_.size() ? q : 0];
+#ifdef FP_LATENCY
+  // The scheduler may release the packet as soon as it is queued,
+  // so its latency is recorded first.
+  cxt->enqueued_ = Time::current();
+  record_latency(*cxt, PROCESS_TO_ENQUEUE, cxt->processed_, cxt->enqueued_);
+#endif
+  if (!c.queue.bounded_push(cxt)) {
+    c.dropped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  c.enqueued.fetch_add(1, std::memory_order_relaxed);
+  return true;
+}
+
+
+// Transmit up to n packets on the port. Priority levels are
+// served in order; a lower priority level is served only when
+// every class in the higher levels is empty or held back by
+// its shaper. Returns the number of packets transmitted.
+int
+Egress_queue_set::schedule(Port& port, int n, Release_fn release, void* arg)
+{
+  std::uint64_t now = Token_bucket::now();
+  int sent = 0;
+  for (Level& l : levels_) {
+    sent += serve(l, port, n - sent, now, release, arg);
+    if (sent == n)
+      break;
+  }
+  return sent;
+}
+
+
+// Serve the classes of one priority level by deficit round
+// robin until n packets are sent or no class can make
+// progress.
+int
+Egress_queue_set::serve(Level& l, Port& port, int n, std::uint64_t now,
+                        Release_fn release, void* arg)
+{
+  int sent = 0;
+  int size = l.members.size();
+  bool active = true;
+  while (active && sent < n) {
+    active = false;
+    for (int k = 0; k < size && sent < n; ++k) {
+      Egress_class& c = *classes_[l.members[l.next]];
+      if (++l.next == size)
+        l.next = 0;
+
+      // Empty classes do not accumulate credit.
+      if (!c.peek()) {
+        c.deficit = 0;
+        continue;
+      }
+
+      c.deficit += c.quantum;
+      bool shaped = false;
+      while (sent < n) {
+        Context* cxt = c.peek();
+        if (!cxt)
+          break;
+        std::uint32_t len = cxt->packet().total_length();
+        if (len > c.deficit)
+          break;
+        if (!c.shaper.overdraw(len, now)) {
+          shaped = true;
+          break;
+        }
+        c.pop();
+        c.deficit -= len;
+        port.send(*cxt);
+#ifdef FP_LATENCY
+        Timestamp t = Time::current();
+        record_latency(*cxt, QUEUE_RESIDENCY, cxt->enqueued_, t);
+        record_latency(*cxt, END_TO_END, cxt->packet().timestamp(), t);
+#endif
+        release(cxt, arg);
+        ++c.sent;
+        ++sent;
+      }
+
+      // A class still holding packets needs another round,
+      // unless its shaper is holding them back. Empty classes
+      // forfeit their remaining credit.
+      if (!c.peek())
+        c.deficit = 0;
+      else if (!shaped)
+        active = true;
+    }
+  }
+  return sent;
+}
+
+
+// Release all queued packets without transmitting them.
+void
+Egress_queue_set::discard(Release_fn release, void* arg)
+{
+  for (auto& c : classes_) {
+    while (Context* cxt = c->peek()) {
+      c->pop();
+      release(cxt, arg);
+      c->dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+}
+
+
+} // namespace fp
@@ -0,0 +1,122 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#ifndef FP_EGRESS_HPP
+#define FP_EGRESS_HPP
+
+#include "token_bucket.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include <boost/lockfree/queue.hpp>
+
+
+namespace fp
+{
+
+class Port;
+class Context;
+
+
+// An egress class is one queue within a port's queue set.
+// Packets are queued by reference to their context. Any thread
+// may enqueue packets, but only the port's scheduler dequeues
+// them.
+//
+// Classes with lower priority values are served first. Classes
+// with equal priority share the port by deficit round robin,
+// each receiving `quantum` bytes per round. A class may be
+// shaped to a maximum rate by its token bucket.
+struct Egress_class
+{
+  using Queue = boost::lockfree::queue<Context*, boost::lockfree::fixed_sized<true>>;
+
+  Egress_class(int prio, std::uint32_t quantum, Token_bucket const& s, int cap)
+    : priority(prio), quantum(quantum), deficit(0), shaper(s), queue(cap),
+      head(nullptr), enqueued(0), dropped(0), sent(0)
+  { }
+
+  Context* peek();
+  void     pop() { head = nullptr; }
+
+  int           priority;
+  std::uint32_t quantum;
+  std::int64_t  deficit;
+  Token_bucket  shaper;
+  Queue         queue;
+  Context*      head;     // The next packet, owned by the scheduler.
+
+  // Counters. Enqueue and drop counts are updated by
+  // producers; the sent count only by the scheduler.
+  std::atomic<std::uint64_t> enqueued;
+  std::atomic<std::uint64_t> dropped;
+  std::uint64_t              sent;
+};
+
+
+// Returns the packet at the head of the queue, or nullptr if
+// the queue is empty. Only the scheduler may call this.
+inline Context*
+Egress_class::peek()
+{
+  if (!head)
+    queue.pop(head);
+  return head;
+}
+
+
+// The set of egress queues attached to a port. Packets are
+// enqueued by the threads that process them, and transmitted
+// by a per-port scheduler, in batches.
+//
+// When a packet has been transmitted (or discarded), the
+// scheduler passes it to a release function, which returns
+// the packet's buffer to its owner.
+class Egress_queue_set
+{
+public:
+  using Release_fn = void (*)(Context*, void*);
+
+  // Default properties for queues.
+  static constexpr std::uint32_t default_quantum = 1514;
+  static constexpr int           default_capacity = 1024;
+
+  Egress_queue_set();
+
+  int add_class(int, std::uint32_t = default_quantum,
+                std::uint64_t = 0, std::uint64_t = 0,
+                int = default_capacity);
+
+  int size() const { return classes_.size(); }
+
+  Egress_class const& operator[](int n) const { return *classes_[n]; }
+  Egress_class&       operator[](int n)       { return *classes_[n]; }
+
+  bool enqueue(Context*, unsigned int);
+  int  schedule(Port&, int, Release_fn, void*);
+  void discard(Release_fn, void*);
+
+private:
+  // A priority level is the set of classes with the same
+  // priority, and the round robin position among them.
+  struct Level
+  {
+    int              priority;
+    std::vector<int> members;
+    int              next;
+  };
+
+  int serve(Level&, Port&, int, std::uint64_t, Release_fn, void*);
+
+  std::vector<std::unique_ptr<Egress_class>> classes_;
+  std::vector<Level>                         levels_;
+};
+
+
+} // namespace fp
+
+
+#endif
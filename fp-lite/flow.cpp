@@ -7,6 +7,7 @@ namespace fp
 
 void Drop_miss(Flow*, Table*, Context* c)
 {
+  c->set_drop_reason(DROP_TABLE_MISS);
   fp_drop(c);
 }
 
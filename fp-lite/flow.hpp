@@ -3,6 +3,12 @@
 #define FP_FLOW_HPP
 
 #include "types.hpp"
+#include "action.hpp"
+#include "worker.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
 
 namespace fp
 {
@@ -20,11 +26,82 @@ using Flow_instructions = void (*)(Flow*, Table*, Context*);
 void Drop_miss(Flow*, Table*, Context*);
 
 
-// The flow counters mantain counts on matches.
+// The flow counters mantain counts on matches. A flow may be
+// matched by several workers at once. So that they do not contend
+// for one cache line on every matched packet, the counts are split
+// into shards on separate lines, and each worker counts in the
+// shard of its index. A full set of per-worker slots would cost
+// more than the flow itself, so workers may share a shard, and
+// counts are incremented atomically, but with no ordering.
 //
-// TODO: Implement me.
+// Reads sum the shards. Copying a set of counters copies its
+// counts.
 struct Flow_counters
 {
+  static constexpr int shards = 4;
+
+  // Shards are 16-byte aligned, which needs no special allocation,
+  // and padded so that no two share a cache line.
+  struct alignas(16) Shard
+  {
+    std::atomic<std::uint64_t> packets;
+    std::atomic<std::uint64_t> bytes;
+    char                       pad[cache_line_size - 16];
+  };
+
+  Flow_counters()
+  {
+    clear();
+  }
+
+  Flow_counters(Flow_counters const& c)
+  {
+    *this = c;
+  }
+
+  Flow_counters& operator=(Flow_counters const& c)
+  {
+    std::uint64_t p = c.packets();
+    std::uint64_t b = c.bytes();
+    clear();
+    shard_[0].packets.store(p, std::memory_order_relaxed);
+    shard_[0].bytes.store(b, std::memory_order_relaxed);
+    return *this;
+  }
+
+  void clear()
+  {
+    for (Shard& s : shard_) {
+      s.packets.store(0, std::memory_order_relaxed);
+      s.bytes.store(0, std::memory_order_relaxed);
+    }
+  }
+
+  // Count a matched packet of n bytes.
+  void count(std::uint64_t n)
+  {
+    Shard& s = shard_[worker_id() % shards];
+    s.packets.fetch_add(1, std::memory_order_relaxed);
+    s.bytes.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  std::uint64_t packets() const
+  {
+    std::uint64_t n = 0;
+    for (Shard const& s : shard_)
+      n += s.packets.load(std::memory_order_relaxed);
+    return n;
+  }
+
+  std::uint64_t bytes() const
+  {
+    std::uint64_t n = 0;
+    for (Shard const& s : shard_)
+      n += s.bytes.load(std::memory_order_relaxed);
+    return n;
+  }
+
+  Shard shard_[shards];
 };
 
 
@@ -35,27 +112,32 @@ struct Flow_timeouts
 
 
 // A flow is an entry in a flow table.
+//
+// A flow's counters are kept out of line, and are shared by its
+// copies. Tables replace a flow by publishing a modified copy, and
+// workers may still count on the previous version until it is
+// retired; sharing the counters means that no count is lost.
 struct Flow
 {
   Flow()
-    : pri_(0), count_(), instr_(Drop_miss), time_(), cookie_(0), flags_(0),
-      egress_(0)
+    : pri_(0), count_(std::make_shared<Flow_counters>()), instr_(Drop_miss),
+      time_(), cookie_(0), flags_(0), egress_(0), meter_(0)
   { }
 
-  Flow(std::size_t pri, Flow_counters count, Flow_instructions instr,
+  Flow(std::size_t pri, Flow_counters const& count, Flow_instructions instr,
        Flow_timeouts time, std::size_t cookie, std::size_t flags)
-    : pri_(pri), count_(count), instr_(instr), time_(time), cookie_(cookie),
-      flags_(flags), egress_(0)
+    : pri_(pri), count_(std::make_shared<Flow_counters>(count)), instr_(instr),
+      time_(time), cookie_(cookie), flags_(flags), egress_(0), meter_(0)
   { }
 
-  Flow(std::size_t pri, Flow_counters count, Flow_instructions instr,
+  Flow(std::size_t pri, Flow_counters const& count, Flow_instructions instr,
        Flow_timeouts time, std::size_t cookie, std::size_t flags, unsigned int egress)
-    : pri_(pri), count_(count), instr_(instr), time_(time), cookie_(cookie),
-      flags_(flags), egress_(egress)
+    : pri_(pri), count_(std::make_shared<Flow_counters>(count)), instr_(instr),
+      time_(time), cookie_(cookie), flags_(flags), egress_(egress), meter_(0)
   { }
 
-  std::size_t       pri_;
-  Flow_counters     count_;
+  std::size_t                    pri_;
+  std::shared_ptr<Flow_counters> count_;
   Flow_instructions instr_;
   Flow_timeouts     time_;
   std::size_t       cookie_;
@@ -63,6 +145,10 @@ struct Flow
   // Maintain the port of the packet which caused this flow to be installed.
   // 0 if this was a default initialized flow.
   unsigned int      egress_;
+  // The meter applied when the flow is matched, or 0 if none.
+  std::uint32_t     meter_;
+  // The precompiled actions applied when the flow is matched.
+  Action_program    prog_;
 };
 
 
@@ -0,0 +1,391 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#include "group.hpp"
+#include "buffer.hpp"
+#include "context.hpp"
+#include "dataplane.hpp"
+#include "egress.hpp"
+#include "port.hpp"
+#include "rcu.hpp"
+#include "tuple.hpp"
+
+#include <cassert>
+#include <cstring>
+#include <string>
+
+
+namespace fp
+{
+
+// -------------------------------------------------------------------------- //
+// Buckets
+
+// Returns true when the bucket's watch port is up, or if
+// the bucket does not watch a port.
+bool
+Bucket::is_live(Dataplane const& dp) const
+{
+  if (watch_port == 0)
+    return true;
+  Port* p = dp.get_port(watch_port);
+  return p && p->is_up();
+}
+
+
+// -------------------------------------------------------------------------- //
+// Groups
+
+Group::Group(std::uint32_t id, Type t)
+  : id_(id), type_(t), next_(0), set_(new Bucket_set())
+{ }
+
+
+Group::~Group()
+{
+  delete set_.load();
+}
+
+
+// Add a new bucket with the given weight, watch port, and actions
+// to the group. The bucket is added to a copy of the current
+// buckets, which is then published. Throws an exception if the
+// bucket cannot be added, leaving the group unchanged.
+void
+Group::add_bucket(unsigned int weight, unsigned int watch, Action const* a, int n)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  Bucket_set const& cur = current();
+  if (cur.buckets.size() == max_buckets)
+    throw std::string("Too many buckets in group");
+  if (type_ == INDIRECT && !cur.buckets.empty())
+    throw std::string("Indirect groups have exactly one bucket");
+
+  Bucket b(next_, weight, watch);
+  if (!b.actions.compile(a, n))
+    throw std::string("Invalid or too many actions for bucket");
+  ++next_;
+
+  Bucket_set* s = new Bucket_set(cur);
+  s->buckets.push_back(b);
+  s->build(type_);
+  rcu_retire(set_.exchange(s, std::memory_order_acq_rel));
+}
+
+
+// Rebuild the Maglev lookup table for a select group. Each
+// bucket walks its own permutation of the table, claiming
+// free entries in proportion to its weight, until the table
+// is full. Permutations are derived from the bucket id, so
+// they are stable as other buckets come and go.
+void
+Group::Bucket_set::build(Type t)
+{
+  lookup.clear();
+  if (t != SELECT)
+    return;
+
+  int n = buckets.size();
+  unsigned int max_weight = 0;
+  for (Bucket const& b : buckets)
+    max_weight = std::max(max_weight, b.weight);
+  if (max_weight == 0)
+    return;
+
+  std::vector<std::uint32_t> offset(n);
+  std::vector<std::uint32_t> skip(n);
+  std::vector<std::uint32_t> next(n, 0);
+  std::vector<std::uint64_t> placed(n, 0);
+  for (int i = 0; i < n; ++i) {
+    std::uint64_t h = mix(buckets[i].id + 1);
+    offset[i] = (h & 0xffffffff) % lookup_size;
+    skip[i] = (h >> 32) % (lookup_size - 1) + 1;
+  }
+
+  // In each round, the heaviest bucket claims one entry and
+  // the others claim entries in proportion to their weight.
+  lookup.assign(lookup_size, 0xff);
+  int filled = 0;
+  for (std::uint64_t round = 1; ; ++round) {
+    for (int i = 0; i < n; ++i) {
+      Bucket const& b = buckets[i];
+      while (placed[i] * max_weight < round * b.weight) {
+        std::uint32_t c;
+        do {
+          c = (offset[i] + std::uint64_t(next[i]) * skip[i]) % lookup_size;
+          ++next[i];
+        } while (lookup[c] != 0xff);
+        lookup[c] = i;
+        ++placed[i];
+        if (++filled == lookup_size)
+          return;
+      }
+    }
+  }
+}
+
+
+// Select a live bucket for the given flow hash. If the
+// chosen bucket is not live, subsequent entries of the
+// lookup table are probed. Returns nullptr if no bucket
+// is live.
+Bucket const*
+Group::select(Dataplane const& dp, std::uint32_t hash) const
+{
+  Bucket_set const& s = current();
+  if (s.lookup.empty())
+    return nullptr;
+  std::uint32_t idx = hash % lookup_size;
+  for (int k = 0; k < lookup_size; ++k) {
+    Bucket const& b = s.buckets[s.lookup[idx]];
+    if (b.is_live(dp))
+      return &b;
+    if (++idx == lookup_size)
+      idx = 0;
+  }
+  return nullptr;
+}
+
+
+// Returns the first live bucket, or nullptr if no bucket
+// is live.
+Bucket const*
+Group::failover(Dataplane const& dp) const
+{
+  for (Bucket const& b : buckets()) {
+    if (b.is_live(dp))
+      return &b;
+  }
+  return nullptr;
+}
+
+
+// -------------------------------------------------------------------------- //
+// Group table
+
+Group_table::Group_table()
+  : groups_(new Map())
+{ }
+
+
+Group_table::~Group_table()
+{
+  Map* m = groups_.load();
+  for (auto& kv : *m)
+    delete kv.second;
+  delete m;
+}
+
+
+// Create a new group. Throws an exception if the group
+// already exists.
+Group&
+Group_table::insert(std::uint32_t id, Group::Type t)
+{
+  if (id == 0)
+    throw std::string("Group 0 is reserved");
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  Map const& cur = current();
+  if (cur.count(id))
+    throw std::string("Group already exists");
+  Group* g = new Group(id, t);
+  Map* m = new Map(cur);
+  m->emplace(id, g);
+  rcu_retire(groups_.exchange(m, std::memory_order_acq_rel));
+  return *g;
+}
+
+
+// If no such group exists, no action is taken.
+void
+Group_table::erase(std::uint32_t id)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  Map const& cur = current();
+  auto iter = cur.find(id);
+  if (iter == cur.end())
+    return;
+  Group* g = iter->second;
+  Map* m = new Map(cur);
+  m->erase(id);
+  rcu_retire(groups_.exchange(m, std::memory_order_acq_rel));
+  rcu_retire(g);
+}
+
+
+Group*
+Group_table::find(std::uint32_t id)
+{
+  Map const& m = current();
+  auto iter = m.find(id);
+  if (iter == m.end())
+    return nullptr;
+  return iter->second;
+}
+
+
+Group const*
+Group_table::find(std::uint32_t id) const
+{
+  Map const& m = current();
+  auto iter = m.find(id);
+  if (iter == m.end())
+    return nullptr;
+  return iter->second;
+}
+
+
+// Apply the group selected by the context. Groups that apply
+// a single bucket do so in place. All groups defer replication
+// to egress by directing the packet to the group port, so
+// that the packet is not re-processed for each bucket.
+//
+// If the group does not exist or has no live bucket, the
+// packet is dropped.
+void
+Group_table::apply(Context& cxt) const
+{
+  Dataplane const& dp = *cxt.dataplane();
+  Group const* g = find(cxt.group_id());
+  Bucket const* b = nullptr;
+  if (g) {
+    switch (g->type()) {
+      case Group::ALL:
+        cxt.set_output_port(dp.get_group_port()->id());
+        return;
+      case Group::SELECT:
+        b = g->select(dp, cxt.flow_hash());
+        break;
+      case Group::INDIRECT:
+        if (!g->buckets().empty())
+          b = &g->buckets().front();
+        break;
+      case Group::FAST_FAILOVER:
+        b = g->failover(dp);
+        break;
+    }
+  }
+
+  if (b) {
+    cxt.apply_program(b->actions);
+  }
+  else {
+    cxt.set_drop_reason(DROP_NO_BUCKET);
+    cxt.set_output_port(dp.get_drop_port()->id());
+  }
+
+  // Chained groups are not supported, so clear the selection
+  // even if the bucket selected another group.
+  cxt.set_group(0);
+}
+
+
+namespace
+{
+
+// Make a replica of the context's packet in the context r of a
+// new buffer. The replica has its own copy of the first segment,
+// which holds the headers that a bucket may modify, and shares
+// later segments with the original. Only the state needed to
+// apply a bucket and send the packet is copied. Returns false if
+// the first segment does not fit in the replica's buffer.
+bool
+clone(Context const& cxt, Context& r, Pool& pool)
+{
+  Packet const& pkt = cxt.packet();
+  Packet& p = r.packet_;
+  r.reset();
+  int size = p.headroom() + p.capacity();
+  if (pkt.headroom() + pkt.length() > size)
+    return false;
+
+  r.input_ = cxt.input_;
+  r.ctrl_ = cxt.ctrl_;
+  r.ctrl_.group = 0;
+  r.metadata_ = cxt.metadata_;
+#ifdef FP_LATENCY
+  r.processed_ = cxt.processed_;
+#endif
+#ifdef FP_TRACE
+  r.trace_ = cxt.trace_;
+#endif
+
+  p.buf_ = p.base_ + pkt.headroom();
+  p.cap_ = size - pkt.headroom();
+  std::memcpy(p.data(), pkt.data(), pkt.length());
+  p.limit(pkt.length());
+  p.stamp(pkt.timestamp());
+  p.next_ = pkt.next_;
+  pool.share(p);
+  return true;
+}
+
+
+// Queue the replica on its output port, or send it if the port
+// has no egress queues, as the driver does for other packets.
+// The replica's buffer is returned to the pool once it is sent
+// or dropped. Replicas without an output port are discarded.
+void
+forward(Context& r, Port const* self, Pool& pool)
+{
+  Port* p = r.output_port();
+  if (!p || p == self) {
+    pool.dealloc(r.packet().id());
+    return;
+  }
+  if (p->is_down()) {
+    p->count_drop(r, DROP_PORT_DOWN);
+  }
+  else if (Egress_queue_set* q = p->queues()) {
+    if (q->enqueue(&r, r.queue_id()))
+      return;
+    p->count_drop(r, DROP_QUEUE_FULL);
+  }
+  else {
+    p->send(r);
+  }
+  pool.dealloc(r.packet().id());
+}
+
+
+} // namespace
+
+
+// Send one replica of the packet for each live bucket in the all
+// group selected by the context. Each replica is made in a buffer
+// from the dataplane's pool, the bucket is applied to it, and it
+// is queued on its output port. The context itself is unchanged,
+// and may be released as soon as this returns.
+void
+Group_table::replicate(Context& cxt) const
+{
+  Group const* g = find(cxt.group_id());
+  if (!g)
+    return;
+
+  Dataplane& dp = *cxt.dataplane();
+  Port* self = dp.get_group_port();
+  Pool* pool = dp.pool();
+  for (Bucket const& b : g->buckets()) {
+    if (!b.is_live(dp))
+      continue;
+
+    Buffer* buf = pool ? pool->try_alloc() : nullptr;
+    if (!buf) {
+      self->count_drop(cxt, DROP_POOL_EXHAUSTED);
+      continue;
+    }
+    Context& r = buf->context();
+    if (!clone(cxt, r, *pool)) {
+      self->count_drop(cxt, DROP_OVERSIZE);
+      pool->dealloc(buf->id());
+      continue;
+    }
+    r.apply_program(b.actions);
+    forward(r, self, *pool);
+  }
+}
+
+
+} // namespace fp
@@ -0,0 +1,145 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#ifndef FP_GROUP_HPP
+#define FP_GROUP_HPP
+
+#include "action.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include <unordered_map>
+
+
+namespace fp
+{
+
+class Dataplane;
+class Context;
+
+
+// A bucket is a set of actions applied to a packet by a
+// group. The weight is used only by select groups. The watch
+// port determines the liveness of the bucket for select and
+// fast failover groups. A watch port of 0 means the bucket
+// is always live.
+struct Bucket
+{
+  Bucket(std::uint32_t id, unsigned int w, unsigned int p)
+    : id(id), weight(w), watch_port(p), actions()
+  { }
+
+  bool is_live(Dataplane const&) const;
+
+  std::uint32_t  id;
+  unsigned int   weight;
+  unsigned int   watch_port;
+  Action_program actions;
+};
+
+
+// A group applies one or more buckets to a packet.
+//
+//  - ALL applies every bucket to its own copy of the packet,
+//    which supports multicast and flooding.
+//  - SELECT applies one live bucket, chosen by consistent
+//    hashing over the packet's flow hash. Buckets receive a
+//    share of flows proportional to their weight.
+//  - INDIRECT applies its only bucket.
+//  - FAST_FAILOVER applies the first live bucket.
+//
+// Select groups use a Maglev lookup table so that adding or
+// removing a bucket remaps only a small fraction of flows.
+//
+// Workers read a group's buckets without locks. A bucket set is
+// never modified once it is published; adding a bucket builds a
+// new set, publishes it, and retires the old one through RCU (see
+// rcu.hpp). Writers are serialized by the group's mutex.
+struct Group
+{
+  enum Type { ALL, SELECT, INDIRECT, FAST_FAILOVER };
+
+  // The number of entries in the select lookup table. This
+  // must be prime.
+  static constexpr int lookup_size = 1021;
+
+  // The maximum number of buckets in a group.
+  static constexpr int max_buckets = 255;
+
+  // The buckets of a group, and its select lookup table.
+  struct Bucket_set
+  {
+    void build(Type);
+
+    std::vector<Bucket>       buckets;
+    std::vector<std::uint8_t> lookup;
+  };
+
+  Group(std::uint32_t, Type);
+  ~Group();
+
+  Group(Group const&) = delete;
+  Group& operator=(Group const&) = delete;
+
+  std::uint32_t id() const   { return id_; }
+  Type          type() const { return type_; }
+
+  // Returns the current buckets. These remain valid until the
+  // calling worker's next quiescent state.
+  Bucket_set const&          current() const { return *set_.load(std::memory_order_acquire); }
+  std::vector<Bucket> const& buckets() const { return current().buckets; }
+
+  void add_bucket(unsigned int, unsigned int, Action const*, int);
+
+  Bucket const* select(Dataplane const&, std::uint32_t) const;
+  Bucket const* failover(Dataplane const&) const;
+
+  std::uint32_t                  id_;
+  Type                           type_;
+  std::uint32_t                  next_; // The next bucket id.
+  std::atomic<Bucket_set*>       set_;
+  std::mutex                     mutex_;
+};
+
+
+// The group table maps group identifiers to groups.
+//
+// Group 0 is reserved; selecting it means that no group
+// is applied.
+//
+// As with bucket sets, the map is published through RCU: inserting
+// or erasing a group publishes a copy of the map, and an erased
+// group is retired with the old map.
+class Group_table
+{
+public:
+  using Map = std::unordered_map<std::uint32_t, Group*>;
+
+  Group_table();
+  ~Group_table();
+
+  Group_table(Group_table const&) = delete;
+  Group_table& operator=(Group_table const&) = delete;
+
+  Group&       insert(std::uint32_t, Group::Type);
+  void         erase(std::uint32_t);
+  Group*       find(std::uint32_t);
+  Group const* find(std::uint32_t) const;
+
+  void apply(Context&) const;
+  void replicate(Context&) const;
+
+private:
+  Map const& current() const { return *groups_.load(std::memory_order_acquire); }
+
+  std::atomic<Map*>       groups_;
+  std::mutex              mutex_;
+};
+
+
+} // namespace fp
+
+
+#endif
@@ -0,0 +1,114 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#include "latency.hpp"
+#include "context.hpp"
+#include "dataplane.hpp"
+#include "time.hpp"
+
+#include <algorithm>
+
+
+namespace fp
+{
+
+Latency_histogram::Latency_histogram()
+  : total_(0), sum_(0), max_(0)
+{
+  for (auto& c : counts_)
+    c.store(0, std::memory_order_relaxed);
+}
+
+
+// Returns the least value counted by the bucket.
+std::uint64_t
+Latency_histogram::lower_bound(int b)
+{
+  if (b < sub_buckets)
+    return b;
+  int e = b / sub_buckets + sub_bits - 1;
+  std::uint64_t sub = b % sub_buckets;
+  return (sub_buckets + sub) << (e - sub_bits);
+}
+
+
+// Add the counts of another histogram to this one. Only the
+// writer of this histogram may merge into it.
+void
+Latency_histogram::merge(Latency_histogram const& h)
+{
+  auto add = [](std::atomic<std::uint64_t>& c, std::atomic<std::uint64_t> const& k) {
+    c.store(c.load(std::memory_order_relaxed) + k.load(std::memory_order_relaxed),
+            std::memory_order_relaxed);
+  };
+  for (int i = 0; i < num_buckets; ++i)
+    add(counts_[i], h.counts_[i]);
+  add(total_, h.total_);
+  add(sum_, h.sum_);
+  std::uint64_t m = h.max_.load(std::memory_order_relaxed);
+  if (m > max_.load(std::memory_order_relaxed))
+    max_.store(m, std::memory_order_relaxed);
+}
+
+
+std::uint64_t
+Latency_histogram::count() const
+{
+  return total_.load(std::memory_order_relaxed);
+}
+
+
+std::uint64_t
+Latency_histogram::max() const
+{
+  return max_.load(std::memory_order_relaxed);
+}
+
+
+double
+Latency_histogram::mean() const
+{
+  std::uint64_t n = count();
+  return n ? double(sum_.load(std::memory_order_relaxed)) / n : 0;
+}
+
+
+// Returns the latency below which the given fraction of the
+// recorded latencies fall, as the upper bound of its bucket
+// (limited to the maximum). Returns 0 if the histogram is empty.
+std::uint64_t
+Latency_histogram::percentile(double q) const
+{
+  std::uint64_t n = 0;
+  for (auto const& c : counts_)
+    n += c.load(std::memory_order_relaxed);
+  if (n == 0)
+    return 0;
+  std::uint64_t rank = std::max<std::uint64_t>(1, q * n + 0.5);
+  std::uint64_t seen = 0;
+  for (int i = 0; i < num_buckets; ++i) {
+    seen += counts_[i].load(std::memory_order_relaxed);
+    if (seen >= rank) {
+      if (i == num_buckets - 1)
+        return max();
+      return std::min(lower_bound(i + 1) - 1, max());
+    }
+  }
+  return max();
+}
+
+
+// Record the latency of a packet between two times, in the
+// calling worker's histogram for the stage. Packets that were
+// not stamped at a stage's start are not recorded.
+void
+record_latency(Context& cxt, Latency_stage s, Timestamp from, Timestamp to)
+{
+  if (!from || to < from)
+    return;
+  Latency_histograms* h = cxt.dataplane()->latency_histograms();
+  h->stages[s].record(Time::to_nanoseconds(to - from));
+}
+
+
+} // namespace fp
@@ -0,0 +1,114 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#ifndef FP_LATENCY_HPP
+#define FP_LATENCY_HPP
+
+
+#include <atomic>
+#include <cstdint>
+
+
+namespace fp
+{
+
+class Context;
+
+
+// The stages of the pipeline whose latency is measured. Times are
+// taken when a packet arrives, when its processing starts, when it
+// is queued for egress, and when it is sent.
+enum Latency_stage
+{
+  INGRESS_TO_PROCESS,
+  PROCESS_TO_ENQUEUE,
+  QUEUE_RESIDENCY,
+  END_TO_END,
+  num_latency_stages
+};
+
+
+// A latency histogram counts nanosecond latencies in log-linear
+// buckets, as in HdrHistogram: each power of two is divided into
+// 16 buckets, so that any value is recorded within 1/16 (about
+// 6%) of its magnitude. Latencies of 2^40 ns or more are counted
+// in the last bucket.
+//
+// A histogram has a single writer. Counters are atomic only so that
+// they can be read while it writes; the writer never uses a locked
+// instruction.
+class Latency_histogram
+{
+public:
+  static constexpr int sub_bits = 4;
+  static constexpr int sub_buckets = 1 << sub_bits;
+  static constexpr int max_bits = 40;
+  static constexpr int num_buckets = (max_bits - sub_bits + 1) * sub_buckets;
+
+  Latency_histogram();
+
+  void record(std::uint64_t);
+  void merge(Latency_histogram const&);
+
+  std::uint64_t count() const;
+  std::uint64_t max() const;
+  double        mean() const;
+  std::uint64_t percentile(double) const;
+
+  static int           bucket(std::uint64_t);
+  static std::uint64_t lower_bound(int);
+
+private:
+  std::atomic<std::uint64_t> counts_[num_buckets];
+  std::atomic<std::uint64_t> total_;
+  std::atomic<std::uint64_t> sum_;
+  std::atomic<std::uint64_t> max_;
+};
+
+
+// Returns the bucket counting the value.
+inline int
+Latency_histogram::bucket(std::uint64_t v)
+{
+  if (v < std::uint64_t(sub_buckets))
+    return v;
+  int e = 63 - __builtin_clzll(v);
+  if (e >= max_bits)
+    return num_buckets - 1;
+  int sub = (v >> (e - sub_bits)) & (sub_buckets - 1);
+  return (e - sub_bits + 1) * sub_buckets + sub;
+}
+
+
+// Count a latency of n nanoseconds.
+inline void
+Latency_histogram::record(std::uint64_t n)
+{
+  auto bump = [](std::atomic<std::uint64_t>& c, std::uint64_t k) {
+    c.store(c.load(std::memory_order_relaxed) + k, std::memory_order_relaxed);
+  };
+  bump(counts_[bucket(n)], 1);
+  bump(total_, 1);
+  bump(sum_, n);
+  if (n > max_.load(std::memory_order_relaxed))
+    max_.store(n, std::memory_order_relaxed);
+}
+
+
+// The latency histograms of one worker.
+struct Latency_histograms
+{
+  Latency_histogram stages[num_latency_stages];
+};
+
+
+// Latencies are recorded only if the runtime is built with
+// FP_LATENCY (see the FREEFLOW_LATENCY option). Otherwise, no
+// times are taken.
+void record_latency(Context&, Latency_stage, std::uint64_t, std::uint64_t);
+
+
+} // namespace fp
+
+
+#endif
@@ -0,0 +1,235 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#include "meter.hpp"
+#include "checksum.hpp"
+#include "context.hpp"
+#include "rcu.hpp"
+#include "time.hpp"
+#include "tuple.hpp"
+
+#include <algorithm>
+#include <string>
+
+
+namespace fp
+{
+
+namespace
+{
+
+// The largest burst, in units, that a bucket can hold without
+// overflowing its scaled token count, for clocks of up to 10 GHz.
+constexpr std::uint64_t max_burst = 1000000000;
+
+// The smallest burst, in bits, of a kilobit meter: one
+// maximum-sized Ethernet frame.
+constexpr std::uint64_t min_bit_burst = 1514 * 8;
+
+
+// Increase the drop precedence of an assured forwarding DSCP
+// by n. Other code points are not changed.
+inline std::uint8_t
+increase_precedence(std::uint8_t dscp, int n)
+{
+  int cls = dscp >> 3;
+  int drop = (dscp >> 1) & 0x3;
+  if (cls < 1 || cls > 4 || drop == 0 || (dscp & 1))
+    return dscp;
+  drop = std::min(3, drop + n);
+  return (cls << 3) | (drop << 1);
+}
+
+
+// Remark the DSCP of an IP packet.
+void
+remark(Context& cxt, int prec)
+{
+  Five_tuple t;
+  if (!extract_tuple(cxt.packet(), t))
+    return;
+  Byte* p = cxt.packet().data() + t.l3;
+  if (t.version == 4) {
+    std::uint16_t old = p[0] << 8 | p[1];
+    std::uint8_t dscp = increase_precedence(p[1] >> 2, prec);
+    p[1] = (dscp << 2) | (p[1] & 0x3);
+    update_checksum(p + 10, old, p[0] << 8 | p[1]);
+  }
+  else if (t.version == 6) {
+    std::uint8_t tc = (p[0] & 0x0f) << 4 | p[1] >> 4;
+    std::uint8_t dscp = increase_precedence(tc >> 2, prec);
+    tc = (dscp << 2) | (tc & 0x3);
+    p[0] = (p[0] & 0xf0) | (tc >> 4);
+    p[1] = (p[1] & 0x0f) | (tc << 4);
+  }
+}
+
+
+} // namespace
+
+
+// Add a band to the meter. Bands are kept sorted by rate.
+//
+// FIXME: Bands should only be added before packets are metered.
+void
+Meter::add_band(Meter_band const& b)
+{
+  if (nbands_ == max_bands)
+    throw std::string("Too many meter bands");
+  if (b.rate == 0)
+    throw std::string("Meter band rate must be positive");
+  Meter_band* last = bands_ + nbands_;
+  Meter_band* pos = std::upper_bound(bands_, last, b, [](Meter_band const& x, Meter_band const& y) {
+    return x.rate < y.rate;
+  });
+  std::copy_backward(pos, last, last + 1);
+  *pos = b;
+  ++nbands_;
+  ++version_;
+}
+
+
+// Configure a worker's buckets to measure its share of each
+// band's rate.
+void
+Meter::configure(State& s, int n)
+{
+  for (int i = 0; i < nbands_; ++i) {
+    Meter_band const& b = bands_[i];
+    std::uint64_t rate = b.rate;
+    std::uint64_t burst = b.burst;
+    if (unit_ == KBPS) {
+      rate = rate * 1000;
+      burst = std::max(burst * 1000, min_bit_burst * n);
+    }
+    else {
+      burst = std::max<std::uint64_t>(burst, n);
+    }
+    burst = std::min(burst / n, max_burst);
+    s.buckets[i] = Token_bucket(std::max<std::uint64_t>(rate / n, 1), burst, Time::frequency());
+  }
+  s.shares = n;
+  s.version = version_;
+}
+
+
+// Measure the packet. Tokens are taken from the bucket of each
+// band whose rate has not been exceeded. The band with the
+// highest exceeded rate, if any, is applied.
+Meter::Result
+Meter::apply(Context& cxt)
+{
+  State& s = state_->local();
+  int n = std::max(active_workers(), 1);
+  if (s.shares != n || s.version != version_)
+    configure(s, n);
+
+  std::uint64_t len = cxt.packet().total_length();
+  std::uint64_t units = unit_ == KBPS ? len * 8 : 1;
+  Timestamp now = Time::current();
+  bump(s.packets);
+  bump(s.bytes, len);
+
+  int hit = -1;
+  for (int i = 0; i < nbands_; ++i) {
+    if (!s.buckets[i].consume(units, now))
+      hit = i;
+  }
+  if (hit < 0)
+    return PASS;
+
+  bump(s.band_packets[hit]);
+  Meter_band const& b = bands_[hit];
+  if (b.type == Meter_band::DROP)
+    return DROP;
+  remark(cxt, b.prec_level);
+  return REMARK;
+}
+
+
+std::uint64_t
+Meter::packets() const
+{
+  std::uint64_t n = 0;
+  for (int i = 0; i < max_workers; ++i)
+    n += (*state_)[i].packets.load(std::memory_order_relaxed);
+  return n;
+}
+
+
+std::uint64_t
+Meter::bytes() const
+{
+  std::uint64_t n = 0;
+  for (int i = 0; i < max_workers; ++i)
+    n += (*state_)[i].bytes.load(std::memory_order_relaxed);
+  return n;
+}
+
+
+std::uint64_t
+Meter::band_packets(int b) const
+{
+  std::uint64_t n = 0;
+  for (int i = 0; i < max_workers; ++i)
+    n += (*state_)[i].band_packets[b].load(std::memory_order_relaxed);
+  return n;
+}
+
+
+// -------------------------------------------------------------------------- //
+// Meter table
+
+Meter_table::Meter_table()
+  : meters_(new Map())
+{ }
+
+
+Meter_table::~Meter_table()
+{
+  Map* m = meters_.load();
+  for (auto& kv : *m)
+    delete kv.second;
+  delete m;
+}
+
+
+// Create a new meter. Throws an exception if the meter
+// already exists.
+Meter&
+Meter_table::insert(std::uint32_t id, Meter::Unit u)
+{
+  if (id == 0)
+    throw std::string("Meter 0 is reserved");
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  Map const& cur = current();
+  if (cur.count(id))
+    throw std::string("Meter already exists");
+  Meter* mtr = new Meter(id, u);
+  Map* m = new Map(cur);
+  m->emplace(id, mtr);
+  rcu_retire(meters_.exchange(m, std::memory_order_acq_rel));
+  return *mtr;
+}
+
+
+// If no such meter exists, no action is taken. Workers may still
+// be using the meter, so it is retired rather than destroyed.
+void
+Meter_table::erase(std::uint32_t id)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  Map const& cur = current();
+  auto iter = cur.find(id);
+  if (iter == cur.end())
+    return;
+  Meter* mtr = iter->second;
+  Map* m = new Map(cur);
+  m->erase(id);
+  rcu_retire(meters_.exchange(m, std::memory_order_acq_rel));
+  rcu_retire(mtr);
+}
+
+
+} // namespace fp
@@ -0,0 +1,170 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#ifndef FP_METER_HPP
+#define FP_METER_HPP
+
+#include "token_bucket.hpp"
+#include "worker.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+
+namespace fp
+{
+
+class Context;
+
+
+// A meter band is applied to packets when the rate measured
+// by a meter exceeds the band's rate. A drop band discards the
+// packet. A DSCP remark band increases the drop precedence of
+// an IP packet's DSCP by prec_level.
+//
+// Rates and bursts are in the units of the meter: kilobits
+// (per second) or packets (per second).
+struct Meter_band
+{
+  enum Type : std::uint8_t { DROP, DSCP_REMARK };
+
+  Type          type;
+  std::uint8_t  prec_level;
+  std::uint64_t rate;
+  std::uint64_t burst;
+};
+
+
+// A meter measures the rate of the packets that pass through
+// it and applies the band with the highest rate that has been
+// exceeded, as in OpenFlow.
+//
+// To avoid shared state on the fast path, each worker measures
+// its own packets with its own token buckets, whose rate is the
+// meter's rate divided by the number of active workers (see
+// active_workers()). A worker's buckets are resized the next time
+// it uses the meter after the number of workers changes. Buckets
+// are refilled by the runtime clock (see time.hpp).
+//
+// This is an approximation. The meter's rate is enforced exactly
+// only when traffic is spread evenly over workers. A worker that
+// receives more than its share is limited to its share, and any
+// thread that holds a worker index counts as a worker, even if it
+// meters no packets.
+class Meter
+{
+public:
+  enum Unit { KBPS, PKTPS };
+
+  // The result of metering a packet.
+  enum Result { PASS, DROP, REMARK };
+
+  static constexpr int max_bands = 4;
+
+  Meter(std::uint32_t id, Unit u)
+    : id_(id), unit_(u), nbands_(0), version_(0), state_(new State_set())
+  { }
+
+  std::uint32_t id() const   { return id_; }
+  Unit          unit() const { return unit_; }
+  int           size() const { return nbands_; }
+
+  Meter_band const& band(int n) const { return bands_[n]; }
+
+  void   add_band(Meter_band const&);
+  Result apply(Context&);
+
+  // Counters, aggregated over all workers.
+  std::uint64_t packets() const;
+  std::uint64_t bytes() const;
+  std::uint64_t band_packets(int) const;
+
+private:
+  // The state of a meter owned by a single worker. Only the
+  // worker updates its counters (see bump()), but any thread may
+  // read them.
+  struct State
+  {
+    int                        shares;  // The number of workers when configured.
+    int                        version; // The band configuration when configured.
+    Token_bucket               buckets[max_bands];
+    std::atomic<std::uint64_t> packets;
+    std::atomic<std::uint64_t> bytes;
+    std::atomic<std::uint64_t> band_packets[max_bands];
+  };
+
+  using State_set = Per_worker<State>;
+
+  void configure(State&, int);
+
+  std::uint32_t id_;
+  Unit          unit_;
+  int           nbands_;
+  int           version_;
+  Meter_band    bands_[max_bands]; // Sorted by rate.
+
+  std::unique_ptr<State_set> state_;
+};
+
+
+// The meter table maps meter ids to meters.
+//
+// Meter 0 is reserved; it means that a flow is not metered.
+//
+// Workers find meters without locks. Inserting or erasing a meter
+// publishes a copy of the map, and the old map, and any erased
+// meter, are retired through RCU (see rcu.hpp). Writers are
+// serialized by a mutex.
+class Meter_table
+{
+public:
+  using Map = std::unordered_map<std::uint32_t, Meter*>;
+
+  Meter_table();
+  ~Meter_table();
+
+  Meter_table(Meter_table const&) = delete;
+  Meter_table& operator=(Meter_table const&) = delete;
+
+  Meter&       insert(std::uint32_t, Meter::Unit);
+  void         erase(std::uint32_t);
+  Meter*       find(std::uint32_t);
+  Meter const* find(std::uint32_t) const;
+
+private:
+  Map const& current() const { return *meters_.load(std::memory_order_acquire); }
+
+  std::atomic<Map*> meters_;
+  std::mutex        mutex_;
+};
+
+
+inline Meter*
+Meter_table::find(std::uint32_t id)
+{
+  Map const& m = current();
+  auto iter = m.find(id);
+  if (iter == m.end())
+    return nullptr;
+  return iter->second;
+}
+
+
+inline Meter const*
+Meter_table::find(std::uint32_t id) const
+{
+  Map const& m = current();
+  auto iter = m.find(id);
+  if (iter == m.end())
+    return nullptr;
+  return iter->second;
+}
+
+
+} // namespace fp
+
+
+#endif
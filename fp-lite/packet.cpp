@@ -1,5 +1,8 @@
 #include "packet.hpp"
 
+#include <algorithm>
+#include <cstring>
+
 namespace fp
 {
 
@@ -18,4 +21,46 @@ namespace fp
 // }
 
 
+// Copy n bytes at the given offset of the packet, which may span
+// segments, into buf. Returns the number of bytes copied, which
+// is less than n if the packet ends first.
+int
+Packet::read(int off, Byte* buf, int n) const
+{
+  int k = 0;
+  for (Packet const* p = this; p && k < n; p = p->next_) {
+    if (off >= p->len_) {
+      off -= p->len_;
+      continue;
+    }
+    int m = std::min(n - k, p->len_ - off);
+    std::memcpy(buf + k, p->buf_ + off, m);
+    k += m;
+    off = 0;
+  }
+  return k;
+}
+
+
+// Copy n bytes from buf to the given offset of the packet, which
+// may span segments. Returns the number of bytes copied, which is
+// less than n if the packet ends first.
+int
+Packet::write(int off, Byte const* buf, int n)
+{
+  int k = 0;
+  for (Packet* p = this; p && k < n; p = p->next_) {
+    if (off >= p->len_) {
+      off -= p->len_;
+      continue;
+    }
+    int m = std::min(n - k, p->len_ - off);
+    std::memcpy(p->buf_ + off, buf + k, m);
+    k += m;
+    off = 0;
+  }
+  return k;
+}
+
+
 } // end namespace fp
@@ -27,12 +27,27 @@ enum Buff_t {
 //
 // FIXME: The size of a packet's buffer is almost certainly
 // larget than its payload.
+//
+// A buffer may reserve headroom before the packet's data, so that
+// headers can be pushed onto the front of the packet by moving the
+// start of its data, rather than by moving the packet.
+//
+// A packet that is larger than its buffer (e.g., a jumbo frame)
+// continues in a chain of segments, each of which is the packet
+// of another buffer. The data, length, and capacity of a packet
+// are those of its first segment, which holds the headers; the
+// read, write, and view functions access the entire chain.
 struct Packet
 {
   Packet(Byte* b, int n)
-    : buf_(b), cap_(n), len_(0), ts_(), id_()
+    : Packet(b, n, 0)
   { }
 
+  Packet(Byte* b, int n, int room)
+    : buf_(b + room), cap_(n - room), len_(0), ts_(), id_(),
+      base_(b), room_(room), next_(nullptr)
+  { assert(0 <= room && room <= n); }
+
   template<int N>
   Packet(Byte (&buf)[N])
     : Packet(buf, N)
@@ -42,26 +57,52 @@ struct Packet
   Byte const* data() const { return buf_; }
   Byte*       data()       { return buf_; }
   
-  // Returns the total capacity of the buffer containing the packe.
+  // Returns the number of bytes from the start of the packet to the
+  // end of the buffer containing the packet.
   int capacity() const { return cap_; }
   
   // Returns the number of bytes actually in the packet. Note that length
   // must always be less than capacity.
   int length() const   { return len_; }
+
+  // Returns the number of unused bytes before and after the packet.
+  int headroom() const { return buf_ - base_; }
+  int tailroom() const { return cap_ - len_; }
+
+  // Segmentation.
+  Packet const* next() const { return next_; }
+  Packet*       next()       { return next_; }
+
+  int total_length() const;
+  int segments() const;
+
+  int         read(int, Byte*, int) const;
+  int         write(int, Byte const*, int);
+  Byte const* view(int, int, Byte*) const;
   
   // Returns the id of the packet. 
   int id()   const { return id_; }
 
+  // Returns the time of the packet's arrival, in ticks of the
+  // runtime clock (see time.hpp), or 0 if it was not stamped.
   uint64_t    timestamp() const { return ts_; }
+  void        stamp(uint64_t t) { ts_ = t; }
 
   void limit(int n);
 
+  Byte* push(int n);
+  Byte* pull(int n);
+  void  reset();
+
   // Data members.
   Byte*     buf_;        // Packet buffer.
-  int       cap_;        // Total buffer size.
+  int       cap_;        // Bytes from buf_ to the end of the buffer.
   int       len_;        // Total bytes in the packet.
   uint64_t  ts_;  // Time of packet arrival.
   int       id_;         // The packet id.
+  Byte*     base_;       // The start of the buffer.
+  int       room_;       // The headroom reserved for each packet.
+  Packet*   next_;       // The next segment, if any.
 };
 
 
@@ -74,6 +115,88 @@ Packet::limit(int n)
 }
 
 
+// Returns the number of bytes in all segments of the packet.
+inline int
+Packet::total_length() const
+{
+  int n = 0;
+  for (Packet const* p = this; p; p = p->next_)
+    n += p->len_;
+  return n;
+}
+
+
+// Returns the number of segments in the packet.
+inline int
+Packet::segments() const
+{
+  int n = 0;
+  for (Packet const* p = this; p; p = p->next_)
+    ++n;
+  return n;
+}
+
+
+// Returns a pointer to n contiguous bytes at the given offset of
+// the packet. If the bytes span segments, they are copied into
+// the buffer, whose address is returned. Returns nullptr if the
+// packet has fewer bytes.
+inline Byte const*
+Packet::view(int off, int n, Byte* buf) const
+{
+  if (off + n <= len_)
+    return buf_ + off;
+  return read(off, buf, n) == n ? buf : nullptr;
+}
+
+
+// Add n bytes to the front of the packet, and return a pointer
+// to them. If there is not enough headroom, the packet is moved
+// toward the end of its buffer. Returns nullptr if the buffer
+// cannot hold the larger packet.
+inline Byte*
+Packet::push(int n)
+{
+  assert(n >= 0);
+  if (headroom() < n) {
+    if (headroom() + tailroom() < n)
+      return nullptr;
+    std::copy_backward(buf_, buf_ + len_, base_ + n + len_);
+    cap_ += headroom();
+    buf_ = base_;
+  } else {
+    buf_ -= n;
+    cap_ += n;
+  }
+  len_ += n;
+  return buf_;
+}
+
+
+// Remove n bytes from the front of the packet. Returns a pointer
+// to the new start of the packet.
+inline Byte*
+Packet::pull(int n)
+{
+  assert(0 <= n && n <= len_);
+  buf_ += n;
+  cap_ -= n;
+  len_ -= n;
+  return buf_;
+}
+
+
+// Empty the packet, restoring the headroom reserved by its buffer.
+inline void
+Packet::reset()
+{
+  cap_ += buf_ - (base_ + room_);
+  buf_ = base_ + room_;
+  len_ = 0;
+  ts_ = 0;
+}
+
+
 // Packet* packet_create(Byte*, int, uint64_t, void*, Buff_t);
 
 } // namespace fp
@@ -0,0 +1,382 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#include "parser.hpp"
+#include "context.hpp"
+
+#include <string>
+
+
+namespace fp
+{
+
+namespace
+{
+
+// Well known ethertypes, IP protocols, and ports.
+constexpr std::uint16_t eth_ipv4   = 0x0800;
+constexpr std::uint16_t eth_ipv6   = 0x86dd;
+constexpr std::uint16_t eth_vlan   = 0x8100;
+constexpr std::uint16_t eth_qinq   = 0x88a8;
+constexpr std::uint16_t eth_mpls   = 0x8847;
+constexpr std::uint16_t eth_mplsm  = 0x8848;
+constexpr std::uint16_t eth_bridge = 0x6558; // Transparent bridging.
+
+constexpr std::uint8_t ip_hopopt  = 0;
+constexpr std::uint8_t ip_tcp     = 6;
+constexpr std::uint8_t ip_udp     = 17;
+constexpr std::uint8_t ip_route   = 43;
+constexpr std::uint8_t ip_frag    = 44;
+constexpr std::uint8_t ip_gre     = 47;
+constexpr std::uint8_t ip_dstopts = 60;
+
+constexpr std::uint16_t vxlan_port = 4789;
+
+
+// The location of each protocol field.
+Field_info const fields[num_protocol_fields] = {
+  {ETHERNET, 0, 6},  // ETH_DST
+  {ETHERNET, 6, 6},  // ETH_SRC
+  {ETHERNET, 12, 2}, // ETH_TYPE
+  {VLAN, 0, 2},      // VLAN_TCI
+  {VLAN, 2, 2},      // VLAN_TYPE
+  {MPLS, 0, 4},      // MPLS_LSE
+  {IPV4, 1, 1},      // IPV4_TOS
+  {IPV4, 2, 2},      // IPV4_LENGTH
+  {IPV4, 4, 2},      // IPV4_ID
+  {IPV4, 6, 2},      // IPV4_FRAG
+  {IPV4, 8, 1},      // IPV4_TTL
+  {IPV4, 9, 1},      // IPV4_PROTO
+  {IPV4, 10, 2},     // IPV4_CHECKSUM
+  {IPV4, 12, 4},     // IPV4_SRC
+  {IPV4, 16, 4},     // IPV4_DST
+  {IPV6, 0, 4},      // IPV6_VTC_FLOW
+  {IPV6, 4, 2},      // IPV6_LENGTH
+  {IPV6, 6, 1},      // IPV6_NEXT
+  {IPV6, 7, 1},      // IPV6_HOP_LIMIT
+  {IPV6, 8, 16},     // IPV6_SRC
+  {IPV6, 24, 16},    // IPV6_DST
+  {TCP, 0, 2},       // TCP_SRC
+  {TCP, 2, 2},       // TCP_DST
+  {TCP, 4, 4},       // TCP_SEQ
+  {TCP, 8, 4},       // TCP_ACK
+  {TCP, 13, 1},      // TCP_FLAGS
+  {TCP, 14, 2},      // TCP_WINDOW
+  {UDP, 0, 2},       // UDP_SRC
+  {UDP, 2, 2},       // UDP_DST
+  {UDP, 4, 2},       // UDP_LENGTH
+  {UDP, 6, 2},       // UDP_CHECKSUM
+  {VXLAN, 0, 1},     // VXLAN_FLAGS
+  {VXLAN, 4, 3},     // VXLAN_VNI
+  {GRE, 0, 2},       // GRE_FLAGS
+  {GRE, 2, 2},       // GRE_PROTO
+};
+
+
+constexpr std::uint32_t
+bit(int p)
+{
+  return std::uint32_t(1) << p;
+}
+
+
+// The protocols that may have to be decoded in order to reach
+// each protocol.
+constexpr std::uint32_t l2 = bit(ETHERNET) | bit(VLAN) | bit(MPLS);
+constexpr std::uint32_t l3 = l2 | bit(IPV4) | bit(IPV6);
+
+std::uint32_t const ancestors[num_protocols] = {
+  0,                 // ETHERNET
+  bit(ETHERNET),     // VLAN
+  l2,                // MPLS
+  l2,                // IPV4
+  l2,                // IPV6
+  l3,                // TCP
+  l3,                // UDP
+  l3 | bit(UDP),     // VXLAN
+  l3,                // GRE
+};
+
+
+// Bounds the number of headers decoded, including those of
+// encapsulated frames.
+constexpr int max_depth = Header_stack::max_headers;
+
+
+inline std::uint16_t
+load16(Byte const* p)
+{
+  return std::uint16_t(p[0]) << 8 | p[1];
+}
+
+
+// Note that the decision for the packet depends on the given
+// bytes, which determine how the packet is decoded.
+inline void
+read(Context& cxt, int off, int n)
+{
+  if (cxt.record_.active)
+    cxt.record_.access(off, n);
+}
+
+
+// Returns the protocol identified by an ethertype, or -1 if it
+// is not decoded.
+inline int
+ethertype_protocol(std::uint16_t type)
+{
+  switch (type) {
+    case eth_vlan:
+    case eth_qinq: return VLAN;
+    case eth_mpls:
+    case eth_mplsm: return MPLS;
+    case eth_ipv4: return IPV4;
+    case eth_ipv6: return IPV6;
+    default: return -1;
+  }
+}
+
+
+// Returns the protocol identified by an IP protocol number, or
+// -1 if it is not decoded.
+inline int
+ip_protocol(std::uint8_t proto)
+{
+  switch (proto) {
+    case ip_tcp: return TCP;
+    case ip_udp: return UDP;
+    case ip_gre: return GRE;
+    default: return -1;
+  }
+}
+
+
+// Decode the header of the given protocol at the given offset.
+// Returns the length of the header, or -1 if the header is
+// truncated or malformed, and stores the protocol of the next
+// header, or -1 if there is none, in next.
+int
+decode(Context& cxt, int proto, int off, int& next)
+{
+  Byte const* p = cxt.packet().data();
+  int len = cxt.packet().length();
+  switch (proto) {
+    case ETHERNET:
+      if (off + 14 > len)
+        return -1;
+      read(cxt, off + 12, 2);
+      next = ethertype_protocol(load16(p + off + 12));
+      return 14;
+
+    case VLAN:
+      if (off + 4 > len)
+        return -1;
+      read(cxt, off + 2, 2);
+      next = ethertype_protocol(load16(p + off + 2));
+      return 4;
+
+    // The payload of the last label is identified by its IP
+    // version.
+    case MPLS:
+      if (off + 5 > len)
+        return -1;
+      read(cxt, off + 2, 1);
+      if (!(p[off + 2] & 0x01)) {
+        next = MPLS;
+        return 4;
+      }
+      read(cxt, off + 4, 1);
+      if ((p[off + 4] >> 4) == 4)
+        next = IPV4;
+      else if ((p[off + 4] >> 4) == 6)
+        next = IPV6;
+      return 4;
+
+    // Only the first fragment carries the transport header.
+    case IPV4: {
+      if (off + 20 > len)
+        return -1;
+      read(cxt, off, 1);
+      int n = (p[off] & 0x0f) * 4;
+      if (n < 20)
+        return -1;
+      read(cxt, off + 6, 4);
+      if ((load16(p + off + 6) & 0x1fff) == 0)
+        next = ip_protocol(p[off + 9]);
+      return n;
+    }
+
+    // Extension headers are included in the IPv6 header.
+    case IPV6: {
+      int n = 40;
+      if (off + n > len)
+        return -1;
+      read(cxt, off + 6, 1);
+      std::uint8_t nh = p[off + 6];
+      bool first = true;
+      while (nh == ip_hopopt || nh == ip_route || nh == ip_dstopts || nh == ip_frag) {
+        if (off + n + 8 > len)
+          return -1;
+        read(cxt, off + n, 4);
+        if (nh == ip_frag) {
+          first = !(load16(p + off + n + 2) & 0xfff8);
+          nh = p[off + n];
+          n += 8;
+        } else {
+          nh = p[off + n];
+          n += (p[off + n + 1] + 1) * 8;
+        }
+      }
+      if (first)
+        next = ip_protocol(nh);
+      return n;
+    }
+
+    case TCP: {
+      if (off + 20 > len)
+        return -1;
+      read(cxt, off + 12, 1);
+      int n = (p[off + 12] >> 4) * 4;
+      return n < 20 ? -1 : n;
+    }
+
+    case UDP:
+      if (off + 8 > len)
+        return -1;
+      read(cxt, off + 2, 2);
+      if (load16(p + off + 2) == vxlan_port)
+        next = VXLAN;
+      return 8;
+
+    case VXLAN:
+      next = ETHERNET;
+      return 8;
+
+    // The optional checksum, key, and sequence number follow
+    // the base header.
+    case GRE: {
+      if (off + 4 > len)
+        return -1;
+      read(cxt, off, 4);
+      std::uint16_t flags = load16(p + off);
+      std::uint16_t type = load16(p + off + 2);
+      next = type == eth_bridge ? ETHERNET : ethertype_protocol(type);
+      return 4 + (flags & 0x8000 ? 4 : 0) + (flags & 0x2000 ? 4 : 0) + (flags & 0x1000 ? 4 : 0);
+    }
+
+    default:
+      return -1;
+  }
+}
+
+
+} // namespace
+
+
+// Returns the location of the given protocol field.
+Field_info const&
+protocol_field(int f)
+{
+  if (f < 0 || f >= num_protocol_fields)
+    throw std::string("Invalid protocol field");
+  return fields[f];
+}
+
+
+Parse_graph::Parse_graph()
+  : reach_(0)
+{
+  for (int& h : headers_)
+    h = -1;
+}
+
+
+// Decode the given protocol and those needed to reach it.
+void
+Parse_graph::reach(int p)
+{
+  reach_ |= bit(p) | ancestors[p];
+}
+
+
+// Bind headers of the given protocol to the identifier.
+void
+Parse_graph::declare_header(int id, int p)
+{
+  if (id < 0 || id >= Environment::max_fields)
+    throw std::string("Invalid header identifier");
+  if (p < 0 || p >= num_protocols)
+    throw std::string("Invalid protocol");
+  headers_[p] = id;
+  reach(p);
+}
+
+
+// Bind the given protocol field to the identifier.
+void
+Parse_graph::declare_field(int id, int f)
+{
+  if (id < 0 || id >= Environment::max_fields)
+    throw std::string("Invalid field identifier");
+  Field_info const& info = protocol_field(f);
+  fields_[info.protocol].push_back({
+    std::uint8_t(id),
+    info.offset,
+    info.length
+  });
+  reach(info.protocol);
+}
+
+
+// Bind a header of n bytes at the given offset, and its
+// declared fields. Bindings beyond the capacity of a binding
+// list are discarded. Fields are not recorded as read; only the
+// bytes that steer decoding (see read) and those the application
+// reads belong to the forwarding decision's key.
+inline void
+Parse_graph::bind(Context& cxt, int p, int off, int n) const
+{
+  Decoding_info& d = cxt.decode_;
+  if (!d.stack.is_full())
+    d.stack.push(p, off);
+  int h = headers_[p];
+  if (h >= 0 && !d.hdrs[h].is_full())
+    d.hdrs.push(h, Binding(off, n));
+  for (Field_binding const& f : fields_[p]) {
+    if (!d.flds[f.id].is_full())
+      cxt.bind_field(f.id, off + f.offset, f.length);
+  }
+}
+
+
+// Decode the headers of the context's packet and bind declared
+// headers and fields at their absolute offsets.
+//
+// Returns false if a header that must be decoded is truncated.
+// Headers preceding it are still bound. The decision for a
+// truncated packet is not cached, since the cache keys do not
+// include the packet length.
+bool
+Parse_graph::parse(Context& cxt) const
+{
+  int len = cxt.packet().length();
+  int off = 0;
+  int proto = ETHERNET;
+  for (int depth = 0; depth < max_depth; ++depth) {
+    if (proto < 0 || !(reach_ & bit(proto)))
+      return true;
+    int next = -1;
+    int n = decode(cxt, proto, off, next);
+    if (n < 0 || off + n > len) {
+      cxt.no_cache();
+      return false;
+    }
+    bind(cxt, proto, off, n);
+    off += n;
+    proto = next;
+  }
+  return true;
+}
+
+
+} // namespace fp
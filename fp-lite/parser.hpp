@@ -0,0 +1,140 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#ifndef FP_PARSER_HPP
+#define FP_PARSER_HPP
+
+#include "types.hpp"
+
+#include <cstdint>
+#include <vector>
+
+
+namespace fp
+{
+
+class Context;
+
+
+// The protocols known to the runtime parser.
+enum Protocol
+{
+  ETHERNET,
+  VLAN,
+  MPLS,
+  IPV4,
+  IPV6,
+  TCP,
+  UDP,
+  VXLAN,
+  GRE,
+  num_protocols
+};
+
+
+// The protocol fields known to the runtime parser. Multi-byte
+// fields are in network byte order within the packet.
+enum Protocol_field
+{
+  ETH_DST,
+  ETH_SRC,
+  ETH_TYPE,
+  VLAN_TCI,
+  VLAN_TYPE,
+  MPLS_LSE,     // The entire label stack entry.
+  IPV4_TOS,
+  IPV4_LENGTH,
+  IPV4_ID,
+  IPV4_FRAG,
+  IPV4_TTL,
+  IPV4_PROTO,
+  IPV4_CHECKSUM,
+  IPV4_SRC,
+  IPV4_DST,
+  IPV6_VTC_FLOW, // Version, traffic class, and flow label.
+  IPV6_LENGTH,
+  IPV6_NEXT,
+  IPV6_HOP_LIMIT,
+  IPV6_SRC,
+  IPV6_DST,
+  TCP_SRC,
+  TCP_DST,
+  TCP_SEQ,
+  TCP_ACK,
+  TCP_FLAGS,
+  TCP_WINDOW,
+  UDP_SRC,
+  UDP_DST,
+  UDP_LENGTH,
+  UDP_CHECKSUM,
+  VXLAN_FLAGS,
+  VXLAN_VNI,
+  GRE_FLAGS,
+  GRE_PROTO,
+  num_protocol_fields
+};
+
+
+// The location of a protocol field within its header.
+struct Field_info
+{
+  std::uint8_t protocol;
+  std::uint8_t offset;
+  std::uint8_t length;
+};
+
+
+Field_info const& protocol_field(int);
+
+
+// A parse graph decodes the headers of a packet and binds the
+// headers and fields declared by the dataplane's applications.
+//
+// The graph is specialized to the declarations: decoding stops
+// at the first header beyond those needed to reach a declared
+// protocol, so an application that only matches Ethernet
+// addresses never examines the network header. Each header is
+// checked against the length of the packet before any of its
+// fields are bound.
+//
+// Encapsulated frames (VXLAN and GRE) are decoded when the
+// tunnel protocol is declared. Fields of an inner header are
+// bound over those of the outer header, so that the innermost
+// binding is the top of each binding list.
+//
+// A graph is immutable once published to workers; declaring a
+// header or field publishes a new graph (see Dataplane).
+class Parse_graph
+{
+public:
+  Parse_graph();
+
+  void declare_header(int, int);
+  void declare_field(int, int);
+
+  bool parse(Context&) const;
+
+  // Returns the set of protocols that are decoded.
+  std::uint32_t protocols() const { return reach_; }
+
+private:
+  struct Field_binding
+  {
+    std::uint8_t id;
+    std::uint8_t offset;
+    std::uint8_t length;
+  };
+
+  void reach(int);
+  void bind(Context&, int, int, int) const;
+
+  std::uint32_t              reach_;
+  int                        headers_[num_protocols]; // Ids, or -1.
+  std::vector<Field_binding> fields_[num_protocols];
+};
+
+
+} // namespace fp
+
+
+#endif
@@ -0,0 +1,126 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#include "pcapng.hpp"
+#include "time.hpp"
+
+#include <cstring>
+
+
+namespace fp
+{
+
+namespace
+{
+
+// Appends the bytes of a value to a block.
+template<typename T>
+inline void
+put(std::string& b, T v)
+{
+  b.append(reinterpret_cast<char const*>(&v), sizeof(v));
+}
+
+
+// Pads a block to a multiple of 4 bytes.
+inline void
+pad(std::string& b)
+{
+  b.append((4 - b.size() % 4) % 4, '\0');
+}
+
+
+// Completes the block that starts at the given offset. Its length
+// is stored after its type, and again at its end.
+inline void
+finish(std::string& b, std::size_t start)
+{
+  std::uint32_t n = b.size() - start + 4;
+  std::memcpy(&b[start + 4], &n, 4);
+  put(b, n);
+}
+
+
+} // namespace
+
+
+Pcapng_clock::Pcapng_clock()
+{
+  timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  wall_ = std::uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  ticks_ = Time::current();
+}
+
+
+// Returns the wall clock time of a timestamp, in nanoseconds since
+// the epoch.
+std::uint64_t
+Pcapng_clock::nanoseconds(std::uint64_t t) const
+{
+  if (t >= ticks_)
+    return wall_ + Time::to_nanoseconds(t - ticks_);
+  return wall_ - Time::to_nanoseconds(ticks_ - t);
+}
+
+
+// Append the section header, and an Ethernet interface that keeps
+// up to n bytes of each packet.
+void
+pcapng_header(std::string& b, int n)
+{
+  std::size_t start = b.size();
+  put<std::uint32_t>(b, 0x0a0d0d0a);
+  put<std::uint32_t>(b, 0);
+  put<std::uint32_t>(b, 0x1a2b3c4d);
+  put<std::uint16_t>(b, 1);
+  put<std::uint16_t>(b, 0);
+  put<std::int64_t>(b, -1);
+  finish(b, start);
+
+  // The interface has timestamps in nanoseconds (if_tsresol 9).
+  start = b.size();
+  put<std::uint32_t>(b, 1);
+  put<std::uint32_t>(b, 0);
+  put<std::uint16_t>(b, 1);
+  put<std::uint16_t>(b, 0);
+  put<std::uint32_t>(b, n);
+  put<std::uint16_t>(b, 9);
+  put<std::uint16_t>(b, 1);
+  put<std::uint8_t>(b, 9);
+  pad(b);
+  put<std::uint32_t>(b, 0);
+  finish(b, start);
+}
+
+
+// Append an enhanced packet block for a packet received at the
+// given time (in ns since the epoch), of which the first bytes
+// were captured. The comment may be null.
+void
+pcapng_packet(std::string& b, std::uint64_t ns, void const* data,
+              std::uint32_t captured, std::uint32_t length, char const* comment)
+{
+  std::size_t start = b.size();
+  put<std::uint32_t>(b, 6);
+  put<std::uint32_t>(b, 0);
+  put<std::uint32_t>(b, 0);
+  put<std::uint32_t>(b, ns >> 32);
+  put<std::uint32_t>(b, ns);
+  put<std::uint32_t>(b, captured);
+  put<std::uint32_t>(b, length);
+  b.append(static_cast<char const*>(data), captured);
+  pad(b);
+  if (comment) {
+    std::uint16_t n = std::strlen(comment);
+    put<std::uint16_t>(b, 1);
+    put<std::uint16_t>(b, n);
+    b.append(comment, n);
+    pad(b);
+    put<std::uint32_t>(b, 0);
+  }
+  finish(b, start);
+}
+
+
+} // namespace fp
@@ -0,0 +1,44 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#ifndef FP_PCAPNG_HPP
+#define FP_PCAPNG_HPP
+
+// Writers for the blocks of a pcapng file, for the captures kept
+// by the runtime (see drop.hpp and sample.hpp). A capture is a
+// section header and a single Ethernet interface, with timestamps
+// in nanoseconds since the epoch, followed by a block for each
+// packet. Each packet may have a comment, which is shown by most
+// readers (e.g., as frame.comment in tshark).
+
+#include <cstdint>
+#include <string>
+
+
+namespace fp
+{
+
+// Converts clock ticks (see time.hpp) to wall clock time. The
+// clocks are related when the converter is created.
+class Pcapng_clock
+{
+public:
+  Pcapng_clock();
+
+  std::uint64_t nanoseconds(std::uint64_t) const;
+
+private:
+  std::uint64_t wall_;  // Wall clock time, in ns.
+  std::uint64_t ticks_; // Clock ticks at the same time.
+};
+
+
+void pcapng_header(std::string&, int);
+void pcapng_packet(std::string&, std::uint64_t, void const*, std::uint32_t,
+                   std::uint32_t, char const*);
+
+
+} // namespace fp
+
+
+#endif
@@ -0,0 +1,194 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#include "perf.hpp"
+
+#include <cstring>
+
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#  include <x86intrin.h>
+#endif
+
+
+namespace fp
+{
+
+namespace
+{
+
+// The perf configuration of each event.
+constexpr std::uint64_t event_configs[num_perf_events] = {
+  PERF_COUNT_HW_CPU_CYCLES,
+  PERF_COUNT_HW_INSTRUCTIONS,
+  PERF_COUNT_HW_CACHE_MISSES,
+  PERF_COUNT_HW_BRANCH_MISSES
+};
+
+
+// Open a hardware event counting the calling thread on any CPU,
+// in the group of the given leader (or as a leader if -1).
+int
+open_event(std::uint64_t config, int group, bool kernel)
+{
+  perf_event_attr attr;
+  std::memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = config;
+  attr.read_format = PERF_FORMAT_GROUP;
+  attr.exclude_kernel = !kernel;
+  attr.exclude_hv = 1;
+  return ::syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+
+#if defined(__x86_64__)
+// Read the counter of an event from its mapped page, without a
+// system call. The kernel updates the page when the event is
+// scheduled, so the read is retried if the sequence changes.
+std::uint64_t
+read_page(perf_event_mmap_page const volatile* pc)
+{
+  std::uint32_t seq;
+  std::uint64_t count;
+  do {
+    seq = pc->lock;
+    asm volatile("" ::: "memory");
+    count = pc->offset;
+    if (std::uint32_t idx = pc->index) {
+      std::uint64_t pmc = __rdpmc(idx - 1);
+      int shift = 64 - pc->pmc_width;
+      count += std::int64_t(pmc << shift) >> shift;
+    }
+    asm volatile("" ::: "memory");
+  } while (pc->lock != seq);
+  return count;
+}
+#endif
+
+
+} // namespace
+
+
+// Open the counters of the calling thread. Kernel events are
+// counted only if they can be.
+Perf_counters::Perf_counters()
+  : leader_(-1), size_(0), rdpmc_(false), kernel_(false)
+{
+  auto clear = [](Perf_totals& t) {
+    t.packets.store(0, std::memory_order_relaxed);
+    for (auto& e : t.events)
+      e.store(0, std::memory_order_relaxed);
+  };
+  for (Perf_totals& t : stages)
+    clear(t);
+  for (Perf_totals& t : applications)
+    clear(t);
+  for (int i = 0; i < num_perf_events; ++i) {
+    fds_[i] = -1;
+    pages_[i] = nullptr;
+  }
+  if (!open(true))
+    open(false);
+}
+
+
+Perf_counters::~Perf_counters()
+{
+  close();
+}
+
+
+// Open the events, as a group led by the first that can be opened.
+// Events that cannot be opened are not counted. Returns false if
+// none can be opened.
+bool
+Perf_counters::open(bool kernel)
+{
+  for (int i = 0; i < num_perf_events; ++i) {
+    int fd = open_event(event_configs[i], leader_, kernel);
+    if (fd < 0)
+      continue;
+    if (leader_ < 0)
+      leader_ = fd;
+    fds_[i] = fd;
+    order_[size_++] = i;
+  }
+  if (leader_ < 0)
+    return false;
+  kernel_ = kernel;
+
+#if defined(__x86_64__)
+  // Use rdpmc only if every event allows it.
+  long page = ::sysconf(_SC_PAGESIZE);
+  rdpmc_ = true;
+  for (int i = 0; i < num_perf_events; ++i) {
+    if (fds_[i] < 0)
+      continue;
+    void* p = ::mmap(nullptr, page, PROT_READ, MAP_SHARED, fds_[i], 0);
+    if (p == MAP_FAILED) {
+      rdpmc_ = false;
+      continue;
+    }
+    pages_[i] = p;
+    if (!static_cast<perf_event_mmap_page*>(p)->cap_user_rdpmc)
+      rdpmc_ = false;
+  }
+#endif
+  return true;
+}
+
+
+void
+Perf_counters::close()
+{
+  long page = ::sysconf(_SC_PAGESIZE);
+  for (int i = 0; i < num_perf_events; ++i) {
+    if (pages_[i])
+      ::munmap(pages_[i], page);
+    if (fds_[i] >= 0 && fds_[i] != leader_)
+      ::close(fds_[i]);
+  }
+  if (leader_ >= 0)
+    ::close(leader_);
+}
+
+
+// Returns the current counts of the calling thread's events. Events
+// that are not counted read as 0. This must be called by the thread
+// that opened the counters.
+Perf_sample
+Perf_counters::read() const
+{
+  Perf_sample s;
+  std::memset(&s, 0, sizeof(s));
+  if (!available())
+    return s;
+
+#if defined(__x86_64__)
+  if (rdpmc_) {
+    for (int i = 0; i < num_perf_events; ++i)
+      if (pages_[i])
+        s.events[i] = read_page(static_cast<perf_event_mmap_page const*>(pages_[i]));
+    return s;
+  }
+#endif
+
+  // The group is read as the number of events, followed by their
+  // values in the order they were opened.
+  std::uint64_t buf[num_perf_events + 1];
+  ssize_t n = ::read(leader_, buf, sizeof(buf));
+  if (n < ssize_t(sizeof(std::uint64_t) * (size_ + 1)))
+    return s;
+  for (int i = 0; i < size_; ++i)
+    s.events[order_[i]] = buf[i + 1];
+  return s;
+}
+
+
+} // namespace fp
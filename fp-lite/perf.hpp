@@ -0,0 +1,141 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#ifndef FP_PERF_HPP
+#define FP_PERF_HPP
+
+#include <atomic>
+#include <cstdint>
+
+
+namespace fp
+{
+
+// The hardware events counted for each worker.
+enum Perf_event
+{
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_LLC_MISSES,
+  PERF_BRANCH_MISSES,
+  num_perf_events
+};
+
+
+// The stages of the pipeline to which events are attributed. A
+// packet is received by its port, classified by the flow caches,
+// processed by the application chain, has its actions applied,
+// and is sent by the egress scheduler of its output port.
+enum Perf_stage
+{
+  PERF_INGRESS,
+  PERF_CLASSIFY,
+  PERF_PROCESS,
+  PERF_ACTIONS,
+  PERF_EGRESS,
+  num_perf_stages
+};
+
+
+// Events are also attributed to the process calls of each of the
+// first max_perf_applications stages of the application chain.
+constexpr int max_perf_applications = 8;
+
+
+// A reading of each event's counter.
+struct Perf_sample
+{
+  std::uint64_t events[num_perf_events];
+};
+
+
+// The events counted during a stage, and the number of packets
+// that passed through it. Totals are updated only by their
+// worker (see bump()), and may be read by any thread.
+struct Perf_totals
+{
+  std::atomic<std::uint64_t> packets;
+  std::atomic<std::uint64_t> events[num_perf_events];
+};
+
+
+// The performance counters of one worker thread. The counters are
+// opened with perf_event_open(2) by the thread that constructs the
+// object, and count only that thread. The events that can be opened
+// are counted in user space, and also in the kernel if permitted
+// (see perf_event_paranoid), so that the cost of system calls made
+// by ports is included.
+//
+// Counters are read with rdpmc where the kernel allows it, and with
+// a single read(2) of the event group otherwise. A stage is measured
+// by taking a sample before it and recording the difference after
+// it:
+//
+//    Perf_sample s = pc->read();
+//    ... // The stage.
+//    s = pc->record(pc->stages[PERF_CLASSIFY], s, n);
+//
+// The returned sample starts the next stage. If no event could be
+// opened (e.g., in a virtual machine without a PMU), nothing is
+// recorded.
+//
+// Counters are used only if the runtime is built with FP_PERF (see
+// the FREEFLOW_PERF option).
+class Perf_counters
+{
+public:
+  Perf_counters();
+  ~Perf_counters();
+
+  Perf_counters(Perf_counters const&) = delete;
+  Perf_counters& operator=(Perf_counters const&) = delete;
+
+  // Returns true if any event is counted, or the given event.
+  bool available() const                 { return leader_ >= 0; }
+  bool available(Perf_event e) const     { return fds_[e] >= 0; }
+
+  // Returns true if events in the kernel are counted.
+  bool kernel() const { return kernel_; }
+
+  Perf_sample read() const;
+  Perf_sample record(Perf_totals&, Perf_sample const&, std::uint64_t);
+
+  Perf_totals stages[num_perf_stages];
+  Perf_totals applications[max_perf_applications];
+
+private:
+  bool open(bool);
+  void close();
+
+  int   leader_;
+  int   fds_[num_perf_events];
+  int   order_[num_perf_events];
+  int   size_;
+  void* pages_[num_perf_events];
+  bool  rdpmc_;
+  bool  kernel_;
+};
+
+
+// Add the events since a previous sample, and n packets, to the
+// totals. Returns the current sample.
+inline Perf_sample
+Perf_counters::record(Perf_totals& t, Perf_sample const& from, std::uint64_t n)
+{
+  if (!available())
+    return from;
+  Perf_sample now = read();
+  auto bump = [](std::atomic<std::uint64_t>& c, std::uint64_t k) {
+    c.store(c.load(std::memory_order_relaxed) + k, std::memory_order_relaxed);
+  };
+  bump(t.packets, n);
+  for (int i = 0; i < num_perf_events; ++i)
+    bump(t.events[i], now.events[i] - from.events[i]);
+  return now;
+}
+
+
+} // namespace fp
+
+
+#endif
@@ -3,7 +3,12 @@
 #define FP_PORT_HPP
 
 #include "context.hpp"
+#include "egress.hpp"
+#include "worker.hpp"
 
+#include <atomic>
+
+#include <memory>
 #include <string>
 
 
@@ -46,13 +51,31 @@ public:
     bool live      : 1;
   };
 
-  // Port statistics.
+  // Port statistics, summed over all threads.
   struct Statistics
   {
     uint64_t packets_rx;
     uint64_t packets_tx;
     uint64_t bytes_rx;
     uint64_t bytes_tx;
+    uint64_t short_reads; // Reads that returned part of a frame.
+    uint64_t eagains;     // Reads and writes that would have blocked.
+    uint64_t drops[num_drop_reasons]; // Drops at the port, by reason.
+  };
+
+  // The statistics counted by one thread. A port's receive and send
+  // paths usually run on different threads, so each thread counts
+  // into its own shard (see bump()), and shards are summed when the
+  // statistics are read.
+  struct Counters
+  {
+    std::atomic<uint64_t> packets_rx;
+    std::atomic<uint64_t> packets_tx;
+    std::atomic<uint64_t> bytes_rx;
+    std::atomic<uint64_t> bytes_tx;
+    std::atomic<uint64_t> short_reads;
+    std::atomic<uint64_t> eagains;
+    std::atomic<uint64_t> drops[num_drop_reasons];
   };
 
   // Ctor/Dtor.
@@ -85,22 +108,39 @@ public:
   // Accessors.
   Id          id() const    { return id_; }
   Label       name() const  { return name_; }
-  Statistics  stats() const { return stats_; }
+  Statistics  stats() const;
+
+  // Returns the calling thread's statistics shard.
+  Counters& counters() { return stats_->local(); }
+
+  // Count a packet dropped by or on behalf of the port. The drop
+  // is also recorded by the dataplane (see drop.hpp).
+  void count_drop(Context&, Drop_reason);
+
+  void clear_stats();
+
+  // Returns the port's egress queues, or nullptr if packets
+  // are sent directly by the thread that processes them.
+  Egress_queue_set* queues() const { return queues_.get(); }
+  Egress_queue_set& enable_queues();
 
 protected:
   Id              id_;        // The internal port ID.
   Address         addr_;      // The hardware address for the port.
   Label           name_;      // The name of the port.
-  Statistics      stats_;     // Statistical information about the port.
+  // Statistical information about the port, sharded by thread.
+  std::unique_ptr<Per_worker<Counters>> stats_;
   Configuration   config_;    // The current port configuration.
   State           state_;     // The runtime state of the port.
+
+  std::unique_ptr<Egress_queue_set> queues_; // Egress queues, if any.
 };
 
 
 // Port constructor that sets ID.
 inline
 Port::Port(Port::Id id, std::string const& name)
-  : id_(id), name_(name), stats_(), config_(), state_()
+  : id_(id), name_(name), stats_(new Per_worker<Counters>()), config_(), state_()
 { }
 
 
@@ -110,6 +150,68 @@ Port::~Port()
 { }
 
 
+// Returns the port's statistics, summed over the shards of all
+// threads. Counters are read while they are updated, so the sum
+// is not an atomic snapshot.
+inline Port::Statistics
+Port::stats() const
+{
+  auto get = [](std::atomic<uint64_t> const& c) {
+    return c.load(std::memory_order_relaxed);
+  };
+  Statistics s = Statistics();
+  int n = worker_count();
+  for (int i = 0; i < n; ++i) {
+    Counters const& c = (*stats_)[i];
+    s.packets_rx += get(c.packets_rx);
+    s.packets_tx += get(c.packets_tx);
+    s.bytes_rx += get(c.bytes_rx);
+    s.bytes_tx += get(c.bytes_tx);
+    s.short_reads += get(c.short_reads);
+    s.eagains += get(c.eagains);
+    for (int r = 0; r < num_drop_reasons; ++r)
+      s.drops[r] += get(c.drops[r]);
+  }
+  return s;
+}
+
+
+inline void
+Port::count_drop(Context& cxt, Drop_reason r)
+{
+  bump(counters().drops[r]);
+  record_drop(cxt, r, id_);
+}
+
+
+// Reset the port's statistics. This should not be called while
+// the port is sending or receiving, since concurrent counts may
+// be lost.
+inline void
+Port::clear_stats()
+{
+  for (int i = 0; i < max_workers; ++i) {
+    Counters& c = (*stats_)[i];
+    for (auto* k : {&c.packets_rx, &c.packets_tx, &c.bytes_rx, &c.bytes_tx,
+                    &c.short_reads, &c.eagains})
+      k->store(0, std::memory_order_relaxed);
+    for (auto& k : c.drops)
+      k.store(0, std::memory_order_relaxed);
+  }
+}
+
+
+// Create the port's egress queue set, if it does not exist,
+// and return it. The new set has a single best-effort queue.
+inline Egress_queue_set&
+Port::enable_queues()
+{
+  if (!queues_)
+    queues_.reset(new Egress_queue_set());
+  return *queues_;
+}
+
+
 // Changes the port configuration to 'up'.
 inline void
 Port::up()
@@ -117,7 +219,7 @@ Port::up()
   config_.down = false;
 
   // FIXME: Actually reset stats?
-  stats_ = Statistics();
+  clear_stats();
 }
 
 
@@ -48,9 +48,12 @@ Port_drop::close()
 }
 
 
+// Count the packet as dropped, for the reason recorded in its
+// context.
 inline bool
-Port_drop::send(Context&)
+Port_drop::send(Context& cxt)
 {
+  count_drop(cxt, cxt.drop_reason());
   return true;
 }
 
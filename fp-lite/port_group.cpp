@@ -0,0 +1,7 @@
+
+#include "port_group.hpp"
+
+namespace fp
+{
+
+} // namespace fp
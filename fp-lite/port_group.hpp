@@ -0,0 +1,69 @@
+#ifndef FP_PORT_GROUP_HPP
+#define FP_PORT_GROUP_HPP
+
+#include "port.hpp"
+#include "group.hpp"
+
+namespace fp
+{
+
+class Context;
+
+
+// Represents the virtual "group" port. Packets sent to the
+// group port are replicated to the buckets of the all group
+// selected by the context. This allows a replicated packet to
+// pass through the pipeline exactly once.
+//
+// The id for this port is within the range of reserved
+// ports, but is an extension of what OpenFlow traditionally
+// considers to be valid.
+class Port_group : public Port
+{
+public:
+  static constexpr Id id = 0xffffffee;
+
+  Port_group()
+    : Port(id)
+  { }
+
+  // Packet related funtions.
+  bool open();
+  bool close();
+  bool send(Context&);
+  bool recv(Context&);
+};
+
+
+inline bool
+Port_group::open()
+{
+  return true;
+}
+
+
+inline bool
+Port_group::close()
+{
+  return true;
+}
+
+
+inline bool
+Port_group::send(Context& cxt)
+{
+  cxt.dataplane()->groups().replicate(cxt);
+  return true;
+}
+
+
+inline bool
+Port_group::recv(Context&)
+{
+  return true;
+}
+
+
+} // end namespace fp
+
+#endif
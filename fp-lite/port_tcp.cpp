@@ -1,8 +1,16 @@
 
 #include "port_tcp.hpp"
+#include "buffer.hpp"
 #include "context.hpp"
+#include "time.hpp"
+#include "trace.hpp"
 #include "types.hpp"
 
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <algorithm>
 #include <cassert>
 #include <cerrno>
 #include <cstdlib>
@@ -12,63 +20,200 @@
 namespace fp
 {
 
+namespace
+{
+
+// The time (in ms) that a socket may make no progress in the
+// middle of a frame before the peer is considered stalled. A
+// worker waiting on a stalled peer would never reach a quiescent
+// state (see rcu.hpp).
+constexpr int stall_timeout = 1000;
+
+
+// Wait for the socket to become ready for the given events after
+// an operation would have blocked. Returns false if the socket is
+// not ready before the stall timeout.
+bool
+wait(int fd, short events, Port::Counters& c)
+{
+  bump(c.eagains);
+  pollfd p = {fd, events, 0};
+  return ::poll(&p, 1, stall_timeout) > 0;
+}
+
+
+// The largest frame that any port can receive. A longer length
+// means that the stream is not synchronized with its frames, or
+// that the peer is misbehaving.
+constexpr std::uint32_t max_frame = Port_eth_tcp::max_segments * Buffer::data_size;
+
+
+// Receive exactly n bytes from the socket. Returns 0 if the
+// connection was closed, -1 on error or if the peer stalls, and
+// n otherwise. Partial reads and retries are counted.
+int
+recv_all(Port_tcp::Socket& sock, Byte* p, int n, Port::Counters& c)
+{
+  int rem = n;
+  while (rem != 0) {
+    int k = sock.recv(p, rem);
+    if (k == 0)
+      return 0;
+    if (k < 0) {
+      // The frame has been started, so wait for the rest.
+      if (errno == EAGAIN && wait(sock.fd(), POLLIN, c))
+        continue;
+      return -1;
+    }
+    if (k < rem)
+      bump(c.short_reads);
+    rem -= k;
+    p += k;
+  }
+  return n;
+}
+
+
+// Receive and discard n bytes from the socket, keeping the stream
+// synchronized with its frames.
+int
+discard(Port_tcp::Socket& sock, int n, Port::Counters& c)
+{
+  Byte buf[2048];
+  int rem = n;
+  while (rem != 0) {
+    int k = recv_all(sock, buf, std::min<int>(rem, sizeof(buf)), c);
+    if (k <= 0)
+      return k;
+    rem -= k;
+  }
+  return n;
+}
+
+
+// Send the rest of a message, of which the first k bytes have been
+// sent. Once part of a frame has been written, the rest must be
+// written to keep the stream synchronized. Returns false on error,
+// or if the peer stalls.
+bool
+send_rest(int fd, msghdr& msg, std::size_t k, Port::Counters& c)
+{
+  for (;;) {
+    // Skip the vectors that have been sent, and trim the first that
+    // has not been.
+    while (msg.msg_iovlen != 0 && k >= msg.msg_iov->iov_len) {
+      k -= msg.msg_iov->iov_len;
+      ++msg.msg_iov;
+      --msg.msg_iovlen;
+    }
+    if (msg.msg_iovlen == 0)
+      return true;
+    msg.msg_iov->iov_base = static_cast<Byte*>(msg.msg_iov->iov_base) + k;
+    msg.msg_iov->iov_len -= k;
+
+    ssize_t n = ::sendmsg(fd, &msg, 0);
+    if (n < 0) {
+      if (errno == EAGAIN && wait(fd, POLLOUT, c)) {
+        k = 0;
+        continue;
+      }
+      return false;
+    }
+    k = n;
+  }
+}
+
+
+} // namespace
+
+
 // Read an ethernet frame from the stream. This recv function utilizes a
 // simple protocol to establish the length of the frame being received. We
 // establish the length with a 4-byte integer value, in network byte
 // order, at the head of the message. If there is not a 4-byte header present,
 // undefined behavior ensues.
+//
+// The frame is read into the packet, and into segments chained
+// to the packet if it does not fit in the packet's buffer.
 bool
 Port_eth_tcp::recv(Context& cxt)
 {
   Socket& sock = socket();
   Packet& p = cxt.packet();
+  Counters& c = counters();
 
-  // Receive the 4-byte header and nativize it.
-  // If we don't receive the 4-byte header, or if we encounter an error
-  // then just give up. It's not worth trying to capture more.
+  // Receive the 4-byte header and nativize it. If nothing can be
+  // read, or we encounter an error, then just give up. Once part
+  // of the header has been read, the rest must be read to keep
+  // the stream synchronized.
   std::uint32_t hdr;
   int k1 = sock.recv((Byte*)&hdr, 4);  
-  if (k1 <= 0 || k1 != 4)
+  if (k1 <= 0) {
+    if (k1 < 0 && errno == EAGAIN)
+      bump(c.eagains);
     return false;
+  }
+  if (k1 != 4) {
+    bump(c.short_reads);
+    int k = recv_all(sock, (Byte*)&hdr + k1, 4 - k1, c);
+    if (k <= 0) {
+      if (k < 0)
+        state_.link_down = true;
+      return false;
+    }
+  }
   hdr = ntohl(hdr);
 
-  // Read the rest of the message.
-  //
-  // TODO: Verify that the packet has capacity for the header.
-  int k2 = sock.recv(p.data(), hdr);
-  if (k2 <= 0) {
-    if (k2 == 0)
-      return false;
+  // A length that no port could receive cannot be skipped safely,
+  // so give up on the link.
+  if (hdr > max_frame) {
+    count_drop(cxt, DROP_MALFORMED);
+    state_.link_down = true;
+    return false;
+  }
 
-    // TODO: If we actually get an EAGAIN, then what should we 
-    // do? Continue receiving? Fail? Not quite sure.
-    if (k2 < 0 && errno != EAGAIN) {
+  // Chain segments for the part of the frame that does not fit
+  // in the packet. If that is not possible, drop the frame.
+  int len = hdr;
+  int room = p.tailroom();
+  Drop_reason why = DROP_OVERSIZE;
+  bool fits = len <= room;
+  if (!fits && pool_) {
+    int max = room + (max_segments - 1) * Buffer::data_size;
+    if (len <= max) {
+      fits = pool_->extend(p, len - room);
+      why = DROP_POOL_EXHAUSTED;
+    }
+  }
+  if (!fits) {
+    count_drop(cxt, why);
+    if (discard(sock, len, c) < 0)
       state_.link_down = true;
+    return false;
+  }
+
+  // Read the rest of the message into each segment.
+  for (Packet* s = &p; s; s = s->next()) {
+    int n = std::min(len, s->tailroom());
+    int k = recv_all(sock, s->data(), n, c);
+    if (k <= 0) {
+      if (k < 0)
+        state_.link_down = true;
+      count_drop(cxt, DROP_MALFORMED);
       return false;
     }
+    s->limit(n);
+    len -= n;
   }
-  p.limit(hdr);
- 
-  // // Receive until recv_size bytes have been read.
-  // Byte* ptr = p.data();
-  // int32_t rem = hdr;
-  // while (rem != 0) {
-  //   int k = sock.recv(ptr, rem);
-  //   if (k <= 0) {
-  //     if (k == 0)
-  //       return false;
-  //     if (k < 0 && errno != EAGAIN) {
-  //       state_.link_down = true;
-  //       return false;
-  //     }
-  //     else
-  //       continue;
-  //   }
-  //   rem -= k;
-  //   ptr += k;
-  // }
-  // p.set_size(hdr);
 
+  // Frames without an Ethernet header cannot be decoded.
+  if (hdr < 14) {
+    count_drop(cxt, DROP_MALFORMED);
+    return false;
+  }
+
+  // Stamp the arrival of the packet.
+  p.stamp(Time::current());
 
   // Set up the input context.
   //
@@ -76,14 +221,28 @@ Port_eth_tcp::recv(Context& cxt)
   cxt.set_input(this, this, 0);
 
   // Update port stats.
-  stats_.packets_rx++;
-  stats_.bytes_rx += hdr;
+  bump(c.packets_rx);
+  bump(c.bytes_rx, hdr);
+
+  // Select the packet for sampling.
+  if (Sampler* s = cxt.dataplane()->sampler())
+    s->begin(cxt);
+
+#ifdef FP_TRACE
+  trace_packet(cxt);
+  trace(cxt, TRACE_PORT_RX, id(), hdr);
+#endif
 
   return true;
 }
 
 
-// Writes a packet to the output stream.
+// Writes a packet to the output stream. The length header and
+// the segments of the packet are gathered into a single write.
+//
+// If the socket cannot accept any of the frame, the packet is
+// dropped and the link stays up. A frame that is partly written
+// is completed, and if that fails, the link is down.
 bool
 Port_eth_tcp::send(Context& cxt)
 {
@@ -93,24 +252,45 @@ Port_eth_tcp::send(Context& cxt)
   // Get the packet from the context.
   Packet const& p = cxt.packet();
 
-  // Send the header size.
-  std::uint32_t hdr = ntohl(p.length());
-  int k1 = sock.send((Byte*)&hdr, 4);
-  if (k1 <= 0) {
+  // Gather the header size and each segment.
+  std::uint32_t hdr = htonl(p.total_length());
+  iovec iov[1 + max_segments];
+  iov[0] = {&hdr, 4};
+  int n = 1;
+  std::size_t total = 4;
+  for (Packet const* s = &p; s && n <= max_segments; s = s->next()) {
+    iov[n++] = {const_cast<Byte*>(s->data()), (std::size_t)s->length()};
+    total += s->length();
+  }
+
+  msghdr msg = {};
+  msg.msg_iov = iov;
+  msg.msg_iovlen = n;
+  Counters& c = counters();
+  ssize_t k = ::sendmsg(sock.fd(), &msg, 0);
+  if (k < 0) {
+    // Nothing was written, so the stream is still synchronized.
+    if (errno == EAGAIN) {
+      bump(c.eagains);
+      count_drop(cxt, DROP_QUEUE_FULL);
+      return false;
+    }
+    count_drop(cxt, DROP_TX_ERROR);
     state_.link_down = true;
     return false;
   }
-
-  // Send the remainder of the packet.
-  int k2 = sock.send(p.data(), p.length());
-  if (k2 <= 0) {
+  if (std::size_t(k) < total && !send_rest(sock.fd(), msg, k, c)) {
+    count_drop(cxt, DROP_TX_ERROR);
     state_.link_down = true;
     return false;
   }
 
   // Update port stats.
-  stats_.packets_tx++;
-  stats_.bytes_tx += k2;
+  bump(c.packets_tx);
+  bump(c.bytes_tx, total - 4);
+#ifdef FP_TRACE
+  trace(cxt, TRACE_PORT_TX, id(), total - 4);
+#endif
 
   return true;
 }
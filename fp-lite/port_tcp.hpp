@@ -9,6 +9,7 @@ namespace fp
 {
 
 class Context;
+class Pool;
 
 
 // -------------------------------------------------------------------------- //
@@ -64,7 +65,7 @@ inline void
 Port_tcp::attach(Socket&& s)
 {
   sock_ = std::move(s);
-  stats_ = {};              // Reset stats
+  clear_stats();            // Reset stats
   state_.link_down = false; // Put the link in up state.
 }
 
@@ -84,13 +85,27 @@ Port_tcp::detach()
 
 // Represents a port that sends and recieves Ethernet frames
 // over a connected TCP socket.
+//
+// Frames that do not fit in the packet's buffer (e.g., jumbo
+// frames, or TCP segmentation offload sized packets) are received
+// into segments allocated from the port's buffer pool. If the port
+// has no pool, or the pool is exhausted, such frames are dropped.
 class Port_eth_tcp : public Port_tcp
 {
 public:
+  // The maximum number of segments in a frame.
+  static constexpr int max_segments = 48;
+
   using Port_tcp::Port_tcp;
 
+  // Sets the pool from which segments are allocated.
+  void set_pool(Pool* p) { pool_ = p; }
+
   bool send(Context&);
   bool recv(Context&);
+
+private:
+  Pool* pool_ = nullptr;
 };
 
 
@@ -0,0 +1,166 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#include "rcu.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+namespace fp
+{
+
+namespace
+{
+
+// The global epoch. It is advanced each time an object is
+// retired. Epoch 0 is never used; it marks an offline worker.
+std::atomic<std::uint64_t> global_epoch(1);
+
+// The most recent epoch observed by each worker at a quiescent
+// state, or 0 if the worker is offline.
+Per_worker<std::atomic<std::uint64_t>> observed;
+
+
+// An object awaiting destruction. It may be destroyed once every
+// online worker has observed an epoch later than the one in
+// which it was retired.
+struct Retired
+{
+  std::uint64_t epoch;
+  void*         object;
+  void        (*destroy)(void*);
+};
+
+std::mutex           retired_mutex;
+std::vector<Retired> retired;
+
+// The number of objects in the retired list. This allows workers
+// to check for pending reclamation without taking the lock.
+std::atomic<std::size_t> pending(0);
+
+// The number of retired objects that triggers reclamation at a
+// quiescent state.
+constexpr std::size_t reclaim_threshold = 64;
+
+
+// Returns the oldest epoch observed by any online worker.
+std::uint64_t
+oldest_epoch()
+{
+  std::uint64_t min = UINT64_MAX;
+  for (int i = 0; i < max_workers; ++i) {
+    std::uint64_t e = observed[i].load(std::memory_order_acquire);
+    if (e && e < min)
+      min = e;
+  }
+  return min;
+}
+
+
+} // namespace
+
+
+// Register the calling thread as a reader. Shared objects may
+// be used only after going online.
+void
+rcu_online()
+{
+  observed.local().store(global_epoch.load(), std::memory_order_seq_cst);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+
+// Unregister the calling thread. No references to shared objects
+// may be held after going offline.
+void
+rcu_offline()
+{
+  observed.local().store(0, std::memory_order_release);
+}
+
+
+// Returns true if the calling thread is online.
+bool
+rcu_is_online()
+{
+  return this_worker >= 0 && observed[this_worker].load(std::memory_order_relaxed);
+}
+
+
+// Announce that the calling worker holds no references to shared
+// objects. This is cheap enough to call once per packet batch. If
+// enough objects have been retired, they are reclaimed here, since
+// this is known to be a safe point for the caller.
+//
+// A thread that is not online goes online.
+void
+rcu_quiescent()
+{
+  std::atomic<std::uint64_t>& e = observed.local();
+  std::uint64_t g = global_epoch.load(std::memory_order_acquire);
+  if (e.load(std::memory_order_relaxed) != g)
+    e.store(g, std::memory_order_release);
+  if (pending.load(std::memory_order_relaxed) >= reclaim_threshold)
+    rcu_reclaim();
+}
+
+
+// Defer the destruction of an object that has been unlinked from
+// all shared structures. This does not wait for a grace period,
+// and it never destroys objects itself, so it may be called by a
+// worker that is still using the retired object (e.g., when a flow
+// learns a new flow).
+void
+rcu_retire(void* p, void (*destroy)(void*))
+{
+  std::lock_guard<std::mutex> lock(retired_mutex);
+  std::uint64_t e = global_epoch.fetch_add(1);
+  retired.push_back({e, p, destroy});
+  pending.store(retired.size(), std::memory_order_relaxed);
+}
+
+
+// Destroy all retired objects whose grace periods have elapsed.
+void
+rcu_reclaim()
+{
+  std::vector<Retired> ready;
+  {
+    std::lock_guard<std::mutex> lock(retired_mutex);
+    std::uint64_t min = oldest_epoch();
+    auto mid = std::partition(retired.begin(), retired.end(), [min](Retired const& r) {
+      return r.epoch >= min;
+    });
+    ready.assign(mid, retired.end());
+    retired.erase(mid, retired.end());
+    pending.store(retired.size(), std::memory_order_relaxed);
+  }
+  for (Retired& r : ready)
+    r.destroy(r.object);
+}
+
+
+// Wait until every online worker has passed through a quiescent
+// state, and then destroy all retired objects. This must not be
+// called while holding references to shared objects.
+//
+// Workers never call this on the fast path; it is intended for
+// control operations that must know when an old object is no
+// longer in use (e.g., unloading an application).
+void
+rcu_synchronize()
+{
+  std::uint64_t e = global_epoch.fetch_add(1) + 1;
+  if (this_worker >= 0 && observed[this_worker].load())
+    rcu_quiescent();
+  while (oldest_epoch() < e)
+    std::this_thread::yield();
+  rcu_reclaim();
+}
+
+
+} // namespace fp
@@ -0,0 +1,98 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#ifndef FP_RCU_HPP
+#define FP_RCU_HPP
+
+#include "worker.hpp"
+
+#include <cstdint>
+
+
+namespace fp
+{
+
+// Read-copy-update with epoch-based reclamation.
+//
+// Readers (workers) search shared structures without locks or
+// atomic read-modify-write operations. Writers never modify an
+// object that a reader may be using; they publish a modified
+// copy and retire the original, which is destroyed only after
+// every online worker has passed through a quiescent state.
+//
+// A worker announces a quiescent state by calling rcu_quiescent()
+// at a point where it holds no references to shared objects,
+// typically once per iteration of its receive loop. A worker that
+// blocks, or that stops processing packets, must go offline so
+// that it does not delay reclamation.
+//
+// Threads that never go online (e.g., a single-threaded driver's
+// main thread) may read and write freely, but objects that they
+// retire are protected only from online workers.
+
+void rcu_online();
+void rcu_offline();
+bool rcu_is_online();
+void rcu_quiescent();
+
+void rcu_retire(void*, void (*)(void*));
+void rcu_reclaim();
+void rcu_synchronize();
+
+
+namespace rcu_impl
+{
+
+template<typename T>
+void
+destroy(void* p)
+{
+  delete static_cast<T*>(p);
+}
+
+} // namespace rcu_impl
+
+
+// A read-side section for a thread that is not otherwise a reader
+// (e.g., a driver's main thread reading the application chain).
+// The thread is online for the lifetime of the section, unless it
+// was already online, in which case it is left so.
+class Rcu_read_section
+{
+public:
+  Rcu_read_section()
+    : online_(rcu_is_online())
+  {
+    if (!online_)
+      rcu_online();
+  }
+
+  ~Rcu_read_section()
+  {
+    if (!online_)
+      rcu_offline();
+  }
+
+  Rcu_read_section(Rcu_read_section const&) = delete;
+  Rcu_read_section& operator=(Rcu_read_section const&) = delete;
+
+private:
+  bool online_;
+};
+
+
+// Retire an object allocated with new. It is deleted after
+// a grace period.
+template<typename T>
+inline void
+rcu_retire(T* p)
+{
+  if (p)
+    rcu_retire(p, rcu_impl::destroy<T>);
+}
+
+
+} // namespace fp
+
+
+#endif
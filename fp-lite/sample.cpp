@@ -0,0 +1,232 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#include "sample.hpp"
+#include "context.hpp"
+#include "time.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+
+namespace fp
+{
+
+// Create a sampler that keeps one in every n packets, on average.
+Sampler::Sampler(std::uint32_t n)
+  : period_(n ? n : 1), scale_(0), rings_(new Per_worker<Ring>()),
+    format_(SAMPLE_PCAPNG), file_(nullptr), running_(false)
+{
+  if (period_ > 1)
+    scale_ = 1 / std::log1p(-1.0 / period_);
+  for (int i = 0; i < max_workers; ++i) {
+    Ring& r = (*rings_)[i];
+    r.records.store(nullptr, std::memory_order_relaxed);
+    r.head.store(0, std::memory_order_relaxed);
+    r.tail.store(0, std::memory_order_relaxed);
+    r.lost.store(0, std::memory_order_relaxed);
+    r.skip = 0;
+    r.random = (std::uint64_t(i) + 1) * 0x9e3779b97f4a7c15ull;
+  }
+}
+
+
+Sampler::~Sampler()
+{
+  stop();
+  for (int i = 0; i < max_workers; ++i)
+    delete[] (*rings_)[i].records.load(std::memory_order_relaxed);
+}
+
+
+// Returns the number of packets to count before the next sample.
+// Skips are geometric with mean n, drawn by inversion from a
+// uniform variate in (0, 1].
+std::uint32_t
+Sampler::next_skip(Ring& r) const
+{
+  if (period_ == 1)
+    return 1;
+  r.random ^= r.random >> 12;
+  r.random ^= r.random << 25;
+  r.random ^= r.random >> 27;
+  std::uint64_t x = r.random * 0x2545f4914f6cdd1dull;
+  double u = double((x >> 11) + 1) / double(1ull << 53);
+  double k = std::floor(std::log(u) * scale_);
+  return k < 0xfffffffe ? std::uint32_t(k) + 1 : 0xffffffff;
+}
+
+
+// Sample the packet, if there is room in the worker's ring. The
+// worker's first packet only starts its count.
+void
+Sampler::take(Context& cxt, Ring& r)
+{
+  bool first = r.skip == 0;
+  if (first)
+    r.random ^= Time::current();
+  r.skip = next_skip(r);
+  if (first)
+    return;
+
+  Record* records = r.records.load(std::memory_order_relaxed);
+  if (!records) {
+    records = new Record[ring_size]();
+    r.records.store(records, std::memory_order_release);
+  }
+  std::uint64_t h = r.head.load(std::memory_order_relaxed);
+  if (h - r.tail.load(std::memory_order_acquire) >= ring_size) {
+    bump(r.lost);
+    return;
+  }
+
+  Packet const& p = cxt.packet();
+  Record& rec = records[h % ring_size];
+  rec.hdr.time = p.timestamp() ? p.timestamp() : Time::current();
+  rec.hdr.in_port = cxt.input_port_id();
+  rec.hdr.out_port = 0;
+  rec.hdr.length = p.total_length();
+  rec.hdr.captured = std::min(p.length(), int(snap_length));
+  rec.hdr.reserved = 0;
+  std::memcpy(rec.data, p.data(), rec.hdr.captured);
+  cxt.set_sampled();
+}
+
+
+// Publish the calling worker's pending sample, which was sent to
+// the given port.
+void
+Sampler::commit(std::uint32_t out)
+{
+  Ring& r = rings_->local();
+  std::uint64_t h = r.head.load(std::memory_order_relaxed);
+  Record* records = r.records.load(std::memory_order_relaxed);
+  records[h % ring_size].hdr.out_port = out;
+  r.head.store(h + 1, std::memory_order_release);
+}
+
+
+// Returns the number of samples published by workers.
+std::uint64_t
+Sampler::samples() const
+{
+  std::uint64_t n = 0;
+  for (int i = 0; i < max_workers; ++i)
+    n += (*rings_)[i].head.load(std::memory_order_relaxed);
+  return n;
+}
+
+
+// Returns the number of samples lost because a ring was full.
+std::uint64_t
+Sampler::lost() const
+{
+  std::uint64_t n = 0;
+  for (int i = 0; i < max_workers; ++i)
+    n += (*rings_)[i].lost.load(std::memory_order_relaxed);
+  return n;
+}
+
+
+// Start exporting samples to the file at the given path, which is
+// replaced. The rings are drained every interval (in ms). Returns
+// false if the file cannot be opened.
+bool
+Sampler::start(std::string const& path, Sample_format f, int interval)
+{
+  assert(!running_);
+  file_ = std::fopen(path.c_str(), "wb");
+  if (!file_)
+    return false;
+  format_ = f;
+
+  std::string out;
+  if (format_ == SAMPLE_PCAPNG) {
+    pcapng_header(out, snap_length);
+  }
+  else {
+    Sample_file_header fh;
+    std::memset(&fh, 0, sizeof(fh));
+    std::memcpy(fh.magic, "FPSAMPL", 8);
+    fh.version = sample_version;
+    fh.snap_length = snap_length;
+    fh.hz = Time::frequency();
+    out.append(reinterpret_cast<char const*>(&fh), sizeof(fh));
+  }
+  std::fwrite(out.data(), 1, out.size(), file_);
+
+  running_ = true;
+  exporter_ = std::thread(&Sampler::run, this, interval);
+  return true;
+}
+
+
+// Stop exporting, after writing the samples that remain.
+void
+Sampler::stop()
+{
+  if (!running_)
+    return;
+  running_ = false;
+  exporter_.join();
+  std::fclose(file_);
+  file_ = nullptr;
+}
+
+
+// Append the published samples of each ring to a buffer, and
+// release their records to the workers.
+void
+Sampler::drain(std::string& out)
+{
+  char comment[64];
+  for (int i = 0; i < max_workers; ++i) {
+    Ring& r = (*rings_)[i];
+    Record const* records = r.records.load(std::memory_order_acquire);
+    if (!records)
+      continue;
+    std::uint64_t t = r.tail.load(std::memory_order_relaxed);
+    std::uint64_t h = r.head.load(std::memory_order_acquire);
+    for (; t != h; ++t) {
+      Record const& rec = records[t % ring_size];
+      if (format_ == SAMPLE_PCAPNG) {
+        std::snprintf(comment, sizeof(comment), "in_port=%u out_port=%u",
+                      rec.hdr.in_port, rec.hdr.out_port);
+        pcapng_packet(out, clock_.nanoseconds(rec.hdr.time), rec.data,
+                      rec.hdr.captured, rec.hdr.length, comment);
+      }
+      else {
+        out.append(reinterpret_cast<char const*>(&rec.hdr), sizeof(rec.hdr));
+        out.append(reinterpret_cast<char const*>(rec.data), rec.hdr.captured);
+      }
+    }
+    r.tail.store(t, std::memory_order_release);
+  }
+}
+
+
+// The exporter's loop. Samples are written in the order of their
+// workers, and are in time order only within each worker.
+void
+Sampler::run(int interval)
+{
+  std::string out;
+  bool more = true;
+  while (more) {
+    more = running_.load();
+    if (more)
+      std::this_thread::sleep_for(std::chrono::milliseconds(interval));
+    out.clear();
+    drain(out);
+    if (!out.empty()) {
+      std::fwrite(out.data(), 1, out.size(), file_);
+      std::fflush(file_);
+    }
+  }
+}
+
+
+} // namespace fp
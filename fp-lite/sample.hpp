@@ -0,0 +1,161 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#ifndef FP_SAMPLE_HPP
+#define FP_SAMPLE_HPP
+
+// The sample module gives visibility of the traffic forwarded by
+// a dataplane at rate, in the manner of sFlow. The headers of one
+// in every n packets are kept, with the packet's input and output
+// ports and the time at which it was received.
+//
+// Packets are selected when they are received (see Port::recv).
+// Each worker counts down a skip drawn from a geometric
+// distribution with mean n, so that every packet is sampled with
+// probability 1/n, without the bias of a fixed period and without
+// drawing a random number for each packet. A packet that is not
+// sampled costs a test and a decrement.
+//
+// The headers of a selected packet are copied when it is received,
+// before actions modify them, into the next record of the worker's
+// ring, and the packet is marked as sampled (see Context::sampled).
+// The record is published when the driver has chosen the packet's
+// output port (see commit()); a sample that is never committed is
+// overwritten by the worker's next. Rings have a single writer and
+// a single reader, and are never locked. When a ring is full, new
+// samples are lost (and counted).
+//
+// An exporter thread drains the rings to a file, either as pcapng
+// (see pcapng.hpp), in which the ports of each packet are given by
+// its comment, or as a compact binary stream: a file header, then
+// for each sample a header followed by its captured bytes.
+
+#include "worker.hpp"
+#include "pcapng.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+
+
+namespace fp
+{
+
+class Context;
+
+
+// The formats in which samples are exported.
+enum Sample_format
+{
+  SAMPLE_PCAPNG,
+  SAMPLE_BINARY
+};
+
+
+// The layout of the binary stream.
+struct Sample_file_header
+{
+  char          magic[8];    // "FPSAMPL" and a null byte.
+  std::uint32_t version;
+  std::uint32_t snap_length; // The most bytes captured of a packet.
+  std::uint64_t hz;          // Clock ticks per second.
+};
+
+struct Sample_header
+{
+  std::uint64_t time;        // Clock ticks.
+  std::uint32_t in_port;
+  std::uint32_t out_port;
+  std::uint32_t length;      // Bytes in the packet.
+  std::uint16_t captured;    // Bytes that follow.
+  std::uint16_t reserved;
+};
+
+static_assert(sizeof(Sample_header) == 24, "unexpected sample header size");
+
+constexpr std::uint32_t sample_version = 1;
+
+
+// Samples the packets received by workers, and exports them.
+class Sampler
+{
+public:
+  static constexpr int snap_length = 128;
+  static constexpr int ring_size = 1024;
+
+  explicit Sampler(std::uint32_t);
+  ~Sampler();
+
+  Sampler(Sampler const&) = delete;
+  Sampler& operator=(Sampler const&) = delete;
+
+  std::uint32_t period() const { return period_; }
+
+  // Packet sampling.
+  void begin(Context&);
+  void commit(std::uint32_t);
+
+  // Export.
+  bool start(std::string const&, Sample_format, int = 100);
+  void stop();
+
+  std::uint64_t samples() const;
+  std::uint64_t lost() const;
+
+private:
+  struct Record
+  {
+    Sample_header hdr;
+    std::uint8_t  data[snap_length];
+  };
+
+  // A worker's ring, allocated on its first sample. The head is
+  // written by the worker, and the tail by the exporter.
+  struct Ring
+  {
+    std::atomic<Record*>       records;
+    std::atomic<std::uint64_t> head;
+    std::atomic<std::uint64_t> tail;
+    std::atomic<std::uint64_t> lost;
+    std::uint32_t              skip;   // Packets until the next sample.
+    std::uint64_t              random; // The state of the skip generator.
+  };
+
+  std::uint32_t next_skip(Ring&) const;
+  void          take(Context&, Ring&);
+  void          drain(std::string&);
+  void          run(int);
+
+  std::uint32_t                     period_;
+  double                            scale_; // For drawing skips.
+  std::unique_ptr<Per_worker<Ring>> rings_;
+  Pcapng_clock                      clock_;
+
+  Sample_format     format_;
+  std::FILE*        file_;
+  std::thread       exporter_;
+  std::atomic<bool> running_;
+};
+
+
+// Decide whether to sample a packet that has just been received,
+// and if so, copy its headers.
+inline void
+Sampler::begin(Context& cxt)
+{
+  Ring& r = rings_->local();
+  if (r.skip > 1) {
+    --r.skip;
+    return;
+  }
+  take(cxt, r);
+}
+
+
+} // namespace fp
+
+
+#endif
@@ -0,0 +1,398 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#include "stats.hpp"
+#include "dataplane.hpp"
+#include "port.hpp"
+#include "table.hpp"
+#include "buffer.hpp"
+#include "perf.hpp"
+#include "application.hpp"
+#include "worker.hpp"
+#include "rcu.hpp"
+
+#include <freeflow/unix.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+
+namespace fp
+{
+
+namespace
+{
+
+// Writes a string as a JSON string literal.
+void
+write_string(std::ostream& os, std::string const& s)
+{
+  os << '"';
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      os << '\\' << c;
+    }
+    else if ((unsigned char)c < 0x20) {
+      char buf[8];
+      std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+      os << buf;
+    }
+    else {
+      os << c;
+    }
+  }
+  os << '"';
+}
+
+
+// Writes a flow key as a string of hexadecimal digits, most
+// significant first.
+void
+write_key(std::ostream& os, Key const& k)
+{
+  char buf[40];
+  std::snprintf(buf, sizeof(buf), "\"%016llx%016llx\"",
+                (unsigned long long)(k >> 64), (unsigned long long)k);
+  os << buf;
+}
+
+
+void
+write_counters(std::ostream& os, Flow_counters const& c)
+{
+  os << "\"packets\":" << c.packets() << ",\"bytes\":" << c.bytes();
+}
+
+
+// The state of a table visit.
+struct Flow_writer
+{
+  std::ostream& os;
+  bool          first;
+};
+
+
+void
+write_flow(Key const& k, Flow const& f, void* arg)
+{
+  Flow_writer& w = *static_cast<Flow_writer*>(arg);
+  std::ostream& os = w.os;
+  if (!w.first)
+    os << ',';
+  w.first = false;
+  os << "{\"key\":";
+  write_key(os, k);
+  os << ",\"priority\":" << f.pri_ << ',';
+  write_counters(os, *f.count_);
+  os << '}';
+}
+
+
+// Writes drop counts, indexed by reason, and their total.
+void
+write_drops(std::ostream& os, std::uint64_t const* drops)
+{
+  std::uint64_t sum = 0;
+  for (int r = 0; r < num_drop_reasons; ++r)
+    sum += drops[r];
+  os << "\"drops\":{\"total\":" << sum;
+  for (int r = 0; r < num_drop_reasons; ++r)
+    os << ",\"" << drop_reason_name(r) << "\":" << drops[r];
+  os << '}';
+}
+
+
+// The names of hardware events and pipeline stages.
+char const* const perf_event_names[num_perf_events] = {
+  "cycles", "instructions", "llc_misses", "branch_misses"
+};
+
+char const* const perf_stage_names[num_perf_stages] = {
+  "ingress", "classify", "process", "actions", "egress"
+};
+
+
+// The sum of a stage's totals over all workers.
+struct Perf_sum
+{
+  std::uint64_t packets;
+  std::uint64_t events[num_perf_events];
+};
+
+
+// Writes the event counts of a stage, with the instructions per
+// cycle and the misses per packet derived from them.
+void
+write_perf(std::ostream& os, Perf_sum const& s)
+{
+  os << "\"packets\":" << s.packets;
+  for (int e = 0; e < num_perf_events; ++e)
+    os << ",\"" << perf_event_names[e] << "\":" << s.events[e];
+  auto ratio = [](std::uint64_t a, std::uint64_t b) {
+    return b ? double(a) / b : 0.0;
+  };
+  char buf[160];
+  std::snprintf(buf, sizeof(buf),
+                ",\"ipc\":%.3f,\"cycles_per_packet\":%.1f"
+                ",\"llc_misses_per_packet\":%.3f,\"branch_misses_per_packet\":%.3f",
+                ratio(s.events[PERF_INSTRUCTIONS], s.events[PERF_CYCLES]),
+                ratio(s.events[PERF_CYCLES], s.packets),
+                ratio(s.events[PERF_LLC_MISSES], s.packets),
+                ratio(s.events[PERF_BRANCH_MISSES], s.packets));
+  os << buf;
+}
+
+
+// Sums the totals selected by f over the workers' counters.
+template<typename F>
+Perf_sum
+sum_perf(Dataplane const& dp, F f)
+{
+  Perf_sum sum = {};
+  for (int i = 0; i < max_workers; ++i) {
+    Perf_counters const* pc = dp.perf_counters(i);
+    if (!pc)
+      continue;
+    Perf_totals const& t = f(*pc);
+    sum.packets += t.packets.load(std::memory_order_relaxed);
+    for (int e = 0; e < num_perf_events; ++e)
+      sum.events[e] += t.events[e].load(std::memory_order_relaxed);
+  }
+  return sum;
+}
+
+
+// Writes the hardware event counts of each pipeline stage and of
+// each application in the chain, if any worker has counters.
+// Events that no worker can count are not reported.
+void
+write_perf_counters(std::ostream& os, Dataplane const& dp)
+{
+  bool any = false;
+  bool kernel = false;
+  bool counted[num_perf_events] = {};
+  for (int i = 0; i < max_workers; ++i) {
+    Perf_counters const* pc = dp.perf_counters(i);
+    if (!pc)
+      continue;
+    any = true;
+    kernel |= pc->kernel();
+    for (int e = 0; e < num_perf_events; ++e)
+      counted[e] |= pc->available(Perf_event(e));
+  }
+  if (!any)
+    return;
+
+  os << ",\"perf\":{\"kernel\":" << (kernel ? "true" : "false")
+     << ",\"events\":[";
+  bool first = true;
+  for (int e = 0; e < num_perf_events; ++e) {
+    if (!counted[e])
+      continue;
+    os << (first ? "\"" : ",\"") << perf_event_names[e] << '"';
+    first = false;
+  }
+  os << "],\"stages\":[";
+  for (int s = 0; s < num_perf_stages; ++s) {
+    Perf_sum sum = sum_perf(dp, [s](Perf_counters const& pc) -> Perf_totals const& {
+      return pc.stages[s];
+    });
+    os << (s ? ",{" : "{") << "\"name\":\"" << perf_stage_names[s] << "\",";
+    write_perf(os, sum);
+    os << '}';
+  }
+  // The chain, and the applications in it, may be retired while
+  // they are read (see Dataplane::swap_application), so their names
+  // are copied within a read-side section.
+  std::vector<std::string> names;
+  {
+    Rcu_read_section rcu;
+    Application_chain const* chain = dp.get_chain();
+    int n = std::min<int>(chain->stages.size(), max_perf_applications);
+    for (int a = 0; a < n; ++a)
+      names.push_back(chain->stages[a]->library().path);
+  }
+
+  os << "],\"applications\":[";
+  for (int a = 0; a < (int)names.size(); ++a) {
+    Perf_sum sum = sum_perf(dp, [a](Perf_counters const& pc) -> Perf_totals const& {
+      return pc.applications[a];
+    });
+    os << (a ? ",{" : "{") << "\"name\":";
+    write_string(os, names[a]);
+    os << ',';
+    write_perf(os, sum);
+    os << '}';
+  }
+  os << "]}";
+}
+
+
+char const*
+table_type(Table::Type t)
+{
+  switch (t) {
+  case Table::EXACT: return "exact";
+  case Table::PREFIX: return "prefix";
+  case Table::WILDCARD: return "wildcard";
+  }
+  return "unknown";
+}
+
+
+} // namespace
+
+
+// Create the server, listening on the UNIX socket at the given
+// path. Any existing socket at that path is removed.
+Stats_server::Stats_server(Dataplane& dp, std::string const& path)
+  : dp_(dp), path_(path), fd_(-1), pool_(nullptr)
+{
+  ff::Unix_socket_address addr(path);
+  ff::un::unlink(addr);
+  fd_ = ff::server_socket(addr);
+  if (fd_ < 0)
+    throw std::string("stats: cannot listen on ") + path;
+  ff::set_option(fd_, ff::nonblocking(true));
+}
+
+
+Stats_server::~Stats_server()
+{
+  ::close(fd_);
+  ::unlink(path_.c_str());
+}
+
+
+// Accept each pending connection and send it a snapshot. Clients
+// are never waited for: one that cannot take the whole snapshot
+// without blocking is disconnected.
+void
+Stats_server::serve()
+{
+  int sd;
+  while ((sd = ff::accept(fd_)) >= 0) {
+    ff::set_option(sd, ff::nonblocking(true));
+    std::string s = snapshot();
+    char const* p = s.data();
+    std::size_t n = s.size();
+    while (n) {
+      ssize_t k = ::send(sd, p, n, MSG_NOSIGNAL);
+      if (k < 0 && errno == EINTR)
+        continue;
+      if (k <= 0)
+        break;
+      p += k;
+      n -= k;
+    }
+    ::close(sd);
+  }
+}
+
+
+// Returns a JSON snapshot of the dataplane's counters.
+std::string
+Stats_server::snapshot() const
+{
+  std::ostringstream os;
+  os << "{\"dataplane\":";
+  write_string(os, dp_.name());
+
+  // Ports.
+  os << ",\"ports\":[";
+  bool first = true;
+  for (Port* p : dp_.ports()) {
+    Port::Statistics s = p->stats();
+    if (!first)
+      os << ',';
+    first = false;
+    os << "{\"id\":" << p->id() << ",\"name\":";
+    write_string(os, p->name());
+    os << ",\"up\":" << (p->is_up() ? "true" : "false")
+       << ",\"packets_rx\":" << s.packets_rx
+       << ",\"packets_tx\":" << s.packets_tx
+       << ",\"bytes_rx\":" << s.bytes_rx
+       << ",\"bytes_tx\":" << s.bytes_tx
+       << ",\"short_reads\":" << s.short_reads
+       << ",\"eagains\":" << s.eagains << ',';
+    write_drops(os, s.drops);
+    os << '}';
+  }
+  os << ']';
+
+  // Tables and their flows.
+  os << ",\"tables\":[";
+  first = true;
+  for (auto const& t : dp_.tables_) {
+    Table const* tbl = t.second;
+    if (!first)
+      os << ',';
+    first = false;
+    os << "{\"id\":" << tbl->id() << ",\"type\":\"" << table_type(tbl->type())
+       << "\",\"miss\":{";
+    write_counters(os, *tbl->miss().count_);
+    os << "},\"flows\":[";
+    Flow_writer w{os, true};
+    tbl->visit(write_flow, &w);
+    os << "]}";
+  }
+  os << ']';
+
+  // Workers, and their sum. Every drop is counted by a worker.
+  os << ",\"workers\":[";
+  std::uint64_t total[3] = {0, 0, 0};
+  std::uint64_t total_drops[num_drop_reasons] = {};
+  int n = worker_count();
+  for (int i = 0; i < n; ++i) {
+    Worker_statistics const& s = dp_.worker_stats(i);
+    std::uint64_t c[3] = {
+      s.packets.load(std::memory_order_relaxed),
+      s.batches.load(std::memory_order_relaxed),
+      s.cache_hits.load(std::memory_order_relaxed)
+    };
+    std::uint64_t drops[num_drop_reasons];
+    for (int r = 0; r < num_drop_reasons; ++r) {
+      drops[r] = s.drops[r].load(std::memory_order_relaxed);
+      total_drops[r] += drops[r];
+    }
+    if (i)
+      os << ',';
+    os << "{\"id\":" << i << ",\"packets\":" << c[0] << ",\"batches\":" << c[1]
+       << ",\"cache_hits\":" << c[2] << ',';
+    write_drops(os, drops);
+    os << '}';
+    for (int j = 0; j < 3; ++j)
+      total[j] += c[j];
+  }
+  os << "],\"total\":{\"packets\":" << total[0] << ",\"batches\":" << total[1]
+     << ",\"cache_hits\":" << total[2] << ',';
+  write_drops(os, total_drops);
+  os << '}';
+
+  // Hardware events.
+  write_perf_counters(os, dp_);
+
+  // Buffers, connections, and sampling.
+  if (pool_)
+    os << ",\"pool\":{\"size\":" << pool_->size()
+       << ",\"free\":" << pool_->available() << '}';
+  if (Conntrack const* ct = dp_.conntrack())
+    os << ",\"conntrack\":{\"capacity\":" << ct->capacity()
+       << ",\"size\":" << ct->size() << '}';
+  if (Sampler const* s = dp_.sampler())
+    os << ",\"sampling\":{\"period\":" << s->period()
+       << ",\"samples\":" << s->samples() << ",\"lost\":" << s->lost() << '}';
+
+  os << "}\n";
+  return os.str();
+}
+
+
+} // namespace fp
@@ -0,0 +1,63 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#ifndef FP_STATS_HPP
+#define FP_STATS_HPP
+
+#include <string>
+
+
+namespace fp
+{
+
+class Dataplane;
+class Pool;
+
+
+// The statistics server exports the counters of a dataplane over
+// a UNIX socket. Each connection receives a JSON snapshot of the
+// port, table, flow, worker, and buffer pool counters, after which
+// the connection is closed. If workers count hardware events (see
+// perf.hpp), the snapshot includes the events, instructions per
+// cycle, and misses per packet of each pipeline stage and of each
+// application. For example:
+//
+//    socat - UNIX-CONNECT:/tmp/flowpath.sock
+//
+// Snapshots never block workers. Worker and flow counters are
+// read as they are updated, and per-worker counters are summed
+// by the reader. Visiting the flows of a table blocks only the
+// writers of that table.
+//
+// The server does not have a thread of its own; the driver polls
+// its descriptor and calls serve() when it is readable.
+class Stats_server
+{
+public:
+  Stats_server(Dataplane&, std::string const&);
+  ~Stats_server();
+
+  Stats_server(Stats_server const&) = delete;
+  Stats_server& operator=(Stats_server const&) = delete;
+
+  // Report the occupancy of the given buffer pool.
+  void set_pool(Pool* p) { pool_ = p; }
+
+  int                fd() const   { return fd_; }
+  std::string const& path() const { return path_; }
+
+  void        serve();
+  std::string snapshot() const;
+
+private:
+  Dataplane&  dp_;
+  std::string path_;
+  int         fd_;
+  Pool*       pool_;
+};
+
+
+} // namespace fp
+
+
+#endif
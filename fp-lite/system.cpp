@@ -4,8 +4,10 @@
 #include "endian.hpp"
 #include "context.hpp"
 #include "dataplane.hpp"
+#include "trace.hpp"
 
 #include <cassert>
+#include <cstdarg>
 
 
 namespace fp
@@ -99,6 +101,25 @@ namespace fp
 } // end namespace fp
 
 
+namespace
+{
+
+// Passes the context's packet through the given meter. Returns
+// true if the packet was dropped.
+bool
+meter_packet(fp::Context* cxt, unsigned int id)
+{
+  fp::Meter* m = cxt->dataplane()->meters().find(id);
+  if (!m || m->apply(*cxt) != fp::Meter::DROP)
+    return false;
+  cxt->set_drop_reason(fp::DROP_METER);
+  fp_drop(cxt);
+  return true;
+}
+
+} // namespace
+
+
 //////////////////////////////////////////////////////////////////////////
 //                    External Runtime System Calls                     //
 //////////////////////////////////////////////////////////////////////////
@@ -144,19 +165,24 @@ fp_output_port(fp::Context* cxt, fp::Port::Id id)
 }
 
 
-// Apply the given action to the context.
+// Apply the given action to the context. If the action cannot
+// be applied, the packet is dropped as malformed.
 void
 fp_apply(fp::Context* cxt, fp::Action a)
 {
+  cxt->no_cache();
   cxt->apply_action(a);
 }
 
 
-// Write the given action to the context's action list.
+// Write the given action to the context's action list. If the
+// list is full, the packet is dropped as malformed.
 void
 fp_write(fp::Context* cxt, fp::Action a)
 {
-  cxt->write_action(a);
+  cxt->no_cache();
+  if (!cxt->write_action(a))
+    cxt->drop(fp::DROP_MALFORMED);
 }
 
 
@@ -168,6 +194,145 @@ fp_clear(fp::Context* cxt)
 }
 
 
+// Advances the current header offset by n bytes.
+void
+fp_advance_header(fp::Context* cxt, std::uint16_t n)
+{
+  cxt->advance(n);
+}
+
+
+// Binds the current header offset to the given identifier.
+void
+fp_bind_header(fp::Context* cxt, int id)
+{
+  cxt->bind_header(id);
+}
+
+
+// Binds a field to a section of the packet, given by an offset
+// relative to the current header and a length. Returns a pointer
+// to the field.
+//
+// Fields are bound at their absolute offsets, since that is how
+// they are looked up by fp_gather. The caller may read the field
+// through the returned pointer, so the forwarding decision is
+// assumed to depend on it.
+fp::Byte*
+fp_bind_field(fp::Context* cxt, int id, std::uint16_t off, std::uint16_t len)
+{
+  int abs_off = cxt->offset() + off;
+  cxt->bind_field(id, abs_off, len);
+  if (cxt->record_.active)
+    cxt->record_.access(abs_off, len);
+  return cxt->get_field(abs_off);
+}
+
+
+// Binds headers of the given protocol (see fp::Protocol) to an
+// identifier when packets are parsed by fp_parse. This is called
+// by an application when it is loaded.
+void
+fp_declare_header(fp::Dataplane* dp, int id, int proto)
+{
+  assert(dp);
+  dp->declare_header(id, proto);
+}
+
+
+// Binds the given protocol field (see fp::Protocol_field) to an
+// identifier when packets are parsed by fp_parse. This is called
+// by an application when it is loaded.
+void
+fp_declare_field(fp::Dataplane* dp, int id, int field)
+{
+  assert(dp);
+  dp->declare_field(id, field);
+}
+
+
+// Parses the context's packet with the dataplane's parse graph,
+// binding every declared header and field that the packet has.
+// Returns 0 if the packet is truncated, in which case it is counted
+// as malformed if it is dropped.
+int
+fp_parse(fp::Context* cxt)
+{
+  if (cxt->dataplane()->get_parser()->parse(*cxt))
+    return 1;
+  cxt->set_drop_reason(fp::DROP_MALFORMED);
+  return 0;
+}
+
+
+// Adds n bytes to the front of the packet, and returns a pointer
+// to them, or nullptr if the packet's buffer cannot hold them.
+// Header and field bindings are removed.
+fp::Byte*
+fp_push_header(fp::Context* cxt, int n)
+{
+  cxt->no_cache();
+  cxt->clear_bindings();
+  return cxt->packet().push(n);
+}
+
+
+// Removes n bytes from the front of the packet. Returns 0 if the
+// packet is shorter than n bytes. Header and field bindings are
+// removed.
+int
+fp_pop_header(fp::Context* cxt, int n)
+{
+  cxt->no_cache();
+  if (n > cxt->packet().length())
+    return 0;
+  cxt->clear_bindings();
+  cxt->packet().pull(n);
+  return 1;
+}
+
+
+// Encapsulates the packet in the given tunnel. Returns 0 if the
+// packet cannot be encapsulated.
+int
+fp_encap(fp::Context* cxt, fp::Tunnel const* t)
+{
+  assert(t);
+  cxt->no_cache();
+  return fp::encap(*cxt, *t);
+}
+
+
+// Removes the packet's outermost tunnel headers. Returns 0 if the
+// packet is not tunneled.
+int
+fp_decap(fp::Context* cxt)
+{
+  cxt->no_cache();
+  return fp::decap(*cxt);
+}
+
+
+// Copies n bytes at the given offset of the packet, which may span
+// its segments, into buf. Returns the number of bytes copied.
+int
+fp_read_packet(fp::Context* cxt, int off, fp::Byte* buf, int n)
+{
+  cxt->no_cache();
+  return cxt->packet().read(off, buf, n);
+}
+
+
+// Copies n bytes from buf to the given offset of the packet, which
+// may span its segments. Returns the number of bytes copied.
+int
+fp_write_packet(fp::Context* cxt, int off, fp::Byte const* buf, int n)
+{
+  cxt->no_cache();
+  return cxt->packet().write(off, buf, n);
+}
+
+
 // Dispatches the given context to the given table, if it exists.
 // Accepts a variadic list of fields needed to construct a key to
 // match against the table.
@@ -179,7 +344,29 @@ fp_goto_table(fp::Context* cxt, fp::Table* tbl, int n, ...)
   fp::Key key = fp_gather(cxt, tbl->key_size(), n, args);
   va_end(args);
 
-  fp::Flow flow = tbl->search(key);
+  // Apply the flow's precompiled actions before executing its
+  // instructions, which may redirect to another table.
+  fp::Flow& flow = tbl->search(key);
+  cxt->set_match(tbl, &flow);
+  flow.count_->count(cxt->packet().total_length());
+#ifdef FP_TRACE
+  if (&flow == &tbl->miss())
+    fp::trace(*cxt, fp::TRACE_TABLE_MISS, tbl->id(), 0);
+  else
+    fp::trace(*cxt, fp::TRACE_TABLE_HIT, tbl->id(), flow.pri_);
+#endif
+
+  // Metered flows may drop the packet before any actions or
+  // instructions are executed. Since that depends on the rate
+  // of the flow, the decision is not cached.
+  if (flow.meter_ && meter_packet(cxt, flow.meter_)) {
+    cxt->no_cache();
+    return;
+  }
+
+  if (!flow.prog_.is_empty())
+    cxt->apply_program(flow.prog_);
+
   // execute the flow function
   flow.instr_(&flow, tbl, cxt);
 }
@@ -246,6 +433,31 @@ fp_port_is_down(fp::Port* p)
 }
 
 
+// Adds an egress queue to the given port with the given
+// priority, DRR quantum, shaping rate (bytes per second), and
+// burst size (bytes). A rate of 0 disables shaping. Returns
+// the id of the new queue.
+int
+fp_port_add_queue(fp::Dataplane* dp, fp::Port::Id id, int prio,
+                  unsigned int quantum, std::uint64_t rate, std::uint64_t burst)
+{
+  assert(dp);
+  fp::Port* p = dp->get_port(id);
+  if (!p)
+    throw std::string("No such port");
+  return p->enable_queues().add_class(prio, quantum, rate, burst);
+}
+
+
+// Selects the egress queue for the context's packet.
+void
+fp_set_queue(fp::Context* cxt, unsigned int q)
+{
+  assert(cxt);
+  cxt->set_queue(q);
+}
+
+
 // Copies the values within 'n' fields into a byte buffer
 // and constructs a key from it.
 //
@@ -298,6 +510,8 @@ fp_gather(fp::Context* cxt, int key_width, int n, va_list args)
         // Lookup the field in the context.
         b = cxt->get_field_binding(f);
         p = cxt->get_field(b.offset);
+        if (cxt->record_.active)
+          cxt->record_.access(b.offset, b.length);
         
         // Copy the field into the buffer.
         std::copy(p, p + b.length, &buf[j]);
@@ -321,11 +535,22 @@ fp_gather(fp::Context* cxt, int key_width, int n, va_list args)
 
 // Creates a new table in the given data plane with the given size,
 // key width, and table type.
+//
+// If the data plane already has a table with the given id, that
+// table is returned instead. This allows a replacement application
+// to adopt the tables (and flows) of the one it replaces. Throws an
+// exception if the existing table is not compatible.
 fp::Table*
 fp_create_table(fp::Dataplane* dp, int id, int key_width, int size, fp::Table::Type type)
 {
   assert(dp);
 
+  if (fp::Table* tbl = dp->get_table(id)) {
+    if (tbl->type() != type || tbl->key_size() != key_width)
+      throw std::string("Table already exists");
+    return tbl;
+  }
+
   fp::Table* tbl = nullptr;
 
   switch (type)
@@ -352,6 +577,16 @@ fp_create_table(fp::Dataplane* dp, int id, int key_width, int size, fp::Table::T
 }
 
 
+// Returns the table with the given id, or nullptr if no such
+// table exists.
+fp::Table*
+fp_get_table(fp::Dataplane* dp, int id)
+{
+  assert(dp);
+  return dp->get_table(id);
+}
+
+
 // Creates a new flow rule from the given key and function pointer
 // and adds it to the given table.
 //
@@ -438,6 +673,27 @@ fp_del_flow(fp::Table* tbl, void* key)
   tbl->erase(k);
 }
 
+// Begins a bulk update of the given table. Flows added to or
+// removed from the table are not visible to the dataplane until
+// the update is committed.
+void
+fp_begin_update(fp::Table* tbl)
+{
+  assert(tbl);
+  tbl->stage();
+}
+
+
+// Atomically applies all changes made to the table since the
+// update began.
+void
+fp_commit_update(fp::Table* tbl)
+{
+  assert(tbl);
+  tbl->commit();
+}
+
+
 // Removes the miss case from the given table and replaces
 // it with the default.
 void
@@ -448,6 +704,201 @@ fp_del_miss(fp::Table* tbl)
 }
 
 
+// Compiles the given actions into the program of the flow
+// matching the given key. The flow must already exist.
+void
+fp_set_flow_actions(fp::Table* tbl, void* key, fp::Action const* a, int n)
+{
+  assert(tbl);
+  assert(key);
+
+  fp::Key k;
+  std::memcpy(&k, key, sizeof(k));
+
+  fp::Flow flow;
+  if (!tbl->fetch(k, flow))
+    throw std::string("No flow matching key");
+  if (!flow.prog_.compile(a, n))
+    throw std::string("Invalid or too many actions for flow");
+  tbl->update(k, flow);
+}
+
+
+// Compiles the given actions into the program of the table's
+// miss flow. The program is compiled before it is published, so
+// that workers never see a partially compiled program.
+void
+fp_set_miss_actions(fp::Table* tbl, fp::Action const* a, int n)
+{
+  assert(tbl);
+  fp::Action_program prog;
+  if (!prog.compile(a, n))
+    throw std::string("Invalid or too many actions for flow");
+  tbl->set_miss_program(prog);
+}
+
+
+// Creates a new group with the given id and type in the
+// dataplane's group table.
+fp::Group*
+fp_add_group(fp::Dataplane* dp, unsigned int id, fp::Group::Type type)
+{
+  assert(dp);
+  return &dp->groups().insert(id, type);
+}
+
+
+// Removes the given group, if it exists.
+void
+fp_del_group(fp::Dataplane* dp, unsigned int id)
+{
+  assert(dp);
+  dp->groups().erase(id);
+}
+
+
+// Adds a bucket with the given weight, watch port, and actions
+// to the group.
+void
+fp_add_bucket(fp::Group* g, unsigned int weight, unsigned int watch, fp::Action const* a, int n)
+{
+  assert(g);
+  g->add_bucket(weight, watch, a, n);
+}
+
+
+// Selects the group to apply to the context prior to egress.
+void
+fp_group(fp::Context* cxt, unsigned int id)
+{
+  assert(cxt);
+  cxt->set_group(id);
+}
+
+
+// Creates a new meter with the given id and unit in the
+// dataplane's meter table.
+fp::Meter*
+fp_add_meter(fp::Dataplane* dp, unsigned int id, fp::Meter::Unit unit)
+{
+  assert(dp);
+  return &dp->meters().insert(id, unit);
+}
+
+
+// Removes the given meter, if it exists.
+void
+fp_del_meter(fp::Dataplane* dp, unsigned int id)
+{
+  assert(dp);
+  dp->meters().erase(id);
+}
+
+
+// Adds a band to the meter with the given rate and burst size,
+// in the units of the meter. The precedence level is used only
+// by DSCP remark bands.
+void
+fp_add_meter_band(fp::Meter* m, fp::Meter_band::Type type,
+                  std::uint64_t rate, std::uint64_t burst, int prec)
+{
+  assert(m);
+  m->add_band({type, std::uint8_t(prec), rate, burst});
+}
+
+
+// Meters the flow matching the given key with the given meter.
+// A meter id of 0 removes the flow's meter.
+void
+fp_set_flow_meter(fp::Table* tbl, void* key, unsigned int id)
+{
+  assert(tbl);
+  assert(key);
+
+  fp::Key k;
+  std::memcpy(&k, key, sizeof(k));
+
+  fp::Flow flow;
+  if (!tbl->fetch(k, flow))
+    throw std::string("No flow matching key");
+  flow.meter_ = id;
+  tbl->update(k, flow);
+}
+
+
+// Passes the context's packet through the given meter. If
+// the meter drops the packet, the context is directed to the
+// drop port and the result is non-zero. Unknown meters pass
+// all packets.
+//
+// The result depends on the rate of traffic, so a packet
+// metered by the application is not cached.
+int
+fp_meter(fp::Context* cxt, unsigned int id)
+{
+  assert(cxt);
+  cxt->no_cache();
+  return meter_packet(cxt, id);
+}
+
+
+// Enables the given flow caches of the dataplane: 1 for the
+// microflow cache, 2 for the megaflow cache, or both. The caches
+// are disabled by 0.
+//
+// An application should only enable the microflow cache if its
+// forwarding decisions are fully determined by a packet's five
+// tuple and input port, and the megaflow cache if it reads the
+// packet only through field bindings.
+void
+fp_enable_flow_cache(fp::Dataplane* dp, int modes)
+{
+  assert(dp);
+  dp->enable_flow_cache(modes);
+}
+
+
+// -------------------------------------------------------------------------- //
+// Connection tracking
+
+// Enable connection tracking for the dataplane, with a table of
+// n connections. Applications call this when they are loaded.
+void
+fp_ct_enable(fp::Dataplane* dp, int n)
+{
+  assert(dp);
+  dp->enable_conntrack(n);
+}
+
+
+// Returns the status of the packet's connection, as a set of
+// fp::Conntrack::Status flags, or 0 if connection tracking is not
+// enabled or the packet cannot be tracked. A packet of a committed
+// connection advances the state of the connection.
+//
+// The decision depends on the connection's state, so it is not
+// cached.
+int
+fp_ct_lookup(fp::Context* cxt)
+{
+  cxt->no_cache();
+  fp::Conntrack* ct = cxt->dataplane()->conntrack();
+  return ct ? ct->lookup(*cxt) : 0;
+}
+
+
+// Commits the packet's connection. Returns 0 if connection tracking
+// is not enabled, the packet cannot be tracked, or the connection
+// table is full.
+int
+fp_ct_commit(fp::Context* cxt)
+{
+  cxt->no_cache();
+  fp::Conntrack* ct = cxt->dataplane()->conntrack();
+  return ct && ct->commit(*cxt);
+}
+
+
 // Raise an event.
 //
 // TODO: Make this asynchronous on another thread. 
@@ -461,7 +912,8 @@ fp_raise_event(fp::Context* cxt, void* handler)
   // of void (*)(Context*)
   void (*event)(fp::Context*) = (void (*)(fp::Context*))(handler);
   
-  // Invoke the event.
+  // Invoke the event. The event's effects are not cached.
+  cxt->no_cache();
   // FIXME: This should produce a copy of the context and process it
   // seperately.
   //
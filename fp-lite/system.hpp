@@ -4,11 +4,32 @@
 #include "port.hpp"
 #include "table.hpp"
 #include "action.hpp"
+#include "group.hpp"
+#include "meter.hpp"
+#include "tunnel.hpp"
 
 
 extern "C"
 {
 
+// Packet decoding.
+void           fp_advance_header(fp::Context*, std::uint16_t);
+void           fp_bind_header(fp::Context*, int);
+fp::Byte*      fp_bind_field(fp::Context*, int, std::uint16_t, std::uint16_t);
+void           fp_declare_header(fp::Dataplane*, int, int);
+void           fp_declare_field(fp::Dataplane*, int, int);
+int            fp_parse(fp::Context*);
+
+// Header insertion and removal.
+fp::Byte*      fp_push_header(fp::Context*, int);
+int            fp_pop_header(fp::Context*, int);
+int            fp_encap(fp::Context*, fp::Tunnel const*);
+int            fp_decap(fp::Context*);
+
+// Packet access across segments.
+int            fp_read_packet(fp::Context*, int, fp::Byte*, int);
+int            fp_write_packet(fp::Context*, int, fp::Byte const*, int);
+
 // Apply actions.
 void           fp_drop(fp::Context*);
 void           fp_flood(fp::Context*);
@@ -30,16 +51,44 @@ bool           fp_port_id_is_down(fp::Dataplane*, fp::Port::Id);
 int            fp_port_get_id(fp::Port*);
 int            fp_port_is_up(fp::Port*);
 int            fp_port_is_down(fp::Port*);
+int            fp_port_add_queue(fp::Dataplane*, fp::Port::Id, int, unsigned int, std::uint64_t, std::uint64_t);
+void           fp_set_queue(fp::Context*, unsigned int);
 
 
 // Flow tables.
 fp::Table*     fp_create_table(fp::Dataplane*, int, int, int, fp::Table::Type);
 void           fp_delete_table(fp::Dataplane*, fp::Table*);
+fp::Table*     fp_get_table(fp::Dataplane*, int);
 void           fp_add_init_flow(fp::Table*, void*, void*, unsigned int, unsigned int);
 void           fp_add_new_flow(fp::Table*, void*, void*, unsigned int, unsigned int);
 void           fp_add_miss(fp::Table*, void*, unsigned int, unsigned int);
 void           fp_del_flow(fp::Table*, void*);
 void           fp_del_miss(fp::Table*);
+void           fp_begin_update(fp::Table*);
+void           fp_commit_update(fp::Table*);
+void           fp_set_flow_actions(fp::Table*, void*, fp::Action const*, int);
+void           fp_set_miss_actions(fp::Table*, fp::Action const*, int);
+
+// Groups.
+fp::Group*     fp_add_group(fp::Dataplane*, unsigned int, fp::Group::Type);
+void           fp_del_group(fp::Dataplane*, unsigned int);
+void           fp_add_bucket(fp::Group*, unsigned int, unsigned int, fp::Action const*, int);
+void           fp_group(fp::Context*, unsigned int);
+
+// Meters.
+fp::Meter*     fp_add_meter(fp::Dataplane*, unsigned int, fp::Meter::Unit);
+void           fp_del_meter(fp::Dataplane*, unsigned int);
+void           fp_add_meter_band(fp::Meter*, fp::Meter_band::Type, std::uint64_t, std::uint64_t, int);
+void           fp_set_flow_meter(fp::Table*, void*, unsigned int);
+int            fp_meter(fp::Context*, unsigned int);
+
+// Caching.
+void           fp_enable_flow_cache(fp::Dataplane*, int);
+
+// Connection tracking.
+void           fp_ct_enable(fp::Dataplane*, int);
+int            fp_ct_lookup(fp::Context*);
+int            fp_ct_commit(fp::Context*);
 
 // Raising events
 void           fp_raise_event(fp::Context*, void*);
@@ -1,4 +1,6 @@
 #include "table.hpp"
+#include "rcu.hpp"
+#include "cache.hpp"
 
 namespace fp
 {
@@ -13,16 +15,178 @@ namespace fp
 // }
 
 
+namespace
+{
+
+// The initial number of buckets is the requested size rounded up
+// to a power of two, but no smaller than this.
+constexpr std::size_t min_buckets = 16;
+
+
+inline std::size_t
+round_buckets(std::size_t n)
+{
+  std::size_t b = min_buckets;
+  while (b < n)
+    b *= 2;
+  return b;
+}
+
+} // namespace
+
+
+// -------------------------------------------------------------------------- //
+// Table
+
+Table::Table(Type t, int id, int k)
+  : type_(t), id_(id), key_size_(k), miss_(new Flow())
+{ }
+
+
+// The table must not be in use by any worker.
+Table::~Table()
+{
+  delete miss_.load();
+}
+
+
+// Publish a new miss flow, and retire the previous one. Cached
+// decisions may refer to the previous flow, so they are invalidated
+// before it is retired. The caller holds the miss mutex.
+void
+Table::replace_miss(Flow* f)
+{
+  Flow* old = miss_.exchange(f, std::memory_order_acq_rel);
+  invalidate_flow_caches();
+  rcu_retire(old);
+}
+
+
+// Replace the miss flow.
+void
+Table::insert_miss(Flow const& f)
+{
+  std::lock_guard<std::mutex> lock(miss_mutex_);
+  replace_miss(new Flow(f));
+}
+
+
+// Replace the miss flow with the default, which drops packets.
+void
+Table::erase_miss()
+{
+  std::lock_guard<std::mutex> lock(miss_mutex_);
+  replace_miss(new Flow());
+}
+
+
+// Replace the action program of the miss flow. Its instructions
+// and counts are kept.
+void
+Table::set_miss_program(Action_program const& prog)
+{
+  std::lock_guard<std::mutex> lock(miss_mutex_);
+  Flow* f = new Flow(*miss_.load(std::memory_order_relaxed));
+  f->prog_ = prog;
+  replace_miss(f);
+}
+
+
+// Replace the instructions of the miss flow, as determined by fn
+// (see Relink_fn). If fn returns nullptr, the default miss flow is
+// installed.
+void
+Table::relink_miss(Relink_fn fn, void* arg)
+{
+  std::lock_guard<std::mutex> lock(miss_mutex_);
+  Flow const* cur = miss_.load(std::memory_order_relaxed);
+  Flow_instructions instr = fn(cur->instr_, arg);
+  if (instr == cur->instr_)
+    return;
+  Flow* f = instr ? new Flow(*cur) : new Flow();
+  if (instr)
+    f->instr_ = instr;
+  replace_miss(f);
+}
+
+
+// -------------------------------------------------------------------------- //
+// Hash table version
+
+Hash_table::Version::Version(std::size_t n)
+  : mask(n - 1), count(0), heads(new std::atomic<Node*>[n]())
+{ }
+
+
+Hash_table::Version::~Version()
+{
+  for (std::size_t i = 0; i <= mask; ++i) {
+    Node* n = heads[i].load(std::memory_order_relaxed);
+    while (n) {
+      Node* next = n->next.load(std::memory_order_relaxed);
+      delete n;
+      n = next;
+    }
+  }
+}
+
+
+// Returns the node with the given key, or nullptr if there
+// is no such node.
+Hash_table::Node*
+Hash_table::Version::find(Key const& k) const
+{
+  Node* n = heads[Key_hash()(k) & mask].load(std::memory_order_acquire);
+  while (n && n->key != k)
+    n = n->next.load(std::memory_order_acquire);
+  return n;
+}
+
+
+// Returns a copy of this version with n buckets. The copy shares
+// no nodes with the original.
+Hash_table::Version*
+Hash_table::Version::copy(std::size_t n) const
+{
+  Version* v = new Version(n);
+  for (std::size_t i = 0; i <= mask; ++i) {
+    Node* p = heads[i].load(std::memory_order_relaxed);
+    for ( ; p; p = p->next.load(std::memory_order_relaxed)) {
+      std::atomic<Node*>& b = v->bucket(p->key);
+      b.store(new Node(p->key, p->flow, b.load(std::memory_order_relaxed)),
+              std::memory_order_relaxed);
+    }
+  }
+  v->count = count;
+  return v;
+}
+
+
+// -------------------------------------------------------------------------- //
+// Hash table
+
+Hash_table::Hash_table(int id, int size, int k)
+  : Table(Table::EXACT, id, k),
+    current_(new Version(round_buckets(size))),
+    staged_(nullptr)
+{ }
+
+
+// The table must not be in use by any worker.
+Hash_table::~Hash_table()
+{
+  delete staged_;
+  delete current_.load();
+}
+
+
 // Returns a reference to a flow. If no flow matches the
 // key, the table-miss flow is returned.
 Flow&
 Hash_table::search(Key const& k)
 {
-  auto iter = std::unordered_map<Key, Flow, Key_hash>::find(k);
-  if (iter == end())
-    return miss_;
-  else
-    return iter->second;
+  Node* n = current_.load(std::memory_order_acquire)->find(k);
+  return n ? n->flow : miss();
 }
 
 
@@ -31,20 +195,79 @@ Hash_table::search(Key const& k)
 Flow const&
 Hash_table::search(Key const& k) const
 {
-  auto iter = std::unordered_map<Key, Flow, Key_hash>::find(k);
-  if (iter == end())
-    return miss_;
-  else
-    return iter->second;
+  Node* n = current_.load(std::memory_order_acquire)->find(k);
+  return n ? n->flow : miss();
+}
+
+
+// Returns the version modified by writers: the staged version
+// if an update is in progress, or the current version.
+inline Hash_table::Version*
+Hash_table::writable() const
+{
+  return staged_ ? staged_ : current_.load(std::memory_order_relaxed);
+}
+
+
+// Replace the current version. The previous version is retired.
+//
+// Every change visible to readers invalidates cached decisions
+// before anything is retired, so that cached references to flows
+// are never used after their grace period.
+void
+Hash_table::publish(Version* v)
+{
+  Version* old = current_.exchange(v, std::memory_order_acq_rel);
+  invalidate_flow_caches();
+  rcu_retire(old);
+}
+
+
+// Destroy a node that has been unlinked from the writable version.
+// Nodes of the current version may still be in use.
+void
+Hash_table::discard(Node* n)
+{
+  if (staged_) {
+    delete n;
+  }
+  else {
+    invalidate_flow_caches();
+    rcu_retire(n);
+  }
 }
 
 
 // If an equivalent flow entry exists, no action is taken.
-// Returns a reference to the inserted (or previous) flow.
+//
+// When the load factor exceeds 1, the table is doubled in size.
+// The current version is copied and the copy published, so that
+// readers are never exposed to a partially rehashed table.
 void
 Hash_table::insert(Key const& k, Flow const& f)
 {
-  Map::insert({k, f});
+  std::lock_guard<std::mutex> lock(mutex_);
+  Version* v = writable();
+  if (v->find(k))
+    return;
+
+  if (v->count >= v->mask + 1) {
+    Version* g = v->copy(2 * (v->mask + 1));
+    if (staged_) {
+      delete staged_;
+      staged_ = g;
+    }
+    else {
+      publish(g);
+    }
+    v = g;
+  }
+
+  std::atomic<Node*>& b = v->bucket(k);
+  b.store(new Node(k, f, b.load(std::memory_order_relaxed)), std::memory_order_release);
+  ++v->count;
+  if (!staged_)
+    invalidate_flow_caches();
 }
 
 
@@ -52,7 +275,156 @@ Hash_table::insert(Key const& k, Flow const& f)
 void
 Hash_table::erase(Key const& k)
 {
-  Map::erase(k);
+  std::lock_guard<std::mutex> lock(mutex_);
+  Version* v = writable();
+  std::atomic<Node*>* link = &v->bucket(k);
+  Node* n = link->load(std::memory_order_relaxed);
+  while (n && n->key != k) {
+    link = &n->next;
+    n = link->load(std::memory_order_relaxed);
+  }
+  if (!n)
+    return;
+
+  link->store(n->next.load(std::memory_order_relaxed), std::memory_order_release);
+  --v->count;
+  discard(n);
+}
+
+
+// Copies the flow matching the key into f, as seen by writers
+// (i.e., including staged changes). Returns false if there is
+// no such flow.
+bool
+Hash_table::fetch(Key const& k, Flow& f) const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  Node* n = writable()->find(k);
+  if (!n)
+    return false;
+  f = n->flow;
+  return true;
+}
+
+
+// Replaces the flow matching the key. The previous flow is not
+// modified; a new entry takes its place in the chain, and keeps
+// the counters of the previous flow, which workers may still be
+// updating. Returns false if there is no such flow.
+bool
+Hash_table::update(Key const& k, Flow const& f)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  Version* v = writable();
+  std::atomic<Node*>* link = &v->bucket(k);
+  Node* n = link->load(std::memory_order_relaxed);
+  while (n && n->key != k) {
+    link = &n->next;
+    n = link->load(std::memory_order_relaxed);
+  }
+  if (!n)
+    return false;
+
+  Node* m = new Node(k, f, n->next.load(std::memory_order_relaxed));
+  m->flow.count_ = n->flow.count_;
+  link->store(m, std::memory_order_release);
+  discard(n);
+  return true;
+}
+
+
+// Begin a bulk update. Subsequent changes are not visible to
+// readers until the update is committed. If an update is already
+// in progress, no action is taken.
+void
+Hash_table::stage()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!staged_) {
+    Version* v = current_.load(std::memory_order_relaxed);
+    staged_ = v->copy(v->mask + 1);
+  }
+}
+
+
+// Atomically replace the table's contents with those of the
+// staged update. If no update is in progress, no action is taken.
+void
+Hash_table::commit()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (staged_) {
+    publish(staged_);
+    staged_ = nullptr;
+  }
+}
+
+
+// Replace the instructions of every flow, including the miss
+// flow, as determined by fn. Flows for which fn returns nullptr
+// are removed. The changes to the current version are published
+// as a single version. If an update is staged, its flows are
+// relinked as well, so that committing it does not restore the
+// previous instructions.
+void
+Hash_table::relink(Relink_fn fn, void* arg)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  Version* cur = current_.load(std::memory_order_relaxed);
+  Version* v = cur->copy(cur->mask + 1);
+  relink(v, fn, arg);
+  publish(v);
+  if (staged_)
+    relink(staged_, fn, arg);
+
+  relink_miss(fn, arg);
+}
+
+
+// Relink the flows of a version that is not visible to readers.
+void
+Hash_table::relink(Version* v, Relink_fn fn, void* arg)
+{
+  for (std::size_t i = 0; i <= v->mask; ++i) {
+    std::atomic<Node*>* link = &v->heads[i];
+    while (Node* n = link->load(std::memory_order_relaxed)) {
+      if (Flow_instructions instr = fn(n->flow.instr_, arg)) {
+        n->flow.instr_ = instr;
+        link = &n->next;
+      }
+      else {
+        link->store(n->next.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        --v->count;
+        delete n;
+      }
+    }
+  }
+}
+
+
+// Call fn for each flow visible to readers (i.e., excluding staged
+// changes), but not the miss flow. Writers are blocked during the
+// visit, so no flow is retired while it is visited; readers are
+// not.
+void
+Hash_table::visit(Visit_fn fn, void* arg) const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  Version* v = current_.load(std::memory_order_relaxed);
+  for (std::size_t i = 0; i <= v->mask; ++i) {
+    Node* n = v->heads[i].load(std::memory_order_relaxed);
+    for ( ; n; n = n->next.load(std::memory_order_relaxed))
+      fn(n->key, n->flow, arg);
+  }
+}
+
+
+// Returns the number of flows visible to writers.
+std::size_t
+Hash_table::size() const
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  return writable()->count;
 }
 
 } // namespace fp
@@ -4,10 +4,13 @@
 
 #include "types.hpp"
 #include "flow.hpp"
+#include "cache.hpp"
 
+#include <atomic>
 #include <cstring>
 #include <algorithm>
-#include <unordered_map>
+#include <memory>
+#include <mutex>
 
 // Used for boost::hash_combine in the key hash function. This is
 // not a particularly good implementation.
@@ -95,64 +98,144 @@ struct Table
 {
   enum Type { EXACT, PREFIX, WILDCARD };
 
-  Table(Type t, int id, int k)
-    : type_(t), id_(id), key_size_(k), miss_()
-  { }
+  // A relink function maps the instructions of a flow to their
+  // replacements when an application is replaced, or returns
+  // nullptr if the flow should be removed.
+  using Relink_fn = Flow_instructions (*)(Flow_instructions, void*);
 
-  virtual ~Table() { }
+  // A visit function is called for each flow of a table.
+  using Visit_fn = void (*)(Key const&, Flow const&, void*);
+
+  Table(Type, int, int);
+  virtual ~Table();
 
   virtual Flow&       search(Key const&)       = 0;
   virtual Flow const& search(Key const&) const = 0;
   
   virtual void insert(Key const&, Flow const&) = 0;
   virtual void erase(Key const&) = 0;
+  virtual bool fetch(Key const&, Flow&) const = 0;
+  virtual bool update(Key const&, Flow const&) = 0;
+
+  virtual void stage() = 0;
+  virtual void commit() = 0;
+  virtual void relink(Relink_fn, void*) = 0;
+  virtual void visit(Visit_fn, void*) const = 0;
   
-  void insert_miss(Flow const& f) { miss_ = f; }
-  void erase_miss() { miss_ = Flow(); }
+  // The miss flow. Like other flows, it is never modified while
+  // readers may see it: a replacement is published and the previous
+  // miss flow is retired through RCU.
+  void insert_miss(Flow const&);
+  void erase_miss();
+  void set_miss_program(Action_program const&);
+  void relink_miss(Relink_fn, void*);
+
+  Flow&       miss()       { return *miss_.load(std::memory_order_acquire); }
+  Flow const& miss() const { return *miss_.load(std::memory_order_acquire); }
 
   Type type() const { return type_; }
   int  key_size() const { return key_size_; }
-  Flow miss()const { return miss_; }
   int  id() const { return id_; }
 
   Type type_;
   int id_;
   int key_size_;
-  
-  // NOTE: The default constructed Flow contains the miss rule as its 
+
+protected:
+  void replace_miss(Flow*);
+
+  // NOTE: The default constructed Flow contains the miss rule as its
   // instruction.
   //
   // FIXME: Some tables (notably prefix and wildcard) can locate the
   // miss rule by an actual key.
-  Flow miss_;
+  std::atomic<Flow*> miss_;
+  std::mutex         miss_mutex_;
 };
 
 
 // An exact match table.
 //
-// TODO: Use an open-address table.
+// The table is a chained hash table that supports concurrent
+// lookup by workers while flows are inserted and removed. Searches
+// take no locks. Writers are serialized by a mutex, and never
+// modify a flow that a reader may see: new entries are linked in
+// with a single store, removed and replaced entries are retired
+// through RCU, and resizing publishes a new version of the table.
+// A flow returned by search() remains valid until the caller's
+// next quiescent state.
 //
-// TODO: Support equivalent flows with multiple priorities.
+// Bulk updates are staged. Between stage() and commit(), inserts
+// and removals apply to a private copy of the table, which is
+// then published atomically; readers see either all or none of
+// the changes.
+//
+// The miss flow is published in the same way (see Table).
 //
-// TODO: Support move semantics for flows.
+// TODO: Support equivalent flows with multiple priorities.
 //
 // TODO: All of our tables match the same headers. OpenFlow
 // requires those matches to be translated into OXM's but
 // we want to be protocol agnostic. How do we solve this
 // problem?
-struct Hash_table : Table, private std::unordered_map<Key, Flow, Key_hash>
+struct Hash_table : Table
 {
-  using Map = std::unordered_map<Key, Flow, Key_hash>;
-
-  Hash_table(int id, int size, int k)
-    : Table(Table::EXACT, id, k), Map(size)
-  { }
+  Hash_table(int id, int size, int k);
+  ~Hash_table();
 
   Flow&       search(Key const&) override;
   Flow const& search(Key const&) const override;
 
   void insert(Key const&, Flow const&) override;
   void erase(Key const&) override;
+  bool fetch(Key const&, Flow&) const override;
+  bool update(Key const&, Flow const&) override;
+
+  void stage() override;
+  void commit() override;
+  void relink(Relink_fn, void*) override;
+  void visit(Visit_fn, void*) const override;
+
+  std::size_t size() const;
+
+private:
+  struct Node
+  {
+    Node(Key const& k, Flow const& f, Node* n)
+      : key(k), flow(f), next(n)
+    { }
+
+    Key                key;
+    Flow               flow;
+    std::atomic<Node*> next;
+  };
+
+  // A version of the table is an array of bucket chains. The
+  // version owns the nodes that are reachable from its buckets.
+  struct Version
+  {
+    explicit Version(std::size_t);
+    ~Version();
+
+    std::atomic<Node*>& bucket(Key const& k) { return heads[Key_hash()(k) & mask]; }
+    Node*               find(Key const&) const;
+
+    Version* copy(std::size_t) const;
+
+    std::size_t                           mask;
+    std::size_t                           count;
+    std::unique_ptr<std::atomic<Node*>[]> heads;
+  };
+
+  Version* writable() const;
+  void     publish(Version*);
+  void     discard(Node*);
+
+  static void relink(Version*, Relink_fn, void*);
+
+  std::atomic<Version*> current_;
+  Version*              staged_;
+  mutable std::mutex    mutex_;
 };
 
 
@@ -0,0 +1,69 @@
+// The checks are kept when NDEBUG is defined.
+#undef NDEBUG
+
+#include "action.hpp"
+#include "context.hpp"
+#include "dataplane.hpp"
+#include "drop.hpp"
+
+#include <cassert>
+#include <iostream>
+
+using namespace fp;
+
+
+constexpr int length = 60;
+
+
+// Apply the action to a packet of 60 bytes in a larger buffer,
+// either directly or compiled into a program. Returns true if the
+// packet was not dropped as malformed.
+bool
+run(Dataplane& dp, Action const& a, bool compiled, Byte* buf, int cap)
+{
+  Context cxt(&dp, Packet(buf, cap));
+  cxt.packet().limit(length);
+  if (!compiled)
+    return cxt.apply_action(a);
+  Action_program prog;
+  bool ok = prog.compile(&a, 1);
+  assert(ok);
+  cxt.apply_program(prog);
+  return cxt.drop_reason() != DROP_MALFORMED;
+}
+
+
+// Sets and copies behave the same whether or not they are compiled.
+// Fields that end past the packet's data, even within its tailroom,
+// drop the packet without writing any of it.
+void
+test_bounds()
+{
+  Dataplane dp("dp");
+  Byte v[] = { 1, 2 };
+  struct Case { int off; bool ok; };
+  for (Case c : { Case{ 0, true }, Case{ length - 2, true }, Case{ length - 1, false },
+                  Case{ length, false }, Case{ 100, false } }) {
+    Action set(Set_action(Packet_memory, c.off, 2, v));
+    Action copy(Copy_action{ Field{ Metadata_memory, 0, 2 }, std::uint16_t(c.off) });
+    for (Action const& a : { set, copy }) {
+      for (bool compiled : { false, true }) {
+        Byte buf[128] = {};
+        bool ok = run(dp, a, compiled, buf, sizeof(buf));
+        assert(ok == c.ok);
+        if (!ok) {
+          for (Byte b : buf)
+            assert(b == 0);
+        }
+      }
+    }
+  }
+}
+
+
+int
+main()
+{
+  test_bounds();
+  std::cout << "ok\n";
+}
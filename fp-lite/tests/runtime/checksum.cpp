@@ -0,0 +1,315 @@
+// The checks are kept when NDEBUG is defined.
+#undef NDEBUG
+
+#include "checksum.hpp"
+#include "context.hpp"
+#include "packet.hpp"
+
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+using namespace fp;
+
+
+// The sum of big-endian words, one at a time (RFC 1071).
+std::uint16_t
+reference(Byte const* p, int n)
+{
+  std::uint64_t s = 0;
+  for (int i = 0; i + 1 < n; i += 2)
+    s += p[i] << 8 | p[i + 1];
+  if (n & 1)
+    s += p[n - 1] << 8;
+  while (s >> 16)
+    s = (s & 0xffff) + (s >> 16);
+  return ~s;
+}
+
+
+std::uint16_t
+load16(Byte const* p)
+{
+  return p[0] << 8 | p[1];
+}
+
+
+void
+store16(Byte* p, std::uint16_t v)
+{
+  p[0] = v >> 8;
+  p[1] = v & 0xff;
+}
+
+
+Checksum_isa const isas[] = { CHECKSUM_SCALAR, CHECKSUM_SSE2, CHECKSUM_AVX2 };
+
+
+// The example of RFC 1071, sec. 3.
+void
+test_example()
+{
+  Byte b[] = { 0x00, 0x01, 0xf2, 0x03, 0xf4, 0xf5, 0xf6, 0xf7 };
+  assert(reference(b, 8) == 0x220d);
+  std::uint16_t c = checksum(b, 8);
+  assert(c == 0x220d);
+  for (Checksum_isa i : isas) {
+    c = checksum(b, 8, i);
+    assert(c == 0x220d);
+  }
+}
+
+
+// Every implementation agrees with the reference for all lengths
+// up to several vectors, at every alignment, including odd lengths
+// that leave a trailing byte.
+void
+test_lengths()
+{
+  std::vector<Byte> buf(600);
+  std::srand(1);
+  for (Byte& b : buf)
+    b = std::rand();
+  for (int off = 0; off < 4; ++off) {
+    for (int n = 0; n + off <= (int)buf.size(); ++n) {
+      std::uint16_t c = reference(&buf[off], n);
+      std::uint16_t x = checksum(&buf[off], n);
+      assert(x == c);
+      for (Checksum_isa i : isas) {
+        x = checksum(&buf[off], n, i);
+        assert(x == c);
+      }
+    }
+  }
+}
+
+
+// Sums of more than one block of vectors are widened without
+// overflowing their lanes.
+void
+test_large()
+{
+  std::vector<Byte> buf(1 << 20, 0xff);
+  buf[12345] = 0x12;
+  std::uint16_t c = reference(buf.data(), buf.size());
+  std::uint16_t d = reference(buf.data(), buf.size() - 1);
+  for (Checksum_isa i : isas) {
+    std::uint16_t x = checksum(buf.data(), buf.size(), i);
+    assert(x == c);
+    x = checksum(buf.data(), buf.size() - 1, i);
+    assert(x == d);
+  }
+}
+
+
+// -------------------------------------------------------------------------- //
+// Checksum updates
+
+constexpr int l3 = 14;
+constexpr int l4 = 34;
+
+
+// Build an Ethernet frame with an IPv4 header and a TCP or UDP
+// segment carrying n bytes of payload.
+int
+make_frame(Byte* p, std::uint8_t proto, int n)
+{
+  int seg = (proto == 6 ? 20 : 8) + n;
+  std::memset(p, 0, l4 + seg);
+  p[12] = 0x08;
+  p[l3] = 0x45;
+  store16(p + l3 + 2, 20 + seg);
+  p[l3 + 8] = 64;
+  p[l3 + 9] = proto;
+  Byte src[] = { 10, 0, 0, 1 };
+  Byte dst[] = { 192, 168, 1, 77 };
+  std::memcpy(p + l3 + 12, src, 4);
+  std::memcpy(p + l3 + 16, dst, 4);
+  store16(p + l4, 40000);
+  store16(p + l4 + 2, 80);
+  if (proto == 6)
+    p[l4 + 12] = 0x50;
+  else
+    store16(p + l4 + 4, seg);
+  for (int i = 0; i < n; ++i)
+    p[l4 + seg - n + i] = i * 13 + 1;
+  return l4 + seg;
+}
+
+
+// Returns the transport checksum of the frame, computed over the
+// pseudo-header and the segment.
+std::uint16_t
+transport_checksum(Byte const* p, int len)
+{
+  int seg = len - l4;
+  std::vector<Byte> b(12 + seg);
+  std::memcpy(&b[0], p + l3 + 12, 8);
+  b[9] = p[l3 + 9];
+  store16(&b[10], seg);
+  std::memcpy(&b[12], p + l4, seg);
+  int off = 12 + (p[l3 + 9] == 6 ? 16 : 6);
+  b[off] = b[off + 1] = 0;
+  return reference(b.data(), b.size());
+}
+
+
+// Set the checksums of the frame, leaving a UDP checksum of zero
+// if asked.
+void
+seal(Byte* p, int len, bool udp_zero = false)
+{
+  store16(p + l3 + 10, 0);
+  store16(p + l3 + 10, reference(p + l3, 20));
+  int off = l4 + (p[l3 + 9] == 6 ? 16 : 6);
+  store16(p + off, 0);
+  if (!udp_zero)
+    store16(p + off, transport_checksum(p, len));
+}
+
+
+// Returns true if the checksums of the frame are correct.
+bool
+valid(Byte const* p, int len)
+{
+  if (reference(p + l3, 20) != 0)
+    return false;
+  int off = l4 + (p[l3 + 9] == 6 ? 16 : 6);
+  std::uint16_t c = load16(p + off);
+  if (p[l3 + 9] == 17 && c == 0)
+    return true;
+  std::uint16_t t = transport_checksum(p, len);
+  return c == t || (t == 0 && c == 0xffff);
+}
+
+
+void
+test_ttl()
+{
+  Byte buf[128];
+  int len = make_frame(buf, 6, 11);
+  seal(buf, len);
+  assert(valid(buf, len));
+  Packet pkt(buf, len);
+  pkt.limit(len);
+  std::uint16_t tcp = load16(buf + l4 + 16);
+  for (int i = 0; i < 64; ++i) {
+    Checksum_update u(pkt, l3 + 8, 1);
+    --buf[l3 + 8];
+    u.commit();
+    assert(valid(buf, len));
+  }
+  assert(buf[l3 + 8] == 0);
+  assert(load16(buf + l4 + 16) == tcp);
+}
+
+
+// Rewrite the source address and port, as a NAT does, in one
+// update and in separate updates.
+void
+test_nat(std::uint8_t proto)
+{
+  Byte buf[128];
+  int len = make_frame(buf, proto, 7);
+  seal(buf, len);
+  Packet pkt(buf, len);
+  pkt.limit(len);
+  Byte addr[] = { 203, 0, 113, 9 };
+  {
+    Checksum_update u(pkt, l3 + 12, 4);
+    std::memcpy(buf + l3 + 12, addr, 4);
+    u.commit();
+  }
+  assert(valid(buf, len));
+  {
+    Checksum_update u(pkt, l4, 2);
+    store16(buf + l4, 1024);
+    u.commit();
+  }
+  assert(valid(buf, len));
+
+  // Rewrite the destination address and port, which are not
+  // adjacent, at an odd offset within the header.
+  {
+    Checksum_update u(pkt, l3 + 17, 3);
+    buf[l3 + 17] = 1;
+    buf[l3 + 18] = 2;
+    buf[l3 + 19] = 3;
+    u.commit();
+  }
+  assert(valid(buf, len));
+  {
+    Checksum_update u(pkt, l4 + 3, 1);
+    buf[l4 + 3] = 0x99;
+    u.commit();
+  }
+  assert(valid(buf, len));
+}
+
+
+// A zero UDP checksum means there is none, and is kept.
+void
+test_udp_zero()
+{
+  Byte buf[128];
+  int len = make_frame(buf, 17, 5);
+  seal(buf, len, true);
+  assert(valid(buf, len));
+  Packet pkt(buf, len);
+  pkt.limit(len);
+  Checksum_update u(pkt, l3 + 16, 4);
+  std::memset(buf + l3 + 16, 0x7f, 4);
+  u.commit();
+  assert(valid(buf, len));
+  assert(load16(buf + l4 + 6) == 0);
+}
+
+
+// Set actions applied by a context share the packet's layout,
+// and find it again if a rewrite changes it.
+void
+test_context()
+{
+  Byte buf[128];
+  int len = make_frame(buf, 17, 9);
+  seal(buf, len);
+  Context cxt(nullptr, Packet(buf, len));
+  cxt.packet().limit(len);
+
+  // Values are given in native byte order.
+  Byte ttl[] = { 7 };
+  Byte port[] = { 0x35, 0x00 };
+  bool ok = cxt.apply_action(Set_action(Packet_memory, l3 + 8, 1, ttl));
+  assert(ok);
+  assert(cxt.decode_.has_layout);
+  ok = cxt.apply_action(Set_action(Packet_memory, l4 + 2, 2, port));
+  assert(ok);
+  assert(valid(buf, len));
+  assert(buf[l3 + 8] == 7);
+  assert(load16(buf + l4 + 2) == 53);
+
+  // Rewriting the protocol changes the layout.
+  Byte tcp[] = { 6 };
+  ok = cxt.apply_action(Set_action(Packet_memory, l3 + 9, 1, tcp));
+  assert(ok);
+  assert(!cxt.decode_.has_layout);
+  cxt.checksum_layout();
+  assert(cxt.decode_.layout.proto == 6);
+}
+
+
+int
+main()
+{
+  test_example();
+  test_lengths();
+  test_large();
+  test_ttl();
+  test_nat(6);
+  test_nat(17);
+  test_udp_zero();
+  test_context();
+  std::cout << "ok\n";
+}
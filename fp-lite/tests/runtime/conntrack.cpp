@@ -0,0 +1,245 @@
+// The checks are kept when NDEBUG is defined.
+#undef NDEBUG
+
+#include "conntrack.hpp"
+#include "context.hpp"
+#include "packet.hpp"
+
+#include <cassert>
+#include <cstring>
+#include <iostream>
+
+using namespace fp;
+
+
+constexpr int l3 = 14;
+constexpr int l4 = 34;
+
+// TCP flags.
+constexpr Byte fin = 0x01;
+constexpr Byte syn = 0x02;
+constexpr Byte rst = 0x04;
+constexpr Byte ack = 0x10;
+
+constexpr int established = Conntrack::TRACKED | Conntrack::ESTABLISHED;
+constexpr int reply = established | Conntrack::REPLY;
+constexpr int fresh = Conntrack::TRACKED | Conntrack::NEW;
+
+
+// A packet of a TCP or UDP conversation between two hosts, in
+// either direction.
+struct Frame
+{
+  Frame(std::uint8_t proto, int host, std::uint16_t port)
+    : pkt(buf, sizeof(buf)), cxt(nullptr, pkt)
+  {
+    std::memset(buf, 0, sizeof(buf));
+    buf[12] = 0x08;
+    buf[l3] = 0x45;
+    buf[l3 + 9] = proto;
+    Byte src[] = { 10, 0, 0, Byte(host) };
+    Byte dst[] = { 192, 168, 0, 1 };
+    std::memcpy(buf + l3 + 12, src, 4);
+    std::memcpy(buf + l3 + 16, dst, 4);
+    buf[l4] = port >> 8;
+    buf[l4 + 1] = port & 0xff;
+    buf[l4 + 3] = 80;
+    buf[l4 + 12] = 0x50;
+    cxt.packet().limit(l4 + 20);
+  }
+
+  // Set the TCP flags, in the given direction.
+  Context& tcp(Byte f, bool rev = false)
+  {
+    if (rev != reversed) {
+      for (int i = 0; i < 4; ++i)
+        std::swap(buf[l3 + 12 + i], buf[l3 + 16 + i]);
+      std::swap(buf[l4], buf[l4 + 2]);
+      std::swap(buf[l4 + 1], buf[l4 + 3]);
+      reversed = rev;
+    }
+    buf[l4 + 13] = f;
+    return cxt;
+  }
+
+  Byte    buf[64];
+  Packet  pkt;
+  Context cxt;
+  bool    reversed = false;
+};
+
+
+// The handshake and close of a TCP connection. Each state is given
+// a distinct timeout, and each packet arrives just before the
+// connection would expire in the state reached by the previous one.
+void
+test_tcp()
+{
+  Conntrack ct(16);
+  int st;
+  bool ok;
+  ct.set_timeout(Conntrack::TCP_SYN_SENT, 11);
+  ct.set_timeout(Conntrack::TCP_SYN_RECV, 12);
+  ct.set_timeout(Conntrack::TCP_FIN_WAIT, 14);
+  ct.set_timeout(Conntrack::TCP_LAST_ACK, 15);
+  ct.set_timeout(Conntrack::TCP_TIME_WAIT, 16);
+
+  Frame f(6, 1, 40000);
+  std::uint32_t t = 0;
+  st = ct.lookup(f.tcp(syn), t);
+  assert(st == fresh);
+  ok = ct.commit(f.tcp(syn), t);
+  assert(ok);
+  assert(ct.size() == 1);
+
+  t += 10;
+  st = ct.lookup(f.tcp(syn | ack, true), t);
+  assert(st == reply);
+  t += 11;
+  st = ct.lookup(f.tcp(ack), t);
+  assert(st == established);
+
+  // Established connections outlive the SYN timeouts.
+  t += 100;
+  st = ct.lookup(f.tcp(ack, true), t);
+  assert(st == reply);
+
+  // Both sides close, and the last ACK enters TIME_WAIT.
+  t += 1000;
+  st = ct.lookup(f.tcp(fin | ack), t);
+  assert(st == established);
+  t += 13;
+  st = ct.lookup(f.tcp(fin | ack, true), t);
+  assert(st == reply);
+  t += 14;
+  st = ct.lookup(f.tcp(ack), t);
+  assert(st == established);
+  t += 15;
+  ct.expire(t);
+  assert(ct.size() == 1);
+  ++t;
+  ct.expire(t);
+  assert(ct.size() == 0);
+  st = ct.lookup(f.tcp(ack), t);
+  assert(st == fresh);
+}
+
+
+// A connection that does not complete its handshake expires with
+// the SYN timeout, and invalid flags are reported.
+void
+test_tcp_invalid()
+{
+  Conntrack ct(16);
+  int st;
+  bool ok;
+  Frame f(6, 2, 40001);
+  st = ct.lookup(f.tcp(syn | fin), 0);
+  assert(st == (fresh | Conntrack::INVALID));
+  ok = ct.commit(f.tcp(syn | fin), 0);
+  assert(!ok);
+  ok = ct.commit(f.tcp(syn), 0);
+  assert(ok);
+  st = ct.lookup(f.tcp(0, true), 1);
+  assert(st == (reply | Conntrack::INVALID));
+  ct.expire(119);
+  assert(ct.size() == 1);
+  ct.expire(120);
+  assert(ct.size() == 0);
+
+  // A reset closes the connection.
+  ok = ct.commit(f.tcp(ack), 200);
+  assert(ok);
+  st = ct.lookup(f.tcp(rst, true), 201);
+  assert(st == reply);
+  ct.expire(210);
+  assert(ct.size() == 1);
+  ct.expire(211);
+  assert(ct.size() == 0);
+}
+
+
+// An established connection is scheduled at most one wheel ahead,
+// and is rescheduled each time the wheel comes around, until its
+// timeout of 432000 seconds elapses. The wheel is advanced in steps
+// shorter and longer than the wheel.
+void
+test_wheel_wrap()
+{
+  static_assert(432000 > Conntrack::wheel_size, "");
+  Conntrack ct(16);
+  bool ok;
+  Frame f(6, 3, 40002);
+  std::uint32_t t0 = 5;
+  ok = ct.commit(f.tcp(ack), t0);
+  assert(ok);
+  std::uint32_t t = t0;
+  for (int i = 0; i < 50; ++i) {
+    t += 1000;
+    ct.expire(t);
+    assert(ct.size() == 1);
+  }
+  t += 3 * Conntrack::wheel_size + 17;
+  ct.expire(t);
+  assert(ct.size() == 1);
+  ct.expire(t0 + 432000 - 1);
+  assert(ct.size() == 1);
+  ct.expire(t0 + 432000);
+  assert(ct.size() == 0);
+}
+
+
+// Commits fail when the table is full, and succeed again once
+// connections expire. UDP connections are unreplied until a reply
+// is seen.
+void
+test_full()
+{
+  Conntrack ct(4);
+  int st;
+  bool ok;
+  assert(ct.capacity() == 4);
+  Frame f0(17, 10, 1000), f1(17, 11, 1000), f2(17, 12, 1000);
+  Frame f3(17, 13, 1000), f4(17, 14, 1000);
+  ok = ct.commit(f0.cxt, 0);
+  assert(ok);
+  ok = ct.commit(f1.cxt, 0);
+  assert(ok);
+  ok = ct.commit(f2.cxt, 0);
+  assert(ok);
+  ok = ct.commit(f3.cxt, 1);
+  assert(ok);
+  assert(ct.size() == 4);
+  ok = ct.commit(f4.cxt, 1);
+  assert(!ok);
+  st = ct.lookup(f4.cxt, 1);
+  assert(st == fresh);
+
+  // Committing again has no effect, and a reply extends the
+  // connection's timeout.
+  ok = ct.commit(f0.cxt, 2);
+  assert(ok);
+  assert(ct.size() == 4);
+  st = ct.lookup(f0.tcp(0, true), 2);
+  assert(st == reply);
+
+  ct.expire(30);
+  assert(ct.size() == 2);
+  ct.expire(31);
+  assert(ct.size() == 1);
+  ok = ct.commit(f4.cxt, 31);
+  assert(ok);
+  st = ct.lookup(f0.cxt, 31);
+  assert(st == reply);
+}
+
+
+int
+main()
+{
+  test_tcp();
+  test_tcp_invalid();
+  test_wheel_wrap();
+  test_full();
+  std::cout << "ok\n";
+}
@@ -0,0 +1,111 @@
+// The checks are kept when NDEBUG is defined.
+#undef NDEBUG
+
+#include "egress.hpp"
+#include "port.hpp"
+#include "context.hpp"
+#include "dataplane.hpp"
+#include "packet.hpp"
+
+#include <cassert>
+#include <iostream>
+#include <vector>
+
+using namespace fp;
+
+
+// A port that records the lengths of the frames it sends.
+struct Test_port : Port
+{
+  Test_port() : Port(1) { }
+
+  bool open() override  { return true; }
+  bool close() override { return true; }
+  bool recv(Context&) override { return false; }
+
+  bool send(Context& cxt) override
+  {
+    sent.push_back(cxt.packet().total_length());
+    return true;
+  }
+
+  std::vector<int> sent;
+};
+
+
+void
+release(Context*, void*)
+{ }
+
+
+// A frame longer than the burst of a shaped class is sent once the
+// bucket is full, and the frames behind it wait until the tokens it
+// overdraws are repaid.
+void
+test_oversize()
+{
+  Dataplane dp("dp");
+  Egress_queue_set qs;
+  int q = qs.add_class(1, Egress_queue_set::default_quantum, 1000, 2000);
+
+  static Byte jumbo[9000];
+  static Byte small[100];
+  Context big(&dp, Packet(jumbo));
+  Context next(&dp, Packet(small));
+  big.packet().limit(sizeof(jumbo));
+  next.packet().limit(sizeof(small));
+  bool ok = qs.enqueue(&big, q);
+  assert(ok);
+  ok = qs.enqueue(&next, q);
+  assert(ok);
+
+  // The DRR deficit reaches the frame's length within a few
+  // rounds, and the frame is sent.
+  Test_port port;
+  std::uint64_t t = Token_bucket::now();
+  int n = 0;
+  for (int i = 0; i < 10 && n == 0; ++i)
+    n = qs.schedule(port, 8, release, nullptr);
+  assert(n == 1);
+  assert(port.sent.size() == 1 && port.sent[0] == 9000);
+  assert(qs[q].sent == 1);
+
+  // At 1000 bytes per second, the 7000 overdrawn bytes take
+  // seconds to repay.
+  n = qs.schedule(port, 8, release, nullptr);
+  assert(n == 0);
+  assert(Token_bucket::now() - t < 1000000000);
+  qs.discard(release, nullptr);
+}
+
+
+// Frames within the burst are unaffected.
+void
+test_burst()
+{
+  Dataplane dp("dp");
+  Egress_queue_set qs;
+  int q = qs.add_class(1, Egress_queue_set::default_quantum, 1000, 2000);
+  static Byte buf[1000];
+  Context a(&dp, Packet(buf));
+  Context b(&dp, Packet(buf));
+  Context c(&dp, Packet(buf));
+  for (Context* x : {&a, &b, &c}) {
+    x->packet().limit(sizeof(buf));
+    bool ok = qs.enqueue(x, q);
+    assert(ok);
+  }
+  Test_port port;
+  int n = qs.schedule(port, 8, release, nullptr);
+  assert(n == 2);
+  qs.discard(release, nullptr);
+}
+
+
+int
+main()
+{
+  test_oversize();
+  test_burst();
+  std::cout << "ok\n";
+}
@@ -0,0 +1,126 @@
+// The checks are kept when NDEBUG is defined.
+#undef NDEBUG
+
+#include "tunnel.hpp"
+#include "checksum.hpp"
+#include "context.hpp"
+#include "packet.hpp"
+
+#include <cassert>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+using namespace fp;
+
+
+constexpr int room = 64;
+
+// The bytes added by a VXLAN tunnel, and by its outer IPv4 datagram.
+constexpr int vxlan_len = 50;
+constexpr int vxlan_ip_len = vxlan_len - 14;
+
+Byte const dst[] = { 0x02, 0, 0, 0, 0, 0x01 };
+Byte const src[] = { 0x02, 0, 0, 0, 0, 0x02 };
+
+
+std::uint16_t
+load16(Byte const* p)
+{
+  return p[0] << 8 | p[1];
+}
+
+
+// A packet of n bytes, with headroom for a tunnel, whose first
+// segment holds at most seg bytes and is followed by a second
+// segment holding the rest.
+struct Frame
+{
+  Frame(int n, int seg)
+    : head(room + seg), tail(n > seg ? n - seg : 0),
+      cxt(nullptr, Packet(head.data(), head.size(), room)),
+      rest(tail.data(), tail.size())
+  {
+    Packet& p = cxt.packet();
+    p.limit(std::min(n, seg));
+    std::memset(p.data(), 0, p.length());
+    p.data()[12] = 0x08;
+    p.data()[14] = 0x45;
+    if (n > seg) {
+      rest.limit(n - seg);
+      p.next_ = &rest;
+    }
+  }
+
+  std::vector<Byte> head;
+  std::vector<Byte> tail;
+  Context           cxt;
+  Packet            rest;
+};
+
+
+// Check the outer headers of a VXLAN packet whose inner frame has
+// n bytes.
+void
+check_vxlan(Packet const& p, int n)
+{
+  Byte const* ip = p.data() + 14;
+  assert(p.total_length() == n + vxlan_len);
+  assert(load16(ip + 2) == n + vxlan_ip_len);
+  assert(checksum(ip, 20) == 0);
+  assert(load16(ip + 20 + 2) == 4789);
+  assert(load16(ip + 20 + 4) == n + vxlan_ip_len - 20);
+}
+
+
+// Encapsulation of small frames, and of frames whose outer datagram
+// has the largest length IPv4 allows.
+void
+test_vxlan()
+{
+  Tunnel t = Tunnel::vxlan(dst, src, 0x0a000001, 0x0a000002, 42);
+  assert(t.length == vxlan_len);
+  for (int n : { 60, 1514, 65535 - vxlan_ip_len }) {
+    Frame f(n, 2048);
+    bool ok = encap(f.cxt, t);
+    assert(ok);
+    check_vxlan(f.cxt.packet(), n);
+
+    // The tunnel is removed again.
+    ok = decap(f.cxt);
+    assert(ok);
+    assert(f.cxt.input_.tunnel_id == 42);
+    assert(f.cxt.packet().total_length() == n);
+  }
+}
+
+
+// A frame too large for the outer datagram is not encapsulated,
+// and is left unchanged.
+void
+test_oversize()
+{
+  Tunnel vx = Tunnel::vxlan(dst, src, 0x0a000001, 0x0a000002, 42);
+  Tunnel gre = Tunnel::gre(dst, src, 0x0a000001, 0x0a000002, 7);
+  for (int n : { 65535 - vxlan_ip_len + 1, 65536, 98304 }) {
+    Frame f(n, 2048);
+    Byte const* data = f.cxt.packet().data();
+    bool ok = encap(f.cxt, vx);
+    assert(!ok);
+    if (n > 65535 - (gre.length - 14)) {
+      ok = encap(f.cxt, gre);
+      assert(!ok);
+    }
+    assert(f.cxt.packet().data() == data);
+    assert(f.cxt.packet().total_length() == n);
+  }
+}
+
+
+int
+main()
+{
+  test_vxlan();
+  test_oversize();
+  std::cout << "ok\n";
+}
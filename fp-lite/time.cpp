@@ -1,18 +1,81 @@
 #include "time.hpp"
 
-#include <chrono>
+#if defined(__x86_64__)
+#  include <cpuid.h>
+#endif
 
 namespace fp
 {
 
-using namespace std::chrono;
+namespace Time
+{
+
+namespace
+{
 
+// The interval over which the TSC is calibrated, in nanoseconds.
+constexpr std::uint64_t calibration_interval = 10000000;
 
-inline Timestamp
-Time::current() const
+
+inline std::uint64_t
+monotonic_ns()
 {
-	return (duration_cast<::milliseconds>(std::chrono::steady_clock::now()).count());
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return std::uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
 }
 
 
-}	// namespace fp
+// Returns true if the processor has an invariant TSC, which runs
+// at a constant rate in all power states.
+bool
+has_invariant_tsc()
+{
+#if defined(__x86_64__)
+  unsigned a, b, c, d;
+  if (!__get_cpuid(0x80000000, &a, &b, &c, &d) || a < 0x80000007)
+    return false;
+  __get_cpuid(0x80000007, &a, &b, &c, &d);
+  return d & (1u << 8);
+#else
+  return false;
+#endif
+}
+
+
+// Measure the TSC frequency against CLOCK_MONOTONIC_RAW, or fall
+// back to that clock if there is no invariant TSC.
+Calibration
+calibrate()
+{
+  Calibration c = {false, 1000000000, std::uint64_t(1) << 32};
+#if defined(__x86_64__)
+  if (!has_invariant_tsc())
+    return c;
+  std::uint64_t t0 = monotonic_ns();
+  std::uint64_t c0 = __rdtsc();
+  std::uint64_t t1;
+  do
+    t1 = monotonic_ns();
+  while (t1 - t0 < calibration_interval);
+  std::uint64_t c1 = __rdtsc();
+  if (c1 <= c0)
+    return c;
+  double hz = double(c1 - c0) * 1e9 / (t1 - t0);
+  c.tsc = true;
+  c.hz = hz;
+  c.mult = 1e9 / hz * 4294967296.0;
+#endif
+  return c;
+}
+
+
+} // namespace
+
+
+Calibration const calibration = calibrate();
+
+
+} // namespace Time
+
+} // namespace fp
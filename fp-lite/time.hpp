@@ -5,10 +5,24 @@
 // view of what 'time' is, and provides time relation functionality
 // such as timers...
 //
+// Timestamps are read from the processor's time stamp counter
+// when it runs at a constant rate (an invariant TSC), which costs
+// a few cycles and no system call. Otherwise, they are read from
+// CLOCK_MONOTONIC_RAW, in nanoseconds. Either way, timestamps
+// are ticks of a monotonic clock, and must be converted to compare
+// them with wall clock durations.
+//
 // TODO: Implement a flow timer.
 
 #include "types.hpp"
 
+#include <cstdint>
+#include <time.h>
+
+#if defined(__x86_64__)
+#  include <x86intrin.h>
+#endif
+
 namespace fp
 {
 
@@ -19,7 +33,65 @@ using Timestamp = std::uint64_t;
 namespace Time
 {
 
-inline Timestamp current() const;
+// The calibration of the clock. Nanoseconds are computed from
+// ticks as (ticks * mult) >> 32.
+struct Calibration
+{
+  bool          tsc;  // True if ticks are TSC cycles.
+  std::uint64_t hz;   // Ticks per second.
+  std::uint64_t mult; // Nanoseconds per tick, scaled by 2^32.
+};
+
+extern Calibration const calibration;
+
+
+// Returns the current time, in ticks.
+inline Timestamp
+current()
+{
+#if defined(__x86_64__)
+  if (calibration.tsc)
+    return __rdtsc();
+#endif
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return std::uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+
+// Returns the number of ticks per second.
+inline std::uint64_t
+frequency()
+{
+  return calibration.hz;
+}
+
+
+// Convert ticks to nanoseconds.
+inline std::uint64_t
+to_nanoseconds(Timestamp t)
+{
+  std::uint64_t m = calibration.mult;
+  return (t >> 32) * m + (((t & 0xffffffff) * m) >> 32);
+}
+
+
+// Convert nanoseconds to ticks.
+inline Timestamp
+from_nanoseconds(std::uint64_t ns)
+{
+  return ns / 1000000000 * calibration.hz +
+         ns % 1000000000 * calibration.hz / 1000000000;
+}
+
+
+// Convert ticks to seconds.
+inline double
+to_seconds(Timestamp t)
+{
+  return double(t) / calibration.hz;
+}
+
 
 } // namespace time
 
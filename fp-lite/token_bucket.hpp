@@ -0,0 +1,123 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#ifndef FP_TOKEN_BUCKET_HPP
+#define FP_TOKEN_BUCKET_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+
+namespace fp
+{
+
+// A token bucket admits up to `rate` units per second, with
+// bursts of up to `burst` units. Units are whatever the owner
+// counts: bytes for shapers, packets or bits for meters.
+//
+// Refills are timed by a clock of `scale` ticks per second:
+// nanoseconds (see now()) unless the owner gives another, such
+// as the runtime clock (see time.hpp). Tokens are kept in units
+// of 1/scale, so that refilling requires no division. A rate of
+// 0 means that the bucket is unlimited.
+//
+// The bucket is not synchronized. Each bucket must be used by
+// a single thread.
+struct Token_bucket
+{
+  static constexpr std::uint64_t ns_per_second = 1000000000;
+
+  Token_bucket()
+    : rate(0), scale(ns_per_second), cap(0), tokens(0), last(0)
+  { }
+
+  Token_bucket(std::uint64_t r, std::uint64_t b, std::uint64_t hz = ns_per_second)
+    : rate(r), scale(hz), cap(b * hz), tokens(b * hz), last(0)
+  { }
+
+  bool is_unlimited() const { return rate == 0; }
+
+  void refill(std::uint64_t);
+  bool consume(std::uint64_t, std::uint64_t);
+  bool overdraw(std::uint64_t, std::uint64_t);
+
+  static std::uint64_t now();
+
+  std::uint64_t rate;   // Units per second.
+  std::uint64_t scale;  // Clock ticks per second.
+  std::uint64_t cap;    // Scaled burst size.
+  std::uint64_t tokens; // Scaled available tokens.
+  std::uint64_t last;   // Time of the last refill, in ticks.
+};
+
+
+// Returns the current time in nanoseconds on a monotonic
+// clock.
+inline std::uint64_t
+Token_bucket::now()
+{
+  using namespace std::chrono;
+  auto t = steady_clock::now().time_since_epoch();
+  return duration_cast<nanoseconds>(t).count();
+}
+
+
+// Add the tokens accumulated since the last refill.
+inline void
+Token_bucket::refill(std::uint64_t t)
+{
+  if (t <= last)
+    return;
+  std::uint64_t elapsed = t - last;
+  last = t;
+
+  // Avoid overflowing the product for long idle periods.
+  std::uint64_t room = cap - tokens;
+  if (elapsed >= room / rate + 1)
+    tokens = cap;
+  else
+    tokens = std::min(cap, tokens + elapsed * rate);
+}
+
+
+// Take n units from the bucket at time t. Returns false,
+// leaving the bucket unchanged, if there are not enough
+// tokens.
+inline bool
+Token_bucket::consume(std::uint64_t n, std::uint64_t t)
+{
+  if (is_unlimited())
+    return true;
+  refill(t);
+  std::uint64_t need = n * scale;
+  if (tokens < need)
+    return false;
+  tokens -= need;
+  return true;
+}
+
+
+// Take n units from the bucket at time t, where n may exceed the
+// burst size. A request larger than the bucket is admitted when the
+// bucket is full, and the tokens it overdraws are repaid before the
+// bucket refills again, so that the long-term rate is kept. Returns
+// false if there are not enough tokens.
+inline bool
+Token_bucket::overdraw(std::uint64_t n, std::uint64_t t)
+{
+  if (consume(n, t))
+    return true;
+  std::uint64_t need = n * scale;
+  if (need <= cap || tokens < cap)
+    return false;
+  tokens = 0;
+  last = t + (need - cap) / rate;
+  return true;
+}
+
+
+} // namespace fp
+
+
+#endif
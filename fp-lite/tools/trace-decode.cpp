@@ -0,0 +1,189 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+// The fp-trace tool decodes a dump of trace rings (see trace.hpp)
+// and prints its events in the order they occurred, one per line:
+//
+//    fp-trace /tmp/flowpath-wire.trace --packet=0100000000000007
+//
+// Events may be selected by packet tag, worker, and event name.
+// Times are in microseconds from the first event in the dump.
+
+#include "trace.hpp"
+#include "drop.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+
+using namespace fp;
+
+
+namespace
+{
+
+struct Options
+{
+  char const*   path   = nullptr;
+  std::uint64_t packet = 0;   // 0 selects all packets.
+  int           worker = -1;  // -1 selects all workers.
+  int           event  = -1;  // -1 selects all events.
+};
+
+
+// An event, and the worker that recorded it.
+struct Event
+{
+  Trace_record  rec;
+  std::uint32_t worker;
+};
+
+
+char const* const action_names[] = {
+  "set", "copy", "output", "queue", "group"
+};
+
+
+void
+usage()
+{
+  std::fprintf(stderr,
+    "usage: fp-trace <dump> [options]\n"
+    "    --packet=<tag>    Events of the packet with the (hex) tag\n"
+    "    --worker=<n>      Events recorded by the worker\n"
+    "    --event=<name>    Events of the kind (e.g., drop)\n");
+  std::exit(1);
+}
+
+
+Options
+parse(int argc, char* argv[])
+{
+  Options opt;
+  for (int i = 1; i < argc; ++i) {
+    char const* a = argv[i];
+    if (std::strncmp(a, "--packet=", 9) == 0)
+      opt.packet = std::strtoull(a + 9, nullptr, 16);
+    else if (std::strncmp(a, "--worker=", 9) == 0)
+      opt.worker = std::atoi(a + 9);
+    else if (std::strncmp(a, "--event=", 8) == 0) {
+      for (int e = 0; e < num_trace_events; ++e)
+        if (std::strcmp(a + 8, trace_event_name(e)) == 0)
+          opt.event = e;
+      if (opt.event < 0)
+        usage();
+    }
+    else if (a[0] != '-' && !opt.path)
+      opt.path = a;
+    else
+      usage();
+  }
+  if (!opt.path)
+    usage();
+  return opt;
+}
+
+
+// Describes the object and value of an event.
+std::string
+describe(Trace_record const& r)
+{
+  char buf[128];
+  unsigned long long v = r.value;
+  switch (r.event) {
+  case TRACE_PORT_RX:
+  case TRACE_PORT_TX:
+    std::snprintf(buf, sizeof(buf), "port=%u len=%llu", r.object, v);
+    break;
+  case TRACE_TABLE_HIT:
+    std::snprintf(buf, sizeof(buf), "table=%u priority=%llu", r.object, v);
+    break;
+  case TRACE_TABLE_MISS:
+    std::snprintf(buf, sizeof(buf), "table=%u", r.object);
+    break;
+  case TRACE_ACTION:
+    if (r.object < sizeof(action_names) / sizeof(*action_names))
+      std::snprintf(buf, sizeof(buf), "%s %llu", action_names[r.object], v);
+    else
+      std::snprintf(buf, sizeof(buf), "type=%u %llu", r.object, v);
+    break;
+  case TRACE_DROP:
+    std::snprintf(buf, sizeof(buf), "port=%u reason=%s", r.object, drop_reason_name(v));
+    break;
+  default:
+    std::snprintf(buf, sizeof(buf), "object=%u value=%llu", r.object, v);
+    break;
+  }
+  return buf;
+}
+
+
+} // namespace
+
+
+int
+main(int argc, char* argv[])
+{
+  Options opt = parse(argc, argv);
+
+  FILE* f = std::fopen(opt.path, "rb");
+  if (!f) {
+    std::perror(opt.path);
+    return 1;
+  }
+
+  Trace_file_header fh;
+  if (std::fread(&fh, sizeof(fh), 1, f) != 1 ||
+      std::memcmp(fh.magic, "FPTRACE", 8) != 0) {
+    std::fprintf(stderr, "%s: not a trace dump\n", opt.path);
+    return 1;
+  }
+  if (fh.version != trace_version || fh.record_size != sizeof(Trace_record)) {
+    std::fprintf(stderr, "%s: unsupported version %u\n", opt.path, fh.version);
+    return 1;
+  }
+
+  // Read each ring, noting the events that were overwritten.
+  std::vector<Event> events;
+  Trace_ring_header rh;
+  while (std::fread(&rh, sizeof(rh), 1, f) == 1) {
+    std::fprintf(stderr, "[fp-trace] worker %u: %u events, %llu overwritten\n",
+                 rh.worker, rh.count, (unsigned long long)(rh.total - rh.count));
+    for (std::uint32_t i = 0; i < rh.count; ++i) {
+      Event e;
+      if (std::fread(&e.rec, sizeof(e.rec), 1, f) != 1) {
+        std::fprintf(stderr, "%s: truncated dump\n", opt.path);
+        return 1;
+      }
+      e.worker = rh.worker;
+      if (opt.packet && e.rec.packet != opt.packet)
+        continue;
+      if (opt.worker >= 0 && e.worker != std::uint32_t(opt.worker))
+        continue;
+      if (opt.event >= 0 && e.rec.event != opt.event)
+        continue;
+      events.push_back(e);
+    }
+  }
+  std::fclose(f);
+
+  // Workers' clocks are synchronized, so their events are ordered
+  // by time. Events of a worker keep their order.
+  std::stable_sort(events.begin(), events.end(), [](Event const& a, Event const& b) {
+    return a.rec.time < b.rec.time;
+  });
+
+  std::uint64_t t0 = events.empty() ? 0 : events.front().rec.time;
+  double hz = fh.hz ? double(fh.hz) : 1e9;
+  for (Event const& e : events) {
+    std::printf("%14.3f  w%-2u  %016llx  %-10s  %s\n",
+                (e.rec.time - t0) * 1e6 / hz, e.worker,
+                (unsigned long long)e.rec.packet, trace_event_name(e.rec.event),
+                describe(e.rec).c_str());
+  }
+  return 0;
+}
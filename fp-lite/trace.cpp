@@ -0,0 +1,223 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#include "trace.hpp"
+#include "worker.hpp"
+#include "time.hpp"
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+
+namespace fp
+{
+
+std::atomic<std::uint32_t> trace_period(0);
+thread_local std::uint32_t trace_countdown = 0;
+
+
+namespace
+{
+
+// A worker's ring of events. Only the worker writes the ring; the
+// head is published after each record is written.
+struct Trace_ring
+{
+  Trace_record               records[trace_ring_size];
+  std::atomic<std::uint64_t> head;
+  std::uint64_t              tags;
+};
+
+
+// Each worker's ring, allocated when it traces its first packet.
+Per_worker<std::atomic<Trace_ring*>> rings;
+
+
+// The file to which rings are dumped on a signal.
+char dump_path[256];
+
+
+// The calling thread's ring, once it has been found.
+thread_local Trace_ring* this_ring = nullptr;
+
+
+// Returns the calling worker's ring.
+inline Trace_ring*
+local_ring()
+{
+  if (this_ring)
+    return this_ring;
+  std::atomic<Trace_ring*>& r = rings.local();
+  Trace_ring* p = r.load(std::memory_order_relaxed);
+  if (!p) {
+    p = new Trace_ring();
+    p->head.store(0, std::memory_order_relaxed);
+    p->tags = 0;
+    r.store(p, std::memory_order_release);
+  }
+  this_ring = p;
+  return p;
+}
+
+
+// Write all of a buffer, using only async-signal-safe calls.
+bool
+write_all(int fd, void const* buf, std::size_t n)
+{
+  char const* p = static_cast<char const*>(buf);
+  while (n) {
+    ssize_t k = ::write(fd, p, n);
+    if (k < 0 && errno == EINTR)
+      continue;
+    if (k <= 0)
+      return false;
+    p += k;
+    n -= k;
+  }
+  return true;
+}
+
+
+void
+on_dump_signal(int)
+{
+  int saved = errno;
+  trace_dump(dump_path);
+  errno = saved;
+}
+
+
+char const* const event_names[num_trace_events] = {
+  "port_rx", "port_tx", "table_hit", "table_miss", "action", "drop"
+};
+
+
+} // namespace
+
+
+// Trace one in every n packets received by each worker.
+void
+trace_enable(std::uint32_t n)
+{
+  trace_period.store(n, std::memory_order_relaxed);
+}
+
+
+// Stop tracing new packets. Packets that are already traced
+// continue to record their events.
+void
+trace_disable()
+{
+  trace_period.store(0, std::memory_order_relaxed);
+}
+
+
+// Returns the tag of a newly traced packet. Tags are unique among
+// the packets traced by the process: the worker is in the high 8
+// bits, and the worker's count of traced packets in the rest.
+std::uint64_t
+trace_begin()
+{
+  Trace_ring* r = local_ring();
+  return (std::uint64_t(worker_id()) << 56) | ++r->tags;
+}
+
+
+// Append an event of the tagged packet to the calling worker's
+// ring.
+void
+trace_record(std::uint64_t tag, Trace_event e, std::uint32_t obj, std::uint64_t v)
+{
+  Trace_ring* r = local_ring();
+  std::uint64_t h = r->head.load(std::memory_order_relaxed);
+  Trace_record& rec = r->records[h & (trace_ring_size - 1)];
+  rec.time = Time::current();
+  rec.packet = tag;
+  rec.value = v;
+  rec.object = obj;
+  rec.event = e;
+  r->head.store(h + 1, std::memory_order_release);
+}
+
+
+// Write the rings to a file descriptor. Only async-signal-safe
+// calls are made, so that rings can be dumped from a signal
+// handler. Workers are not stopped; events recorded during the
+// dump may overwrite the oldest records being written.
+bool
+trace_dump(int fd)
+{
+  Trace_file_header fh;
+  std::memset(&fh, 0, sizeof(fh));
+  std::memcpy(fh.magic, "FPTRACE", 8);
+  fh.version = trace_version;
+  fh.record_size = sizeof(Trace_record);
+  fh.hz = Time::frequency();
+  if (!write_all(fd, &fh, sizeof(fh)))
+    return false;
+
+  for (int i = 0; i < max_workers; ++i) {
+    Trace_ring const* r = rings[i].load(std::memory_order_acquire);
+    if (!r)
+      continue;
+    std::uint64_t h = r->head.load(std::memory_order_acquire);
+    std::uint32_t n = h < trace_ring_size ? h : trace_ring_size;
+    Trace_ring_header rh = {std::uint32_t(i), n, h};
+    if (!write_all(fd, &rh, sizeof(rh)))
+      return false;
+
+    // The oldest records start at the head, once it has wrapped.
+    std::uint32_t first = (h - n) & (trace_ring_size - 1);
+    std::uint32_t k = trace_ring_size - first < n ? trace_ring_size - first : n;
+    if (!write_all(fd, r->records + first, k * sizeof(Trace_record)))
+      return false;
+    if (!write_all(fd, r->records, (n - k) * sizeof(Trace_record)))
+      return false;
+  }
+  return true;
+}
+
+
+// Write the rings to the file at the given path, replacing it.
+bool
+trace_dump(char const* path)
+{
+  int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return false;
+  bool ok = trace_dump(fd);
+  ::close(fd);
+  return ok;
+}
+
+
+// Dump the rings to the file at the given path whenever the
+// process receives the signal.
+void
+trace_dump_on_signal(int sig, char const* path)
+{
+  std::strncpy(dump_path, path, sizeof(dump_path) - 1);
+  struct sigaction sa;
+  std::memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_dump_signal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  ::sigaction(sig, &sa, nullptr);
+}
+
+
+// Returns the name of an event.
+char const*
+trace_event_name(int e)
+{
+  if (0 <= e && e < num_trace_events)
+    return event_names[e];
+  return "unknown";
+}
+
+
+} // namespace fp
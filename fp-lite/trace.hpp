@@ -0,0 +1,149 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#ifndef FP_TRACE_HPP
+#define FP_TRACE_HPP
+
+// The trace module records the events in the life of sampled
+// packets into per-worker rings, for debugging the forwarding of
+// packets at rate. Each event is a compact binary record with a
+// timestamp taken from the clock (see time.hpp), the tag of its
+// packet, and two event-specific values:
+//
+//    Event             Object          Value
+//    TRACE_PORT_RX     port            length
+//    TRACE_PORT_TX     port            length
+//    TRACE_TABLE_HIT   table           flow priority
+//    TRACE_TABLE_MISS  table           0
+//    TRACE_ACTION      action type     port, queue, or group
+//    TRACE_DROP        port            drop reason
+//
+// Drops are recorded with their reason (see drop.hpp), at the port
+// that dropped the packet. Packets dropped by the pipeline are
+// recorded at the drop port.
+//
+// Packets are sampled when they are received. Each worker counts
+// down the sampling period, so that one in every n of the packets
+// it receives is traced, and every event of a sampled packet is
+// recorded. Events of packets that are not sampled cost a single
+// test.
+//
+// Rings have a single writer, and are never locked. When a ring is
+// full, the oldest events are overwritten, so that the rings hold
+// the most recent history of each worker. The rings may be dumped
+// to a file on demand, or when the process receives a signal; the
+// fp-trace tool decodes the dump.
+//
+// Events are recorded only if the runtime is built with FP_TRACE
+// (see the FREEFLOW_TRACE option).
+
+#include "context.hpp"
+
+#include <atomic>
+#include <cstdint>
+
+
+namespace fp
+{
+
+// The kinds of traced events.
+enum Trace_event : std::uint8_t
+{
+  TRACE_PORT_RX,
+  TRACE_PORT_TX,
+  TRACE_TABLE_HIT,
+  TRACE_TABLE_MISS,
+  TRACE_ACTION,
+  TRACE_DROP,
+  num_trace_events
+};
+
+
+// A traced event, as stored in a ring and in a dump.
+struct Trace_record
+{
+  std::uint64_t time;      // Clock ticks.
+  std::uint64_t packet;    // The packet's tag.
+  std::uint64_t value;
+  std::uint32_t object;
+  std::uint8_t  event;
+  std::uint8_t  reserved[3];
+};
+
+static_assert(sizeof(Trace_record) == 32, "unexpected trace record size");
+
+
+// The number of records in each worker's ring.
+constexpr std::uint32_t trace_ring_size = 1 << 16;
+
+
+// The layout of a dump. The file header is followed by each ring
+// that has recorded events: a ring header, then its records, from
+// oldest to newest.
+struct Trace_file_header
+{
+  char          magic[8];    // "FPTRACE" and a null byte.
+  std::uint32_t version;
+  std::uint32_t record_size;
+  std::uint64_t hz;          // Clock ticks per second.
+};
+
+struct Trace_ring_header
+{
+  std::uint32_t worker;
+  std::uint32_t count;       // Records that follow.
+  std::uint64_t total;       // Records ever written.
+};
+
+constexpr std::uint32_t trace_version = 1;
+
+
+// The sampling period, or 0 if tracing is disabled, and each
+// worker's count of packets until the next sample.
+extern std::atomic<std::uint32_t> trace_period;
+extern thread_local std::uint32_t trace_countdown;
+
+void trace_enable(std::uint32_t);
+void trace_disable();
+
+std::uint64_t trace_begin();
+void          trace_record(std::uint64_t, Trace_event, std::uint32_t, std::uint64_t);
+
+bool trace_dump(int);
+bool trace_dump(char const*);
+void trace_dump_on_signal(int, char const*);
+
+char const* trace_event_name(int);
+
+
+#ifdef FP_TRACE
+// Decide whether to trace a packet that has just been received.
+inline void
+trace_packet(Context& cxt)
+{
+  std::uint32_t n = trace_period.load(std::memory_order_relaxed);
+  if (n == 0)
+    return;
+  if (trace_countdown > 1 && trace_countdown <= n) {
+    --trace_countdown;
+    return;
+  }
+  trace_countdown = n;
+  cxt.trace_ = trace_begin();
+}
+
+
+// Record an event, if the packet is traced.
+inline void
+trace(Context const& cxt, Trace_event e, std::uint32_t obj, std::uint64_t v)
+{
+  if (cxt.trace_)
+    trace_record(cxt.trace_, e, obj, v);
+}
+#endif
+
+
+} // namespace fp
+
+
+#endif
@@ -0,0 +1,365 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#include "tunnel.hpp"
+#include "checksum.hpp"
+#include "context.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+
+namespace fp
+{
+
+namespace
+{
+
+// Well known ethertypes, IP protocols, and ports.
+constexpr std::uint16_t eth_ipv4   = 0x0800;
+constexpr std::uint16_t eth_ipv6   = 0x86dd;
+constexpr std::uint16_t eth_vlan   = 0x8100;
+constexpr std::uint16_t eth_qinq   = 0x88a8;
+constexpr std::uint16_t eth_mpls   = 0x8847;
+constexpr std::uint16_t eth_mplsm  = 0x8848;
+constexpr std::uint16_t eth_bridge = 0x6558;
+
+constexpr std::uint8_t ip_udp = 17;
+constexpr std::uint8_t ip_gre = 47;
+
+constexpr std::uint16_t vxlan_port = 4789;
+
+// Header lengths.
+constexpr int eth_len   = 14;
+constexpr int ipv4_len  = 20;
+constexpr int udp_len   = 8;
+constexpr int vxlan_len = 8;
+constexpr int gre_len   = 4;
+constexpr int mpls_len  = 4;
+
+// The time to live of outer IPv4 headers.
+constexpr std::uint8_t default_ttl = 64;
+
+
+inline std::uint16_t
+load16(Byte const* p)
+{
+  return p[0] << 8 | p[1];
+}
+
+
+inline std::uint32_t
+load32(Byte const* p)
+{
+  return std::uint32_t(load16(p)) << 16 | load16(p + 2);
+}
+
+
+inline void
+store16(Byte* p, std::uint16_t n)
+{
+  p[0] = n >> 8;
+  p[1] = n & 0xff;
+}
+
+
+inline void
+store32(Byte* p, std::uint32_t n)
+{
+  store16(p, n >> 16);
+  store16(p + 2, n & 0xffff);
+}
+
+
+// Write the Ethernet and IPv4 headers of a VXLAN or GRE tunnel.
+// The total length of the IPv4 header is 0, and its checksum is
+// computed for that length.
+void
+outer_headers(Tunnel& t, Byte const* dst, Byte const* src, std::uint32_t sip,
+              std::uint32_t dip, std::uint8_t proto)
+{
+  Byte* p = t.header;
+  std::memset(p, 0, Tunnel::max_header);
+  std::copy(dst, dst + 6, p);
+  std::copy(src, src + 6, p + 6);
+  store16(p + 12, eth_ipv4);
+
+  Byte* ip = p + eth_len;
+  ip[0] = 0x45;
+  store16(ip + 6, 0x4000); // Don't fragment.
+  ip[8] = default_ttl;
+  ip[9] = proto;
+  store32(ip + 12, sip);
+  store32(ip + 16, dip);
+  store16(ip + 10, checksum(ip, ipv4_len));
+}
+
+
+// Returns the length of the Ethernet header and its VLAN tags,
+// or 0 if the frame is truncated.
+int
+l2_length(Packet const& pkt)
+{
+  Byte const* p = pkt.data();
+  int off = eth_len;
+  if (pkt.length() < off)
+    return 0;
+  for (int i = 0; i < 2; ++i) {
+    std::uint16_t type = load16(p + off - 2);
+    if (type != eth_vlan && type != eth_qinq)
+      break;
+    if (pkt.length() < off + 4)
+      return 0;
+    off += 4;
+  }
+  return off;
+}
+
+
+// Remove the n bytes following the first l2 bytes of the packet,
+// by moving the Ethernet header over them.
+void
+remove(Packet& pkt, int l2, int n)
+{
+  Byte* p = pkt.data();
+  std::copy_backward(p, p + l2, p + l2 + n);
+  pkt.pull(n);
+}
+
+
+bool
+push_label(Context& cxt, Tunnel const& t)
+{
+  Packet& pkt = cxt.packet();
+  int l2 = l2_length(pkt);
+  if (!l2)
+    return false;
+  std::uint16_t type = load16(pkt.data() + l2 - 2);
+  bool inner = type == eth_mpls || type == eth_mplsm;
+  Byte* p = pkt.push(mpls_len);
+  if (!p)
+    return false;
+  std::copy(p + mpls_len, p + mpls_len + l2, p);
+  std::copy(t.header, t.header + mpls_len, p + l2);
+  if (!inner)
+    p[l2 + 2] |= 0x01; // Bottom of stack.
+  store16(p + l2 - 2, eth_mpls);
+  return true;
+}
+
+
+bool
+pop_label(Context& cxt, int l2)
+{
+  Packet& pkt = cxt.packet();
+  Byte* p = pkt.data();
+  if (pkt.length() < l2 + mpls_len + 1)
+    return false;
+  std::uint32_t lse = load32(p + l2);
+  std::uint16_t type = eth_mpls;
+  if (lse & 0x100) {
+    if ((p[l2 + mpls_len] >> 4) == 4)
+      type = eth_ipv4;
+    else if ((p[l2 + mpls_len] >> 4) == 6)
+      type = eth_ipv6;
+    else
+      return false;
+  }
+  remove(pkt, l2, mpls_len);
+  store16(pkt.data() + l2 - 2, type);
+  cxt.input_.tunnel_id = lse >> 12;
+  return true;
+}
+
+
+// Decapsulate a VXLAN or GRE packet with the IPv4 header at l2.
+bool
+decap_ipv4(Context& cxt, int l2)
+{
+  Packet& pkt = cxt.packet();
+  Byte const* p = pkt.data();
+  int len = pkt.length();
+  if (len < l2 + ipv4_len)
+    return false;
+  Byte const* ip = p + l2;
+  int ihl = (ip[0] & 0x0f) * 4;
+  if (ihl < ipv4_len || (load16(ip + 6) & 0x3fff))
+    return false;
+  int off = l2 + ihl;
+
+  if (ip[9] == ip_udp) {
+    if (len < off + udp_len + vxlan_len + eth_len)
+      return false;
+    if (load16(p + off + 2) != vxlan_port || !(p[off + udp_len] & 0x08))
+      return false;
+    cxt.input_.tunnel_id = load32(p + off + udp_len + 4) >> 8;
+    pkt.pull(off + udp_len + vxlan_len);
+    return true;
+  }
+
+  if (ip[9] == ip_gre) {
+    if (len < off + gre_len)
+      return false;
+    std::uint16_t flags = load16(p + off);
+    std::uint16_t type = load16(p + off + 2);
+    int n = gre_len;
+    if (flags & 0x8000)
+      n += 4;
+    if (flags & 0x2000) {
+      if (len < off + n + 4)
+        return false;
+      cxt.input_.tunnel_id = load32(p + off + n);
+      n += 4;
+    }
+    if (flags & 0x1000)
+      n += 4;
+    if (len < off + n)
+      return false;
+
+    // A bridged frame is complete. Otherwise, the outer Ethernet
+    // header is kept for the inner packet.
+    if (type == eth_bridge) {
+      pkt.pull(off + n);
+      return true;
+    }
+    if (type != eth_ipv4 && type != eth_ipv6)
+      return false;
+    remove(pkt, l2, ihl + n);
+    store16(pkt.data() + l2 - 2, type);
+    return true;
+  }
+  return false;
+}
+
+
+} // namespace
+
+
+// Returns a VXLAN tunnel between the given Ethernet and IPv4
+// addresses, with the given network identifier.
+Tunnel
+Tunnel::vxlan(Byte const* dst, Byte const* src, std::uint32_t sip, std::uint32_t dip,
+              std::uint32_t vni)
+{
+  Tunnel t;
+  t.type = VXLAN;
+  t.length = eth_len + ipv4_len + udp_len + vxlan_len;
+  outer_headers(t, dst, src, sip, dip, ip_udp);
+  Byte* udp = t.header + eth_len + ipv4_len;
+  store16(udp + 2, vxlan_port);
+  Byte* vx = udp + udp_len;
+  vx[0] = 0x08; // The identifier is valid.
+  store32(vx + 4, vni << 8);
+  return t;
+}
+
+
+// Returns a GRE tunnel carrying Ethernet frames between the given
+// Ethernet and IPv4 addresses. The key is omitted if it is 0.
+Tunnel
+Tunnel::gre(Byte const* dst, Byte const* src, std::uint32_t sip, std::uint32_t dip,
+            std::uint32_t key)
+{
+  Tunnel t;
+  t.type = GRE;
+  t.length = eth_len + ipv4_len + gre_len + (key ? 4 : 0);
+  outer_headers(t, dst, src, sip, dip, ip_gre);
+  Byte* gre = t.header + eth_len + ipv4_len;
+  store16(gre + 2, eth_bridge);
+  if (key) {
+    store16(gre, 0x2000);
+    store32(gre + gre_len, key);
+  }
+  return t;
+}
+
+
+// Returns an MPLS tunnel that pushes the given label, traffic
+// class, and time to live.
+Tunnel
+Tunnel::mpls(std::uint32_t label, std::uint8_t tc, std::uint8_t ttl)
+{
+  Tunnel t;
+  t.type = MPLS;
+  t.length = mpls_len;
+  std::memset(t.header, 0, max_header);
+  store32(t.header, (label & 0xfffff) << 12 | (tc & 0x7) << 9 | ttl);
+  return t;
+}
+
+
+// Encapsulate the context's packet in the tunnel. The outer headers
+// are pushed into the packet's headroom. Returns false if the
+// packet's buffer cannot hold them, or if the packet cannot be
+// encapsulated. Packets whose outer IPv4 datagram would exceed
+// 65535 bytes are not encapsulated.
+//
+// The VXLAN source port is taken from the inner packet's flow hash,
+// as recommended by RFC 7348, so that the underlay spreads flows
+// over its paths. The UDP checksum is 0.
+//
+// Header and field bindings are removed, since the headers have
+// moved.
+bool
+encap(Context& cxt, Tunnel const& t)
+{
+  if (t.type == Tunnel::MPLS) {
+    if (!push_label(cxt, t))
+      return false;
+    cxt.clear_bindings();
+    return true;
+  }
+
+  Packet& pkt = cxt.packet();
+  std::uint16_t sport = 0;
+  if (t.type == Tunnel::VXLAN)
+    sport = 0xc000 | (cxt.flow_hash() & 0x3fff);
+  int ip_len = t.length - eth_len + pkt.total_length();
+  if (ip_len > 0xffff)
+    return false;
+  Byte* p = pkt.push(t.length);
+  if (!p)
+    return false;
+  std::copy(t.header, t.header + t.length, p);
+
+  Byte* ip = p + eth_len;
+  store16(ip + 2, ip_len);
+  update_checksum(ip + 10, 0, ip_len);
+  if (t.type == Tunnel::VXLAN) {
+    Byte* udp = ip + ipv4_len;
+    store16(udp, sport);
+    store16(udp + 4, ip_len - ipv4_len);
+  }
+  cxt.clear_bindings();
+  return true;
+}
+
+
+// Remove the outermost tunnel headers from the context's packet:
+// the outer headers of a VXLAN or GRE packet, or the top MPLS
+// label. The tunnel identifier of the context is set to the VXLAN
+// network identifier, the GRE key, or the MPLS label. Returns false
+// if the packet is not tunneled.
+//
+// Header and field bindings are removed, since the headers have
+// moved.
+bool
+decap(Context& cxt)
+{
+  Packet const& pkt = cxt.packet();
+  int l2 = l2_length(pkt);
+  if (!l2)
+    return false;
+  std::uint16_t type = load16(pkt.data() + l2 - 2);
+  bool ok = false;
+  if (type == eth_mpls || type == eth_mplsm)
+    ok = pop_label(cxt, l2);
+  else if (type == eth_ipv4)
+    ok = decap_ipv4(cxt, l2);
+  if (ok)
+    cxt.clear_bindings();
+  return ok;
+}
+
+
+} // namespace fp
@@ -0,0 +1,52 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#ifndef FP_TUNNEL_HPP
+#define FP_TUNNEL_HPP
+
+#include "types.hpp"
+
+#include <cstdint>
+
+
+namespace fp
+{
+
+class Context;
+
+
+// A tunnel describes the outer headers added to packets by
+// encapsulation. The headers are built once, when the tunnel is
+// created, and copied in front of each encapsulated packet; only
+// the lengths, the IPv4 checksum, and the VXLAN source port are
+// computed per packet.
+//
+// VXLAN and GRE tunnels carry the entire Ethernet frame over
+// IPv4. An MPLS tunnel pushes a label between the Ethernet header
+// (and any VLAN tags) and its payload.
+//
+// Addresses and values are in native byte order.
+struct Tunnel
+{
+  enum Type : std::uint8_t { VXLAN, GRE, MPLS };
+
+  static constexpr int max_header = 64;
+
+  static Tunnel vxlan(Byte const*, Byte const*, std::uint32_t, std::uint32_t, std::uint32_t);
+  static Tunnel gre(Byte const*, Byte const*, std::uint32_t, std::uint32_t, std::uint32_t);
+  static Tunnel mpls(std::uint32_t, std::uint8_t, std::uint8_t);
+
+  Type         type;
+  std::uint8_t length;             // The number of bytes pushed.
+  Byte         header[max_header]; // The outer headers.
+};
+
+
+bool encap(Context&, Tunnel const&);
+bool decap(Context&);
+
+
+} // namespace fp
+
+
+#endif
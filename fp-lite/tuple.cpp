@@ -0,0 +1,153 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#include "tuple.hpp"
+#include "packet.hpp"
+
+#include <algorithm>
+
+
+namespace fp
+{
+
+namespace
+{
+
+// Well known ethertypes and IP protocols.
+constexpr std::uint16_t eth_ipv4  = 0x0800;
+constexpr std::uint16_t eth_ipv6  = 0x86dd;
+constexpr std::uint16_t eth_vlan  = 0x8100;
+constexpr std::uint16_t eth_qinq  = 0x88a8;
+constexpr std::uint16_t eth_mpls  = 0x8847;
+constexpr std::uint16_t eth_mplsm = 0x8848;
+
+constexpr std::uint8_t ip_hopopt  = 0;
+constexpr std::uint8_t ip_tcp     = 6;
+constexpr std::uint8_t ip_udp     = 17;
+constexpr std::uint8_t ip_route   = 43;
+constexpr std::uint8_t ip_frag    = 44;
+constexpr std::uint8_t ip_dstopts = 60;
+constexpr std::uint8_t ip_sctp    = 132;
+
+
+inline std::uint16_t
+load16(Byte const* p)
+{
+  return std::uint16_t(p[0]) << 8 | p[1];
+}
+
+
+// Extract transport ports, if the protocol has them.
+inline void
+extract_ports(Byte const* p, int len, int off, Five_tuple& t)
+{
+  if (t.proto != ip_tcp && t.proto != ip_udp && t.proto != ip_sctp)
+    return;
+  if (off + 4 > len)
+    return;
+  t.l4 = off;
+  t.src_port = load16(p + off);
+  t.dst_port = load16(p + off + 2);
+}
+
+
+} // namespace
+
+
+// Extract the five tuple from an Ethernet frame. This skips
+// up to two VLAN tags and any number of MPLS labels. Returns
+// false if the frame is truncated. Non-IP frames are identified
+// by their Ethernet addresses.
+bool
+extract_tuple(Packet const& pkt, Five_tuple& t)
+{
+  Byte const* p = pkt.data();
+  int len = pkt.length();
+  std::memset(&t, 0, sizeof(t));
+  if (len < 14)
+    return false;
+
+  std::copy(p, p + 6, t.dst);
+  std::copy(p + 6, p + 12, t.src);
+  int off = 12;
+  std::uint16_t type = load16(p + off);
+  off += 2;
+  for (int i = 0; i < 2 && (type == eth_vlan || type == eth_qinq); ++i) {
+    if (off + 4 > len)
+      return false;
+    type = load16(p + off + 2);
+    off += 4;
+  }
+
+  // Skip the label stack and infer the payload from the
+  // IP version nibble.
+  if (type == eth_mpls || type == eth_mplsm) {
+    while (true) {
+      if (off + 4 > len)
+        return false;
+      bool bos = p[off + 2] & 0x01;
+      off += 4;
+      if (bos)
+        break;
+    }
+    if (off >= len)
+      return false;
+    if ((p[off] >> 4) == 4)
+      type = eth_ipv4;
+    else if ((p[off] >> 4) == 6)
+      type = eth_ipv6;
+  }
+  t.ether_type = type;
+  t.l3 = off;
+
+  if (type == eth_ipv4) {
+    if (off + 20 > len)
+      return false;
+    int ihl = (p[off] & 0x0f) * 4;
+    if (ihl < 20 || off + ihl > len)
+      return false;
+    std::memset(t.src, 0, 16);
+    std::memset(t.dst, 0, 16);
+    std::copy(p + off + 12, p + off + 16, t.src);
+    std::copy(p + off + 16, p + off + 20, t.dst);
+    t.version = 4;
+    t.proto = p[off + 9];
+
+    // Only the first fragment carries the transport header.
+    if ((load16(p + off + 6) & 0x1fff) == 0)
+      extract_ports(p, len, off + ihl, t);
+  }
+  else if (type == eth_ipv6) {
+    if (off + 40 > len)
+      return false;
+    std::copy(p + off + 8, p + off + 24, t.src);
+    std::copy(p + off + 24, p + off + 40, t.dst);
+    t.version = 6;
+    std::uint8_t next = p[off + 6];
+    off += 40;
+
+    // Skip extension headers.
+    while (next == ip_hopopt || next == ip_route || next == ip_dstopts ||
+           next == ip_frag) {
+      if (off + 8 > len)
+        return false;
+      if (next == ip_frag) {
+        if (load16(p + off + 2) & 0xfff8) {
+          t.proto = p[off];
+          return true;
+        }
+        next = p[off];
+        off += 8;
+      } else {
+        next = p[off];
+        off += (p[off + 1] + 1) * 8;
+      }
+    }
+    t.proto = next;
+    extract_ports(p, len, off, t);
+  }
+  return true;
+}
+
+
+} // namespace fp
@@ -0,0 +1,97 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#ifndef FP_TUPLE_HPP
+#define FP_TUPLE_HPP
+
+#include "types.hpp"
+
+#include <cstdint>
+#include <cstring>
+
+
+namespace fp
+{
+
+struct Packet;
+
+
+// The five tuple identifies the conversation to which a
+// packet belongs. It is extracted by the runtime, independently
+// of the application's own decoding, to support services that
+// must classify packets before (or without) running the
+// application, such as load balancing and caching.
+//
+// For IPv4, addresses occupy the first 4 bytes of src and dst.
+// For non-IP frames, src and dst hold the Ethernet addresses,
+// and ports and protocol are 0. Ports are in native byte order.
+struct Five_tuple
+{
+  Byte          src[16];
+  Byte          dst[16];
+  std::uint16_t src_port;
+  std::uint16_t dst_port;
+  std::uint8_t  proto;
+  std::uint8_t  version;    // IP version (4 or 6) or 0 if not IP.
+  std::uint16_t ether_type; // Innermost ethertype.
+  std::uint16_t l3;         // Offset of the network header.
+  std::uint16_t l4;         // Offset of the transport header or 0.
+};
+
+
+bool extract_tuple(Packet const&, Five_tuple&);
+
+
+// -------------------------------------------------------------------------- //
+// Hashing
+
+// Mix a 64-bit value. This is the finalizer of MurmurHash3.
+inline std::uint64_t
+mix(std::uint64_t k)
+{
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdull;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ull;
+  k ^= k >> 33;
+  return k;
+}
+
+
+// Hash n bytes, 8 at a time.
+inline std::uint64_t
+hash_bytes(Byte const* p, int n, std::uint64_t seed = 0)
+{
+  std::uint64_t h = seed ^ (n * 0x9e3779b97f4a7c15ull);
+  for (; n >= 8; n -= 8, p += 8) {
+    std::uint64_t w;
+    std::memcpy(&w, p, 8);
+    h = mix(h ^ w);
+  }
+  if (n) {
+    std::uint64_t w = 0;
+    std::memcpy(&w, p, n);
+    h = mix(h ^ w);
+  }
+  return h;
+}
+
+
+// Returns the hash of a five tuple. The result is never 0,
+// so that 0 can denote a hash that has not been computed.
+inline std::uint32_t
+hash(Five_tuple const& t)
+{
+  std::uint64_t h = hash_bytes(t.src, 16);
+  h = hash_bytes(t.dst, 16, h);
+  h = mix(h ^ (std::uint64_t(t.src_port) << 32 | 
+               std::uint64_t(t.dst_port) << 16 | t.proto));
+  std::uint32_t r = std::uint32_t(h ^ (h >> 32));
+  return r ? r : 1;
+}
+
+
+} // namespace fp
+
+
+#endif
@@ -0,0 +1,88 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#include "worker.hpp"
+
+#include <string>
+
+
+namespace fp
+{
+
+thread_local int this_worker = -1;
+
+namespace
+{
+
+static_assert(max_workers == 64, "worker indexes are held in a 64-bit set");
+
+// The indexes held by live threads, one bit per index.
+std::atomic<std::uint64_t> assigned(0);
+
+// One more than the highest index ever assigned.
+std::atomic<int> limit(0);
+
+
+// Releases the calling thread's index when the thread exits.
+struct Worker_index
+{
+  ~Worker_index()
+  {
+    if (this_worker >= 0)
+      assigned.fetch_and(~(std::uint64_t(1) << this_worker), std::memory_order_release);
+  }
+};
+
+
+} // namespace
+
+
+// Assign the lowest free worker index to the calling thread. The
+// index is released when the thread exits, and may then be assigned
+// to another thread, which inherits the per-worker state left by
+// the first. Throws an exception if every index is held.
+int
+assign_worker()
+{
+  thread_local Worker_index holder;
+  std::uint64_t s = assigned.load(std::memory_order_relaxed);
+  int n;
+  do {
+    if (s == ~std::uint64_t(0))
+      throw std::string("Too many workers");
+    n = 0;
+    while (s & (std::uint64_t(1) << n))
+      ++n;
+  } while (!assigned.compare_exchange_weak(s, s | (std::uint64_t(1) << n),
+                                           std::memory_order_acquire,
+                                           std::memory_order_relaxed));
+
+  int l = limit.load(std::memory_order_relaxed);
+  while (l <= n && !limit.compare_exchange_weak(l, n + 1, std::memory_order_relaxed))
+    ;
+  return n;
+}
+
+
+// Returns one more than the highest index ever assigned. Readers
+// of per-worker state need only visit this many slots.
+int
+worker_count()
+{
+  return limit.load(std::memory_order_relaxed);
+}
+
+
+// Returns the number of indexes held by live threads.
+int
+active_workers()
+{
+  std::uint64_t s = assigned.load(std::memory_order_relaxed);
+  int n = 0;
+  for (; s; s &= s - 1)
+    ++n;
+  return n;
+}
+
+
+} // namespace fp
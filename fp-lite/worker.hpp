@@ -0,0 +1,106 @@
+// Copyright (c) 2015 Flowgrammable.org
+// All rights reserved
+
+#ifndef FP_WORKER_HPP
+#define FP_WORKER_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+
+namespace fp
+{
+
+// A worker is any thread that processes packets. Each worker
+// is assigned a small, dense index the first time it asks for
+// one. This allows per-worker state to be stored in fixed arrays
+// and updated without synchronization.
+//
+// A thread holds its index until it exits, after which the index
+// may be reused. At most max_workers threads may hold an index at
+// once; asking for one more is an error.
+constexpr int         max_workers = 64;
+constexpr std::size_t cache_line_size = 64;
+
+int worker_id();
+int worker_count();
+int active_workers();
+int assign_worker();
+
+// The calling thread's worker index, or -1 if unassigned.
+extern thread_local int this_worker;
+
+
+// Returns the calling thread's worker index.
+inline int
+worker_id()
+{
+  if (this_worker < 0)
+    this_worker = assign_worker();
+  return this_worker;
+}
+
+
+// Add n to a counter that only the calling worker updates. The
+// counter may be read by other threads while it is updated, but
+// no locked instruction is needed to increment it.
+inline void
+bump(std::atomic<std::uint64_t>& c, std::uint64_t n = 1)
+{
+  c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+
+// Per-worker storage for a value of type T. Each worker's value
+// occupies its own cache lines, so that updates from different
+// workers do not contend. Readers aggregate over all slots.
+//
+// Dynamically allocated sets are allocated on a cache line
+// boundary.
+template<typename T>
+struct Per_worker
+{
+  struct alignas(cache_line_size) Slot
+  {
+    T value;
+  };
+
+  static void* operator new(std::size_t);
+  static void  operator delete(void*);
+
+  T&       local()       { return slots[worker_id()].value; }
+  T const& local() const { return slots[worker_id()].value; }
+
+  T&       operator[](int n)       { return slots[n].value; }
+  T const& operator[](int n) const { return slots[n].value; }
+
+  Slot slots[max_workers];
+};
+
+
+template<typename T>
+void*
+Per_worker<T>::operator new(std::size_t n)
+{
+  void* p;
+  if (::posix_memalign(&p, cache_line_size, n))
+    throw std::bad_alloc();
+  return p;
+}
+
+
+template<typename T>
+void
+Per_worker<T>::operator delete(void* p)
+{
+  std::free(p);
+}
+
+
+} // namespace fp
+
+
+#endif